@@ -1,6 +0,0 @@
-fortune > bigfile.txt
-for i in {1..10}
-do
-    echo -e "---" >> bigfile.txt;
-    fortune >> bigfile.txt;
-done
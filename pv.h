@@ -2,12 +2,499 @@
 #define _PV_H_
 
 #include "dcrypt.h"
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define CCA_STRENGTH 32 /* must be one of 16, 24 or 32; used to set AES keys */
+#define BLOCK_LEN 16
+#define HMAC_LEN 20		/* HMAC-SHA1 output */
+#define TRAILER_LEN (HMAC_LEN + 4)	/* HMAC || numpad0 ends every ctxt */
+
+#define PV_DEFAULT_BUFSIZE (1 << 20)
+#define PV_MAX_BUFSIZE (1 << 30)
+#define PV_PIPE_MAX (4 << 20)	/* most pipe buffer pv_pipe_grow asks for */
+#define PV_STDIO "-"		/* file name meaning stdin or stdout */
+
+/* Ciphertext formats.  The original one (PV_MODE_CBC) is
+ *
+ *     IV | CBC-AES (K_AES, ptxt || 0^padlen) | HMAC-SHA1 (K_HMAC, IV || Y) | padlen
+ *
+ * with no header at all, and padlen outside the MAC.  Every later format
+ * starts with a PV_HDR_LEN byte header, and authenticates it and every
+ * other byte of the file, padlen included:
+ *
+ *     "PVAULT" | version | mode | flags | 0 0 0 | param (32 bits, big endian)
+ *
+ * pv_encrypt never picks a CBC IV that starts with the magic, so the
+ * two cannot be confused.
+ *
+ * PV_MODE_GCM:  header | nonce (12) | GCM-AES (K_AES, ptxt) | tag (16)
+ *
+ * PV_MODE_CBC_SHA256:  header | IV | Y | HMAC-SHA256 (K_HMAC, header || IV || Y || padlen) | padlen
+ *   with Y = CBC-AES (K_AES, ptxt || 0^padlen) as in PV_MODE_CBC and
+ *   padlen the same 4 bytes, big endian, under the MAC as after it
+ *
+ * PV_MODE_SEG:  header | nonce (16) | segment_0 | ... | segment_n | padlen | final tag
+ *   where param is the segment size S, a multiple of 16; each segment is
+ *   IV_i | Y_i | T_i with Y_i = CBC-AES (K_AES, ptxt_i) under its own IV
+ *   and T_i an HMAC-SHA256 tag over header, nonce, i, IV_i and Y_i.
+ *   Every ptxt_i is S bytes but the last, which is shorter (maybe empty)
+ *   and 0-padded; the final tag covers T_0..T_n (see pv_seg.c).  Each
+ *   segment can be checked before any of its plaintext is released.
+ *
+ * PV_MODE_ARCHIVE:  header | nonce (16) | member_0 | ... | member_n-1 | index | trailer
+ *   written by pv_archive (see pv_archive.c), param 0.  Each member is
+ *   a file, directory or symlink of a tree, stored as a PV_MODE_SEG
+ *   segment IV_i | Y_i | T_i of its own length, T_i binding i and the
+ *   member's padlen; the index is one more such segment, the last, whose
+ *   ptxt holds an entry (name, metadata, offset and T_i) per member; the
+ *   trailer is index offset (64 bits) | n | index padlen | final tag.
+ */
+#define PV_MAGIC "PVAULT"
+#define PV_MAGIC_LEN 6
+#define PV_HDR_LEN 16
+#define PV_VERSION 2
+
+#define PV_MODE_CBC 0
+#define PV_MODE_GCM 1
+#define PV_MODE_CBC_SHA256 2
+#define PV_MODE_SEG 3
+#define PV_MODE_ARCHIVE 4
+
+#define PV_FLAG_LZ 0x01		/* the ptxt was compressed (pv_lz.c) */
+/* pv_encrypt_init (..., mode | PV_MODE_FLAGS (f)) sets header flags f */
+#define PV_MODE_FLAGS(f) ((f) << 8)
+
+struct pv_hdr {
+  u_int version;
+  u_int mode;
+  u_int flags;
+  u_int32_t param;
+};
+
+/* run-time tunables shared by pv_encrypt and pv_decrypt */
+struct pv_opts {
+  size_t bufsize;		/* bytes per read()/write(); multiple of BLOCK_LEN */
+  int jobs;			/* worker threads; 1 means do it all inline */
+  int mode;			/* PV_MODE_* written by pv_encrypt */
+  int pipeline;			/* pv_encrypt: read/encrypt/MAC/write on 4 threads */
+  int use_mmap;			/* map regular files instead of read/write */
+  int range;			/* pv_decrypt: only ptxt[offset..offset+length] */
+  off_t offset;
+  off_t length;			/* -1: to the end */
+  int verify;			/* pv_decrypt: PV_VERIFY_ONLY or _FIRST, or 0 */
+  int compress;			/* pv_encrypt: LZ-compress the ptxt first */
+  int lanes;			/* pv_encrypt --batch, cbc modes: files
+				   interleaved per thread */
+};
+
+#define PV_VERIFY_ONLY 1	/* --verify: check the MAC, decrypt nothing */
+#define PV_VERIFY_FIRST 2	/* --verify-first: check it, then decrypt */
+
+/* fixed-size worker thread pool (pv_pool.c); embed a pv_task in the
+   job structure and recover it in fn */
+struct pv_task {
+  void (*fn) (struct pv_task *);
+  struct pv_task *next;
+};
+struct pv_pool;
+
+struct pv_pool *pv_pool_new (int nthreads);
+void pv_pool_free (struct pv_pool *p);
+void pv_pool_submit (struct pv_pool *p, struct pv_task *t);
+void pv_pool_wait (struct pv_pool *p);
+int pv_pool_size (const struct pv_pool *p);
+
+/* lock-free single-producer/single-consumer pointer queue (pv_ring.c) */
+struct pv_ring;
+
+struct pv_ring *pv_ring_new (u_int size);
+void pv_ring_free (struct pv_ring *r);
+int pv_ring_push (struct pv_ring *r, void *p);
+void *pv_ring_pop (struct pv_ring *r);
+void *pv_ring_pop_wait (struct pv_ring *r);
+
+/* sequential reads or writes of one file with several requests kept
+   in flight (pv_io.c).  Drop-in replacements for read_chunk and
+   write_chunk; pv_io_close waits for the writes and leaves the file
+   offset just past the data, and must come before close(fd). */
+struct pv_io;
+
+struct pv_io *pv_io_open (int fd, int writing, size_t chunk);
+ssize_t pv_io_read (struct pv_io *io, char *buf, size_t len);
+int pv_io_write (struct pv_io *io, const char *buf, size_t len);
+int pv_io_close (struct pv_io *io);
+/* the ptxt length of a cbc or gcm ctxt file, from its size and trailer */
+off_t pv_ptxt_length (int fd, int mode);
+
+/* --nocache, --direct (pv_misc.c): keep bulk I/O out of the page cache */
+#define PV_IOP_NOCACHE 0x01	/* fadvise SEQUENTIAL, DONTNEED behind us */
+#define PV_IOP_DIRECT 0x02	/* O_DIRECT where the file system takes it */
+#define PV_DIRECT_ALIGN 4096	/* of O_DIRECT buffers, offsets, lengths */
+
+extern int pv_iopolicy;
+int pv_direct (int fd, int on);
+void pv_cache_start (int fd);
+void pv_cache_flush (int fd, off_t off, off_t len);
+void pv_cache_drop (int fd, off_t off, off_t len, int writing);
+int pv_prealloc (int fd, off_t size);
+
+/* --max-rate, --max-iops, --rate-file, --nice, --ioprio (pv_qos.c):
+   the I/O wrappers call pv_qos_charge after each request, which does
+   nothing unless pv_qos_start turned throttling on */
+extern int pv_qos_on;
+int pv_qos_arg (int argc, char **argv, int *argi);
+int pv_qos_start (const char *pname);
+void pv_qos_charge (size_t n);
+
+/* --stats: time per phase and I/O counters (pv_stats.c).  Every hook
+   does nothing unless pv_stats_init turned them on. */
+#define PV_PH_KEY 0		/* import_sk_from_file */
+#define PV_PH_SEED 1		/* ri */
+#define PV_PH_SELFTEST 2
+#define PV_PH_CIPHER 3		/* AES (CBC or GCM, GHASH included) */
+#define PV_PH_MAC 4		/* HMAC */
+#define PV_PH_READ 5
+#define PV_PH_WRITE 6
+#define PV_PH_LZ 7		/* --compress, either way */
+#define PV_PH_THROTTLE 8	/* asleep for --max-rate, --max-iops */
+#define PV_NPHASES 9
+
+#define PV_ST_BYTES_IN 0
+#define PV_ST_BYTES_OUT 1
+#define PV_ST_READS 2		/* read/pread calls or io_uring reads */
+#define PV_ST_WRITES 3
+#define PV_ST_SHORT_READS 4	/* returned less than asked, not at EOF */
+#define PV_ST_URING_ENTERS 5
+#define PV_NCOUNTS 6
+
+struct pv_stamp {
+  double wall, cpu;
+};
+
+extern int pv_stats_on;
+void pv_stats_init (int on);
+void pv_stats_begin (struct pv_stamp *s);
+void pv_stats_end (int phase, const struct pv_stamp *s);
+void pv_stats_add (int counter, u_int64_t n);
+void pv_stats_report (const char *tool, int status);
+
+/* static tracepoints (USDT) for perf and bpftrace, provider "pv", where
+   <sys/sdt.h> is installed (systemtap-sdt-dev); each is a single nop
+   until something attaches.  -DPV_NO_SDT leaves them out. */
+#if !defined (PV_NO_SDT) && defined (__has_include)
+# if __has_include (<sys/sdt.h>)
+#  include <sys/sdt.h>
+# endif
+#endif
+#ifdef DTRACE_PROBE2
+# define PV_PROBE1(name, a) DTRACE_PROBE1 (pv, name, a)
+# define PV_PROBE2(name, a, b) DTRACE_PROBE2 (pv, name, a, b)
+#else
+# define PV_PROBE1(name, a)
+# define PV_PROBE2(name, a, b)
+#endif
+
+/* --batch: many files in one process (pv_batch.c) */
+#define PV_BATCH_SUFFIX ".pv"	/* pv_encrypt's outputs, for a directory */
+
+typedef int (*pv_batch_fn) (const char *in, const char *out, void *arg);
+long pv_batch_run (const char *manifest, const char *suffix, int strip,
+		   int nthreads, pv_batch_fn fn, void *arg);
+/* ... or, to have several files going at once in each thread */
+struct pv_batch_worker;
+typedef void (*pv_batch_loop) (struct pv_batch_worker *w, void *arg);
+long pv_batch_run_loop (const char *manifest, const char *suffix, int strip,
+			int nthreads, pv_batch_loop loop, void *arg);
+int pv_batch_next (struct pv_batch_worker *w, const char **in,
+		   const char **out);
+void pv_batch_done (struct pv_batch_worker *w, const char *in,
+		    const char *out, int r);
+
+/* AES with a run-time selected implementation (pv_aes.c) */
+#if defined (__x86_64__) || defined (__i386__)
+# define PV_HAVE_AESNI 1
+#endif
+
+/* one of several CBC encryptions run side by side (pv_cbc_encrypt_lanes) */
+#define PV_CBC_LANES 8
+struct pv_cbc_lane {
+  char *out;
+  const char *in;		/* out may equal in */
+  size_t len;			/* a multiple of BLOCK_LEN */
+  char *iv;			/* as for pv_cbc_encrypt */
+};
+
+struct pv_aes_ctx {
+  const char *name;		/* "aesni" or "generic" */
+  u_int nrounds;
+  u_char ek[15 * 16];		/* AES-NI encryption round keys */
+  u_char dk[15 * 16];		/* AES-NI decryption round keys */
+  struct aes_ctx aes;		/* libdcrypt key schedule */
+  void (*encrypt) (const struct pv_aes_ctx *, void *, const void *);
+  void (*decrypt) (const struct pv_aes_ctx *, void *, const void *);
+  void (*cbc_encrypt) (const struct pv_aes_ctx *, char *, const char *,
+		       size_t, char *);
+  void (*cbc_decrypt) (const struct pv_aes_ctx *, char *, const char *,
+		       size_t, char *);
+  void (*cbc_encrypt_lanes) (const struct pv_aes_ctx *, struct pv_cbc_lane *,
+			     int);
+  void (*ctr32) (const struct pv_aes_ctx *, char *, const char *,
+		 size_t, u_char *);
+};
+
+void pv_aes_setkey (struct pv_aes_ctx *c, const void *key, u_int len);
+void pv_aes_clrkey (struct pv_aes_ctx *c);
+void pv_aes_encrypt (const struct pv_aes_ctx *c, void *out, const void *in);
+void pv_aes_decrypt (const struct pv_aes_ctx *c, void *out, const void *in);
+void pv_cbc_encrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		     size_t len, char *iv);
+void pv_cbc_decrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		     size_t len, char *iv);
+void pv_cbc_encrypt_lanes (const struct pv_aes_ctx *c, struct pv_cbc_lane *l,
+			   int n);
+void pv_ctr32_encrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		       size_t nblocks, u_char *ctr);
+int pv_aes_selftest (void);
+
+/* one range of a CBC decryption handed to a pv_pool */
+struct pv_cbc_job {
+  struct pv_task task;		/* must be first */
+  const struct pv_aes_ctx *aes;
+  char *out;
+  const char *in;
+  size_t len;
+  char iv[BLOCK_LEN];
+};
+void pv_cbc_decrypt_start (struct pv_pool *pool, struct pv_cbc_job *jobs,
+			   int njobs, const struct pv_aes_ctx *c, char *out,
+			   const char *in, size_t len, char *iv);
+
+/* AES-GCM (pv_gcm.c) */
+#define PV_GCM_NONCE_LEN 12
+#define PV_GCM_TAG_LEN 16
+#define PV_GCM_MAX_LEN (((u_int64_t) 1 << 36) - 32) /* (2^32 - 2) blocks */
+
+struct pv_gcm_ctx {
+  const struct pv_aes_ctx *aes;
+  u_char h[BLOCK_LEN];		/* hash key AES(0) */
+  u_char j0[BLOCK_LEN];		/* pre-counter block; masks the tag */
+  u_char ctr[BLOCK_LEN];	/* next counter block */
+  u_char x[BLOCK_LEN];		/* GHASH accumulator */
+  u_int64_t alen, clen;		/* bytes of AAD and ciphertext so far */
+  int partial;			/* a ragged final block has been done */
+  u_int64_t hl[16], hh[16];	/* 4-bit multiplication tables */
+  u_char hpow[4][BLOCK_LEN];	/* H^1..H^4, for PCLMULQDQ */
+  void (*ghash) (struct pv_gcm_ctx *, const u_char *, size_t);
+};
+
+void pv_gcm_init (struct pv_gcm_ctx *g, const struct pv_aes_ctx *aes,
+		  const u_char *nonce);
+void pv_gcm_aad (struct pv_gcm_ctx *g, const void *aad, size_t len);
+int pv_gcm_encrypt (struct pv_gcm_ctx *g, char *out, const char *in,
+		    size_t len);
+int pv_gcm_decrypt (struct pv_gcm_ctx *g, char *out, const char *in,
+		    size_t len);
+int pv_gcm_hash (struct pv_gcm_ctx *g, const char *in, size_t len);
+void pv_gcm_final (struct pv_gcm_ctx *g, u_char *tag);
+int pv_gcm_selftest (void);
+
+/* HMAC-SHA1 and HMAC-SHA256 with a run-time selected SHA implementation
+   (pv_hmac.c) */
+#define PV_MAC_SHA1 0
+#define PV_MAC_SHA256 1
+#define PV_SHA256_LEN 32
+#define PV_MAC_MAX_LEN PV_SHA256_LEN
+
+struct pv_hmac_ctx {
+  const char *name;		/* "sha-ni" or "generic" */
+  u_int outlen;			/* HMAC_LEN or PV_SHA256_LEN */
+  u_int32_t ist[8];		/* state after the block K^ipad */
+  u_int32_t ost[8];		/* state after the block K^opad */
+  u_int32_t st[8];		/* running state */
+  u_char buf[64];		/* partial block */
+  size_t nbuf;
+  u_int64_t len;		/* bytes hashed, K^ipad included */
+  void (*compress) (u_int32_t *, const u_char *, size_t);
+};
+
+void pv_hmac_init (struct pv_hmac_ctx *c, int alg, const void *key,
+		   size_t keylen);
+void pv_hmac_update (struct pv_hmac_ctx *c, const void *data, size_t len);
+void pv_hmac_final (struct pv_hmac_ctx *c, u_char *out);
+void pv_hmac_padlen (struct pv_hmac_ctx *c, int mode, u_int32_t numpad0);
+void pv_hmac_clr (struct pv_hmac_ctx *c);
+int pv_hmac_selftest (void);
+int pv_hmac_check (void);
+
+/* PV_MODE_SEG segment and final tags (pv_seg.c) */
+#define PV_SEG_NONCE_LEN 16
+#define PV_SEG_TAG_LEN PV_SHA256_LEN
+#define PV_SEG_TRAILER_LEN (4 + PV_SEG_TAG_LEN)	/* padlen || final tag */
+
+struct pv_seg {
+  struct pv_hmac_ctx prefix;	/* has absorbed header || nonce */
+  struct pv_hmac_ctx all;	/* the final tag, so far */
+  u_int32_t nseg;		/* segments tagged */
+};
+
+void pv_seg_init (struct pv_seg *s, const char *sk_hmac, size_t sk_len,
+		  const char *head);
+void pv_seg_tag (struct pv_seg *s, int last, u_int32_t numpad0,
+		 const char *rec, size_t len, u_char *tag);
+void pv_seg_start (const struct pv_seg *s, struct pv_hmac_ctx *c,
+		   u_int32_t idx, int last, u_int32_t numpad0);
+void pv_seg_mac (const struct pv_seg *s, u_int32_t idx, int last,
+		 u_int32_t numpad0, const char *rec, size_t len, u_char *tag);
+void pv_seg_add (struct pv_seg *s, const u_char *tag);
+void pv_seg_final (struct pv_seg *s, u_char *tag);
+void pv_seg_clr (struct pv_seg *s);
+
+/* --compress (pv_lz.c): the ptxt as frames of LZ-compressed blocks */
+#define PV_LZ_BLOCK (1 << 16)
+#define PV_LZ_HASH_LOG 14
+#define PV_LZ_BOUND(n) ((n) + 4 * ((n) / PV_LZ_BLOCK + 1))
+
+struct pv_lz {
+  u_int32_t table[1 << PV_LZ_HASH_LOG]; /* last position of each hash */
+};
+
+struct pv_unlz {
+  char *frame;			/* a frame that came in pieces */
+  size_t nframe;
+  u_int32_t flen;		/* its header */
+  char *out;			/* a decompressed block */
+};
+
+void pv_lz_init (struct pv_lz *z);
+size_t pv_lz_frames (struct pv_lz *z, char *out, const char *in, size_t len);
+int pv_unlz_init (struct pv_unlz *u);
+int pv_unlz_update (struct pv_unlz *u, const char *in, size_t len,
+		    int (*put) (void *, const char *, size_t), void *arg);
+int pv_unlz_final (struct pv_unlz *u);
+void pv_unlz_free (struct pv_unlz *u);
+
+/* libpv: streaming and one-shot encryption and decryption in memory,
+   for the cbc, cbc-sha256 and gcm formats (pv_lib.c).  Every call
+   returns PV_OK or one of the errors below. */
+#define PV_OK 0
+#define PV_ERR_ARG -1		/* bad key, mode, or call out of order */
+#define PV_ERR_SPACE -2		/* out too small; nothing was consumed */
+#define PV_ERR_FORMAT -3	/* not a ciphertext, truncated, bad padding */
+#define PV_ERR_AUTH -4		/* MAC or tag mismatch */
+#define PV_ERR_MODE -5		/* PV_MODE_SEG, or --compress in one shot:
+				   use pv_encrypt/pv_decrypt */
+#define PV_ERR_LENGTH -6	/* too long for gcm */
+
+/* the most output an update of n bytes, or a final, can produce */
+#define PV_UPDATE_MAX(n) ((n) + PV_HDR_LEN + 2 * BLOCK_LEN)
+#define PV_FINAL_MAX (PV_HDR_LEN + 2 * BLOCK_LEN + PV_MAC_MAX_LEN + 4)
+
+struct pv_encrypt_ctx {
+  int mode, state;
+  struct pv_aes_ctx aes;
+  struct pv_hmac_ctx mac;	/* cbc formats */
+  struct pv_gcm_ctx gcm;	/* gcm; points at aes */
+  char iv[BLOCK_LEN];		/* CBC chaining value */
+  char head[PV_HDR_LEN + BLOCK_LEN]; /* header and IV (or nonce) */
+  size_t nhead;
+  char part[BLOCK_LEN];		/* ptxt short of a whole block */
+  size_t npart;
+};
+
+struct pv_decrypt_ctx {
+  int mode, state;		/* mode is -1 until the header is in */
+  int flags;			/* the header's: PV_FLAG_LZ or 0 */
+  struct pv_aes_ctx aes;
+  struct pv_hmac_ctx mac;
+  struct pv_gcm_ctx gcm;
+  char iv[BLOCK_LEN];
+  char mackey[PV_MAC_MAX_LEN];	/* until the format is known */
+  char aeskey[PV_MAC_MAX_LEN];	/* the same, for gcm, when verifying */
+  size_t mackeylen;
+  int verify;			/* pv_verify_init: MAC only, no ptxt */
+  char head[PV_HDR_LEN + BLOCK_LEN];
+  size_t nhead, headlen;
+  char la[2 * BLOCK_LEN + PV_MAC_MAX_LEN + 4]; /* held back: see pv_lib.c */
+  size_t nla, keep;
+  struct pv_pool *pool;		/* optional, see pv_decrypt_threads */
+  struct pv_cbc_job *jobs;
+  int njobs;
+};
+
+const char *pv_strerror (int err);
+int pv_encrypt_init (struct pv_encrypt_ctx *c, const void *key, size_t keylen,
+		     int mode);
+int pv_encrypt_update (struct pv_encrypt_ctx *c, const void *in, size_t inlen,
+		       void *out, size_t outcap, size_t *outlen);
+int pv_encrypt_final (struct pv_encrypt_ctx *c, void *out, size_t outcap,
+		      size_t *outlen);
+void pv_encrypt_clr (struct pv_encrypt_ctx *c);
+int pv_decrypt_init (struct pv_decrypt_ctx *c, const void *key, size_t keylen);
+int pv_verify_init (struct pv_decrypt_ctx *c, const void *key, size_t keylen);
+void pv_decrypt_threads (struct pv_decrypt_ctx *c, struct pv_pool *pool,
+			 struct pv_cbc_job *jobs, int njobs);
+int pv_decrypt_update (struct pv_decrypt_ctx *c, const void *in, size_t inlen,
+		       void *out, size_t outcap, size_t *outlen);
+int pv_decrypt_final (struct pv_decrypt_ctx *c, void *out, size_t outcap,
+		      size_t *outlen);
+void pv_decrypt_clr (struct pv_decrypt_ctx *c);
+size_t pv_encrypt_length (int mode, size_t inlen);
+int pv_encrypt_buffer (const void *key, size_t keylen, int mode,
+		       const void *in, size_t inlen, void *out, size_t outcap,
+		       size_t *outlen);
+int pv_decrypt_buffer (const void *key, size_t keylen, const void *in,
+		       size_t inlen, void *out, size_t outcap, size_t *outlen);
+
+/* page-aligned, locked buffers for keys and bulk data, recycled
+   (pv_arena.c) */
+void *pv_alloc (size_t len);
+void pv_free (void *p, size_t used);
+
+/* xor, MAC comparison and scrubbing kernels (pv_kern.c) */
+void xor_buffers (void *dst, const void *a, const void *b, size_t len);
+int pv_ct_differs (const void *a, const void *b, size_t len);
+void pv_scrub (void *p, size_t len);
+int pv_kern_selftest (void);
+int pv_kern_check (void);
 
 /* pv_misc.c */
 void ri (void);
+void pv_random (void *buf, size_t len);
 char *import_sk_from_file (char **raw_sk_p, size_t *raw_len_p, int fdsk);
 int write_chunk (int fd, const char *buf, u_int len);
-void xor_buffers(void *dst, const void *a, const void *b, size_t len);
+ssize_t read_chunk (int fd, char *buf, size_t len);
+ssize_t pread_chunk (int fd, char *buf, size_t len, off_t off);
+int pwrite_chunk (int fd, const char *buf, size_t len, off_t off);
+int pv_open_in (const char *name);
+int pv_open_out (const char *name, int flags, mode_t mode);
+void pv_remove_out (const char *name);
+int pv_sync_dir (const char *name);
+void pv_pipe_grow (int fd, size_t size);
+off_t parse_offset (const char *s);
+size_t parse_size (const char *s);
+size_t parse_bufsize (const char *s);
+void pv_opts_init (struct pv_opts *o);
+int parse_mode (const char *s);
+void pv_hdr_pack (char *buf, const struct pv_hdr *h);
+int pv_hdr_parse (struct pv_hdr *h, const char *buf);
+int pv_hdr_check (const struct pv_hdr *h);
+
+/* what make check and make bench share (pv_harness.c) */
+#define PV_MAXLIST 32		/* most items in an option list */
+
+struct pv_run {
+  double secs;
+  long rss_kb;
+  int status;
+};
+
+int pv_run_tool (const char *bin, const char *prog, char **argv, int quiet,
+		 struct pv_run *r);
+int pv_make_input (const char *path, off_t size, int text);
+int pv_same_file (const char *a, const char *b);
+int pv_split (char *s, char **v);
+off_t pv_parse_sum (const char *s);
 
 #ifndef HAVE_GETPROGNAME
 # define MY_MAXNAME 80
@@ -16,7 +503,4 @@ const char *getprogname(void);
 void setprogname(const char *n);
 #endif /* HAVE_GETPROGNAME */
 
-#define CCA_STRENGTH 32 /* must be one of 16, 24 or 32; used to set AES keys */
-#define BLOCK_LEN 16
-
 #endif /* _PV_H_ */
@@ -0,0 +1,691 @@
+#include "pv.h"
+
+/* Block cipher backends.  The portable one wraps libdcrypt's table-driven
+ * aes_encrypt/aes_decrypt; on x86 CPUs that advertise AES-NI we use the
+ * aesenc/aesdec instructions instead, which is an order of magnitude faster
+ * and, unlike table lookups, does not leak key bits through the cache.
+ * The backend is picked at run time in pv_aes_setkey; setting the
+ * environment variable PV_AES=generic forces the portable one.
+ */
+
+/*
+ * libdcrypt backend
+ */
+
+static void
+generic_encrypt (const struct pv_aes_ctx *c, void *out, const void *in)
+{
+  aes_encrypt (&c->aes, out, in);
+}
+
+static void
+generic_decrypt (const struct pv_aes_ctx *c, void *out, const void *in)
+{
+  aes_decrypt (&c->aes, out, in);
+}
+
+static void
+generic_cbc_encrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		     size_t len, char *iv)
+{
+  size_t off;
+
+  for (off = 0; off < len; off += BLOCK_LEN) {
+    xor_buffers (iv, in + off, iv, BLOCK_LEN);	/* iv := in ^ iv */
+    aes_encrypt (&c->aes, out + off, iv);	/* out := AES(iv) */
+    memcpy (iv, out + off, BLOCK_LEN);
+  }
+}
+
+static void
+generic_cbc_encrypt_lanes (const struct pv_aes_ctx *c, struct pv_cbc_lane *l,
+			   int n)
+{
+  for (; n--; l++)
+    generic_cbc_encrypt (c, l->out, l->in, l->len, l->iv);
+}
+
+static void
+generic_cbc_decrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		     size_t len, char *iv)
+{
+  char cur[BLOCK_LEN];
+  size_t off;
+
+  for (off = 0; off < len; off += BLOCK_LEN) {
+    memcpy (cur, in + off, BLOCK_LEN);	      /* in and out may overlap */
+    aes_decrypt (&c->aes, out + off, cur);    /* out := AES'(in) */
+    xor_buffers (out + off, out + off, iv, BLOCK_LEN); /* out := out ^ iv */
+    memcpy (iv, cur, BLOCK_LEN);	      /* iv := in */
+  }
+}
+
+/* add n to the big-endian 32-bit counter in the last word of ctr */
+static void
+ctr32_add (u_char *ctr, u_int32_t n)
+{
+  u_int32_t v = getint (ctr + BLOCK_LEN - 4) + n;
+
+  putint (ctr + BLOCK_LEN - 4, v);
+}
+
+static void
+generic_ctr32 (const struct pv_aes_ctx *c, char *out, const char *in,
+	       size_t nblocks, u_char *ctr)
+{
+  char ks[BLOCK_LEN];
+  size_t off;
+
+  for (off = 0; nblocks--; off += BLOCK_LEN) {
+    aes_encrypt (&c->aes, ks, ctr);
+    xor_buffers (out + off, in + off, ks, BLOCK_LEN);
+    ctr32_add (ctr, 1);
+  }
+  pv_scrub (ks, sizeof (ks));
+}
+
+/*
+ * AES-NI backend
+ */
+
+#ifdef PV_HAVE_AESNI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <emmintrin.h>
+
+#define AESNI __attribute__ ((target ("aes,sse2")))
+
+#define RK(c, i) _mm_loadu_si128 ((const __m128i *) (c)->ek + (i))
+#define DK(c, i) _mm_loadu_si128 ((const __m128i *) (c)->dk + (i))
+
+static int
+have_aesni (void)
+{
+  unsigned int a, b, c, d;
+
+  if (!__get_cpuid (1, &a, &b, &c, &d))
+    return 0;
+  return (c & bit_AES) && (d & bit_SSE2);
+}
+
+/* key expansion, after Intel's AES-NI white paper (Gueron, 2010) */
+static AESNI __m128i
+expand_step (__m128i t1, __m128i t2)
+{
+  __m128i t3;
+
+  t3 = _mm_slli_si128 (t1, 4);
+  t1 = _mm_xor_si128 (t1, t3);
+  t3 = _mm_slli_si128 (t3, 4);
+  t1 = _mm_xor_si128 (t1, t3);
+  t3 = _mm_slli_si128 (t3, 4);
+  t1 = _mm_xor_si128 (t1, t3);
+  return _mm_xor_si128 (t1, t2);
+}
+
+static AESNI void
+expand128 (__m128i *ks, const unsigned char *key)
+{
+  ks[0] = _mm_loadu_si128 ((const __m128i *) key);
+#define STEP128(i, rcon) \
+  ks[i] = expand_step (ks[i-1], _mm_shuffle_epi32 ( \
+            _mm_aeskeygenassist_si128 (ks[i-1], rcon), 0xff))
+  STEP128 (1, 0x01); STEP128 (2, 0x02); STEP128 (3, 0x04);
+  STEP128 (4, 0x08); STEP128 (5, 0x10); STEP128 (6, 0x20);
+  STEP128 (7, 0x40); STEP128 (8, 0x80); STEP128 (9, 0x1b);
+  STEP128 (10, 0x36);
+#undef STEP128
+}
+
+/* one round of the 192-bit schedule: t1 holds words 0-3, t3 words 4-5 */
+static AESNI void
+assist192 (__m128i *t1, __m128i t2, __m128i *t3)
+{
+  __m128i t4;
+
+  *t1 = expand_step (*t1, _mm_shuffle_epi32 (t2, 0x55));
+  t2 = _mm_shuffle_epi32 (*t1, 0xff);
+  t4 = _mm_slli_si128 (*t3, 4);
+  *t3 = _mm_xor_si128 (*t3, t4);
+  *t3 = _mm_xor_si128 (*t3, t2);
+}
+
+#define MIX_LO(a, b) _mm_castpd_si128 (_mm_shuffle_pd (_mm_castsi128_pd (a), \
+						       _mm_castsi128_pd (b), 0))
+#define MIX_HI(a, b) _mm_castpd_si128 (_mm_shuffle_pd (_mm_castsi128_pd (a), \
+						       _mm_castsi128_pd (b), 1))
+
+static AESNI void
+expand192 (__m128i *ks, const unsigned char *key)
+{
+  unsigned char k[32];
+  __m128i t1, t3;
+
+  bzero (k, sizeof (k));	/* 24-byte key: don't load past its end */
+  memcpy (k, key, 24);
+  t1 = _mm_loadu_si128 ((const __m128i *) k);
+  t3 = _mm_loadu_si128 ((const __m128i *) (k + 16));
+  pv_scrub (k, sizeof (k));
+
+  ks[0] = t1;
+  ks[1] = t3;
+  assist192 (&t1, _mm_aeskeygenassist_si128 (t3, 0x01), &t3);
+  ks[1] = MIX_LO (ks[1], t1);
+  ks[2] = MIX_HI (t1, t3);
+  assist192 (&t1, _mm_aeskeygenassist_si128 (t3, 0x02), &t3);
+  ks[3] = t1;
+  ks[4] = t3;
+  assist192 (&t1, _mm_aeskeygenassist_si128 (t3, 0x04), &t3);
+  ks[4] = MIX_LO (ks[4], t1);
+  ks[5] = MIX_HI (t1, t3);
+  assist192 (&t1, _mm_aeskeygenassist_si128 (t3, 0x08), &t3);
+  ks[6] = t1;
+  ks[7] = t3;
+  assist192 (&t1, _mm_aeskeygenassist_si128 (t3, 0x10), &t3);
+  ks[7] = MIX_LO (ks[7], t1);
+  ks[8] = MIX_HI (t1, t3);
+  assist192 (&t1, _mm_aeskeygenassist_si128 (t3, 0x20), &t3);
+  ks[9] = t1;
+  ks[10] = t3;
+  assist192 (&t1, _mm_aeskeygenassist_si128 (t3, 0x40), &t3);
+  ks[10] = MIX_LO (ks[10], t1);
+  ks[11] = MIX_HI (t1, t3);
+  assist192 (&t1, _mm_aeskeygenassist_si128 (t3, 0x80), &t3);
+  ks[12] = t1;
+}
+
+static AESNI void
+expand256 (__m128i *ks, const unsigned char *key)
+{
+  __m128i t1, t3;
+
+  t1 = _mm_loadu_si128 ((const __m128i *) key);
+  t3 = _mm_loadu_si128 ((const __m128i *) (key + 16));
+  ks[0] = t1;
+  ks[1] = t3;
+#define STEP256A(i, rcon) \
+  ks[i] = t1 = expand_step (t1, _mm_shuffle_epi32 ( \
+		 _mm_aeskeygenassist_si128 (t3, rcon), 0xff))
+#define STEP256B(i) \
+  ks[i] = t3 = expand_step (t3, _mm_shuffle_epi32 ( \
+		 _mm_aeskeygenassist_si128 (t1, 0x00), 0xaa))
+  STEP256A (2, 0x01); STEP256B (3);
+  STEP256A (4, 0x02); STEP256B (5);
+  STEP256A (6, 0x04); STEP256B (7);
+  STEP256A (8, 0x08); STEP256B (9);
+  STEP256A (10, 0x10); STEP256B (11);
+  STEP256A (12, 0x20); STEP256B (13);
+  STEP256A (14, 0x40);
+#undef STEP256A
+#undef STEP256B
+}
+
+static AESNI void
+aesni_setkey (struct pv_aes_ctx *c, const void *key, u_int len)
+{
+  __m128i ks[15];
+  u_int i;
+
+  switch (len) {
+  case 16: expand128 (ks, key); c->nrounds = 10; break;
+  case 24: expand192 (ks, key); c->nrounds = 12; break;
+  default: expand256 (ks, key); c->nrounds = 14; break;
+  }
+  /* decryption uses the equivalent inverse cipher: reversed round keys,
+     with InvMixColumns applied to all but the first and last */
+  for (i = 0; i <= c->nrounds; i++) {
+    _mm_storeu_si128 ((__m128i *) c->ek + i, ks[i]);
+    _mm_storeu_si128 ((__m128i *) c->dk + (c->nrounds - i),
+		      (i == 0 || i == c->nrounds) ? ks[i]
+		      : _mm_aesimc_si128 (ks[i]));
+  }
+  pv_scrub (ks, sizeof (ks));
+}
+
+static AESNI __m128i
+aesni_enc1 (const struct pv_aes_ctx *c, __m128i b)
+{
+  u_int r;
+
+  b = _mm_xor_si128 (b, RK (c, 0));
+  for (r = 1; r < c->nrounds; r++)
+    b = _mm_aesenc_si128 (b, RK (c, r));
+  return _mm_aesenclast_si128 (b, RK (c, c->nrounds));
+}
+
+static AESNI __m128i
+aesni_dec1 (const struct pv_aes_ctx *c, __m128i b)
+{
+  u_int r;
+
+  b = _mm_xor_si128 (b, DK (c, 0));
+  for (r = 1; r < c->nrounds; r++)
+    b = _mm_aesdec_si128 (b, DK (c, r));
+  return _mm_aesdeclast_si128 (b, DK (c, c->nrounds));
+}
+
+static AESNI void
+aesni_encrypt (const struct pv_aes_ctx *c, void *out, const void *in)
+{
+  _mm_storeu_si128 ((__m128i *) out,
+		    aesni_enc1 (c, _mm_loadu_si128 ((const __m128i *) in)));
+}
+
+static AESNI void
+aesni_decrypt (const struct pv_aes_ctx *c, void *out, const void *in)
+{
+  _mm_storeu_si128 ((__m128i *) out,
+		    aesni_dec1 (c, _mm_loadu_si128 ((const __m128i *) in)));
+}
+
+/* CBC encryption is serial: each block waits for the previous one */
+static AESNI void
+aesni_cbc_encrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		   size_t len, char *iv)
+{
+  __m128i x = _mm_loadu_si128 ((const __m128i *) iv);
+  size_t off;
+
+  for (off = 0; off < len; off += BLOCK_LEN) {
+    x = _mm_xor_si128 (x, _mm_loadu_si128 ((const __m128i *) (in + off)));
+    x = aesni_enc1 (c, x);
+    _mm_storeu_si128 ((__m128i *) (out + off), x);
+  }
+  _mm_storeu_si128 ((__m128i *) iv, x);
+}
+
+/* ... but separate messages don't wait on each other.  Runs w blocks
+   of w runs through the rounds together, nblocks times: x[i] is run
+   i's chaining value and in[i], out[i] where it has got to.  A slot
+   with no run in it has step[i] 0 and goes round in place on a dummy
+   block; w is a constant at each call, so x stays in registers. */
+static AESNI void
+cbc_enc_wide (const struct pv_aes_ctx *c, __m128i *x, const char **in,
+	      char **out, const size_t *step, size_t nblocks, const int w)
+{
+  __m128i b[PV_CBC_LANES], k;
+  u_int r;
+  int i;
+
+  while (nblocks--) {
+    k = RK (c, 0);
+    for (i = 0; i < w; i++)
+      b[i] = _mm_xor_si128 (_mm_xor_si128 (x[i], k),
+			    _mm_loadu_si128 ((const __m128i *) in[i]));
+    for (r = 1; r < c->nrounds; r++) {
+      k = RK (c, r);
+      for (i = 0; i < w; i++)
+	b[i] = _mm_aesenc_si128 (b[i], k);
+    }
+    k = RK (c, c->nrounds);
+    for (i = 0; i < w; i++) {
+      x[i] = _mm_aesenclast_si128 (b[i], k);
+      _mm_storeu_si128 ((__m128i *) out[i], x[i]);
+      in[i] += step[i];
+      out[i] += step[i];
+    }
+  }
+}
+
+/* n <= PV_CBC_LANES runs, each as aesni_cbc_encrypt would do it but
+   one block of each per trip through the rounds, so that the aesenc
+   latency of one is hidden behind the others.  Runs drop out as they
+   end; the rest carry on in 8 or 4 slots, and the last alone. */
+static AESNI void
+aesni_cbc_encrypt_lanes (const struct pv_aes_ctx *c, struct pv_cbc_lane *l,
+			 int n)
+{
+  __m128i x[PV_CBC_LANES];
+  const char *in[PV_CBC_LANES];
+  char *out[PV_CBC_LANES];
+  size_t step[PV_CBC_LANES], off, end;
+  char junk[BLOCK_LEN];
+  int live[PV_CBC_LANES], m, i, j, w;
+
+  bzero (junk, sizeof (junk));
+  for (off = 0;; off = end) {
+    /* the runs that aren't done, and how far they all go together */
+    for (m = j = 0, end = 0; j < n; j++)
+      if (l[j].len > off) {
+	live[m++] = j;
+	if (!end || l[j].len < end)
+	  end = l[j].len;
+      }
+    if (m <= 1)
+      break;
+    w = m > 4 ? 8 : 4;
+    for (i = 0; i < w; i++) {
+      j = live[i < m ? i : 0];
+      x[i] = _mm_loadu_si128 ((const __m128i *) l[j].iv);
+      in[i] = i < m ? l[j].in + off : junk;
+      out[i] = i < m ? l[j].out + off : junk;
+      step[i] = i < m ? BLOCK_LEN : 0;
+    }
+    if (w == 8)
+      cbc_enc_wide (c, x, in, out, step, (end - off) / BLOCK_LEN, 8);
+    else
+      cbc_enc_wide (c, x, in, out, step, (end - off) / BLOCK_LEN, 4);
+    for (i = 0; i < m; i++)
+      _mm_storeu_si128 ((__m128i *) l[live[i]].iv, x[i]);
+  }
+  if (m == 1)
+    aesni_cbc_encrypt (c, l[live[0]].out + off, l[live[0]].in + off,
+		       l[live[0]].len - off, l[live[0]].iv);
+  pv_scrub (junk, sizeof (junk));
+}
+
+/* CBC decryption is not: run LANES independent blocks through the pipeline */
+#define LANES 8
+
+static AESNI void
+aesni_cbc_decrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		   size_t len, char *iv)
+{
+  __m128i prev = _mm_loadu_si128 ((const __m128i *) iv);
+  __m128i ct[LANES], b[LANES], k;
+  size_t off = 0;
+  u_int r, j;
+
+  for (; off + LANES * BLOCK_LEN <= len; off += LANES * BLOCK_LEN) {
+    k = DK (c, 0);
+    for (j = 0; j < LANES; j++) {
+      ct[j] = _mm_loadu_si128 ((const __m128i *) (in + off) + j);
+      b[j] = _mm_xor_si128 (ct[j], k);
+    }
+    for (r = 1; r < c->nrounds; r++) {
+      k = DK (c, r);
+      for (j = 0; j < LANES; j++)
+	b[j] = _mm_aesdec_si128 (b[j], k);
+    }
+    k = DK (c, c->nrounds);
+    for (j = 0; j < LANES; j++) {
+      b[j] = _mm_aesdeclast_si128 (b[j], k);
+      _mm_storeu_si128 ((__m128i *) (out + off) + j,
+			_mm_xor_si128 (b[j], j ? ct[j-1] : prev));
+    }
+    prev = ct[LANES - 1];
+  }
+  for (; off < len; off += BLOCK_LEN) {
+    ct[0] = _mm_loadu_si128 ((const __m128i *) (in + off));
+    _mm_storeu_si128 ((__m128i *) (out + off),
+		      _mm_xor_si128 (aesni_dec1 (c, ct[0]), prev));
+    prev = ct[0];
+  }
+  _mm_storeu_si128 ((__m128i *) iv, prev);
+}
+/* counter mode has no chaining at all: keep 8 blocks in flight */
+static AESNI void
+aesni_ctr32 (const struct pv_aes_ctx *c, char *out, const char *in,
+	     size_t nblocks, u_char *ctr)
+{
+  __m128i b[LANES], k;
+  u_int32_t w0, w1, w2, n;
+  u_int r, j, lanes;
+
+  memcpy (&w0, ctr, 4);		/* the fixed 96 bits, in memory order */
+  memcpy (&w1, ctr + 4, 4);
+  memcpy (&w2, ctr + 8, 4);
+  n = getint (ctr + 12);
+
+  while (nblocks) {
+    lanes = nblocks < LANES ? nblocks : LANES;
+    k = RK (c, 0);
+    for (j = 0; j < lanes; j++)
+      b[j] = _mm_xor_si128 (_mm_set_epi32 ((int) __builtin_bswap32 (n + j),
+					   (int) w2, (int) w1, (int) w0), k);
+    for (r = 1; r < c->nrounds; r++) {
+      k = RK (c, r);
+      for (j = 0; j < lanes; j++)
+	b[j] = _mm_aesenc_si128 (b[j], k);
+    }
+    k = RK (c, c->nrounds);
+    for (j = 0; j < lanes; j++) {
+      b[j] = _mm_aesenclast_si128 (b[j], k);
+      _mm_storeu_si128 ((__m128i *) out + j,
+			_mm_xor_si128 (b[j], _mm_loadu_si128 ((const __m128i *) in + j)));
+    }
+    n += lanes;
+    nblocks -= lanes;
+    in += lanes * BLOCK_LEN;
+    out += lanes * BLOCK_LEN;
+  }
+  putint (ctr + 12, n);
+}
+#endif /* PV_HAVE_AESNI */
+
+/*
+ * dispatch
+ */
+
+void
+pv_aes_setkey (struct pv_aes_ctx *c, const void *key, u_int len)
+{
+  const char *force = getenv ("PV_AES");
+
+  assert (len == 16 || len == 24 || len == 32);
+  bzero (c, sizeof (*c));
+#ifdef PV_HAVE_AESNI
+  if (!(force && !strcmp (force, "generic")) && have_aesni ()) {
+    c->name = "aesni";
+    aesni_setkey (c, key, len);
+    c->encrypt = aesni_encrypt;
+    c->decrypt = aesni_decrypt;
+    c->cbc_encrypt = aesni_cbc_encrypt;
+    c->cbc_encrypt_lanes = aesni_cbc_encrypt_lanes;
+    c->cbc_decrypt = aesni_cbc_decrypt;
+    c->ctr32 = aesni_ctr32;
+    return;
+  }
+#else
+  (void) force;
+#endif /* PV_HAVE_AESNI */
+  c->name = "generic";
+  aes_setkey (&c->aes, key, len);
+  c->encrypt = generic_encrypt;
+  c->decrypt = generic_decrypt;
+  c->cbc_encrypt = generic_cbc_encrypt;
+  c->cbc_encrypt_lanes = generic_cbc_encrypt_lanes;
+  c->cbc_decrypt = generic_cbc_decrypt;
+  c->ctr32 = generic_ctr32;
+}
+
+void
+pv_aes_clrkey (struct pv_aes_ctx *c)
+{
+  pv_scrub (c, sizeof (*c));
+}
+
+void
+pv_aes_encrypt (const struct pv_aes_ctx *c, void *out, const void *in)
+{
+  c->encrypt (c, out, in);
+}
+
+void
+pv_aes_decrypt (const struct pv_aes_ctx *c, void *out, const void *in)
+{
+  c->decrypt (c, out, in);
+}
+
+/* CBC over len bytes (a multiple of BLOCK_LEN); out may equal in.
+   iv holds the previous ciphertext block on entry and the last
+   ciphertext block of this run on return, so calls can be chained. */
+void
+pv_cbc_encrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		size_t len, char *iv)
+{
+  c->cbc_encrypt (c, out, in, len, iv);
+}
+
+void
+pv_cbc_decrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		size_t len, char *iv)
+{
+  c->cbc_decrypt (c, out, in, len, iv);
+}
+
+/* pv_cbc_encrypt of n independent runs under the one key, interleaved
+   (by PV_CBC_LANES at a time) to keep the AES unit busy; each run's
+   len may be different, or 0 */
+void
+pv_cbc_encrypt_lanes (const struct pv_aes_ctx *c, struct pv_cbc_lane *l,
+		      int n)
+{
+  for (; n > PV_CBC_LANES; n -= PV_CBC_LANES, l += PV_CBC_LANES)
+    c->cbc_encrypt_lanes (c, l, PV_CBC_LANES);
+  c->cbc_encrypt_lanes (c, l, n);
+}
+
+/* counter mode over nblocks blocks, as used by GCM: out := in ^
+   AES(ctr), AES(ctr+1), ...; only the last 32 bits of ctr count, and
+   ctr is advanced past the blocks used.  out may equal in. */
+void
+pv_ctr32_encrypt (const struct pv_aes_ctx *c, char *out, const char *in,
+		  size_t nblocks, u_char *ctr)
+{
+  c->ctr32 (c, out, in, nblocks, ctr);
+}
+
+/*
+ * multi-threaded CBC decryption
+ */
+
+/* below this many bytes per thread, handing work out costs more than
+   it saves */
+#define CBC_MIN_RANGE (64 * 1024)
+
+static void
+cbc_job_run (struct pv_task *t)
+{
+  struct pv_cbc_job *j = (struct pv_cbc_job *) t;
+
+  pv_cbc_decrypt (j->aes, j->out, j->in, j->len, j->iv);
+}
+
+/* Unlike encryption, CBC decryption of a block only needs the ciphertext
+   block before it, so a run can be cut into ranges that are decrypted
+   independently.  Queues up to njobs such ranges on pool; the caller
+   must pv_pool_wait before using out or reusing in.  iv is advanced to
+   the last ciphertext block right away.  Without a pool, or for short
+   runs, this is just pv_cbc_decrypt. */
+void
+pv_cbc_decrypt_start (struct pv_pool *pool, struct pv_cbc_job *jobs,
+		      int njobs, const struct pv_aes_ctx *c, char *out,
+		      const char *in, size_t len, char *iv)
+{
+  size_t off, per;
+  int i, n;
+
+  if (!pool || njobs < 2 || len < 2 * CBC_MIN_RANGE) {
+    pv_cbc_decrypt (c, out, in, len, iv);
+    return;
+  }
+
+  n = len / CBC_MIN_RANGE;
+  if (n > njobs)
+    n = njobs;
+  per = (len / BLOCK_LEN + n - 1) / n * BLOCK_LEN;
+
+  /* take every chaining block before any job can overwrite in */
+  for (i = 0, off = 0; off < len; i++, off += per) {
+    jobs[i].task.fn = cbc_job_run;
+    jobs[i].aes = c;
+    jobs[i].out = out + off;
+    jobs[i].in = in + off;
+    jobs[i].len = (len - off < per) ? len - off : per;
+    memcpy (jobs[i].iv, off ? in + off - BLOCK_LEN : iv, BLOCK_LEN);
+  }
+  memcpy (iv, in + len - BLOCK_LEN, BLOCK_LEN);
+  n = i;
+
+  for (i = 0; i < n; i++)
+    pv_pool_submit (pool, &jobs[i].task);
+}
+
+/* known-answer test: the FIPS-197 appendix C vectors for every key size,
+   then a multi-block CBC round trip checked against libdcrypt.
+   Returns 0 if the selected backend agrees, -1 otherwise. */
+int
+pv_aes_selftest (void)
+{
+  static const u_char pt[BLOCK_LEN] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+    0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+  };
+  static const u_char kat[3][BLOCK_LEN] = {
+    { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+      0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a },
+    { 0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0,
+      0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91 },
+    { 0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+      0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 }
+  };
+#define ST_BLOCKS 19		/* some full pipeline batches plus a tail */
+  char key[32], iv1[BLOCK_LEN], iv2[BLOCK_LEN];
+  char buf[BLOCK_LEN], msg[ST_BLOCKS * BLOCK_LEN];
+  char ct1[sizeof (msg)], ct2[sizeof (msg)];
+#define ST_LANES (PV_CBC_LANES + 3)	/* a full set and a ragged one */
+  char lct[ST_LANES][sizeof (msg)], liv[ST_LANES][BLOCK_LEN];
+  struct pv_cbc_lane lanes[ST_LANES];
+  struct pv_aes_ctx c;
+  struct aes_ctx ref;
+  int i, j, ks, ret = 0;
+
+  for (i = 0; i < 32; i++)
+    key[i] = i;
+  for (i = 0; i < (int) sizeof (msg); i++)
+    msg[i] = (char) (i * 7 + 3);
+
+  for (ks = 0; ks < 3 && !ret; ks++) {
+    u_int klen = 16 + 8 * ks;
+
+    pv_aes_setkey (&c, key, klen);
+    pv_aes_encrypt (&c, buf, pt);
+    if (memcmp (buf, kat[ks], BLOCK_LEN))
+      ret = -1;
+    pv_aes_decrypt (&c, buf, kat[ks]);
+    if (memcmp (buf, pt, BLOCK_LEN))
+      ret = -1;
+
+    /* CBC against a straightforward libdcrypt reference */
+    aes_setkey (&ref, key, klen);
+    memset (iv1, 0x5a, BLOCK_LEN);
+    memcpy (ct1, msg, sizeof (msg));
+    for (i = 0; i < ST_BLOCKS; i++) {
+      xor_buffers (iv1, ct1 + i * BLOCK_LEN, iv1, BLOCK_LEN);
+      aes_encrypt (&ref, ct1 + i * BLOCK_LEN, iv1);
+      memcpy (iv1, ct1 + i * BLOCK_LEN, BLOCK_LEN);
+    }
+    aes_clrkey (&ref);
+    memset (iv2, 0x5a, BLOCK_LEN);
+    pv_cbc_encrypt (&c, ct2, msg, sizeof (msg), iv2);
+    if (memcmp (ct1, ct2, sizeof (msg)) || memcmp (iv1, iv2, BLOCK_LEN))
+      ret = -1;
+    memset (iv2, 0x5a, BLOCK_LEN);
+    pv_cbc_decrypt (&c, ct2, ct2, sizeof (msg), iv2); /* in place */
+    if (memcmp (ct2, msg, sizeof (msg)) || memcmp (iv1, iv2, BLOCK_LEN))
+      ret = -1;
+    /* the same message, cut short at a different length in each lane */
+    for (j = 0; j < ST_LANES; j++) {
+      memset (liv[j], 0x5a, BLOCK_LEN);
+      lanes[j].out = lct[j];
+      lanes[j].in = msg;
+      lanes[j].len = (j * 7 % (ST_BLOCKS + 1)) * BLOCK_LEN;
+      lanes[j].iv = liv[j];
+    }
+    pv_cbc_encrypt_lanes (&c, lanes, ST_LANES);
+    for (j = 0; j < ST_LANES; j++)
+      if (memcmp (lct[j], ct1, lanes[j].len)
+	  || (lanes[j].len && memcmp (liv[j], ct1 + lanes[j].len - BLOCK_LEN,
+				      BLOCK_LEN)))
+	ret = -1;
+    if (ret)
+      fprintf (stderr, "%s: AES-%u self-test failed (%s backend)\n",
+	       getprogname (), klen * 8, c.name);
+    pv_aes_clrkey (&c);
+  }
+#undef ST_BLOCKS
+#undef ST_LANES
+
+  return ret;
+}
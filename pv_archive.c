@@ -0,0 +1,1045 @@
+#include "pv.h"
+#include <dirent.h>
+
+/* pv_archive: a tree of files in one PV_MODE_ARCHIVE container (see
+ * pv.h), rather than a ctxt, an IV, a MAC and an inode per file.
+ *
+ * Each member is encrypted and tagged like a --mode seg segment of its
+ * own length (pv_seg.c): CBC-AES under a fresh IV, then an HMAC-SHA256
+ * over the header, the nonce, the member's number and padlen, its IV
+ * and its Y.  So each member is authenticated on its own, and none can
+ * be moved, swapped with another or carried over from another archive.
+ * The archive is written front to back in one pass (it may be a pipe):
+ * the members as the tree is walked, then the index, then the trailer.
+ *
+ * The index is one more segment, the last, whose ptxt is an entry per
+ * member, in order:
+ *
+ *     offset (64 bits) | size (64) | mtime (64) | st_mode (32) |
+ *       name length (16) | tag (32 bytes) | name
+ *
+ * all big endian, offset being where the member's segment starts and
+ * tag its T_i; the final tag in the trailer covers every T_i and the
+ * index's own.  Reading needs a regular file: the trailer is read
+ * from the end, and from it the index in one more pread, only when a
+ * list or an extraction first needs it; its entries are walked where
+ * they lie rather than parsed into a table.  A member then is one
+ * pread (or a run of them, for one over --bufsize), checked against
+ * the tag in the index before its ptxt is written; one too big to
+ * hold is decrypted as it is read into a temporary file beside its
+ * name, which replaces what is there only once the tag has matched.
+ */
+
+#define ARC_ENTRY_LEN (8 + 8 + 8 + 4 + 2 + PV_SEG_TAG_LEN) /* then the name */
+#define ARC_TRAILER_LEN (8 + 4 + 4 + PV_SEG_TAG_LEN)
+#define ARC_NAME_MAX 0xffff
+#define ARC_PADDED(n) ((n) + (BLOCK_LEN - (n) % BLOCK_LEN) % BLOCK_LEN)
+
+struct arc_entry {
+  u_int32_t idx;		/* the member's number */
+  u_int64_t off;		/* of its segment */
+  u_int64_t size;		/* ptxt bytes */
+  u_int64_t mtime;
+  u_int32_t mode;
+  const char *name;		/* not NUL-terminated */
+  size_t namelen;
+  const u_char *tag;
+};
+
+/* pv_archive -c */
+struct arc_writer {
+  struct pv_aes_ctx aes;
+  struct pv_seg seg;		/* seg.nseg: the members so far */
+  struct pv_io *out;
+  dev_t dev;			/* of the archive, which isn't put in it */
+  ino_t ino;
+  u_int64_t off;		/* bytes written */
+  size_t bufsize;
+  char *rec;			/* IV | bufsize bytes | tag */
+  char *index;			/* the entries so far */
+  size_t nindex, capindex;
+  int failed;			/* something was left out */
+};
+
+/* pv_archive -t, -x */
+struct arc_reader {
+  int fd;
+  struct pv_aes_ctx aes;
+  struct pv_seg seg;
+  u_int32_t n;			/* members */
+  u_int32_t numpad0;		/* of the index */
+  u_int64_t index_off;
+  u_char final[PV_SEG_TAG_LEN];
+  char *index;			/* the entries, once loaded */
+  size_t nindex;
+  size_t bufsize;
+  char *rec;			/* IV | bufsize bytes | tag */
+  mode_t mask;			/* the umask, for -x */
+  int failed;
+};
+
+static void
+put64 (char *p, u_int64_t v)
+{
+  putint (p, (u_int32_t) (v >> 32));
+  putint (p + 4, (u_int32_t) v);
+}
+
+static u_int64_t
+get64 (const char *p)
+{
+  return (u_int64_t) getint (p) << 32 | getint (p + 4);
+}
+
+/* The next member, from fd (size bytes of it, or zeros where it falls
+   short), mem, or nothing (size 0), as a segment; its tag into tag.
+   last is for the index.  Returns 0, 1 if fd fell short, or -1 (after
+   complaining) if the archive couldn't be written. */
+static int
+arc_put (struct arc_writer *w, int fd, const char *mem, u_int64_t size,
+	 int last, u_char *tag, const char *name)
+{
+  const u_int32_t numpad0 = (BLOCK_LEN - size % BLOCK_LEN) % BLOCK_LEN;
+  struct pv_hmac_ctx c;
+  struct pv_io *in = NULL;
+  struct pv_stamp t;
+  char iv[BLOCK_LEN], *p;
+  u_int64_t left = size;
+  size_t n, len, head = BLOCK_LEN;
+  ssize_t r;
+  int ret = 0;
+
+  if (fd != -1 && size > w->bufsize
+      && !(in = pv_io_open (fd, 0, w->bufsize))) {
+    fprintf (stderr, "%s: Cannot allocate memory\n", getprogname ());
+    return -1;
+  }
+  pv_random (w->rec, BLOCK_LEN);
+  memcpy (iv, w->rec, BLOCK_LEN);
+  pv_seg_start (&w->seg, &c, w->seg.nseg, last, numpad0);
+  pv_hmac_update (&c, w->rec, BLOCK_LEN);
+  do {
+    n = left < w->bufsize ? left : w->bufsize;
+    p = w->rec + head;
+    if (mem) {
+      memcpy (p, mem, n);
+      mem += n;
+    }
+    else if (fd != -1 && !ret) {
+      r = in ? pv_io_read (in, p, n) : read_chunk (fd, p, n);
+      if (r < (ssize_t) n) {
+	if (r == -1)
+	  fprintf (stderr, "%s: %s: %s; ", getprogname (), name,
+		   strerror (errno));
+	else
+	  fprintf (stderr, "%s: %s: file shrank; ", getprogname (), name);
+	fprintf (stderr, "the rest of it is zeros\n");
+	bzero (p + (r > 0 ? r : 0), n - (r > 0 ? r : 0));
+	ret = 1;
+      }
+    }
+    else
+      bzero (p, n);
+    left -= n;
+    len = n;
+    if (!left && numpad0) {
+      bzero (p + n, numpad0);
+      len += numpad0;
+    }
+    pv_stats_begin (&t);
+    pv_cbc_encrypt (&w->aes, p, p, len, iv);
+    pv_stats_end (PV_PH_CIPHER, &t);
+    pv_stats_begin (&t);
+    pv_hmac_update (&c, p, len);
+    if (!left) {
+      pv_hmac_final (&c, tag);
+      memcpy (p + len, tag, PV_SEG_TAG_LEN);
+      len += PV_SEG_TAG_LEN;
+    }
+    pv_stats_end (PV_PH_MAC, &t);
+    if (pv_io_write (w->out, w->rec, head + len) != 0) {
+      perror (getprogname ());
+      ret = -1;
+      break;
+    }
+    w->off += head + len;
+    head = 0;
+  } while (left);
+
+  pv_hmac_clr (&c);
+  pv_io_close (in);
+  if (ret != -1)
+    pv_seg_add (&w->seg, tag);
+  return ret;
+}
+
+/* the entry for the member just put, which started at off */
+static int
+arc_entry_add (struct arc_writer *w, const char *name, const struct stat *st,
+	       u_int64_t off, u_int64_t size, const u_char *tag)
+{
+  const size_t namelen = strlen (name);
+  char *p;
+  size_t cap;
+
+  if (w->nindex + ARC_ENTRY_LEN + namelen > w->capindex) {
+    cap = w->capindex ? 2 * w->capindex : 1 << 16;
+    while (cap < w->nindex + ARC_ENTRY_LEN + namelen)
+      cap *= 2;
+    if (!(p = (char *) malloc (cap))) {
+      fprintf (stderr, "%s: Cannot allocate memory\n", getprogname ());
+      return -1;
+    }
+    memcpy (p, w->index, w->nindex);
+    if (w->index)
+      pv_scrub (w->index, w->nindex);
+    free (w->index);
+    w->index = p;
+    w->capindex = cap;
+  }
+  p = w->index + w->nindex;
+  put64 (p, off);
+  put64 (p + 8, size);
+  put64 (p + 16, (u_int64_t) st->st_mtime);
+  putint (p + 24, (u_int32_t) st->st_mode);
+  p[28] = (char) (namelen >> 8);
+  p[29] = (char) namelen;
+  memcpy (p + 30, tag, PV_SEG_TAG_LEN);
+  memcpy (p + ARC_ENTRY_LEN, name, namelen);
+  w->nindex += ARC_ENTRY_LEN + namelen;
+  return 0;
+}
+
+/* path, and if it is a directory everything under it; name is what
+   the archive calls it, or "" for a directory whose contents go in
+   under their own names.  Returns 0, or -1 if the archive can no
+   longer be written. */
+static int
+arc_add (struct arc_writer *w, const char *path, const char *name)
+{
+  u_char tag[PV_SEG_TAG_LEN];
+  struct stat st;
+  struct dirent *d;
+  const char *what = NULL;
+  char *link = NULL, *sub, *subname;
+  u_int64_t off = w->off, size = 0;
+  ssize_t n;
+  int fd = -1, r = 0;
+  DIR *dp = NULL;
+
+  if (lstat (path, &st) != 0) {
+    fprintf (stderr, "%s: %s: %s\n", getprogname (), path, strerror (errno));
+    w->failed = 1;
+    return 0;
+  }
+  if (st.st_dev == w->dev && st.st_ino == w->ino)
+    what = "the archive itself";
+  else if (strlen (name) > ARC_NAME_MAX)
+    what = "name too long";
+  else if (!*name && !S_ISDIR (st.st_mode))
+    what = "not a name an archive can hold";
+  else if (S_ISREG (st.st_mode)) {
+    if ((fd = open (path, O_RDONLY)) == -1)
+      what = strerror (errno);
+    size = st.st_size;
+  }
+  else if (S_ISLNK (st.st_mode)) {
+    if (!(link = (char *) malloc (st.st_size + 1))
+	|| (n = readlink (path, link, st.st_size + 1)) == -1)
+      what = strerror (errno);
+    else if (n > st.st_size)
+      what = "link changed as we read it";
+    else
+      size = n;
+  }
+  else if (S_ISDIR (st.st_mode)) {
+    if (!(dp = opendir (path)))
+      what = strerror (errno);
+  }
+  else
+    what = "not a file, directory or symlink";
+  if (what) {
+    fprintf (stderr, "%s: %s: %s; left out\n", getprogname (), path, what);
+    w->failed = 1;
+    free (link);
+    return 0;
+  }
+
+  if (!*name)
+    ;				/* only what's in it */
+  else if (w->seg.nseg == 0xffffffffu) {
+    fprintf (stderr, "%s: too many members\n", getprogname ());
+    r = -1;
+  }
+  else if ((r = arc_put (w, fd, link, size, 0, tag, path)) != -1) {
+    w->failed |= r;
+    r = arc_entry_add (w, name, &st, off, size, tag);
+  }
+  if (fd != -1) {
+    pv_cache_drop (fd, 0, size, 0);
+    close (fd);
+  }
+  free (link);
+
+  while (dp && r == 0 && (d = readdir (dp))) {
+    if (!strcmp (d->d_name, ".") || !strcmp (d->d_name, ".."))
+      continue;
+    sub = (char *) malloc (strlen (path) + strlen (d->d_name) + 2);
+    subname = (char *) malloc (strlen (name) + strlen (d->d_name) + 2);
+    if (!sub || !subname) {
+      fprintf (stderr, "%s: Cannot allocate memory\n", getprogname ());
+      r = -1;
+    }
+    else {
+      sprintf (sub, "%s%s%s", path, path[strlen (path) - 1] == '/' ? "" : "/",
+	       d->d_name);
+      sprintf (subname, "%s%s%s", name, *name ? "/" : "", d->d_name);
+      r = arc_add (w, sub, subname);
+    }
+    free (sub);
+    free (subname);
+  }
+  if (dp)
+    closedir (dp);
+  return r;
+}
+
+/* what the archive calls path: path without a leading / or ./ ("" or
+   "." for the top of the tree), or NULL if it has a .. in it */
+static const char *
+arc_name (const char *path)
+{
+  const char *p;
+
+  for (;;) {
+    if (*path == '/')
+      path++;
+    else if (path[0] == '.' && path[1] == '/')
+      path += 2;
+    else
+      break;
+  }
+  for (p = path; (p = strstr (p, "..")); p += 2)
+    if ((p == path || p[-1] == '/') && (!p[2] || p[2] == '/'))
+      return NULL;
+  return path;
+}
+
+/* pv_archive -c: the paths into fd.  Returns 0, 1 if some were left
+   out, or -1 (after complaining) if there is no archive. */
+static int
+arc_create (int fd, const char *sk, size_t sk_len, char **paths, int npaths,
+	    const struct pv_opts *opts)
+{
+  struct arc_writer w;
+  struct pv_hdr hdr;
+  char head[PV_HDR_LEN + PV_SEG_NONCE_LEN], trailer[ARC_TRAILER_LEN];
+  u_char tag[PV_SEG_TAG_LEN];
+  struct stat st;
+  const char *name;
+  char *path;
+  size_t len;
+  int i, r = 0;
+
+  bzero (&w, sizeof (w));
+  w.bufsize = opts->bufsize;
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode)) {
+    w.dev = st.st_dev;
+    w.ino = st.st_ino;
+  }
+  bzero (&hdr, sizeof (hdr));
+  hdr.version = PV_VERSION;
+  hdr.mode = PV_MODE_ARCHIVE;
+  pv_hdr_pack (head, &hdr);
+  pv_random (head + PV_HDR_LEN, PV_SEG_NONCE_LEN);
+  w.rec = (char *) pv_alloc (BLOCK_LEN + w.bufsize + PV_SEG_TAG_LEN);
+  w.out = pv_io_open (fd, 1, w.bufsize);
+  if (!w.rec || !w.out) {
+    fprintf (stderr, "%s: Cannot allocate memory\n", getprogname ());
+    pv_io_close (w.out);
+    pv_free (w.rec, 0);
+    return -1;
+  }
+  pv_aes_setkey (&w.aes, sk, sk_len);
+  pv_seg_init (&w.seg, sk + sk_len, sk_len, head);
+  if (pv_io_write (w.out, head, sizeof (head)) != 0) {
+    perror (getprogname ());
+    r = -1;
+  }
+  w.off = sizeof (head);
+
+  for (i = 0; i < npaths && r == 0; i++) {
+    if (!(path = strdup (paths[i]))) {
+      fprintf (stderr, "%s: Cannot allocate memory\n", getprogname ());
+      r = -1;
+      break;
+    }
+    for (len = strlen (path); len > 1 && path[len - 1] == '/'; len--)
+      path[len - 1] = '\0';	/* dir/ is dir */
+    if (!(name = arc_name (path))) {
+      fprintf (stderr, "%s: %s: not a name an archive can hold\n",
+	       getprogname (), path);
+      w.failed = 1;
+    }
+    else
+      r = arc_add (&w, path, strcmp (name, ".") ? name : "");
+    free (path);
+  }
+
+  if (r == 0) {
+    put64 (trailer, w.off);
+    putint (trailer + 8, w.seg.nseg);
+    putint (trailer + 12, (BLOCK_LEN - w.nindex % BLOCK_LEN) % BLOCK_LEN);
+    if (arc_put (&w, -1, w.index ? w.index : "", w.nindex, 1, tag, NULL)
+	== -1)
+      r = -1;
+  }
+  if (r == 0) {
+    pv_seg_final (&w.seg, (u_char *) trailer + 16);
+    if (pv_io_write (w.out, trailer, sizeof (trailer)) != 0) {
+      perror (getprogname ());
+      r = -1;
+    }
+  }
+  if (pv_io_close (w.out) != 0 && r == 0) {
+    perror (getprogname ());
+    r = -1;
+  }
+
+  pv_seg_clr (&w.seg);
+  pv_aes_clrkey (&w.aes);
+  pv_free (w.rec, BLOCK_LEN + w.bufsize + PV_SEG_TAG_LEN);
+  if (w.index)
+    pv_scrub (w.index, w.nindex);
+  free (w.index);
+  return r == -1 ? -1 : w.failed;
+}
+
+/* the header and trailer of the archive in fd, but not yet its index.
+   Returns 0, or -1 after complaining. */
+static int
+arc_open (struct arc_reader *a, int fd, const char *sk, size_t sk_len,
+	  size_t bufsize)
+{
+  char head[PV_HDR_LEN + PV_SEG_NONCE_LEN], trailer[ARC_TRAILER_LEN];
+  struct pv_hdr hdr;
+  struct stat st;
+
+  bzero (a, sizeof (*a));
+  a->fd = fd;
+  a->bufsize = bufsize;
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)) {
+    fprintf (stderr, "%s: an archive is read from a regular file\n",
+	     getprogname ());
+    return -1;
+  }
+  if (st.st_size < (off_t) (sizeof (head) + BLOCK_LEN + PV_SEG_TAG_LEN
+			    + ARC_TRAILER_LEN)
+      || pread_chunk (fd, head, sizeof (head), 0) != (ssize_t) sizeof (head)
+      || pv_hdr_parse (&hdr, head) != 0 || hdr.mode != PV_MODE_ARCHIVE) {
+    fprintf (stderr, "%s: not an archive\n", getprogname ());
+    return -1;
+  }
+  if (hdr.version != PV_VERSION || hdr.flags || hdr.param) {
+    fprintf (stderr, "%s: unsupported archive version %u\n", getprogname (),
+	     hdr.version);
+    return -1;
+  }
+  if (pread_chunk (fd, trailer, sizeof (trailer), st.st_size - sizeof (trailer))
+      != (ssize_t) sizeof (trailer)) {
+    perror (getprogname ());
+    return -1;
+  }
+  a->index_off = get64 (trailer);
+  a->n = getint (trailer + 8);
+  a->numpad0 = getint (trailer + 12);
+  memcpy (a->final, trailer + 16, PV_SEG_TAG_LEN);
+  /* what's between the index's start and the trailer: a segment */
+  a->nindex = st.st_size - sizeof (trailer) - a->index_off;
+  if (a->index_off < sizeof (head)
+      || a->index_off > (u_int64_t) st.st_size - sizeof (trailer)
+      || a->nindex < BLOCK_LEN + PV_SEG_TAG_LEN
+      || (a->nindex - BLOCK_LEN - PV_SEG_TAG_LEN) % BLOCK_LEN
+      || a->numpad0 >= BLOCK_LEN
+      || a->numpad0 > a->nindex - BLOCK_LEN - PV_SEG_TAG_LEN) {
+    fprintf (stderr, "%s: archive truncated or corrupt\n", getprogname ());
+    return -1;
+  }
+  if (!(a->rec = (char *) pv_alloc (BLOCK_LEN + bufsize + PV_SEG_TAG_LEN))) {
+    fprintf (stderr, "%s: Cannot allocate memory\n", getprogname ());
+    return -1;
+  }
+  pv_aes_setkey (&a->aes, sk, sk_len);
+  pv_seg_init (&a->seg, sk + sk_len, sk_len, head);
+  return 0;
+}
+
+/* the entry at *pos in the index, moving pos past it: 1, or 0 at the
+   end, or -1 if the entries don't add up */
+static int
+arc_next (const struct arc_reader *a, size_t *pos, u_int32_t idx,
+	  struct arc_entry *e)
+{
+  const char *p = a->index + *pos;
+
+  if (*pos == a->nindex)
+    return idx == a->n ? 0 : -1;
+  if (a->nindex - *pos < ARC_ENTRY_LEN || idx >= a->n)
+    return -1;
+  e->idx = idx;
+  e->off = get64 (p);
+  e->size = get64 (p + 8);
+  e->mtime = get64 (p + 16);
+  e->mode = getint (p + 24);
+  e->namelen = (u_char) p[28] << 8 | (u_char) p[29];
+  e->tag = (const u_char *) p + 30;
+  e->name = p + ARC_ENTRY_LEN;
+  if (a->nindex - *pos - ARC_ENTRY_LEN < e->namelen
+      || e->off > a->index_off
+      || a->index_off - e->off < BLOCK_LEN + PV_SEG_TAG_LEN
+      || e->size > a->index_off - e->off - BLOCK_LEN - PV_SEG_TAG_LEN
+      || ARC_PADDED (e->size) > a->index_off - e->off - BLOCK_LEN
+      - PV_SEG_TAG_LEN)
+    return -1;
+  *pos += ARC_ENTRY_LEN + e->namelen;
+  return 1;
+}
+
+/* reads, checks and decrypts the index, the first time it is wanted.
+   Returns 0, or -1 after complaining. */
+static int
+arc_index (struct arc_reader *a)
+{
+  const size_t len = a->nindex;
+  u_char tag[PV_SEG_TAG_LEN];
+  struct arc_entry e;
+  struct pv_seg all;
+  struct pv_stamp t;
+  char iv[BLOCK_LEN];
+  size_t pos = 0;
+  u_int32_t i;
+  int r;
+
+  if (a->index)
+    return 0;
+  if (!(a->index = (char *) malloc (len))
+      || pread_chunk (a->fd, a->index, len, a->index_off) != (ssize_t) len) {
+    fprintf (stderr, "%s: can't read the index: %s\n", getprogname (),
+	     a->index ? strerror (errno) : "Cannot allocate memory");
+    free (a->index);
+    a->index = NULL;
+    return -1;
+  }
+  pv_stats_begin (&t);
+  pv_seg_mac (&a->seg, a->n, 1, a->numpad0, a->index,
+	      len - PV_SEG_TAG_LEN, tag);
+  pv_stats_end (PV_PH_MAC, &t);
+  if (pv_ct_differs (tag, a->index + len - PV_SEG_TAG_LEN, PV_SEG_TAG_LEN)) {
+    fprintf (stderr, "WARNING: HMAC MISMATCH in the archive index. "
+	     "Check key and archive integrity.\n");
+    free (a->index);
+    a->index = NULL;
+    return -1;
+  }
+  pv_stats_begin (&t);
+  memcpy (iv, a->index, BLOCK_LEN);
+  pv_cbc_decrypt (&a->aes, a->index + BLOCK_LEN, a->index + BLOCK_LEN,
+		  len - BLOCK_LEN - PV_SEG_TAG_LEN, iv);
+  pv_stats_end (PV_PH_CIPHER, &t);
+  a->nindex = len - BLOCK_LEN - PV_SEG_TAG_LEN - a->numpad0;
+  memmove (a->index, a->index + BLOCK_LEN, a->nindex);
+
+  /* the final tag, over every member's tag and the index's */
+  memcpy (&all, &a->seg, sizeof (all));
+  for (i = 0; (r = arc_next (a, &pos, i, &e)) == 1; i++)
+    pv_seg_add (&all, e.tag);
+  pv_seg_add (&all, tag);
+  pv_seg_final (&all, tag);
+  pv_seg_clr (&all);
+  if (r == -1 || pv_ct_differs (tag, a->final, PV_SEG_TAG_LEN)) {
+    fprintf (stderr, "WARNING: HMAC MISMATCH in the archive trailer. "
+	     "Check key and archive integrity.\n");
+    pv_scrub (a->index, len);
+    free (a->index);
+    a->index = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void
+arc_close (struct arc_reader *a)
+{
+  pv_seg_clr (&a->seg);
+  pv_aes_clrkey (&a->aes);
+  pv_free (a->rec, BLOCK_LEN + a->bufsize + PV_SEG_TAG_LEN);
+  if (a->index)
+    pv_scrub (a->index, a->nindex);
+  free (a->index);
+}
+
+/* e, which fits in a->rec, read and checked; its ptxt is then at
+   a->rec + BLOCK_LEN.  Returns 0, -1 if it can't be read, or -2 if its
+   tag is wrong. */
+static int
+arc_load (struct arc_reader *a, const struct arc_entry *e)
+{
+  const u_int32_t numpad0 = (BLOCK_LEN - e->size % BLOCK_LEN) % BLOCK_LEN;
+  const u_int64_t ctlen = e->size + numpad0;
+  struct pv_stamp t;
+  u_char tag[PV_SEG_TAG_LEN];
+
+  if (pread_chunk (a->fd, a->rec, BLOCK_LEN + ctlen, e->off)
+      != (ssize_t) (BLOCK_LEN + ctlen))
+    return -1;
+  pv_stats_begin (&t);
+  pv_seg_mac (&a->seg, e->idx, 0, numpad0, a->rec, BLOCK_LEN + ctlen, tag);
+  pv_stats_end (PV_PH_MAC, &t);
+  if (pv_ct_differs (tag, e->tag, PV_SEG_TAG_LEN))
+    return -2;
+  pv_stats_begin (&t);
+  pv_cbc_decrypt (&a->aes, a->rec + BLOCK_LEN, a->rec + BLOCK_LEN, ctlen,
+		  a->rec);
+  pv_stats_end (PV_PH_CIPHER, &t);
+  return 0;
+}
+
+/* e's ptxt, checked, into fout (or into memory at *mem, a symlink's
+   target: malloc'ed, NUL-terminated).  Returns 0, -1 if it can't be
+   read or written, or -2 if its tag is wrong; if the member is too big
+   to check before it is written, some of it may have been by then. */
+static int
+arc_get (struct arc_reader *a, const struct arc_entry *e, int fout,
+	 char **mem)
+{
+  const u_int32_t numpad0 = (BLOCK_LEN - e->size % BLOCK_LEN) % BLOCK_LEN;
+  const u_int64_t ctlen = e->size + numpad0;
+  struct pv_hmac_ctx c;
+  struct pv_io *out = NULL;
+  struct pv_stamp t;
+  u_char tag[PV_SEG_TAG_LEN];
+  char iv[BLOCK_LEN], *p;
+  u_int64_t off = e->off, left = ctlen, ptleft = e->size;
+  size_t n, head = BLOCK_LEN;
+  int ret = 0;
+
+  if (mem && !(*mem = (char *) malloc (e->size + 1)))
+    return -1;
+  if (ctlen <= a->bufsize) {	/* all of it, checked before it's used */
+    if ((ret = arc_load (a, e)) != 0)
+      return ret;
+    if (mem) {
+      memcpy (*mem, a->rec + BLOCK_LEN, e->size);
+      (*mem)[e->size] = '\0';
+      return 0;
+    }
+    return write_chunk (fout, a->rec + BLOCK_LEN, e->size) == 0 ? 0 : -1;
+  }
+
+  /* too big to hold: decrypted as it comes, the tag checked at the end */
+  if (!mem && !(out = pv_io_open (fout, 1, a->bufsize)))
+    return -1;
+  pv_seg_start (&a->seg, &c, e->idx, 0, numpad0);
+  do {
+    n = left < a->bufsize ? left : a->bufsize;
+    if (pread_chunk (a->fd, a->rec, head + n, off) != (ssize_t) (head + n)) {
+      ret = -1;
+      break;
+    }
+    off += head + n;
+    left -= n;
+    pv_stats_begin (&t);
+    pv_hmac_update (&c, a->rec, head + n);
+    pv_stats_end (PV_PH_MAC, &t);
+    if (head)
+      memcpy (iv, a->rec, BLOCK_LEN);
+    p = a->rec + head;
+    pv_stats_begin (&t);
+    pv_cbc_decrypt (&a->aes, p, p, n, iv);
+    pv_stats_end (PV_PH_CIPHER, &t);
+    if (n > ptleft)
+      n = ptleft;		/* the padding */
+    if (mem)
+      memcpy (*mem + (e->size - ptleft), p, n);
+    else if (pv_io_write (out, p, n) != 0) {
+      ret = -1;
+      break;
+    }
+    ptleft -= n;
+    head = 0;
+  } while (left);
+  if (ret == 0) {
+    pv_hmac_final (&c, tag);
+    if (pv_ct_differs (tag, e->tag, PV_SEG_TAG_LEN))
+      ret = -2;
+  }
+  pv_hmac_clr (&c);
+  if (pv_io_close (out) != 0 && ret == 0)
+    ret = -1;
+  if (mem)
+    (*mem)[e->size] = '\0';
+  return ret;
+}
+
+/* whether e is one of the names asked for, or under one; marks it */
+static int
+arc_wanted (const struct arc_entry *e, char **names, int nnames, char *seen)
+{
+  size_t len;
+  int i, r = !nnames;
+
+  for (i = 0; i < nnames; i++) {
+    len = strlen (names[i]);
+    while (len > 1 && names[i][len - 1] == '/')
+      len--;
+    if (len <= e->namelen && !strncmp (e->name, names[i], len)
+	&& (len == e->namelen || e->name[len] == '/')) {
+      seen[i] = 1;
+      r = 1;
+    }
+  }
+  return r;
+}
+
+/* pv_archive -t: the names (with -v, mode, size and mtime too) */
+static int
+arc_list (struct arc_reader *a, int verbose, char **names, int nnames,
+	  char *seen)
+{
+  struct arc_entry e;
+  size_t pos = 0;
+  u_int32_t i;
+
+  if (arc_index (a) != 0)
+    return -1;
+  for (i = 0; arc_next (a, &pos, i, &e) == 1; i++) {
+    if (!arc_wanted (&e, names, nnames, seen))
+      continue;
+    if (verbose)
+      printf ("%07o %12lu %12lu ", (u_int) e.mode, (unsigned long) e.size,
+	      (unsigned long) e.mtime);
+    printf ("%.*s\n", (int) e.namelen, e.name);
+  }
+  return 0;
+}
+
+/* the directories name is in, made where missing.  None may be a
+   symlink, so that nothing lands outside the current directory.  last
+   is the one made or checked last time, which needn't be again. */
+static int
+arc_parents (char *name, char *last)
+{
+  char *slash = strrchr (name, '/'), *p;
+  struct stat st;
+  int bad = 0;
+
+  if (!slash)
+    return 0;
+  *slash = '\0';
+  if (strcmp (name, last))
+    for (p = name; !bad; p++) {
+      if ((p = strchr (p, '/')))
+	*p = '\0';
+      if (lstat (name, &st) != 0)
+	bad = mkdir (name, 0777) != 0;
+      else if ((bad = !S_ISDIR (st.st_mode)))
+	errno = ENOTDIR;
+      if (bad)
+	fprintf (stderr, "%s: %s: %s\n", getprogname (), name,
+		 strerror (errno));
+      if (!p)
+	break;
+      *p = '/';
+    }
+  if (!bad)
+    strcpy (last, name);
+  *slash = '/';
+  return bad ? -1 : 0;
+}
+
+/* a regular member into name, which is replaced only once the
+   member's tag has matched: one that fits in a->rec is checked before
+   name is opened, and a bigger one goes into a temporary file beside
+   name that is renamed over it at the end.  Returns 0, -1 or -2 as
+   arc_get does. */
+static int
+arc_extract_file (struct arc_reader *a, const struct arc_entry *e,
+		  const char *name)
+{
+  struct timespec ts[2];
+  char *tmp = NULL;
+  int fd, r, err;
+
+  if (ARC_PADDED (e->size) <= a->bufsize) {
+    if ((r = arc_load (a, e)) != 0)
+      return r;
+    if ((fd = open (name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+		    e->mode & 07777)) == -1)
+      return -1;
+    r = write_chunk (fd, a->rec + BLOCK_LEN, e->size) == 0 ? 0 : -1;
+  }
+  else {
+    if (!(tmp = (char *) malloc (strlen (name) + sizeof (".pvXXXXXX"))))
+      return -1;
+    sprintf (tmp, "%s.pvXXXXXX", name);
+    if ((fd = mkstemp (tmp)) == -1) {
+      free (tmp);
+      return -1;
+    }
+    fchmod (fd, e->mode & 07777 & ~a->mask);
+    r = arc_get (a, e, fd, NULL);
+  }
+  ts[0].tv_sec = 0;
+  ts[0].tv_nsec = UTIME_OMIT;
+  ts[1].tv_sec = (time_t) e->mtime;
+  ts[1].tv_nsec = 0;
+  if (r == 0)
+    futimens (fd, ts);
+  if (close (fd) != 0 && r == 0)
+    r = -1;
+  if (tmp) {
+    if (r == 0 && rename (tmp, name) != 0)
+      r = -1;
+    if (r != 0) {
+      err = errno;
+      unlink (tmp);
+      errno = err;
+    }
+    free (tmp);
+  }
+  return r;
+}
+
+/* one member into the current directory (or, with tostdout, a file's
+   ptxt onto stdout).  Returns 0 or -1. */
+static int
+arc_extract_one (struct arc_reader *a, const struct arc_entry *e,
+		 int tostdout, char *last)
+{
+  char *name, *target = NULL;
+  int r = 0;
+
+  if (!(name = (char *) malloc (e->namelen + 1)))
+    return -1;
+  memcpy (name, e->name, e->namelen);
+  name[e->namelen] = '\0';
+  if (e->namelen != strlen (name) || arc_name (name) != name
+      || !strcmp (name, ".")) {
+    fprintf (stderr, "%s: %s: unsafe name; skipped\n", getprogname (), name);
+    free (name);
+    return -1;
+  }
+  if (tostdout) {
+    if (S_ISREG (e->mode)
+	&& (r = arc_get (a, e, STDOUT_FILENO, NULL)) == -2
+	&& ARC_PADDED (e->size) > a->bufsize)
+      pv_remove_out (PV_STDIO);
+  }
+  else if (arc_parents (name, last) != 0) {
+    free (name);
+    return -1;
+  }
+  else if (S_ISDIR (e->mode)) {
+    if (mkdir (name, (e->mode & 07777) | 0700) != 0 && errno != EEXIST)
+      r = -1;
+  }
+  else if (S_ISLNK (e->mode)) {
+    if ((r = arc_get (a, e, -1, &target)) == 0)
+      r = symlink (target, name);
+    free (target);
+  }
+  else if (S_ISREG (e->mode))
+    r = arc_extract_file (a, e, name);
+  if (r == -2)
+    fprintf (stderr, "WARNING: HMAC MISMATCH in member %s. "
+	     "Check key and archive integrity.\n", name);
+  else if (r == -1)
+    fprintf (stderr, "%s: %s: %s\n", getprogname (), name, strerror (errno));
+  free (name);
+  return r ? -1 : 0;
+}
+
+/* pv_archive -x: the members named (or all of them), in their order in
+   the archive, which is that of the file offsets */
+static int
+arc_extract (struct arc_reader *a, int tostdout, char **names, int nnames,
+	     char *seen)
+{
+  struct arc_entry e;
+  size_t pos = 0;
+  u_int32_t i;
+  char *last;
+
+  if (arc_index (a) != 0)
+    return -1;
+  if (!(last = (char *) malloc (ARC_NAME_MAX + 1)))
+    return -1;
+  last[0] = '\0';
+  a->mask = umask (0);
+  umask (a->mask);
+  for (i = 0; arc_next (a, &pos, i, &e) == 1; i++)
+    if (arc_wanted (&e, names, nnames, seen)
+	&& arc_extract_one (a, &e, tostdout, last) != 0)
+      a->failed = 1;
+  free (last);
+  return 0;
+}
+
+void
+usage (const char *pname)
+{
+  printf ("Personal Vault: Archives\n");
+  printf ("Usage: %s -c [--bufsize N] [--nocache | --direct] [--stats]\n"
+	  "          [--max-rate N] [--max-iops N] [--rate-file F] [--nice N]\n"
+	  "          [--ioprio C[:N]] SK-FILE ARCHIVE PATH...\n", pname);
+  printf ("       %s -t [-v] SK-FILE ARCHIVE [MEMBER...]\n", pname);
+  printf ("       %s -x [-C DIR] [-O] [options] SK-FILE ARCHIVE [MEMBER...]\n",
+	  pname);
+  printf ("       -c creates ARCHIVE (which may be - for stdout) from the\n");
+  printf ("       files, directories and symlinks at and under each PATH,\n");
+  printf ("       each encrypted and authenticated on its own under sk,\n");
+  printf ("       with an encrypted index at the end.  -t lists the members\n");
+  printf ("       (with -v, their modes, sizes and mtimes), and -x extracts\n");
+  printf ("       them, or just those named and what is under them; both\n");
+  printf ("       need ARCHIVE to be a regular file.  A member whose MAC\n");
+  printf ("       doesn't match is not extracted, and leaves any file of\n");
+  printf ("       its name as it was.\n");
+  printf ("       --bufsize N  read and write N bytes at a time\n");
+  printf ("                    (suffix K, M or G; default 1M)\n");
+  printf ("       -C DIR       extract into DIR\n");
+  printf ("       -O           extract the files' contents onto stdout\n");
+  printf ("       --nocache, --direct, --stats and the rate limits are as\n");
+  printf ("       for pv_encrypt.\n");
+
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct pv_opts opts;
+  struct arc_reader a;
+  struct pv_stamp t;
+  const char *dir = NULL;
+  char *raw_sk, *seen = NULL;
+  size_t raw_len;
+  int argi, fdsk, fd, stats = 0, verbose = 0, tostdout = 0, op = 0;
+  int i, nnames, r;
+
+  pv_opts_init (&opts);
+  for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+    if (!strcmp (argv[argi], "-c") || !strcmp (argv[argi], "-t")
+	|| !strcmp (argv[argi], "-x")) {
+      if (op)
+	usage (argv[0]);
+      op = argv[argi][1];
+    }
+    else if (!strcmp (argv[argi], "-v"))
+      verbose = 1;
+    else if (!strcmp (argv[argi], "-O"))
+      tostdout = 1;
+    else if (!strcmp (argv[argi], "-C") && argi + 1 < argc)
+      dir = argv[++argi];
+    else if (!strcmp (argv[argi], "--bufsize") && argi + 1 < argc) {
+      if (!(opts.bufsize = parse_bufsize (argv[++argi])))
+	usage (argv[0]);
+    }
+    else if (!strcmp (argv[argi], "--nocache"))
+      pv_iopolicy |= PV_IOP_NOCACHE;
+    else if (!strcmp (argv[argi], "--direct"))
+      pv_iopolicy |= PV_IOP_NOCACHE | PV_IOP_DIRECT;
+    else if (!strcmp (argv[argi], "--stats"))
+      stats = 1;
+    else if (pv_qos_arg (argc, argv, &argi) != 1)
+      usage (argv[0]);
+  }
+  pv_stats_init (stats);
+  if (pv_qos_start (argv[0]) != 0)
+    exit (1);
+  if (!op || argc - argi < (op == 'c' ? 3 : 2) || (op == 'c' && dir))
+    usage (argv[0]);
+  setprogname (argv[0]);
+
+  /* make sure the AES backend picked for this CPU gives the right answers */
+  pv_stats_begin (&t);
+  if (pv_kern_selftest () != 0 || pv_aes_selftest () != 0
+      || pv_hmac_selftest () != 0)
+    exit (-1);
+  pv_stats_end (PV_PH_SELFTEST, &t);
+
+  pv_stats_begin (&t);
+  if ((fdsk = open (argv[argi], O_RDONLY)) == -1) {
+    if (errno == ENOENT)
+      usage (argv[0]);
+    perror (argv[0]);
+    exit (-1);
+  }
+  if (!(import_sk_from_file (&raw_sk, &raw_len, fdsk))) {
+    fprintf (stderr, "%s: no symmetric key found in %s\n", argv[0], argv[argi]);
+    close (fdsk);
+    exit (2);
+  }
+  close (fdsk);
+  pv_stats_end (PV_PH_KEY, &t);
+  assert (raw_len % 2 == 0);
+
+  if (op == 'c') {
+    /* initialize the pseudorandom generator (for the nonce and IVs) */
+    pv_stats_begin (&t);
+    ri ();
+    pv_stats_end (PV_PH_SEED, &t);
+
+    if ((fd = pv_open_out (argv[argi+1], O_WRONLY | O_TRUNC | O_CREAT,
+			   0600)) == -1) {
+      perror (argv[argi+1]);
+      pv_free (raw_sk, raw_len);
+      exit (-1);
+    }
+    if (!strcmp (argv[argi+1], PV_STDIO))
+      pv_pipe_grow (fd, opts.bufsize);
+    r = arc_create (fd, raw_sk, raw_len / 2, argv + argi + 2, argc - argi - 2,
+		    &opts);
+    if (close (fd) != 0 && r != -1) {
+      perror (argv[argi+1]);
+      r = -1;
+    }
+    if (r == -1)
+      pv_remove_out (argv[argi+1]);
+  }
+  else {
+    nnames = argc - argi - 2;
+    if ((fd = pv_open_in (argv[argi+1])) == -1) {
+      perror (argv[argi+1]);
+      pv_free (raw_sk, raw_len);
+      exit (-1);
+    }
+    r = -1;
+    if (arc_open (&a, fd, raw_sk, raw_len / 2, opts.bufsize) == 0) {
+      if (!(seen = (char *) calloc (nnames + 1, 1)))
+	perror (argv[0]);
+      else if (dir && chdir (dir) != 0)
+	perror (dir);
+      else if (op == 't')
+	r = arc_list (&a, verbose, argv + argi + 2, nnames, seen);
+      else
+	r = arc_extract (&a, tostdout, argv + argi + 2, nnames, seen);
+      for (i = 0; r == 0 && i < nnames; i++)
+	if (!seen[i]) {
+	  fprintf (stderr, "%s: %s: not in the archive\n", argv[0],
+		   argv[argi + 2 + i]);
+	  a.failed = 1;
+	}
+      if (r == 0)
+	r = a.failed;
+      arc_close (&a);
+      free (seen);
+    }
+    close (fd);
+  }
+
+  /* scrub the buffer that is holding the key before exiting */
+  pv_free (raw_sk, raw_len);
+
+  pv_stats_report ("pv_archive", r ? 1 : 0);
+  return r ? 1 : 0;
+}
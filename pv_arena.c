@@ -0,0 +1,150 @@
+#include "pv.h"
+
+/* The one allocator for key material and bulk buffers: pv_alloc and
+ * pv_free.  Each region is an anonymous mapping of its own, so it
+ * starts on a page boundary (which covers cache lines, the vector
+ * kernels and O_DIRECT), and it is mlock'ed so that keys and plaintext
+ * never reach swap, and kept out of core dumps.  pv_free scrubs a
+ * region and keeps it for the next request of about its size, so a
+ * long --batch run maps, locks and faults in its buffers once rather
+ * than once per file; past PV_ARENA_KEEP idle regions they go back to
+ * the system.
+ *
+ * With PV_HUGEPAGES=1 in the environment, regions of PV_ARENA_HUGE or
+ * more are rounded up to whole huge pages and taken from the reserved
+ * pool (MAP_HUGETLB), or else marked for transparent huge pages.
+ *
+ * Locking is best effort: once RLIMIT_MEMLOCK is used up the rest is
+ * simply not locked.  Every call may come from any thread.
+ */
+
+#define PV_ARENA_KEEP 64
+#define PV_ARENA_HUGE (2 << 20)
+
+struct region {
+  char *p;
+  size_t size;
+  int busy;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct region *r;
+  size_t n, cap, idle;
+  size_t page;
+  int huge;			/* PV_HUGEPAGES; -1 until looked up */
+} arena = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, -1 };
+
+/* a new mapping of size bytes (a multiple of the page size), or NULL */
+static char *
+region_map (size_t size)
+{
+  void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if (arena.huge && size % PV_ARENA_HUGE == 0)
+    p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    if (arena.huge && size >= PV_ARENA_HUGE)
+      madvise (p, size, MADV_HUGEPAGE);
+#endif
+  }
+#ifdef MADV_DONTDUMP
+  madvise (p, size, MADV_DONTDUMP);
+#endif
+  mlock (p, size);		/* also faults it all in, up front */
+  return (char *) p;
+}
+
+/* len bytes, page-aligned and (if possible) locked; NULL if out of
+   memory.  Release them with pv_free. */
+void *
+pv_alloc (size_t len)
+{
+  const char *e;
+  struct region *r, *best = NULL;
+  size_t size, i;
+  char *p;
+
+  pthread_mutex_lock (&arena.lock);
+  if (arena.huge == -1) {
+    e = getenv ("PV_HUGEPAGES");
+    arena.huge = e && *e && strcmp (e, "0");
+    arena.page = sysconf (_SC_PAGESIZE);
+  }
+  size = len ? (len + arena.page - 1) / arena.page * arena.page : arena.page;
+  if (arena.huge && size >= PV_ARENA_HUGE)
+    size = (size + PV_ARENA_HUGE - 1) / PV_ARENA_HUGE * PV_ARENA_HUGE;
+
+  /* the smallest idle region that fits, if it isn't twice too big */
+  for (i = 0; i < arena.n; i++) {
+    r = &arena.r[i];
+    if (!r->busy && r->size >= size && r->size / 2 < size
+	&& (!best || r->size < best->size))
+      best = r;
+  }
+  if (best) {
+    best->busy = 1;
+    arena.idle--;
+    pthread_mutex_unlock (&arena.lock);
+    return best->p;
+  }
+  pthread_mutex_unlock (&arena.lock);
+
+  if (!(p = region_map (size)))	/* (not holding up the others) */
+    return NULL;
+  pthread_mutex_lock (&arena.lock);
+  if (arena.n == arena.cap) {
+    r = (struct region *) realloc (arena.r, (arena.cap ? 2 * arena.cap : 16)
+				   * sizeof (*r));
+    if (!r) {
+      pthread_mutex_unlock (&arena.lock);
+      munmap (p, size);
+      return NULL;
+    }
+    arena.r = r;
+    arena.cap = arena.cap ? 2 * arena.cap : 16;
+  }
+  r = &arena.r[arena.n++];
+  r->p = p;
+  r->size = size;
+  r->busy = 1;
+  pthread_mutex_unlock (&arena.lock);
+  return p;
+}
+
+/* Scrubs the first used bytes of p (all that were ever written to it)
+   and takes it back; NULL is ignored. */
+void
+pv_free (void *p, size_t used)
+{
+  struct region *r = NULL;
+  size_t i;
+
+  if (!p)
+    return;
+  pv_scrub (p, used);
+  pthread_mutex_lock (&arena.lock);
+  for (i = 0; i < arena.n; i++)
+    if (arena.r[i].p == p) {
+      r = &arena.r[i];
+      break;
+    }
+  assert (r && r->busy);
+  if (arena.idle < PV_ARENA_KEEP) {
+    r->busy = 0;
+    arena.idle++;
+  }
+  else {
+    munmap (r->p, r->size);
+    *r = arena.r[--arena.n];
+  }
+  pthread_mutex_unlock (&arena.lock);
+}
@@ -0,0 +1,350 @@
+#include "pv.h"
+#include <dirent.h>
+
+/* --batch: run one tool over many files in one process.  The list of
+ * (input, output) pairs comes from a manifest, or from a directory and
+ * a suffix rule, and is then dealt out in equal contiguous ranges to
+ * the worker threads.  A worker takes files from the front of its own
+ * range; when that is empty it steals the back half of another's.
+ * Files vary a lot in size, so the static split alone would leave
+ * threads idle behind one that drew the big ones, while a single
+ * shared queue would have every worker contend for it on every
+ * (small) file.
+ *
+ * By default each worker runs the tool's function on one file after
+ * another.  A tool that would rather have several files on the go in
+ * each thread (pv_encrypt's interleaved CBC) supplies a loop instead,
+ * which takes files with pv_batch_next as it has room for them and
+ * reports each with pv_batch_done.
+ */
+
+struct batch_item {
+  char *in, *out;
+};
+
+struct batch_range {
+  pthread_mutex_t lock;
+  size_t lo, hi;		/* items[lo..hi) are left */
+  char pad[64];			/* keep each range on its own cache line */
+};
+
+struct batch {
+  struct batch_item *items;
+  size_t n, size;
+  struct batch_range *ranges;
+  int nthreads;
+  pv_batch_loop loop;
+  pv_batch_fn fn;
+  void *arg;
+  pthread_mutex_t report;	/* serializes the per-file status lines */
+  size_t failed;
+};
+
+struct pv_batch_worker {
+  struct batch *b;
+  int id;
+};
+
+static int
+batch_add (struct batch *b, const char *in, size_t inlen, const char *out,
+	   size_t outlen)
+{
+  struct batch_item *it;
+
+  if (b->n == b->size) {
+    b->size = b->size ? 2 * b->size : 64;
+    if (!(it = (struct batch_item *) realloc (b->items,
+					      b->size * sizeof (*it))))
+      return -1;
+    b->items = it;
+  }
+  it = &b->items[b->n];
+  if (!(it->in = (char *) malloc (inlen + 1))
+      || !(it->out = (char *) malloc (outlen + 1))) {
+    free (it->in);
+    return -1;
+  }
+  memcpy (it->in, in, inlen);
+  it->in[inlen] = '\0';
+  memcpy (it->out, out, outlen);
+  it->out[outlen] = '\0';
+  b->n++;
+  return 0;
+}
+
+/* one pair per line, separated by a tab (or, without a tab, by
+   spaces); blank lines and lines starting with # are skipped */
+static int
+batch_read_manifest (struct batch *b, FILE *f, const char *name)
+{
+  char *line = NULL, *sep, *out;
+  size_t cap = 0, len, lineno = 0;
+  ssize_t r;
+
+  while ((r = getline (&line, &cap, f)) != -1) {
+    lineno++;
+    len = r;
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (!len || line[0] == '#')
+      continue;
+    if (!(sep = strchr (line, '\t')) && !(sep = strchr (line, ' '))) {
+      fprintf (stderr, "%s: %s:%lu: expected INPUT OUTPUT\n", getprogname (),
+	       name, (unsigned long) lineno);
+      free (line);
+      return -1;
+    }
+    for (out = sep; *out == '\t' || *out == ' '; out++)
+      ;
+    if (!*out || batch_add (b, line, sep - line, out, strlen (out)) != 0) {
+      fprintf (stderr, "%s: %s:%lu: %s\n", getprogname (), name,
+	       (unsigned long) lineno,
+	       *out ? "out of memory" : "expected INPUT OUTPUT");
+      free (line);
+      return -1;
+    }
+  }
+  free (line);
+  if (ferror (f)) {
+    fprintf (stderr, "%s: error reading %s\n", getprogname (), name);
+    return -1;
+  }
+  return 0;
+}
+
+/* every regular file in dir: with strip, those named NAME+suffix, to
+   be written to NAME; otherwise the others, to be written to
+   NAME+suffix */
+static int
+batch_read_dir (struct batch *b, const char *dir, const char *suffix,
+		int strip)
+{
+  const size_t dlen = strlen (dir), slen = strlen (suffix);
+  struct dirent *d;
+  struct stat st;
+  DIR *dp;
+  char *path = NULL;
+  size_t nlen, cap = 0;
+  int has_suffix, ret = 0;
+
+  if (!(dp = opendir (dir))) {
+    perror (dir);
+    return -1;
+  }
+  while (!ret && (d = readdir (dp))) {
+    nlen = strlen (d->d_name);
+    has_suffix = nlen > slen && !strcmp (d->d_name + nlen - slen, suffix);
+    if (d->d_name[0] == '.' || has_suffix != strip)
+      continue;
+    if (dlen + nlen + slen + 2 > cap) {
+      cap = 2 * (dlen + nlen + slen + 2);
+      free (path);
+      if (!(path = (char *) malloc (cap))) {
+	ret = -1;
+	break;
+      }
+    }
+    sprintf (path, "%s/%s", dir, d->d_name);
+    if (stat (path, &st) != 0 || !S_ISREG (st.st_mode))
+      continue;
+    if (strip)
+      ret = batch_add (b, path, dlen + 1 + nlen, path, dlen + 1 + nlen - slen);
+    else {
+      strcpy (path + dlen + 1 + nlen, suffix);
+      ret = batch_add (b, path, dlen + 1 + nlen, path, dlen + 1 + nlen + slen);
+    }
+  }
+  if (ret)
+    fprintf (stderr, "%s: out of memory\n", getprogname ());
+  free (path);
+  closedir (dp);
+  return ret;
+}
+
+/* the next item for worker id: from the front of its own range, else
+   the back half of the first other range that has any.  Returns 0 and
+   sets *i, or -1 when every range is empty.  (Items only ever move
+   between ranges, under both locks' protection in turn, so a worker
+   that finds them all empty can quit: anything in transit belongs to
+   the thief, who will do it.) */
+static int
+batch_next (struct batch *b, int id, size_t *i)
+{
+  struct batch_range *mine = &b->ranges[id], *v;
+  size_t lo, hi;
+  int k;
+
+  pthread_mutex_lock (&mine->lock);
+  if (mine->lo < mine->hi) {
+    *i = mine->lo++;
+    pthread_mutex_unlock (&mine->lock);
+    return 0;
+  }
+  pthread_mutex_unlock (&mine->lock);
+
+  for (k = 1; k < b->nthreads; k++) {
+    v = &b->ranges[(id + k) % b->nthreads];
+    pthread_mutex_lock (&v->lock);
+    if (v->lo == v->hi) {
+      pthread_mutex_unlock (&v->lock);
+      continue;
+    }
+    hi = v->hi;
+    lo = v->hi = v->lo + (v->hi - v->lo) / 2;
+    pthread_mutex_unlock (&v->lock);
+
+    pthread_mutex_lock (&mine->lock);
+    mine->lo = lo + 1;
+    mine->hi = hi;
+    pthread_mutex_unlock (&mine->lock);
+    *i = lo;
+    return 0;
+  }
+  return -1;
+}
+
+/* Takes the next file for w: sets *in and *out (good until the run
+   ends) and returns 0, or returns -1 when there are none left. */
+int
+pv_batch_next (struct pv_batch_worker *w, const char **in, const char **out)
+{
+  size_t i;
+
+  if (batch_next (w->b, w->id, &i) != 0)
+    return -1;
+  *in = w->b->items[i].in;
+  *out = w->b->items[i].out;
+  return 0;
+}
+
+/* the status line for a file taken with pv_batch_next; r is 0 if it
+   went well */
+void
+pv_batch_done (struct pv_batch_worker *w, const char *in, const char *out,
+	       int r)
+{
+  struct batch *b = w->b;
+
+  pthread_mutex_lock (&b->report);
+  printf ("%s\t%s\t%s\n", r == 0 ? "ok" : "FAILED", in, out);
+  fflush (stdout);
+  if (r != 0)
+    b->failed++;
+  pthread_mutex_unlock (&b->report);
+}
+
+/* the default loop: one file at a time */
+static void
+batch_each (struct pv_batch_worker *w, void *arg)
+{
+  const char *in, *out;
+
+  (void) arg;
+  while (pv_batch_next (w, &in, &out) == 0)
+    pv_batch_done (w, in, out, w->b->fn (in, out, w->b->arg));
+}
+
+static void *
+batch_worker (void *arg)
+{
+  struct pv_batch_worker *w = (struct pv_batch_worker *) arg;
+
+  w->b->loop (w, w->b->arg);
+  return NULL;
+}
+
+/* Runs loop (w, arg) on nthreads threads over the pairs listed in
+   manifest (or, if manifest is a directory, given by the suffix rule
+   of batch_read_dir), or, if loop is NULL, fn (in, out, arg) for each
+   pair.  Every file gets a line "ok" or "FAILED", in and out as it
+   finishes.  Returns the number of failures, or -1 if the list
+   couldn't be made. */
+static long
+batch_run (const char *manifest, const char *suffix, int strip,
+	   int nthreads, pv_batch_loop loop, pv_batch_fn fn, void *arg)
+{
+  struct batch b;
+  struct pv_batch_worker *w = NULL;
+  pthread_t *tids = NULL;
+  struct stat st;
+  FILE *f;
+  size_t i, per;
+  int k, started = 0, ret;
+
+  bzero (&b, sizeof (b));
+  b.loop = loop ? loop : batch_each;
+  b.fn = fn;
+  b.arg = arg;
+  if (stat (manifest, &st) == 0 && S_ISDIR (st.st_mode))
+    ret = batch_read_dir (&b, manifest, suffix, strip);
+  else if (!(f = fopen (manifest, "r"))) {
+    perror (manifest);
+    ret = -1;
+  }
+  else {
+    ret = batch_read_manifest (&b, f, manifest);
+    fclose (f);
+  }
+
+  if (!ret) {
+    if ((size_t) nthreads > b.n)
+      nthreads = b.n ? b.n : 1;
+    b.nthreads = nthreads;
+    b.ranges = (struct batch_range *) malloc (nthreads * sizeof (*b.ranges));
+    w = (struct pv_batch_worker *) malloc (nthreads * sizeof (*w));
+    tids = (pthread_t *) malloc (nthreads * sizeof (*tids));
+    if (!b.ranges || !w || !tids) {
+      fprintf (stderr, "%s: out of memory\n", getprogname ());
+      ret = -1;
+    }
+  }
+
+  if (!ret) {
+    pthread_mutex_init (&b.report, NULL);
+    per = b.n / nthreads;
+    for (k = 0; k < nthreads; k++) {
+      pthread_mutex_init (&b.ranges[k].lock, NULL);
+      b.ranges[k].lo = k * per;
+      b.ranges[k].hi = k == nthreads - 1 ? b.n : (k + 1) * per;
+      w[k].b = &b;
+      w[k].id = k;
+    }
+    /* worker 0 is this thread */
+    for (started = 1; started < nthreads; started++)
+      if (pthread_create (&tids[started], NULL, batch_worker,
+			  &w[started]) != 0)
+	break;
+    batch_worker (&w[0]);	/* steals from any that didn't start */
+    for (k = 1; k < started; k++)
+      pthread_join (tids[k], NULL);
+    for (k = 0; k < nthreads; k++)
+      pthread_mutex_destroy (&b.ranges[k].lock);
+    pthread_mutex_destroy (&b.report);
+  }
+
+  for (i = 0; i < b.n; i++) {
+    free (b.items[i].in);
+    free (b.items[i].out);
+  }
+  free (b.items);
+  free (b.ranges);
+  free (w);
+  free (tids);
+  return ret ? -1 : (long) b.failed;
+}
+
+/* fn (in, out, arg) for every pair, as above */
+long
+pv_batch_run (const char *manifest, const char *suffix, int strip,
+	      int nthreads, pv_batch_fn fn, void *arg)
+{
+  return batch_run (manifest, suffix, strip, nthreads, NULL, fn, arg);
+}
+
+/* loop (w, arg) in each thread, as above */
+long
+pv_batch_run_loop (const char *manifest, const char *suffix, int strip,
+		   int nthreads, pv_batch_loop loop, void *arg)
+{
+  return batch_run (manifest, suffix, strip, nthreads, loop, NULL, arg);
+}
@@ -0,0 +1,471 @@
+#include "pv.h"
+#include <limits.h>
+
+/* make bench: end-to-end throughput of pv_encrypt and pv_decrypt.
+ *
+ * Inputs are generated from a fixed xorshift stream seeded by their
+ * size, so every run (and every machine) sees the same bytes; the
+ * default sizes include ones that aren't a multiple of 16.  Each
+ * input is encrypted and decrypted under every combination of mode,
+ * --bufsize and thread count asked for, the round trip is compared
+ * with the input, and the rate (MB/s, 10^6 bytes) and peak RSS of
+ * each run are recorded.  Small files are dominated by start-up cost
+ * instead, so a separate series times many runs on one small file and
+ * reports percentiles of the latency.  A third compares --compress
+ * with plain encryption, on made-up log text (which compresses about
+ * 3-4x) and on the random bytes (which don't compress at all).
+ *
+ * The results go out as JSON, one record per line, which is also the
+ * format --baseline reads back: a record whose rate dropped (or whose
+ * latency grew) by more than --tolerance percent against the baseline
+ * is listed under "regressions", and makes the exit status 1, as does
+ * any round trip that fails.
+ */
+
+#define BENCH_MIN_COMPARE (1 << 20)	/* smaller sizes are too noisy */
+
+struct bench {
+  const char *bin;		/* where pv_encrypt and pv_decrypt are */
+  const char *dir;		/* scratch files */
+  char key[PATH_MAX], in[PATH_MAX], ct[PATH_MAX], pt[PATH_MAX];
+  char *baseline;		/* --baseline, read in whole */
+  double tolerance;		/* percent */
+  FILE *out;
+  int nrec, failures, regressions;
+};
+
+/* value of "name": in the baseline record starting with key, or -1 */
+static double
+baseline_value (struct bench *b, const char *key, const char *name)
+{
+  char pat[64];
+  const char *line, *v;
+
+  if (!b->baseline || !(line = strstr (b->baseline, key)))
+    return -1;
+  sprintf (pat, "\"%s\":", name);
+  if (!(v = strstr (line, pat)) || (strchr (line, '\n')
+				    && v > strchr (line, '\n')))
+    return -1;
+  return atof (v + strlen (pat));
+}
+
+/* flags value against the baseline; higher is better unless lower */
+static void
+compare (struct bench *b, const char *key, const char *name, double value,
+	 int lower)
+{
+  double base = baseline_value (b, key, name), change;
+
+  if (base <= 0)
+    return;
+  change = 100 * (value - base) / base;
+  if (lower ? change > b->tolerance : -change > b->tolerance) {
+    fprintf (stderr, "%s: regression: {%s} %s %.1f -> %.1f (%+.1f%%)\n",
+	     getprogname (), key, name, base, value, change);
+    b->regressions++;
+  }
+}
+
+static void
+record (struct bench *b, const char *kind, const char *key, const char *rest)
+{
+  fprintf (b->out, "%s    {\"kind\":\"%s\",%s,%s}", b->nrec++ ? ",\n" : "",
+	   kind, key, rest);
+}
+
+static void
+bench_throughput (struct bench *b, const char *mode, size_t bufsize,
+		  int jobs, off_t size)
+{
+  char bs[32], js[32], key[160], rest[256];
+  char *enc[16], *dec[16];
+  struct pv_run re, rd;
+  int n, ok;
+
+  sprintf (bs, "%lu", (unsigned long) bufsize);
+  sprintf (js, "%d", jobs);
+  n = 1;
+  enc[n++] = "--mode";
+  enc[n++] = (char *) mode;
+  enc[n++] = "--bufsize";
+  enc[n++] = bs;
+  if (jobs > 1 && !strncmp (mode, "cbc", 3))
+    enc[n++] = "--pipeline";	/* the threaded encryption there is */
+  else if (jobs > 1 && !strcmp (mode, "seg")) {
+    enc[n++] = "-j";		/* a segment per thread */
+    enc[n++] = js;
+  }
+  enc[n++] = b->key;
+  enc[n++] = b->in;
+  enc[n++] = b->ct;
+  enc[n] = NULL;
+  n = 1;
+  dec[n++] = "--bufsize";
+  dec[n++] = bs;
+  dec[n++] = "-j";
+  dec[n++] = js;
+  dec[n++] = b->key;
+  dec[n++] = b->ct;
+  dec[n++] = b->pt;
+  dec[n] = NULL;
+
+  ok = pv_run_tool (b->bin, "pv_encrypt", enc, 0, &re) == 0
+    && pv_run_tool (b->bin, "pv_decrypt", dec, 0, &rd) == 0
+    && pv_same_file (b->in, b->pt) == 0;
+  if (!ok) {
+    fprintf (stderr, "%s: round trip FAILED: mode %s bufsize %s jobs %d"
+	     " size %lu\n", getprogname (), mode, bs, jobs,
+	     (unsigned long) size);
+    b->failures++;
+    re.secs = rd.secs = 0;
+  }
+
+  sprintf (key, "\"mode\":\"%s\",\"bufsize\":%lu,\"jobs\":%d,\"size\":%lu",
+	   mode, (unsigned long) bufsize, jobs, (unsigned long) size);
+  sprintf (rest, "\"encrypt_mbs\":%.1f,\"decrypt_mbs\":%.1f,"
+	   "\"encrypt_rss_kb\":%ld,\"decrypt_rss_kb\":%ld,\"ok\":%s",
+	   ok && re.secs > 0 ? size / re.secs / 1e6 : 0,
+	   ok && rd.secs > 0 ? size / rd.secs / 1e6 : 0,
+	   ok ? re.rss_kb : 0, ok ? rd.rss_kb : 0, ok ? "true" : "false");
+  if (ok && size >= BENCH_MIN_COMPARE) {
+    compare (b, key, "encrypt_mbs", size / re.secs / 1e6, 0);
+    compare (b, key, "decrypt_mbs", size / rd.secs / 1e6, 0);
+  }
+  record (b, "throughput", key, rest);
+  unlink (b->ct);
+  unlink (b->pt);
+}
+
+/* --compress against plain mode, on the input of size (text or not) */
+static void
+bench_compress (struct bench *b, const char *mode, const char *data,
+		off_t size)
+{
+  char key[160], rest[320];
+  char *enc[8], *dec[8];
+  struct pv_run re[2], rd[2];
+  struct stat st;
+  off_t ctlen = 0;
+  double mbs[2][2];
+  int lz, ok = 1;
+
+  for (lz = 0; lz < 2; lz++) {
+    enc[1] = "--mode";
+    enc[2] = (char *) mode;
+    enc[3] = lz ? "--compress" : b->key;
+    enc[4] = lz ? b->key : b->in;
+    enc[5] = lz ? b->in : b->ct;
+    enc[6] = lz ? b->ct : NULL;
+    enc[7] = NULL;
+    dec[1] = b->key;
+    dec[2] = b->ct;
+    dec[3] = b->pt;
+    dec[4] = NULL;
+    ok = ok && pv_run_tool (b->bin, "pv_encrypt", enc, 0, &re[lz]) == 0
+      && stat (b->ct, &st) == 0
+      && pv_run_tool (b->bin, "pv_decrypt", dec, 0, &rd[lz]) == 0
+      && pv_same_file (b->in, b->pt) == 0;
+    if (ok && lz)
+      ctlen = st.st_size;
+    mbs[lz][0] = ok && re[lz].secs > 0 ? size / re[lz].secs / 1e6 : 0;
+    mbs[lz][1] = ok && rd[lz].secs > 0 ? size / rd[lz].secs / 1e6 : 0;
+  }
+  if (!ok) {
+    fprintf (stderr, "%s: round trip FAILED: mode %s --compress, %s size %lu\n",
+	     getprogname (), mode, data, (unsigned long) size);
+    b->failures++;
+  }
+
+  sprintf (key, "\"mode\":\"%s\",\"data\":\"%s\",\"size\":%lu", mode, data,
+	   (unsigned long) size);
+  sprintf (rest, "\"plain_encrypt_mbs\":%.1f,\"lz_encrypt_mbs\":%.1f,"
+	   "\"plain_decrypt_mbs\":%.1f,\"lz_decrypt_mbs\":%.1f,"
+	   "\"lz_ratio\":%.2f,\"encrypt_speedup\":%.2f,\"decrypt_speedup\":%.2f,"
+	   "\"ok\":%s", mbs[0][0], mbs[1][0], mbs[0][1], mbs[1][1],
+	   ok && ctlen ? (double) size / ctlen : 0,
+	   ok && mbs[0][0] ? mbs[1][0] / mbs[0][0] : 0,
+	   ok && mbs[0][1] ? mbs[1][1] / mbs[0][1] : 0, ok ? "true" : "false");
+  if (ok && size >= BENCH_MIN_COMPARE) {
+    compare (b, key, "lz_encrypt_mbs", mbs[1][0], 0);
+    compare (b, key, "lz_decrypt_mbs", mbs[1][1], 0);
+  }
+  record (b, "compress", key, rest);
+  unlink (b->ct);
+  unlink (b->pt);
+}
+
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile (const double *v, int n, int p)
+{
+  return v[(n - 1) * p / 100];
+}
+
+/* latency of runs encrypt+decrypt cycles of one small file */
+static void
+bench_latency (struct bench *b, const char *mode, off_t size, int runs)
+{
+  double *te, *td;
+  char key[128], rest[256];
+  char *enc[8], *dec[8];
+  struct pv_run re, rd;
+  int i, ok = 1;
+
+  te = (double *) malloc (runs * sizeof (double));
+  td = (double *) malloc (runs * sizeof (double));
+  if (!te || !td) {
+    fprintf (stderr, "%s: out of memory\n", getprogname ());
+    free (te);
+    free (td);
+    b->failures++;
+    return;
+  }
+  enc[1] = "--mode";
+  enc[2] = (char *) mode;
+  enc[3] = b->key;
+  enc[4] = b->in;
+  enc[5] = b->ct;
+  enc[6] = NULL;
+  dec[1] = b->key;
+  dec[2] = b->ct;
+  dec[3] = b->pt;
+  dec[4] = NULL;
+  for (i = 0; ok && i < runs; i++) {
+    ok = pv_run_tool (b->bin, "pv_encrypt", enc, 0, &re) == 0
+      && pv_run_tool (b->bin, "pv_decrypt", dec, 0, &rd) == 0;
+    te[i] = re.secs * 1e6;
+    td[i] = rd.secs * 1e6;
+  }
+  ok = ok && pv_same_file (b->in, b->pt) == 0;
+  if (!ok) {
+    fprintf (stderr, "%s: round trip FAILED: mode %s size %lu\n",
+	     getprogname (), mode, (unsigned long) size);
+    b->failures++;
+    runs = 1;
+    te[0] = td[0] = 0;
+  }
+  qsort (te, runs, sizeof (double), cmp_double);
+  qsort (td, runs, sizeof (double), cmp_double);
+
+  sprintf (key, "\"mode\":\"%s\",\"size\":%lu", mode, (unsigned long) size);
+  sprintf (rest, "\"runs\":%d,\"encrypt_us_p50\":%.0f,\"encrypt_us_p90\":%.0f,"
+	   "\"encrypt_us_p99\":%.0f,\"decrypt_us_p50\":%.0f,"
+	   "\"decrypt_us_p90\":%.0f,\"decrypt_us_p99\":%.0f,\"ok\":%s",
+	   runs, percentile (te, runs, 50), percentile (te, runs, 90),
+	   percentile (te, runs, 99), percentile (td, runs, 50),
+	   percentile (td, runs, 90), percentile (td, runs, 99),
+	   ok ? "true" : "false");
+  if (ok) {
+    compare (b, key, "encrypt_us_p50", percentile (te, runs, 50), 1);
+    compare (b, key, "decrypt_us_p50", percentile (td, runs, 50), 1);
+  }
+  record (b, "latency", key, rest);
+  unlink (b->ct);
+  unlink (b->pt);
+  free (te);
+  free (td);
+}
+
+/* the whole of path, as a string */
+static char *
+read_file (const char *path)
+{
+  struct stat st;
+  char *s = NULL;
+  ssize_t n = -1;
+  int fd;
+
+  if ((fd = open (path, O_RDONLY)) != -1 && fstat (fd, &st) == 0
+      && (s = (char *) malloc (st.st_size + 1)))
+    n = read_chunk (fd, s, st.st_size);
+  if (n == -1) {
+    perror (path);
+    free (s);
+    s = NULL;
+  }
+  else
+    s[n] = '\0';
+  if (fd != -1)
+    close (fd);
+  return s;
+}
+
+static void
+usage (const char *pname)
+{
+  printf ("Personal Vault: Benchmark\n");
+  printf ("Usage: %s [options]\n", pname);
+  printf ("       Times pv_encrypt and pv_decrypt over generated inputs and\n");
+  printf ("       prints the results as JSON.  Exits 1 if a round trip\n");
+  printf ("       fails or a result regressed against --baseline.\n");
+  printf ("       --sizes L      input sizes, e.g. 0,17,1M+7,10G\n");
+  printf ("       --modes L      from cbc,cbc-sha256,gcm,seg (default all)\n");
+  printf ("       --bufsizes L   --bufsize values (default 64K,1M)\n");
+  printf ("       --jobs L       pv_decrypt -j values (default 1,4); above 1,\n");
+  printf ("                      the cbc modes encrypt with --pipeline\n");
+  printf ("       --lz-sizes L   --compress series sizes (default 64M;\n");
+  printf ("                      cbc-sha256 and gcm, of --modes)\n");
+  printf ("       --small N      latency series: N runs on a --small-size file\n");
+  printf ("       --small-size S (default 200 runs of 1K)\n");
+  printf ("       --baseline F   compare with the JSON of an earlier run\n");
+  printf ("       --tolerance P  percent slower that counts (default 10)\n");
+  printf ("       --bin DIR      where the tools are (default .)\n");
+  printf ("       --dir DIR      scratch directory (default pv_bench.d)\n");
+  printf ("       -o FILE        write the JSON to FILE, not stdout\n");
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  char sizes_s[] = "0,1,15,16,17,4096,1M+7,64M+3,256M+1";
+  char modes_s[] = "cbc,cbc-sha256,gcm,seg";
+  char bufsizes_s[] = "64K,1M";
+  char jobs_s[] = "1,4";
+  char lz_sizes_s[] = "64M";
+  char *sizes_l = sizes_s, *modes_l = modes_s, *bufsizes_l = bufsizes_s;
+  char *jobs_l = jobs_s, *lz_sizes_l = lz_sizes_s;
+  char *sizes[PV_MAXLIST], *modes[PV_MAXLIST], *lz_sizes[PV_MAXLIST];
+  char *bufsizes[PV_MAXLIST], *jobs[PV_MAXLIST], *kg[3];
+  const char *outname = NULL, *baseline = NULL;
+  int nsizes, nmodes, nbufsizes, njobs, nlz, small = 200, i, m, k, j;
+  off_t small_size = 1024, size;
+  size_t bufsize;
+  struct bench b;
+  struct pv_run r;
+
+  setprogname (argv[0]);
+  bzero (&b, sizeof (b));
+  b.bin = ".";
+  b.dir = "pv_bench.d";
+  b.tolerance = 10;
+  for (i = 1; i < argc; i++) {
+    if (i + 1 == argc)
+      usage (argv[0]);
+    if (!strcmp (argv[i], "--sizes"))
+      sizes_l = argv[++i];
+    else if (!strcmp (argv[i], "--modes"))
+      modes_l = argv[++i];
+    else if (!strcmp (argv[i], "--bufsizes"))
+      bufsizes_l = argv[++i];
+    else if (!strcmp (argv[i], "--jobs"))
+      jobs_l = argv[++i];
+    else if (!strcmp (argv[i], "--lz-sizes"))
+      lz_sizes_l = argv[++i];
+    else if (!strcmp (argv[i], "--small"))
+      small = atoi (argv[++i]);
+    else if (!strcmp (argv[i], "--small-size")) {
+      if ((small_size = pv_parse_sum (argv[++i])) == -1)
+	usage (argv[0]);
+    }
+    else if (!strcmp (argv[i], "--baseline"))
+      baseline = argv[++i];
+    else if (!strcmp (argv[i], "--tolerance"))
+      b.tolerance = atof (argv[++i]);
+    else if (!strcmp (argv[i], "--bin"))
+      b.bin = argv[++i];
+    else if (!strcmp (argv[i], "--dir"))
+      b.dir = argv[++i];
+    else if (!strcmp (argv[i], "-o"))
+      outname = argv[++i];
+    else
+      usage (argv[0]);
+  }
+  nsizes = pv_split (sizes_l, sizes);
+  nmodes = pv_split (modes_l, modes);
+  nbufsizes = pv_split (bufsizes_l, bufsizes);
+  njobs = pv_split (jobs_l, jobs);
+  nlz = pv_split (lz_sizes_l, lz_sizes);
+  for (i = 0; i < nsizes; i++)
+    if (pv_parse_sum (sizes[i]) == -1)
+      usage (argv[0]);
+  for (i = 0; i < nlz; i++)
+    if (pv_parse_sum (lz_sizes[i]) == -1)
+      usage (argv[0]);
+  for (i = 0; i < nmodes; i++)
+    if (parse_mode (modes[i]) == -1)
+      usage (argv[0]);
+  for (i = 0; i < nbufsizes; i++)
+    if (!parse_bufsize (bufsizes[i]))
+      usage (argv[0]);
+  for (i = 0; i < njobs; i++)
+    if (atoi (jobs[i]) < 1)
+      usage (argv[0]);
+
+  if (baseline && !(b.baseline = read_file (baseline)))
+    exit (2);
+  if (mkdir (b.dir, 0700) != 0 && errno != EEXIST) {
+    perror (b.dir);
+    exit (2);
+  }
+  sprintf (b.key, "%.*s/key", PATH_MAX - 8, b.dir);
+  sprintf (b.in, "%.*s/in", PATH_MAX - 8, b.dir);
+  sprintf (b.ct, "%.*s/ct", PATH_MAX - 8, b.dir);
+  sprintf (b.pt, "%.*s/pt", PATH_MAX - 8, b.dir);
+  kg[1] = b.key;
+  kg[2] = NULL;
+  if (pv_run_tool (b.bin, "pv_keygen", kg, 0, &r) != 0) {
+    fprintf (stderr, "%s: cannot make a key with %s/pv_keygen\n",
+	     getprogname (), b.bin);
+    exit (2);
+  }
+  if (!outname)
+    b.out = stdout;
+  else if (!(b.out = fopen (outname, "w"))) {
+    perror (outname);
+    exit (2);
+  }
+
+  fprintf (b.out, "{\n  \"tool\": \"pv_bench\",\n  \"cpus\": %ld,\n"
+	   "  \"records\": [\n", sysconf (_SC_NPROCESSORS_ONLN));
+  for (i = 0; i < nsizes; i++) {
+    size = pv_parse_sum (sizes[i]);
+    fprintf (stderr, "%s: size %lu\n", getprogname (), (unsigned long) size);
+    if (pv_make_input (b.in, size, 0) != 0)
+      exit (2);
+    for (m = 0; m < nmodes; m++)
+      for (k = 0; k < nbufsizes; k++)
+	for (j = 0; j < njobs; j++) {
+	  bufsize = parse_bufsize (bufsizes[k]);
+	  bench_throughput (&b, modes[m], bufsize, atoi (jobs[j]), size);
+	}
+  }
+  for (i = 0; i < nlz; i++) {
+    size = pv_parse_sum (lz_sizes[i]);
+    for (k = 0; k < 2; k++) {	/* text, then random */
+      fprintf (stderr, "%s: --compress, %s, size %lu\n", getprogname (),
+	       k ? "random" : "text", (unsigned long) size);
+      if (pv_make_input (b.in, size, !k) != 0)
+	exit (2);
+      for (m = 0; m < nmodes; m++)
+	if (!strcmp (modes[m], "cbc-sha256") || !strcmp (modes[m], "gcm"))
+	  bench_compress (&b, modes[m], k ? "random" : "text", size);
+    }
+  }
+  if (small > 0) {
+    fprintf (stderr, "%s: latency, %d runs of %lu bytes\n", getprogname (),
+	     small, (unsigned long) small_size);
+    if (pv_make_input (b.in, small_size, 0) != 0)
+      exit (2);
+    for (m = 0; m < nmodes; m++)
+      bench_latency (&b, modes[m], small_size, small);
+  }
+  fprintf (b.out, "\n  ],\n  \"failures\": %d,\n  \"regressions\": %d\n}\n",
+	   b.failures, b.regressions);
+  if (b.out != stdout)
+    fclose (b.out);
+
+  unlink (b.in);
+  unlink (b.key);
+  rmdir (b.dir);
+  free (b.baseline);
+  return b.failures || b.regressions ? 1 : 0;
+}
@@ -0,0 +1,939 @@
+#include "pv.h"
+#include <limits.h>
+#include <dirent.h>
+
+/* make check: the thorough tests that are too slow to run at every
+ * start-up.  The tools themselves only push a single known vector
+ * through each primitive before they touch a key; this goes through
+ * every kernel level the CPU has over all the awkward lengths and
+ * alignments, and prints how each compares with the scalar code, and
+ * runs HMAC against libdcrypt over every length around the SHA block
+ * and padding boundaries, for each compression function.  libpv's
+ * streaming decryption is fed in pieces of several sizes, each offered
+ * first with no room for output: that must fail with PV_ERR_SPACE
+ * having taken nothing, so that the retry gives back the plaintext.
+ *
+ * Then it runs the tools themselves (from --bin) on generated inputs:
+ * every authenticated format is encrypted, and a copy with a single
+ * bit flipped (in the middle, and in the very last byte, which is
+ * padlen for cbc-sha256) must be turned down by pv_decrypt, with and
+ * without --mmap, by --verify and by pv_rekey.  The classic cbc format
+ * leaves padlen outside its MAC, so only its middle is tried.
+ *
+ * --offset/--length on a --mode seg ciphertext must give back just the
+ * matching slice of the input, for ranges inside a segment, across a
+ * segment boundary, to the end of the file and beyond it; and a copy
+ * cut short at a segment boundary (with or without the bytes that
+ * would pass for a trailer) must be turned down once the range reaches
+ * what now looks like the last segment.
+ *
+ * pv_encrypt --batch DIR -j 2 --lanes 4, which interleaves the CBC
+ * chains of several files in each thread, is run on a directory of
+ * files of mixed sizes in both cbc modes, and every F.pv must decrypt
+ * back to F.
+ *
+ * pv_archive must give back a tree it packed (files either side of
+ * --bufsize, an empty one, a symlink) and list all of it, and must turn
+ * down an archive with a bit flipped in a member, in the index or in
+ * the trailer, leaving a file already extracted from it as it was.  It
+ * must refuse a member whose name has .. in it (such an archive is
+ * forged here, as pv_archive -c won't make one) and one whose directory
+ * is a symlink to somewhere else.
+ *
+ * Last, the file I/O of pv_io.c both ways: every input (--io-sizes) is
+ * encrypted and decrypted in every mode once with PV_IO=sync, which
+ * forces the plain pread/pwrite fallback, and once on the io_uring,
+ * and the ciphertext of each is also decrypted the other way; each
+ * output must match the input.  The --stats of every run (PV_STATS)
+ * shows whether the ring was used: it must not have been under
+ * PV_IO=sync, and if it never is otherwise (the kernel won't give us
+ * one) that is said, as then only the fallback was tested.
+ *
+ * Every failure is reported on stderr, and any of them makes the exit
+ * status 1.
+ */
+
+struct check {
+  const char *bin;		/* where the tools are */
+  const char *dir;		/* scratch files */
+  char key[PATH_MAX], in[PATH_MAX], ct[PATH_MAX], pt[PATH_MAX], bad[PATH_MAX];
+  char ref[PATH_MAX];		/* what pt ought to be */
+  char stats[PATH_MAX];		/* PV_STATS of the io series */
+  int runs, failures;
+  int ring_runs;		/* io series runs that did use the ring */
+};
+
+/* pv_decrypt_update in pieces of step bytes, each tried first with no
+   room for its output; 0 if the plaintext comes back whole */
+static int
+lib_space (const char *key, const char *ct, size_t ctlen, const char *pt,
+	   size_t ptlen, size_t step)
+{
+  struct pv_decrypt_ctx d;
+  char *out;
+  size_t off, k, got = 0, len;
+  int r, ret = -1;
+
+  if (!(out = (char *) malloc (ptlen + PV_UPDATE_MAX (ctlen))))
+    return -1;
+  if (pv_decrypt_init (&d, key, 64) != PV_OK)
+    goto done;
+  for (off = 0; off < ctlen; off += k) {
+    k = ctlen - off < step ? ctlen - off : step;
+    r = pv_decrypt_update (&d, ct + off, k, out + got, 0, &len);
+    if (r == PV_ERR_SPACE)
+      r = pv_decrypt_update (&d, ct + off, k, out + got, PV_UPDATE_MAX (k),
+			     &len);
+    if (r != PV_OK)
+      goto done;
+    got += len;
+  }
+  if (pv_decrypt_final (&d, out + got, PV_UPDATE_MAX (ctlen), &len) == PV_OK
+      && got + len == ptlen && !memcmp (out, pt, ptlen))
+    ret = 0;
+ done:
+  pv_decrypt_clr (&d);
+  free (out);
+  return ret;
+}
+
+/* libpv's PV_ERR_SPACE consumes nothing, in every format */
+static int
+check_lib (void)
+{
+  static const int modes[3] = { PV_MODE_CBC, PV_MODE_CBC_SHA256, PV_MODE_GCM };
+  static const size_t steps[5] = { 1, 7, 16, 100, 5000 };
+  char key[64], pt[3000], ct[3000 + PV_FINAL_MAX];
+  size_t i, m, s, ctlen;
+  int ret = 0;
+
+  for (i = 0; i < sizeof (key); i++)
+    key[i] = (char) (i * 7 + 1);
+  for (i = 0; i < sizeof (pt); i++)
+    pt[i] = (char) (i * 13 + 5);
+  for (m = 0; m < 3; m++) {
+    if (pv_encrypt_buffer (key, sizeof (key), modes[m], pt, sizeof (pt), ct,
+			   sizeof (ct), &ctlen) != PV_OK) {
+      fprintf (stderr, "%s: pv_encrypt_buffer failed in mode %d\n",
+	       getprogname (), modes[m]);
+      ret = -1;
+      continue;
+    }
+    for (s = 0; s < 5; s++)
+      if (lib_space (key, ct, ctlen, pt, sizeof (pt), steps[s]) != 0) {
+	fprintf (stderr, "%s: libpv, mode %d, in pieces of %lu: a retry "
+		 "after PV_ERR_SPACE went wrong\n", getprogname (), modes[m],
+		 (unsigned long) steps[s]);
+	ret = -1;
+      }
+  }
+  pv_scrub (key, sizeof (key));
+  if (!ret)
+    printf ("lib PV_ERR_SPACE takes nothing, and the retry goes through\n");
+  return ret;
+}
+
+/* runs bin/prog; see pv_run_tool */
+static int
+run_tool (struct check *c, const char *prog, char **argv, int quiet)
+{
+  c->runs++;
+  return pv_run_tool (c->bin, prog, argv, quiet, NULL);
+}
+
+/* c->bad := c->ct with one bit of the byte at pos flipped (pos counts
+   back from the end if negative) */
+static int
+make_tampered (struct check *c, off_t pos)
+{
+  struct stat st;
+  char *buf = NULL;
+  int fd, ret = -1;
+
+  if ((fd = open (c->ct, O_RDONLY)) != -1 && fstat (fd, &st) == 0
+      && (buf = (char *) malloc (st.st_size + 1))
+      && read_chunk (fd, buf, st.st_size) == st.st_size) {
+    close (fd);
+    if (pos < 0)
+      pos += st.st_size;
+    buf[pos] ^= 0x01;
+    if ((fd = open (c->bad, O_WRONLY | O_TRUNC | O_CREAT, 0600)) != -1
+	&& write_chunk (fd, buf, st.st_size) == 0)
+      ret = 0;
+  }
+  if (ret)
+    perror (c->bad);
+  if (fd != -1)
+    close (fd);
+  free (buf);
+  return ret;
+}
+
+/* each tool must turn c->bad down */
+static void
+check_rejected (struct check *c, const char *mode, off_t size, const char *where)
+{
+  char *dec[] = { NULL, NULL, NULL, NULL, NULL };
+  char *mm[] = { NULL, "--mmap", NULL, NULL, NULL, NULL };
+  char *ver[] = { NULL, "--verify", NULL, NULL, NULL };
+  char *rk[] = { NULL, NULL, NULL, NULL, NULL, NULL };
+  const char *failed = NULL;
+
+  dec[1] = mm[2] = ver[2] = rk[1] = rk[2] = c->key;
+  dec[2] = mm[3] = ver[3] = rk[3] = c->bad;
+  dec[3] = mm[4] = rk[4] = c->pt;
+  if (run_tool (c, "pv_decrypt", dec, 1) == 0)
+    failed = "pv_decrypt";
+  else if (run_tool (c, "pv_decrypt", mm, 1) == 0)
+    failed = "pv_decrypt --mmap";
+  else if (run_tool (c, "pv_decrypt", ver, 1) == 0)
+    failed = "pv_decrypt --verify";
+  else if (strcmp (mode, "seg") && run_tool (c, "pv_rekey", rk, 1) == 0)
+    failed = "pv_rekey";
+  if (failed) {
+    fprintf (stderr, "%s: %s accepted %s, size %lu, with its %s byte "
+	     "changed\n", getprogname (), failed, mode, (unsigned long) size,
+	     where);
+    c->failures++;
+  }
+}
+
+/* encrypts c->in (of size bytes) in mode, checks that it decrypts,
+   then that it won't once tampered with */
+static void
+check_tamper (struct check *c, const char *mode, off_t size)
+{
+  char *enc[] = { NULL, "--mode", NULL, NULL, NULL, NULL, NULL };
+  char *dec[] = { NULL, NULL, NULL, NULL, NULL };
+  struct stat st;
+
+  enc[2] = (char *) mode;
+  enc[3] = dec[1] = c->key;
+  enc[4] = c->in;
+  enc[5] = dec[2] = c->ct;
+  dec[3] = c->pt;
+  if (run_tool (c, "pv_encrypt", enc, 0) != 0
+      || run_tool (c, "pv_decrypt", dec, 0) != 0
+      || pv_same_file (c->in, c->pt) != 0 || stat (c->ct, &st) != 0) {
+    fprintf (stderr, "%s: %s, size %lu: round trip failed\n",
+	     getprogname (), mode, (unsigned long) size);
+    c->failures++;
+    return;
+  }
+  if (make_tampered (c, st.st_size / 2) != 0) {
+    c->failures++;
+    return;
+  }
+  check_rejected (c, mode, size, "middle");
+  if (!strcmp (mode, "cbc"))
+    return;
+  if (make_tampered (c, -1) != 0) {
+    c->failures++;
+    return;
+  }
+  check_rejected (c, mode, size, "last");
+}
+
+/* dst := len bytes of src from off on (or all the rest, if len is -1;
+   fewer if src ends first) */
+static int
+slice_file (const char *src, const char *dst, off_t off, off_t len)
+{
+  struct stat st;
+  char *buf = NULL;
+  ssize_t n = -1;
+  int fd, ret = -1;
+
+  if ((fd = open (src, O_RDONLY)) != -1 && fstat (fd, &st) == 0) {
+    if (off > st.st_size)
+      off = st.st_size;
+    if (len < 0 || len > st.st_size - off)
+      len = st.st_size - off;
+    if ((buf = (char *) malloc (len + 1)))
+      n = pread_chunk (fd, buf, len, off);
+  }
+  if (fd != -1)
+    close (fd);
+  if (n == len && (fd = open (dst, O_WRONLY | O_TRUNC | O_CREAT, 0600)) != -1) {
+    ret = write_chunk (fd, buf, len);
+    close (fd);
+  }
+  if (ret)
+    perror (dst);
+  free (buf);
+  return ret;
+}
+
+/* pv_decrypt [-j jobs] --offset off [--length len] of ct into c->pt;
+   0 if it succeeded */
+static int
+decrypt_range (struct check *c, const char *ct, off_t off, off_t len,
+	       const char *jobs, int quiet)
+{
+  char *dec[12], offs[32], lens[32];
+  int n = 1;
+
+  if (jobs) {
+    dec[n++] = "-j";
+    dec[n++] = (char *) jobs;
+  }
+  sprintf (offs, "%ld", (long) off);
+  dec[n++] = "--offset";
+  dec[n++] = offs;
+  if (len >= 0) {
+    sprintf (lens, "%ld", (long) len);
+    dec[n++] = "--length";
+    dec[n++] = lens;
+  }
+  dec[n++] = c->key;
+  dec[n++] = (char *) ct;
+  dec[n++] = c->pt;
+  dec[n] = NULL;
+  return run_tool (c, "pv_decrypt", dec, quiet);
+}
+
+/* --offset/--length on a --mode seg ciphertext of RANGE_SEGS and a bit
+   segments of RANGE_SEG bytes */
+static void
+check_ranges (struct check *c)
+{
+#define RANGE_SEG 4096
+#define RANGE_SEGS 3
+  static const struct {
+    off_t off, len;		/* len -1: to the end */
+    const char *jobs, *what;
+  } r[] = {
+    { 100, 200, NULL, "inside a segment" },
+    { 4000, 300, NULL, "across a segment boundary" },
+    { 4096, 4096, NULL, "exactly a segment" },
+    { 1000, 10000, "2", "across segments, -j 2" },
+    { 9000, -1, NULL, "to the end" },
+    { 0, -1, NULL, "all of it" },
+    { 12800, 5000, NULL, "past the end" },
+    { 20000, -1, NULL, "wholly past the end" }
+  };
+  const off_t size = RANGE_SEGS * RANGE_SEG + 1000;
+  const off_t start = PV_HDR_LEN + PV_SEG_NONCE_LEN;
+  const off_t reclen = BLOCK_LEN + RANGE_SEG + PV_SEG_TAG_LEN;
+  char *enc[] = { NULL, "--mode", "seg", "--bufsize", "4K", NULL, NULL, NULL,
+		  NULL };
+  size_t i;
+  int cut;
+
+  enc[5] = c->key;
+  enc[6] = c->in;
+  enc[7] = c->ct;
+  if (pv_make_input (c->in, size, 0) != 0
+      || run_tool (c, "pv_encrypt", enc, 0) != 0) {
+    fprintf (stderr, "%s: cannot make a --mode seg ctxt\n", getprogname ());
+    c->failures++;
+    return;
+  }
+  for (i = 0; i < sizeof (r) / sizeof (r[0]); i++)
+    if (decrypt_range (c, c->ct, r[i].off, r[i].len, r[i].jobs, 0) != 0
+	|| slice_file (c->in, c->ref, r[i].off, r[i].len) != 0
+	|| pv_same_file (c->ref, c->pt) != 0) {
+      fprintf (stderr, "%s: --offset %ld --length %ld (%s) is wrong\n",
+	       getprogname (), (long) r[i].off, (long) r[i].len, r[i].what);
+      c->failures++;
+    }
+
+  /* two segments and nothing after, or a would-be trailer */
+  for (cut = 0; cut < 2; cut++)
+    if (slice_file (c->ct, c->bad, 0, start + 2 * reclen
+		    + (cut ? PV_SEG_TRAILER_LEN : 0)) != 0
+	|| decrypt_range (c, c->bad, RANGE_SEG + 100, -1, NULL, 1) == 0) {
+      fprintf (stderr, "%s: --offset took a ctxt cut short after two "
+	       "segments%s\n", getprogname (),
+	       cut ? " and a would-be trailer" : "");
+      c->failures++;
+    }
+#undef RANGE_SEGS
+#undef RANGE_SEG
+}
+
+/* pv_encrypt --batch DIR -j 2 --lanes 4 in the cbc modes, every file
+   of DIR decrypted on its own */
+static void
+check_lanes (struct check *c)
+{
+  static const char *const sizes[] = {
+    "0", "1", "15", "16", "17", "100", "4096", "64K", "64K+3", "200K+9",
+    "1M+7", "3M+5"
+  };
+  static const char *const modes[] = { "cbc", "cbc-sha256" };
+  static const char *const bufsizes[] = { "64K", "1M" };
+  const size_t nsizes = sizeof (sizes) / sizeof (sizes[0]);
+  char *enc[] = { NULL, "--mode", NULL, "--bufsize", NULL, "-j", "2",
+		  "--lanes", "4", "--batch", NULL, NULL, NULL };
+  char *dec[] = { NULL, NULL, NULL, NULL, NULL };
+  char dir[PATH_MAX], f[PATH_MAX + 8], ct[PATH_MAX + 16];
+  size_t i, m, k;
+
+  sprintf (dir, "%.*s/lanes", PATH_MAX - 8, c->dir);
+  if (mkdir (dir, 0700) != 0 && errno != EEXIST) {
+    perror (dir);
+    c->failures++;
+    return;
+  }
+  for (i = 0; i < nsizes; i++) {
+    sprintf (f, "%s/f%02u", dir, (unsigned) i % 100);
+    if (pv_make_input (f, pv_parse_sum (sizes[i]), 0) != 0) {
+      c->failures++;
+      return;
+    }
+  }
+  enc[10] = dir;
+  enc[11] = dec[1] = c->key;
+  dec[2] = ct;
+  dec[3] = c->pt;
+  for (m = 0; m < sizeof (modes) / sizeof (modes[0]); m++)
+    for (k = 0; k < sizeof (bufsizes) / sizeof (bufsizes[0]); k++) {
+      enc[2] = (char *) modes[m];
+      enc[4] = (char *) bufsizes[k];
+      if (run_tool (c, "pv_encrypt", enc, 0) != 0) {
+	fprintf (stderr, "%s: --batch --lanes 4, %s, --bufsize %s failed\n",
+		 getprogname (), modes[m], bufsizes[k]);
+	c->failures++;
+	continue;
+      }
+      for (i = 0; i < nsizes; i++) {
+	sprintf (f, "%s/f%02u", dir, (unsigned) i % 100);
+	sprintf (ct, "%s.pv", f);
+	if (run_tool (c, "pv_decrypt", dec, 0) != 0
+	    || pv_same_file (f, c->pt) != 0) {
+	  fprintf (stderr, "%s: --batch --lanes 4, %s, --bufsize %s: %s "
+		   "(%s bytes) doesn't round-trip\n", getprogname (),
+		   modes[m], bufsizes[k], f, sizes[i]);
+	  c->failures++;
+	}
+      }
+    }
+
+  for (i = 0; i < nsizes; i++) {
+    sprintf (f, "%s/f%02u", dir, (unsigned) i % 100);
+    sprintf (ct, "%s.pv", f);
+    unlink (f);
+    unlink (ct);
+  }
+  rmdir (dir);
+}
+
+/* the entries of dir, or -1 */
+static int
+entries (const char *dir)
+{
+  struct dirent *d;
+  DIR *dp;
+  int n = 0;
+
+  if (!(dp = opendir (dir)))
+    return -1;
+  while ((d = readdir (dp)))
+    if (strcmp (d->d_name, ".") && strcmp (d->d_name, ".."))
+      n++;
+  closedir (dp);
+  return n;
+}
+
+/* path and everything under it, gone */
+static void
+remove_tree (const char *path)
+{
+  struct dirent *d;
+  struct stat st;
+  char *sub;
+  DIR *dp;
+
+  if (lstat (path, &st) != 0)
+    return;
+  if (S_ISDIR (st.st_mode) && (dp = opendir (path))) {
+    while ((d = readdir (dp)))
+      if (strcmp (d->d_name, ".") && strcmp (d->d_name, "..")
+	  && (sub = (char *) malloc (strlen (path) + strlen (d->d_name) + 2))) {
+	sprintf (sub, "%s/%s", path, d->d_name);
+	remove_tree (sub);
+	free (sub);
+      }
+    closedir (dp);
+    rmdir (path);
+  }
+  else
+    unlink (path);
+}
+
+#define ARC_ENTRY (8 + 8 + 8 + 4 + 2 + PV_SEG_TAG_LEN) /* as in pv_archive.c */
+#define ARC_TRAILER (8 + 4 + 4 + PV_SEG_TAG_LEN)
+
+static void
+put64 (char *p, u_int64_t v)
+{
+  putint (p, (u_int32_t) (v >> 32));
+  putint (p + 4, (u_int32_t) v);
+}
+
+/* c->bad := an archive under c->key, laid out as pv_archive.c lays
+   one out, of a single file called name (shorter than 64 bytes),
+   which pv_archive -c would not have let in */
+static int
+make_unsafe (struct check *c, const char *name)
+{
+  static const char ptxt[] = "escaped\n";
+  const size_t namelen = strlen (name), len = ARC_ENTRY + namelen;
+  const u_int32_t pad = (BLOCK_LEN - len % BLOCK_LEN) % BLOCK_LEN;
+  char head[PV_HDR_LEN + PV_SEG_NONCE_LEN];
+  char mem[2 * BLOCK_LEN + PV_SEG_TAG_LEN];	/* IV | ptxt, padded | tag */
+  char index[BLOCK_LEN + ARC_ENTRY + 64 + BLOCK_LEN + PV_SEG_TAG_LEN];
+  char trailer[ARC_TRAILER], iv[BLOCK_LEN], *p, *raw_sk;
+  struct pv_aes_ctx aes;
+  struct pv_seg seg;
+  struct pv_hdr hdr;
+  size_t raw_len;
+  int fd, ret = -1;
+
+  if ((fd = open (c->key, O_RDONLY)) == -1
+      || !import_sk_from_file (&raw_sk, &raw_len, fd)) {
+    fprintf (stderr, "%s: no key in %s\n", getprogname (), c->key);
+    if (fd != -1)
+      close (fd);
+    return -1;
+  }
+  close (fd);
+  bzero (&hdr, sizeof (hdr));
+  hdr.version = PV_VERSION;
+  hdr.mode = PV_MODE_ARCHIVE;
+  pv_hdr_pack (head, &hdr);
+  pv_random (head + PV_HDR_LEN, PV_SEG_NONCE_LEN);
+  pv_aes_setkey (&aes, raw_sk, raw_len / 2);
+  pv_seg_init (&seg, raw_sk + raw_len / 2, raw_len / 2, head);
+
+  bzero (mem, sizeof (mem));
+  pv_random (mem, BLOCK_LEN);
+  memcpy (iv, mem, BLOCK_LEN);
+  memcpy (mem + BLOCK_LEN, ptxt, sizeof (ptxt) - 1);
+  pv_cbc_encrypt (&aes, mem + BLOCK_LEN, mem + BLOCK_LEN, BLOCK_LEN, iv);
+  pv_seg_tag (&seg, 0, BLOCK_LEN - (sizeof (ptxt) - 1), mem, 2 * BLOCK_LEN,
+	      (u_char *) mem + 2 * BLOCK_LEN);
+
+  bzero (index, sizeof (index));
+  pv_random (index, BLOCK_LEN);
+  memcpy (iv, index, BLOCK_LEN);
+  p = index + BLOCK_LEN;
+  put64 (p, sizeof (head));
+  put64 (p + 8, sizeof (ptxt) - 1);
+  put64 (p + 16, 0);
+  putint (p + 24, S_IFREG | 0600);
+  p[28] = (char) (namelen >> 8);
+  p[29] = (char) namelen;
+  memcpy (p + 30, mem + 2 * BLOCK_LEN, PV_SEG_TAG_LEN);
+  memcpy (p + ARC_ENTRY, name, namelen);
+  pv_cbc_encrypt (&aes, p, p, len + pad, iv);
+  pv_seg_tag (&seg, 1, pad, index, BLOCK_LEN + len + pad,
+	      (u_char *) p + len + pad);
+
+  put64 (trailer, sizeof (head) + sizeof (mem));
+  putint (trailer + 8, 1);
+  putint (trailer + 12, pad);
+  pv_seg_final (&seg, (u_char *) trailer + 16);
+
+  if ((fd = open (c->bad, O_WRONLY | O_TRUNC | O_CREAT, 0600)) != -1
+      && write_chunk (fd, head, sizeof (head)) == 0
+      && write_chunk (fd, mem, sizeof (mem)) == 0
+      && write_chunk (fd, index, BLOCK_LEN + len + pad + PV_SEG_TAG_LEN) == 0
+      && write_chunk (fd, trailer, sizeof (trailer)) == 0)
+    ret = 0;
+  else
+    perror (c->bad);
+  if (fd != -1)
+    close (fd);
+  pv_seg_clr (&seg);
+  pv_aes_clrkey (&aes);
+  pv_free (raw_sk, raw_len);
+  return ret;
+}
+
+/* pv_archive -x of archive into dir (with -t first if list) must fail */
+static void
+arc_rejected (struct check *c, const char *archive, const char *dir,
+	      int list, const char *what)
+{
+  char *ls[] = { NULL, "-t", NULL, NULL, NULL };
+  char *x[] = { NULL, "-x", "--bufsize", "64K", "-C", NULL, NULL, NULL, NULL };
+
+  ls[2] = x[6] = c->key;
+  ls[3] = x[7] = (char *) archive;
+  x[5] = (char *) dir;
+  if (list && run_tool (c, "pv_archive", ls, 1) == 0) {
+    fprintf (stderr, "%s: pv_archive -t accepted %s\n", getprogname (), what);
+    c->failures++;
+  }
+  if (run_tool (c, "pv_archive", x, 1) == 0) {
+    fprintf (stderr, "%s: pv_archive -x accepted %s\n", getprogname (), what);
+    c->failures++;
+  }
+}
+
+/* pv_archive: a tree packed, listed and extracted whole; a member, the
+   index and the trailer tampered with; a name with .. in it; and a
+   symlink among the directories a member is extracted into.  None of
+   the bad ones may change what is already on disk. */
+static void
+check_archive (struct check *c)
+{
+  static const char *const files[] = { "a", "sub/b", "sub/c" };
+  static const char *const sizes[] = { "3000", "1M+7", "0" };
+  const size_t nfiles = sizeof (files) / sizeof (files[0]);
+  char *cr[] = { NULL, "-c", "--bufsize", "64K", NULL, NULL, NULL, NULL };
+  char *ls[] = { NULL, "-t", NULL, NULL, NULL, NULL };
+  char *x[] = { NULL, "-x", "--bufsize", "64K", "-C", NULL, NULL, NULL, NULL };
+  char top[PATH_MAX], src[PATH_MAX + 8], abs[PATH_MAX], xdir[PATH_MAX + 8];
+  char f[2 * PATH_MAX + 16], g[2 * PATH_MAX + 16], link[8];
+  const char *rel;
+  size_t i;
+  ssize_t n;
+
+  sprintf (top, "%.*s/arc", PATH_MAX - 8, c->dir);
+  sprintf (src, "%s/src", top);
+  sprintf (xdir, "%s/x", top);
+  sprintf (f, "%s/sub", src);
+  if (mkdir (top, 0700) != 0 || mkdir (src, 0700) != 0
+      || mkdir (f, 0700) != 0 || mkdir (xdir, 0700) != 0
+      || !realpath (src, abs)) {
+    perror (top);
+    c->failures++;
+    remove_tree (top);
+    return;
+  }
+  rel = abs + 1;		/* what the archive calls src */
+  for (i = 0; i < nfiles; i++) {
+    sprintf (f, "%s/%s", src, files[i]);
+    if (pv_make_input (f, pv_parse_sum (sizes[i]), 0) != 0) {
+      c->failures++;
+      remove_tree (top);
+      return;
+    }
+  }
+  sprintf (f, "%s/sub/l", src);
+  if (symlink ("b", f) != 0) {
+    perror (f);
+    c->failures++;
+  }
+
+  /* the round trip */
+  cr[4] = ls[2] = x[6] = c->key;
+  cr[5] = ls[3] = x[7] = c->ct;
+  cr[6] = abs;
+  x[5] = xdir;
+  if (run_tool (c, "pv_archive", cr, 0) != 0) {
+    fprintf (stderr, "%s: pv_archive -c failed\n", getprogname ());
+    c->failures++;
+  }
+  ls[4] = f;			/* -t NAME fails unless NAME is there */
+  for (i = 0; i <= nfiles; i++) {
+    if (i < nfiles)
+      sprintf (f, "%s/%s", rel, files[i]);
+    else
+      sprintf (f, "%s/missing", rel);
+    if ((run_tool (c, "pv_archive", ls, i == nfiles) == 0) != (i < nfiles)) {
+      fprintf (stderr, "%s: pv_archive -t %s %s\n", getprogname (),
+	       i < nfiles ? "didn't list" : "listed", f);
+      c->failures++;
+    }
+  }
+  ls[4] = NULL;
+  if (run_tool (c, "pv_archive", x, 0) != 0) {
+    fprintf (stderr, "%s: pv_archive -x failed\n", getprogname ());
+    c->failures++;
+  }
+  for (i = 0; i < nfiles; i++) {
+    sprintf (f, "%s/%s", src, files[i]);
+    sprintf (g, "%s/%s/%s", xdir, rel, files[i]);
+    if (pv_same_file (f, g) != 0) {
+      fprintf (stderr, "%s: pv_archive -x: %s doesn't match %s\n",
+	       getprogname (), g, f);
+      c->failures++;
+    }
+  }
+  sprintf (g, "%s/%s/sub/l", xdir, rel);
+  if ((n = readlink (g, link, sizeof (link))) != 1 || link[0] != 'b') {
+    fprintf (stderr, "%s: pv_archive -x: %s isn't a link to b\n",
+	     getprogname (), g);
+    c->failures++;
+  }
+
+  /* the index, then the trailer's numbers and its final tag */
+  if (make_tampered (c, -(ARC_TRAILER + PV_SEG_TAG_LEN + 1)) == 0)
+    arc_rejected (c, c->bad, xdir, 1, "a tampered index");
+  if (make_tampered (c, -ARC_TRAILER) == 0)
+    arc_rejected (c, c->bad, xdir, 1, "a tampered trailer");
+  if (make_tampered (c, -1) == 0)
+    arc_rejected (c, c->bad, xdir, 1, "a tampered final tag");
+
+  /* one member (checked before it is written, and one too big for
+     that), in an archive of just that file: the one extracted above
+     must be left as it was, and nothing else left beside it */
+  for (i = 0; i < 2; i++) {
+    sprintf (f, "%s/%s", abs, files[i]);
+    cr[6] = f;
+    if (run_tool (c, "pv_archive", cr, 0) != 0
+	|| make_tampered (c, PV_HDR_LEN + PV_SEG_NONCE_LEN + BLOCK_LEN
+			  + pv_parse_sum (sizes[i]) / 2) != 0) {
+      c->failures++;
+      continue;
+    }
+    arc_rejected (c, c->bad, xdir, 0, "a tampered member");
+    sprintf (g, "%s/%s/%s", xdir, rel, files[i]);
+    if (pv_same_file (f, g) != 0) {
+      fprintf (stderr, "%s: a tampered member changed %s\n", getprogname (),
+	       g);
+      c->failures++;
+    }
+    *strrchr (g, '/') = '\0';
+    if (entries (g) != (i ? 3 : 2)) {
+      fprintf (stderr, "%s: a tampered member left something in %s\n",
+	       getprogname (), g);
+      c->failures++;
+    }
+  }
+
+  /* a name with .. in it, which only a forger could have put there */
+  sprintf (f, "%s/escaped", top);
+  if (make_unsafe (c, "../escaped") == 0)
+    arc_rejected (c, c->bad, xdir, 0, "a name with .. in it");
+  if (access (f, F_OK) == 0) {
+    fprintf (stderr, "%s: pv_archive -x wrote %s\n", getprogname (), f);
+    c->failures++;
+  }
+
+  /* a directory of a member's name that is a symlink elsewhere */
+  remove_tree (xdir);
+  sprintf (f, "%.*s/elsewhere", (int) (strrchr (abs, '/') - abs), abs);
+  sprintf (g, "%s/%.*s", xdir, (int) (strchr (rel, '/') - rel), rel);
+  if (mkdir (xdir, 0700) != 0 || mkdir (f, 0700) != 0 || symlink (f, g) != 0)
+    perror (g);
+  arc_rejected (c, c->ct, xdir, 0, "a symlinked directory");
+  if (entries (f) != 0) {
+    fprintf (stderr, "%s: pv_archive -x wrote through the symlink %s\n",
+	     getprogname (), g);
+    c->failures++;
+  }
+
+  remove_tree (top);
+}
+#undef ARC_TRAILER
+#undef ARC_ENTRY
+
+/* the uring_enters of the --stats line in c->stats, which is then
+   emptied; -1 if there isn't one */
+static long
+uring_enters (struct check *c)
+{
+  char buf[4096], *p;
+  ssize_t n = -1;
+  int fd;
+
+  if ((fd = open (c->stats, O_RDWR)) != -1) {
+    n = read_chunk (fd, buf, sizeof (buf) - 1);
+    if (ftruncate (fd, 0) != 0)
+      n = -1;
+    close (fd);
+  }
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  return (p = strstr (buf, "\"uring_enters\":")) ? atol (p + 15) : -1;
+}
+
+/* runs prog with PV_IO=sync if sync, else on the ring if it can be
+   had; 0 if it succeeded, and didn't use the ring under PV_IO=sync */
+static int
+run_io (struct check *c, const char *prog, char **argv, int sync)
+{
+  long enters;
+  int r;
+
+  if (sync)
+    setenv ("PV_IO", "sync", 1);
+  else
+    unsetenv ("PV_IO");
+  r = run_tool (c, prog, argv, 0);
+  unsetenv ("PV_IO");
+  if ((enters = uring_enters (c)) == -1) {
+    fprintf (stderr, "%s: %s printed no --stats\n", getprogname (), prog);
+    return -1;
+  }
+  if (sync && enters) {
+    fprintf (stderr, "%s: %s used the ring under PV_IO=sync\n",
+	     getprogname (), prog);
+    return -1;
+  }
+  if (enters)
+    c->ring_runs++;
+  return r;
+}
+
+/* c->in (of size bytes) through pv_encrypt and pv_decrypt in mode,
+   with the ciphertext made (enc_sync) and read (dec_sync) through the
+   fallback or the ring */
+static void
+check_io (struct check *c, const char *mode, off_t size, int enc_sync,
+	  int dec_sync)
+{
+  char *enc[] = { NULL, "--mode", NULL, NULL, NULL, NULL, NULL };
+  char *dec[] = { NULL, NULL, NULL, NULL, NULL };
+
+  enc[2] = (char *) mode;
+  enc[3] = dec[1] = c->key;
+  enc[4] = c->in;
+  enc[5] = dec[2] = c->ct;
+  dec[3] = c->pt;
+  if (run_io (c, "pv_encrypt", enc, enc_sync) != 0
+      || run_io (c, "pv_decrypt", dec, dec_sync) != 0
+      || pv_same_file (c->in, c->pt) != 0) {
+    fprintf (stderr, "%s: %s, size %lu, encrypted %s and decrypted %s: "
+	     "round trip failed\n", getprogname (), mode,
+	     (unsigned long) size, enc_sync ? "with PV_IO=sync" : "on the ring",
+	     dec_sync ? "with PV_IO=sync" : "on the ring");
+    c->failures++;
+  }
+}
+
+static void
+usage (const char *pname)
+{
+  printf ("Personal Vault: Tests\n");
+  printf ("Usage: %s [options]\n", pname);
+  printf ("       Checks the xor/compare kernels against the scalar code\n");
+  printf ("       and times them, and HMAC against libdcrypt; then that\n");
+  printf ("       the tools turn down tampered ciphertexts, --offset and\n");
+  printf ("       --length on --mode seg, --batch --lanes, pv_archive, and\n");
+  printf ("       round trips with PV_IO=sync and on the io_uring.  Exits 1\n");
+  printf ("       if anything fails.\n");
+  printf ("       --sizes L      tamper series sizes, e.g. 0,17,1M+7\n");
+  printf ("       --io-sizes L   PV_IO series sizes (default\n");
+  printf ("                      0,1,15,16,17,4096,1M+7,5M+3)\n");
+  printf ("       --bin DIR      where the tools are (default .)\n");
+  printf ("       --dir DIR      scratch directory (default pv_check.d)\n");
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  static const char *const modes[] = { "cbc", "cbc-sha256", "gcm", "seg" };
+  char sizes_s[] = "0,1,16,17,1M+7";
+  char io_sizes_s[] = "0,1,15,16,17,4096,1M+7,5M+3";
+  char *sizes_l = sizes_s, *sizes[PV_MAXLIST], *kg[3];
+  char *io_sizes_l = io_sizes_s, *io_sizes[PV_MAXLIST];
+  int nsizes, nio, failures = 0, i, k;
+  size_t m;
+  off_t size;
+  struct check c;
+
+  setprogname (argv[0]);
+  bzero (&c, sizeof (c));
+  c.bin = ".";
+  c.dir = "pv_check.d";
+  for (i = 1; i < argc; i++) {
+    if (i + 1 == argc)
+      usage (argv[0]);
+    if (!strcmp (argv[i], "--sizes"))
+      sizes_l = argv[++i];
+    else if (!strcmp (argv[i], "--io-sizes"))
+      io_sizes_l = argv[++i];
+    else if (!strcmp (argv[i], "--bin"))
+      c.bin = argv[++i];
+    else if (!strcmp (argv[i], "--dir"))
+      c.dir = argv[++i];
+    else
+      usage (argv[0]);
+  }
+  nsizes = pv_split (sizes_l, sizes);
+  nio = pv_split (io_sizes_l, io_sizes);
+  for (i = 0; i < nsizes; i++)
+    if (pv_parse_sum (sizes[i]) == -1)
+      usage (argv[0]);
+  for (i = 0; i < nio; i++)
+    if (pv_parse_sum (io_sizes[i]) == -1)
+      usage (argv[0]);
+
+  if (pv_kern_check () != 0)
+    failures++;
+  if (pv_hmac_check () != 0)
+    failures++;
+  ri ();
+  if (check_lib () != 0)
+    failures++;
+
+  if (mkdir (c.dir, 0700) != 0 && errno != EEXIST) {
+    perror (c.dir);
+    exit (2);
+  }
+  sprintf (c.key, "%.*s/key", PATH_MAX - 8, c.dir);
+  sprintf (c.in, "%.*s/in", PATH_MAX - 8, c.dir);
+  sprintf (c.ct, "%.*s/ct", PATH_MAX - 8, c.dir);
+  sprintf (c.pt, "%.*s/pt", PATH_MAX - 8, c.dir);
+  sprintf (c.bad, "%.*s/bad", PATH_MAX - 8, c.dir);
+  sprintf (c.ref, "%.*s/ref", PATH_MAX - 8, c.dir);
+  sprintf (c.stats, "%.*s/stats", PATH_MAX - 8, c.dir);
+  kg[1] = c.key;
+  kg[2] = NULL;
+  if (run_tool (&c, "pv_keygen", kg, 0) != 0) {
+    fprintf (stderr, "%s: cannot make a key with %s/pv_keygen\n",
+	     getprogname (), c.bin);
+    exit (2);
+  }
+
+  for (i = 0; i < nsizes; i++) {
+    size = pv_parse_sum (sizes[i]);
+    if (pv_make_input (c.in, size, 0) != 0)
+      exit (2);
+    for (m = 0; m < sizeof (modes) / sizeof (modes[0]); m++)
+      check_tamper (&c, modes[m], size);
+  }
+  printf ("tamper %d tool runs, %d failures\n", c.runs, c.failures);
+  failures += c.failures;
+
+  c.runs = c.failures = 0;
+  check_ranges (&c);
+  printf ("range %d tool runs, %d failures\n", c.runs, c.failures);
+  failures += c.failures;
+
+  c.runs = c.failures = 0;
+  check_lanes (&c);
+  printf ("lanes %d tool runs, %d failures\n", c.runs, c.failures);
+  failures += c.failures;
+
+  c.runs = c.failures = 0;
+  check_archive (&c);
+  printf ("archive %d tool runs, %d failures\n", c.runs, c.failures);
+  failures += c.failures;
+
+  c.runs = c.failures = 0;
+  setenv ("PV_STATS", c.stats, 1);
+  for (i = 0; i < nio; i++) {
+    size = pv_parse_sum (io_sizes[i]);
+    if (pv_make_input (c.in, size, 0) != 0)
+      exit (2);
+    for (m = 0; m < sizeof (modes) / sizeof (modes[0]); m++)
+      for (k = 0; k < 4; k++)	/* sync/sync, sync/ring, ring/sync, ring/ring */
+	check_io (&c, modes[m], size, !(k & 2), !(k & 1));
+  }
+  unsetenv ("PV_STATS");
+  printf ("io %d tool runs, %d on the ring, %d failures\n", c.runs,
+	  c.ring_runs, c.failures);
+  if (!c.ring_runs)
+    printf ("io no io_uring to be had here: only PV_IO=sync was tested\n");
+  failures += c.failures;
+
+  unlink (c.key);
+  unlink (c.in);
+  unlink (c.ct);
+  unlink (c.pt);
+  unlink (c.bad);
+  unlink (c.ref);
+  unlink (c.stats);
+  rmdir (c.dir);
+  printf ("%s: %s\n", getprogname (), failures ? "FAILED" : "all passed");
+  return failures ? 1 : 0;
+}
@@ -1,7 +1,500 @@
 #include "pv.h"
 
-void
-decrypt_file (const char *ptxt_fname, void *raw_sk, size_t raw_len, int fin)
+/* the buffers and the worker pool used by decrypt_file */
+struct dec_bufs {
+  char *ct;			/* ciphertext chunk (+ lookahead) */
+  char *pt;			/* plaintext chunk */
+  size_t nct, npt;		/* their sizes, for pv_free */
+  struct pv_pool *pool;		/* NULL unless -j N with N > 1 */
+  struct pv_cbc_job *jobs;
+  struct pv_io *in, *out;	/* the ctxt and ptxt files */
+};
+
+/* waits for any decryption or I/O still running, then frees (and
+   scrubs) everything */
+static void
+free_bufs (struct dec_bufs *b)
+{
+  pv_io_close(b->in); pv_io_close(b->out);
+  pv_pool_free(b->pool);
+  free(b->jobs);
+  pv_free(b->ct, b->nct);
+  pv_free(b->pt, b->npt);
+}
+
+/* the body of decrypt_seg, from b->in to b->out: one segment at a time,
+   check its tag (and, for the last, the final tag) before decrypting
+   and writing it (or, with no b->out, only check them: --verify).
+   The smallest possible ending, an empty last segment and the trailer,
+   is read ahead: a segment followed by that much is a whole one, and
+   anything shorter is the last segment and the trailer. */
+static int
+seg_stream (struct pv_seg *seg_s, const struct pv_aes_ctx *aes_s,
+	    struct dec_bufs *b, int njobs, size_t seglen)
+{
+  const size_t reclen = BLOCK_LEN + seglen + PV_SEG_TAG_LEN;
+  const size_t minlast = BLOCK_LEN + PV_SEG_TAG_LEN + PV_SEG_TRAILER_LEN;
+  char *rec = b->ct, *bufptxt = b->pt;
+  u_char tag[PV_SEG_TAG_LEN];
+  char iv[BLOCK_LEN];
+  u_int32_t numpad0 = 0u;
+  ssize_t numread;
+  size_t have = 0, ctlen;
+  struct pv_stamp t;
+  int last;
+
+  do {
+    numread = pv_io_read(b->in, rec + have, reclen + minlast - have);
+    if (numread == -1) {
+      perror("decrypt_file: error reading ctx file");
+      return -1;
+    }
+    have += numread;
+    last = have < reclen + minlast;
+    if (last && (have < minlast || (have - minlast) % BLOCK_LEN)) {
+      fprintf(stderr,"decrypt_file: ctxt file is truncated or has bad size\n");
+      return -1;
+    }
+    ctlen = last ? have - minlast : seglen;
+    if (last)
+      numpad0 = getint(rec + have - PV_SEG_TRAILER_LEN);
+
+    pv_stats_begin(&t);
+    pv_seg_tag(seg_s, last, numpad0, rec, BLOCK_LEN + ctlen, tag);
+    pv_stats_end(PV_PH_MAC, &t);
+    if (pv_ct_differs(tag, rec + BLOCK_LEN + ctlen, PV_SEG_TAG_LEN)) {
+      fprintf(stderr, "WARNING: HMAC MISMATCH in segment %u. Check key and ciphertext integrity.\n",
+	     seg_s->nseg - 1);
+      return -1;
+    }
+    if (last) {
+      pv_seg_final(seg_s, tag);
+      if (pv_ct_differs(tag, rec + have - PV_SEG_TAG_LEN, PV_SEG_TAG_LEN)) {
+	fprintf(stderr, "WARNING: HMAC MISMATCH. Check key and ciphertext integrity.\n");
+	return -1;
+      }
+      if (numpad0 >= BLOCK_LEN || numpad0 > ctlen) {
+	fprintf(stderr,"decrypt_file: bad padding length %u\n", numpad0);
+	return -1;
+      }
+    }
+
+    /* authentic: now it may be decrypted and released */
+    if (b->out) {
+      memcpy(iv, rec, BLOCK_LEN);
+      pv_stats_begin(&t);
+      pv_cbc_decrypt_start(b->pool, b->jobs, njobs, aes_s,
+			   bufptxt, rec + BLOCK_LEN, ctlen, iv);
+      if (b->pool)
+	pv_pool_wait(b->pool);
+      pv_stats_end(PV_PH_CIPHER, &t);
+      PV_PROBE2(decrypt_chunk, numread, ctlen - numpad0);
+      if (pv_io_write(b->out, bufptxt, ctlen - numpad0) != 0) {
+	perror("decrypt_file: error writing ptxt");
+	return -1;
+      }
+    }
+    if (!last) {		/* carry the lookahead over */
+      memmove(rec, rec + reclen, minlast);
+      have = minlast;
+    }
+  } while (!last);
+
+  return 0;
+}
+
+/* the other body of decrypt_seg, for --offset/--length.  Segments
+   have a fixed size, so the file size tells where each one is and
+   which is last; only those covering the range are read (with pread),
+   authenticated and decrypted, so the cost is proportional to the
+   length of the range.  The final tag isn't checked, but the last
+   segment is whenever the range reaches it (or beyond), so a truncated
+   file can't pass for a shorter plaintext. */
+static int
+seg_range (int fptxt, int fin, struct pv_seg *seg_s,
+	   const struct pv_aes_ctx *aes_s, struct dec_bufs *b, int njobs,
+	   size_t seglen, off_t offset, off_t length)
+{
+  const size_t reclen = BLOCK_LEN + seglen + PV_SEG_TAG_LEN;
+  const off_t start = PV_HDR_LEN + PV_SEG_NONCE_LEN; /* of segment 0 */
+  char *rec = b->ct, *bufptxt = b->pt;
+  u_char tag[PV_SEG_TAG_LEN];
+  char iv[BLOCK_LEN], trailer[PV_SEG_TRAILER_LEN];
+  u_int32_t numpad0;
+  u_int64_t nfull, idx;
+  size_t ctlen, lastlen, from, to;
+  off_t body, segoff;
+  struct pv_stamp t;
+  struct stat st;
+  int last;
+
+  if (fstat(fin, &st) != 0) {
+    perror("decrypt_file: cannot stat ctxt file");
+    return -1;
+  }
+  body = st.st_size - start - PV_SEG_TRAILER_LEN; /* all the segments */
+  if (body < BLOCK_LEN + PV_SEG_TAG_LEN
+      || (u_int64_t) (body - BLOCK_LEN - PV_SEG_TAG_LEN) % reclen > seglen
+      || (u_int64_t) (body - BLOCK_LEN - PV_SEG_TAG_LEN) % reclen % BLOCK_LEN) {
+    fprintf(stderr,"decrypt_file: ctxt file is truncated or has bad size\n");
+    return -1;
+  }
+  nfull = (u_int64_t) (body - BLOCK_LEN - PV_SEG_TAG_LEN) / reclen;
+  lastlen = (u_int64_t) (body - BLOCK_LEN - PV_SEG_TAG_LEN) % reclen;
+  if (pread_chunk(fin, trailer, PV_SEG_TRAILER_LEN, start + body)
+      != PV_SEG_TRAILER_LEN) {
+    perror("decrypt_file: error reading ctx file");
+    return -1;
+  }
+
+  /* from the segment holding offset (or the last one, if offset is
+     past the end) until the range or the file ends */
+  idx = (u_int64_t) offset / seglen;
+  if (idx > nfull)
+    idx = nfull;
+  for (; idx <= nfull
+	 && (length < 0 || (off_t) (idx * seglen) < offset + length); idx++) {
+    last = idx == nfull;
+    ctlen = last ? lastlen : seglen;
+    numpad0 = last ? getint(trailer) : 0;
+    segoff = start + (off_t) (idx * reclen);
+    if (pread_chunk(fin, rec, BLOCK_LEN + ctlen + PV_SEG_TAG_LEN, segoff)
+	!= (ssize_t) (BLOCK_LEN + ctlen + PV_SEG_TAG_LEN)) {
+      perror("decrypt_file: error reading ctx file");
+      return -1;
+    }
+    seg_s->nseg = idx;
+    pv_stats_begin(&t);
+    pv_seg_tag(seg_s, last, numpad0, rec, BLOCK_LEN + ctlen, tag);
+    pv_stats_end(PV_PH_MAC, &t);
+    if (pv_ct_differs(tag, rec + BLOCK_LEN + ctlen, PV_SEG_TAG_LEN)) {
+      fprintf(stderr, "WARNING: HMAC MISMATCH in segment %lu. Check key and ciphertext integrity.\n",
+	     (unsigned long) idx);
+      return -1;
+    }
+    if (numpad0 >= BLOCK_LEN || numpad0 > ctlen) {
+      fprintf(stderr,"decrypt_file: bad padding length %u\n", numpad0);
+      return -1;
+    }
+
+    /* the part of this segment's ptxt inside the range */
+    from = (off_t) (idx * seglen) < offset ? offset - idx * seglen : 0;
+    to = ctlen - numpad0;
+    if (length >= 0 && (off_t) (idx * seglen + to) > offset + length)
+      to = offset + length - idx * seglen;
+    if (from >= to)
+      continue;
+    memcpy(iv, rec, BLOCK_LEN);
+    pv_stats_begin(&t);
+    pv_cbc_decrypt_start(b->pool, b->jobs, njobs, aes_s,
+			 bufptxt, rec + BLOCK_LEN, ctlen, iv);
+    if (b->pool)
+      pv_pool_wait(b->pool);
+    pv_stats_end(PV_PH_CIPHER, &t);
+    if (write_chunk(fptxt, bufptxt + from, to - from) != 0) {
+      perror("decrypt_file: error writing ptxt");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* PV_MODE_SEG (see encrypt_seg): head holds the header already read
+   from fin.  Memory use is about two segments, whatever the file size,
+   and nothing is written that hasn't been authenticated.  With fptxt
+   -1 the segments are only authenticated (--verify).  Returns 0 on
+   success, -1 (after complaining) on failure. */
+static int
+decrypt_seg (int fptxt, const char *sk_aes, const char *sk_hmac, size_t sk_len,
+	     int fin, const char *hdrbuf, const struct pv_hdr *hdr,
+	     const struct pv_opts *opts)
+{
+  const size_t seglen = hdr->param;
+  char head[PV_HDR_LEN + PV_SEG_NONCE_LEN];
+  struct pv_aes_ctx aes_s;
+  struct pv_seg seg_s;
+  struct dec_bufs b;
+  int ret;
+
+  memcpy(head, hdrbuf, PV_HDR_LEN);
+  if (read_chunk(fin, head + PV_HDR_LEN, PV_SEG_NONCE_LEN) != PV_SEG_NONCE_LEN) {
+    fprintf(stderr,"decrypt_file: ctxt file is too short or read error\n");
+    return -1;
+  }
+  bzero(&b, sizeof(b));
+  b.nct = 2 * (BLOCK_LEN + PV_SEG_TAG_LEN) + seglen + PV_SEG_TRAILER_LEN;
+  b.ct = (char*)pv_alloc(b.nct * sizeof(char)); /* + lookahead */
+  if (fptxt != -1) {
+    b.npt = seglen;
+    b.pt = (char*)pv_alloc(b.npt * sizeof(char));
+    if (opts->jobs > 1) {
+      b.pool = pv_pool_new(opts->jobs);
+      b.jobs = (struct pv_cbc_job*)malloc(opts->jobs * sizeof(struct pv_cbc_job));
+    }
+  }
+  if (!b.ct || (fptxt != -1
+		&& (!b.pt || (opts->jobs > 1 && (!b.pool || !b.jobs))))) {
+    fprintf(stderr, "decrypt_file: Cannot allocate memory\n");
+    free_bufs(&b);
+    return -1;
+  }
+
+  bzero(&aes_s, sizeof(aes_s));
+  if (fptxt != -1)
+    pv_aes_setkey(&aes_s, sk_aes, sk_len);
+  pv_seg_init(&seg_s, sk_hmac, sk_len, head);
+  if (fptxt == -1) {
+    if (!(b.in = pv_io_open(fin, 0, BLOCK_LEN + seglen + PV_SEG_TAG_LEN))) {
+      fprintf(stderr, "decrypt_file: Cannot allocate memory\n");
+      ret = -1;
+    }
+    else
+      ret = seg_stream(&seg_s, &aes_s, &b, 1, seglen);
+  }
+  else if (opts->range)
+    ret = seg_range(fptxt, fin, &seg_s, &aes_s, &b, opts->jobs, seglen,
+		    opts->offset, opts->length);
+  else if (!(b.in = pv_io_open(fin, 0, BLOCK_LEN + seglen + PV_SEG_TAG_LEN))
+	   || !(b.out = pv_io_open(fptxt, 1, seglen))) {
+    fprintf(stderr, "decrypt_file: Cannot allocate memory\n");
+    ret = -1;
+  }
+  else {
+    ret = seg_stream(&seg_s, &aes_s, &b, opts->jobs, seglen);
+    if (pv_io_close(b.out) != 0 && ret == 0) {
+      perror("decrypt_file: error writing ptxt");
+      ret = -1;
+    }
+    b.out = NULL;
+  }
+
+  pv_seg_clr(&seg_s);
+  pv_aes_clrkey(&aes_s);
+  free_bufs(&b);
+  return ret;
+}
+
+/* --mmap, for the CBC formats: fin is positioned just past the IV.
+   With the whole ciphertext mapped, the trailer is simply its last
+   bytes, so the size of the ptxt is known before anything is
+   decrypted: ptxt_fname is sized up front and Y is decrypted straight
+   into its pages, a stride at a time while the HMAC reads the same
+   stride.  Returns 0 on success, -1 (after complaining) on failure, or
+   1 if the files can't be mapped and should be read and written. */
+static int
+decrypt_mapped (int fptxt, int fin, const struct pv_aes_ctx *aes,
+		struct pv_hmac_ctx *hmac, char *iv, int mode,
+		const struct pv_opts *opts)
+{
+  const size_t trailer_len = hmac->outlen + 4;
+  struct stat st_in, st_out;
+  struct dec_bufs b;
+  char *in, *out = NULL, *y, *trailer;
+  u_char mac[PV_MAC_MAX_LEN];
+  char last[BLOCK_LEN];
+  u_int32_t numpad0;
+  size_t inlen, ylen, ptlen, off, len, ctlen;
+  struct pv_stamp t;
+  off_t pos;
+  int ret = 0;
+
+  if (fstat(fin, &st_in) != 0 || !S_ISREG(st_in.st_mode)
+      || fstat(fptxt, &st_out) != 0 || !S_ISREG(st_out.st_mode)
+      || (fcntl(fptxt, F_GETFL) & O_ACCMODE) != O_RDWR /* e.g. stdout */
+      || (off_t) (size_t) st_in.st_size != st_in.st_size
+      || (pos = lseek(fin, 0, SEEK_CUR)) == -1)
+    return 1;
+  inlen = st_in.st_size;
+  if (inlen < pos + trailer_len || (inlen - pos - trailer_len) % BLOCK_LEN) {
+    fprintf(stderr,"decrypt_file: ctxt file has bad size (not multiple of block length)\n");
+    return -1;
+  }
+  if ((in = (char*)mmap(NULL, inlen, PROT_READ, MAP_PRIVATE, fin, 0)) == MAP_FAILED)
+    return 1;
+  madvise(in, inlen, MADV_SEQUENTIAL);
+  y = in + pos;
+  ylen = inlen - pos - trailer_len;
+  trailer = y + ylen;
+  numpad0 = getint(trailer + hmac->outlen); /* only trusted after the HMAC */
+  if (numpad0 >= BLOCK_LEN || numpad0 > ylen) {
+    fprintf(stderr,"decrypt_file: bad padding length %u\n", numpad0);
+    munmap(in, inlen);
+    return -1;
+  }
+  ptlen = ylen - numpad0;
+
+  bzero(&b, sizeof(b));
+  if (opts->jobs > 1) {
+    b.pool = pv_pool_new(opts->jobs);
+    b.jobs = (struct pv_cbc_job*)malloc(opts->jobs * sizeof(struct pv_cbc_job));
+    if (!b.pool || !b.jobs) {
+      fprintf(stderr, "decrypt_file: Cannot allocate memory\n");
+      free_bufs(&b);
+      munmap(in, inlen);
+      return -1;
+    }
+  }
+  if (ptlen) {
+    if (ftruncate(fptxt, ptlen) != 0
+	|| (out = (char*)mmap(NULL, ptlen, PROT_READ | PROT_WRITE, MAP_SHARED,
+			      fptxt, 0)) == MAP_FAILED) {
+      perror("decrypt_file: cannot size or map ptxt file");
+      free_bufs(&b);
+      munmap(in, inlen);
+      return -1;
+    }
+    madvise(out, ptlen, MADV_SEQUENTIAL);
+  }
+  pv_stats_add(PV_ST_BYTES_IN, inlen - pos); /* no read or write calls to count */
+  pv_stats_add(PV_ST_BYTES_OUT, ptlen);
+
+  for (off = 0; off < ylen; off += len) {
+    len = ylen - off < opts->bufsize ? ylen - off : opts->bufsize;
+    /* the final block holds the padding, so it goes via last */
+    ctlen = off + len == ylen ? len - BLOCK_LEN : len;
+    pv_stats_begin(&t);
+    pv_cbc_decrypt_start(b.pool, b.jobs, opts->jobs, aes,
+			 out + off, y + off, ctlen, iv);
+    pv_stats_end(PV_PH_CIPHER, &t);
+    pv_stats_begin(&t);
+    pv_hmac_update(hmac, y + off, len);
+    pv_stats_end(PV_PH_MAC, &t);
+    pv_stats_begin(&t);
+    if (b.pool)
+      pv_pool_wait(b.pool);
+    if (ctlen < len) {
+      pv_cbc_decrypt(aes, last, y + off + ctlen, BLOCK_LEN, iv);
+      memcpy(out + off + ctlen, last, BLOCK_LEN - numpad0);
+      pv_scrub(last, BLOCK_LEN);
+    }
+    pv_stats_end(PV_PH_CIPHER, &t);
+  }
+
+  pv_hmac_padlen(hmac, mode, numpad0);
+  pv_hmac_final(hmac, mac);
+  if (pv_ct_differs(trailer, mac, hmac->outlen)) {
+    fprintf(stderr, "WARNING: HMAC MISMATCH. Check key and ciphertext integrity.\n");
+    ret = -1;
+  }
+
+  if (out)
+    munmap(out, ptlen);
+  free_bufs(&b);
+  munmap(in, inlen);
+  return ret;
+}
+
+/* --compress: the ptxt goes through the LZ decoder (pv_lz.c) on its
+   way out.  The decoder's time counts as PV_PH_LZ, less the writes. */
+struct unlz_sink {
+  struct pv_io *out;
+  struct pv_stamp t;
+};
+
+static int
+unlz_put (void *arg, const char *p, size_t n)
+{
+  struct unlz_sink *k = (struct unlz_sink *) arg;
+  int r;
+
+  pv_stats_end(PV_PH_LZ, &k->t);
+  r = pv_io_write(k->out, p, n);
+  pv_stats_begin(&k->t);
+  return r;
+}
+
+/* out the next len bytes of ptxt, decompressed first if lz isn't NULL;
+   returns 0, -1 if they couldn't be written, or -2 if they don't
+   decompress (with cbc, most likely a tampered ctxt) */
+static int
+release (struct pv_io *out, struct pv_unlz *lz, const char *p, size_t len)
+{
+  struct unlz_sink k;
+  int r;
+
+  if (!lz)
+    return pv_io_write(out, p, len) != 0 ? -1 : 0;
+  k.out = out;
+  pv_stats_begin(&k.t);
+  r = pv_unlz_update(lz, p, len, unlz_put, &k);
+  pv_stats_end(PV_PH_LZ, &k.t);
+  return r == -2 ? -1 : r == -1 ? -2 : 0;
+}
+
+/* --verify: authenticate the ctxt in fin without decrypting any of it.
+   Only the MAC (or the seg tags, or the gcm tag) is computed, over
+   large sequential reads, and nothing is written.  Returns 0 if the
+   ctxt is authentic, -1 (after complaining) otherwise. */
+static int
+verify_file (int fin, void *raw_sk, size_t raw_len, const struct pv_opts *opts)
+{
+  const size_t sk_len = raw_len / 2;
+  const char *sk_aes = (const char*)raw_sk;
+  const char *sk_hmac = (const char*)raw_sk+sk_len;
+  const size_t bufsize = opts->bufsize;
+  struct pv_decrypt_ctx ctx;
+  struct pv_hdr hdr;
+  struct pv_io *in;
+  char head[PV_HDR_LEN], *buf;
+  ssize_t numread;
+  size_t len;
+  int r, have_hdr, mode;
+
+  posix_fadvise(fin, 0, 0, POSIX_FADV_SEQUENTIAL); /* fails on a pipe */
+  if ((numread = read_chunk(fin, head, PV_HDR_LEN)) < PV_HDR_LEN) {
+    if (numread == -1) perror(0);
+    fprintf(stderr,"decrypt_file: ctxt file is too short or read error\n");
+    return -1;
+  }
+  have_hdr = pv_hdr_parse(&hdr, head) == 0;
+  if (have_hdr && pv_hdr_check(&hdr) != 0)
+    return -1;
+  if (have_hdr && hdr.mode == PV_MODE_SEG)
+    return decrypt_seg(-1, sk_aes, sk_hmac, sk_len, fin, head, &hdr, opts);
+  mode = have_hdr ? (int) hdr.mode : PV_MODE_CBC;
+
+  if ((r = pv_verify_init(&ctx, raw_sk, raw_len)) != PV_OK
+      || (r = pv_decrypt_update(&ctx, head, PV_HDR_LEN, NULL, 0, &len))
+      != PV_OK) {
+    fprintf(stderr, "decrypt_file: %s\n", pv_strerror(r));
+    pv_decrypt_clr(&ctx);
+    return -1;
+  }
+  buf = (char*)pv_alloc(bufsize * sizeof(char));
+  if (!buf || !(in = pv_io_open(fin, 0, bufsize))) {
+    fprintf(stderr, "decrypt_file: Cannot allocate memory\n");
+    pv_decrypt_clr(&ctx);
+    pv_free(buf, 0);
+    return -1;
+  }
+  while ((numread = pv_io_read(in, buf, bufsize)) > 0
+	 && (r = pv_decrypt_update(&ctx, buf, numread, NULL, 0, &len)) == PV_OK
+	 && (size_t) numread == bufsize) /* short read_chunk means EOF */
+    ;
+  if (numread == -1)
+    perror("decrypt_file: error reading ctx file");
+  else if (r == PV_OK)
+    r = pv_decrypt_final(&ctx, NULL, 0, &len);
+  if (r == PV_ERR_AUTH)
+    fprintf(stderr, "WARNING: %s MISMATCH. Check key and ciphertext integrity.\n",
+	   mode == PV_MODE_GCM ? "GCM TAG" : "HMAC");
+  else if (r != PV_OK)
+    fprintf(stderr, "decrypt_file: %s\n", pv_strerror(r));
+
+  pv_io_close(in);
+  pv_decrypt_clr(&ctx);
+  pv_free(buf, bufsize);
+  return numread == -1 || r != PV_OK ? -1 : 0;
+}
+
+/* Returns 0, or -1 (after complaining, and removing ptxt_fname).
+   With --verify-first nothing is created, let alone written, until
+   the whole of fin has been authenticated; then it is read again,
+   from the page cache as often as not. */
+int
+decrypt_file (const char *ptxt_fname, void *raw_sk, size_t raw_len, int fin,
+	      const struct pv_opts *opts)
 {
   /*************************************************************************** 
    * Task: Read the ciphertext from the file descriptor fin, decrypt it using
@@ -35,12 +528,27 @@ decrypt_file (const char *ptxt_fname, void *raw_sk, size_t raw_len, int fin)
    * will encounter the end-of-file, at which point we will know where Y ends,
    * and how to finish reading the last bytes of the ciphertext.
    */
-  int i;
+  if (opts->verify == PV_VERIFY_FIRST) {
+    off_t start = lseek(fin, 0, SEEK_CUR);
+    if (start == -1) {
+      fprintf(stderr, "decrypt_file: --verify-first needs a ctxt file it can read twice, not a pipe\n");
+      return -1;
+    }
+    if (verify_file(fin, raw_sk, raw_len, opts) != 0)
+      return -1;
+    if (lseek(fin, start, SEEK_SET) == -1) {
+      perror("decrypt_file: cannot rewind ctxt file");
+      return -1;
+    }
+  }
+
   /* Create plaintext file---may be confidential info, so permission is 0600 */
-  int fptxt = open(ptxt_fname, O_RDWR | O_TRUNC | O_CREAT, 0600); /* RDWR for ftruncate */
+  /* (a shared writable mapping needs the file open for reading too) */
+  int fptxt = pv_open_out(ptxt_fname, (opts->use_mmap ? O_RDWR : O_WRONLY)
+		   | O_TRUNC | O_CREAT, 0600);
   if (fptxt == -1) {
     perror("encrypt_file: error opening ptxt file");
-    return;
+    return -1;
   }
 
   /* use the first part of the symmetric key for the CBC-AES decryption ...*/
@@ -51,114 +559,167 @@ decrypt_file (const char *ptxt_fname, void *raw_sk, size_t raw_len, int fin)
   /* ... and the second part for the HMAC-SHA1 */
   const char *sk_hmac = (const char*)raw_sk+sk_len;
 
-  /* Reading Y */
-  /* First, read the IV (Initialization Vector) */
-  char *cprev = (char*)malloc(BLOCK_LEN * sizeof(char));
-  if (!cprev) {
-    fprintf(stderr, "decrypt_file: Cannot allocate %d bytes\n",BLOCK_LEN);
-    close(fptxt); unlink(ptxt_fname);
-    return;
-  }
-  int numread = read(fin, cprev, BLOCK_LEN); /* read IV */
+  /* Newer formats start with a header, the original one with the IV */
+  char head[PV_HDR_LEN];
+  ssize_t numread = read_chunk(fin, head, PV_HDR_LEN);
   /* printf("numread: %d\n",numread); */
-  if (numread < BLOCK_LEN) {
+  if (numread < PV_HDR_LEN) {
     if (numread == -1) perror(0);
     fprintf(stderr,"decrypt_file: ctxt file is too short or read error\n");
-    close(fptxt); unlink(ptxt_fname);
-    free(cprev);
-    return;
+    close(fptxt); pv_remove_out(ptxt_fname);
+    return -1;
+  }
+  struct pv_hdr hdr;
+  int have_hdr = pv_hdr_parse(&hdr, head) == 0;
+  PV_PROBE2(decrypt_start, have_hdr ? (int) hdr.mode : PV_MODE_CBC,
+	    have_hdr && hdr.mode == PV_MODE_SEG ? hdr.param : opts->bufsize);
+  if (opts->range && (!have_hdr || hdr.mode != PV_MODE_SEG)) {
+    fprintf(stderr,"decrypt_file: --offset/--length need a --mode seg ctxt\n");
+    close(fptxt); pv_remove_out(ptxt_fname);
+    return -1;
+  }
+  if (have_hdr && (pv_hdr_check(&hdr) != 0
+		   || (hdr.mode == PV_MODE_SEG
+		       && decrypt_seg(fptxt, sk_aes, sk_hmac, sk_len, fin, head,
+				      &hdr, opts) != 0))) {
+    close(fptxt); pv_remove_out(ptxt_fname);
+    PV_PROBE1(decrypt_done, -1);
+    return -1;
+  }
+  if (have_hdr && hdr.mode == PV_MODE_SEG) {
+    close(fptxt);
+    PV_PROBE1(decrypt_done, 0);
+    return 0;
   }
 
-  /* compute the HMAC-SHA1 as you go */
-  struct sha1_ctx hmac_s;	/* init HMAC */
-  hmac_sha1_init(sk_hmac, sk_len, &hmac_s);
-  hmac_sha1_update(&hmac_s, cprev, BLOCK_LEN);
-  
-  struct aes_ctx aes_s;		/* init AES */
-  aes_setkey(&aes_s, sk_aes, sk_len);
+  /* The rest is libpv's (pv_lib.c), fed what we've read so far and then
+   * a chunk at a time.  It keeps the trailer and the last block of Y
+   * (which holds the zero padding) back until the end, where it checks
+   * the MAC or tag and releases the last of the ptxt.  Reads and writes
+   * run ahead and behind us through pv_io.c, and with -j the CBC
+   * decryption of each chunk is spread over the worker pool.  A
+   * --compress ctxt then goes through the LZ decoder (release). */
+  struct pv_decrypt_ctx ctx;
+  struct dec_bufs b;
+  struct pv_unlz unlz, *lz = NULL;
+  const size_t bufsize = opts->bufsize; /* multiple of BLOCK_LEN */
+  const size_t outcap = PV_UPDATE_MAX(bufsize) < PV_FINAL_MAX
+    ? PV_FINAL_MAX : PV_UPDATE_MAX(bufsize);
+  size_t len;
+  int r, mode = have_hdr ? (int) hdr.mode : PV_MODE_CBC, rr = 0;
 
-  char *bufin = (char*)malloc((BLOCK_LEN+24) * sizeof(char)); /* buffer to hold chunks of ctxt+24 */
-  char *bufptxt = (char*)malloc(BLOCK_LEN * sizeof(char));	   /* buffer to hold chunks of ptxt */
-  if (!bufin || !bufptxt) {
+  bzero(&b, sizeof(b));
+  bzero(&unlz, sizeof(unlz));
+  if ((r = pv_decrypt_init(&ctx, raw_sk, raw_len)) != PV_OK
+      || (r = pv_decrypt_update(&ctx, head, PV_HDR_LEN, NULL, 0, &len))
+      != PV_OK) {
+    fprintf(stderr, "decrypt_file: %s\n", pv_strerror(r));
+    pv_decrypt_clr(&ctx);
+    close(fptxt); pv_remove_out(ptxt_fname);
+    return -1;
+  }
+
+  if (opts->use_mmap && mode != PV_MODE_GCM && !(ctx.flags & PV_FLAG_LZ)) {
+    /* decrypt_mapped wants the HMAC primed with the header and IV */
+    if (have_hdr && (read_chunk(fin, head, BLOCK_LEN) != BLOCK_LEN
+		     || pv_decrypt_update(&ctx, head, BLOCK_LEN, NULL, 0, &len)
+		     != PV_OK)) {
+      fprintf(stderr,"decrypt_file: ctxt file is too short or read error\n");
+      pv_decrypt_clr(&ctx);
+      close(fptxt); pv_remove_out(ptxt_fname);
+      return -1;
+    }
+    r = decrypt_mapped(fptxt, fin, &ctx.aes, &ctx.mac, ctx.iv, mode,
+		       opts);
+    if (r != 1) {		/* else fall back to read/write */
+      pv_decrypt_clr(&ctx);
+      close(fptxt);
+      PV_PROBE1(decrypt_done, r);
+      if (r != 0)
+	pv_remove_out(ptxt_fname);
+      return r;
+    }
+    r = PV_OK;
+  }
+
+  b.nct = bufsize;
+  b.npt = outcap;
+  b.ct = (char*)pv_alloc(b.nct * sizeof(char));  /* chunks of ctxt */
+  b.pt = (char*)pv_alloc(b.npt * sizeof(char));  /* chunks of ptxt */
+  if (opts->jobs > 1) {
+    b.pool = pv_pool_new(opts->jobs);
+    b.jobs = (struct pv_cbc_job*)malloc(opts->jobs * sizeof(struct pv_cbc_job));
+    pv_decrypt_threads(&ctx, b.pool, b.jobs, opts->jobs);
+  }
+  if (!(ctx.flags & PV_FLAG_LZ)
+      && pv_prealloc(fptxt, pv_ptxt_length(fin, mode)) != 0) {
+    perror("decrypt_file: cannot reserve space for ptxt file");
+    pv_decrypt_clr(&ctx);
+    close(fptxt); pv_remove_out(ptxt_fname);
+    free_bufs(&b);
+    return -1;
+  }
+  b.in = pv_io_open(fin, 0, bufsize);
+  b.out = pv_io_open(fptxt, 1, outcap);
+  if ((ctx.flags & PV_FLAG_LZ) && pv_unlz_init(&unlz) == 0)
+    lz = &unlz;
+  if (!b.ct || !b.pt || !b.in || !b.out
+      || (opts->jobs > 1 && (!b.pool || !b.jobs))
+      || ((ctx.flags & PV_FLAG_LZ) && !lz)) {
     fprintf(stderr, "decrypt_file: Cannot allocate memory\n");
-    aes_clrkey(&aes_s);
-    close(fptxt); unlink(ptxt_fname);
-    free(cprev); if (bufptxt) free(bufptxt);
-    if (bufin) free(bufin);
-    return;
-  }
-  numread = read(fin, bufin, BLOCK_LEN+24); /* first long read */
-  /* printf("numread: %d\n",numread);  */
-  if (numread < 24) {
-    if (numread == -1) perror(0);
-    fprintf(stderr,"decrypt_file: ctxt file is too short or read error\n");
-    aes_clrkey(&aes_s);
-    close(fptxt); unlink(ptxt_fname);
-    free(cprev); free(bufin); free(bufptxt);
-    return;
-  }
-  numread -= 24;
- 
-  while (numread == BLOCK_LEN) {                   /* while we read a full block */
-    aes_decrypt(&aes_s, bufptxt, bufin);           /* bufptxt := AES'(bufin[0..BLOCK_LEN]) */
-    xor_buffers(bufptxt, bufptxt, cprev, BLOCK_LEN);  /* bufptxt := bufptxt ^ cprev */
-    memcpy(cprev, bufin, BLOCK_LEN);		   /* cprev := bufin[0..BLOCK_LEN] */
-    hmac_sha1_update(&hmac_s, cprev, BLOCK_LEN);   /* update HMAC with new ctxt */
-    for (i=0; i < 24; i++)                         /* SHIFT bufin[BLOCK_LEN..BLOCK_LEN+24] to beginning*/
-      bufin[i] = bufin[i+BLOCK_LEN];
-    if (write_chunk(fptxt, bufptxt, BLOCK_LEN) != 0){ /* writeout ptxt block */
-      fprintf(stderr,"decrypt_file: error writing to %s\n",ptxt_fname);
-      aes_clrkey(&aes_s);
-      close(fptxt); unlink(ptxt_fname);
-      free(cprev); free(bufin); free(bufptxt);
-      return;
-    }
-    numread = read(fin, bufin+24, BLOCK_LEN);         /* read next ctxt */
-    /* printf("numread: %d\n",numread); */
-  }
-  /* numread == 0 expected on last block */
-  if (numread != 0) {
-    printf("expected %d\n",0);
-    if (numread == -1) perror("decrypt_file: error reading ctx file");
-    else fprintf(stderr,"decrypt_file: ctxt file has bad size (not multiple of block length)\n");
-    aes_clrkey(&aes_s);
-    close(fptxt); unlink(ptxt_fname);
-    free(cprev); free(bufin); free(bufptxt);
-    return;
-  }
-
-  aes_clrkey(&aes_s);
-  /* bufin[0..24] holds the HMAC||numpad0 and bufptxt holds last ctxt block (possible extra 0s) */
-  cprev = (char*)realloc(cprev, 20); /* ensure cprev has 20 bytes capacity */
-  if (!cprev) {
-    fprintf(stderr,"decrypt_file: failed to reallocate 20 bytes\n");
-    close(fptxt); unlink(ptxt_fname);
-    free(bufin); free(cprev); free(bufptxt);
-    return;
-  }
-  hmac_sha1_final(sk_hmac, sk_len, &hmac_s, (u_char*)cprev); /* cprev := computed HMAC */
-  for (i=0; i < 20; i++)
-    if (bufin[i] != cprev[i]) { /* mismatch! */
-      printf("WARNING: HMAC MISMATCH. Check key and ciphertext integrity.\n");
-      close(fptxt); unlink(ptxt_fname);
-      free(cprev); free(bufin); free(bufptxt);
-      return;
+    pv_decrypt_clr(&ctx);
+    close(fptxt); pv_remove_out(ptxt_fname);
+    free_bufs(&b);
+    return -1;
+  }
+
+  while ((numread = pv_io_read(b.in, b.ct, bufsize)) > 0) {
+    if ((r = pv_decrypt_update(&ctx, b.ct, numread, b.pt, outcap, &len))
+	!= PV_OK)
+      break;
+    PV_PROBE2(decrypt_chunk, numread, len);
+    if ((rr = release(b.out, lz, b.pt, len)) != 0)
+      break;
+    if ((size_t) numread < bufsize) { /* short read_chunk means EOF */
+      numread = 0;
+      break;
     }
-  
-  /* now let's fix those last 0s */
-  u_int32_t numpad0 = getint(bufin+20);
-  /* printf("numpad0= %u\n", numpad0); */
-  if (numpad0 > 0) {
-    int sk = lseek(fptxt, -numpad0, SEEK_CUR); /* desired total file length */
-    /* printf("sk= %d\n",sk); */
-    if (ftruncate(fptxt, sk) != 0) 
-      perror("decrypt_file: error truncating ptxt file to remove excess 0s");
   }
-  
+  if (numread == -1)
+    perror("decrypt_file: error reading ctx file");
+  else if (numread == 0 && r == PV_OK && rr == 0) {
+    if ((r = pv_decrypt_final(&ctx, b.pt, outcap, &len)) == PV_OK
+	&& (rr = release(b.out, lz, b.pt, len)) == 0 && lz)
+      rr = pv_unlz_final(lz) ? -2 : 0;
+  }
+  if (rr == -1) {
+    fprintf(stderr,"decrypt_file: error writing to %s\n",ptxt_fname);
+    numread = -1;
+  }
+  else if (rr == -2) {		/* the MAC will be found wrong, as a rule */
+    fprintf(stderr,"decrypt_file: compressed ptxt is corrupt (tampered ciphertext?)\n");
+    numread = -1;
+  }
+  if (r == PV_ERR_AUTH)
+    fprintf(stderr, "WARNING: %s MISMATCH. Check key and ciphertext integrity.\n",
+	   mode == PV_MODE_GCM ? "GCM TAG" : "HMAC");
+  else if (r != PV_OK)
+    fprintf(stderr, "decrypt_file: %s\n", pv_strerror(r));
+  int werr = pv_io_close(b.out) != 0; /* finishes the writes */
+  b.out = NULL;
+  if (werr && numread == 0 && r == PV_OK)
+    fprintf(stderr,"decrypt_file: error writing to %s\n",ptxt_fname);
+
+  pv_decrypt_clr(&ctx);
+  free_bufs(&b);
+  if (lz)
+    pv_unlz_free(lz);
   close(fptxt);
-  free(cprev);
-  free(bufin);
-  free(bufptxt);
+  PV_PROBE1(decrypt_done, werr || numread != 0 || r != PV_OK ? -1 : 0);
+  if (werr || numread != 0 || r != PV_OK) {
+    pv_remove_out(ptxt_fname);
+    return -1;
+  }
 
   /* CBC (Cipher-Block Chaining)---Decryption
    * decrypt the current block and xor it with the previous one 
@@ -185,13 +746,45 @@ decrypt_file (const char *ptxt_fname, void *raw_sk, size_t raw_len, int fin)
    * the ciphertext (padlen).
    */
 
+  return 0;
+}
+
+/* --batch: the key and options shared by every file */
+struct batch_arg {
+  void *raw_sk;
+  size_t raw_len;
+  struct pv_opts opts;
+};
+
+static int
+batch_one (const char *ctxt, const char *ptxt, void *arg)
+{
+  struct batch_arg *a = (struct batch_arg *) arg;
+  int fdctxt, r;
+
+  if ((fdctxt = open (ctxt, O_RDONLY)) == -1) {
+    fprintf (stderr, "%s: %s: %s\n", getprogname (), ctxt, strerror (errno));
+    return -1;
+  }
+  if (a->opts.verify == PV_VERIFY_ONLY) /* ptxt is just a name then */
+    r = verify_file (fdctxt, a->raw_sk, a->raw_len, &a->opts);
+  else
+    r = decrypt_file (ptxt, a->raw_sk, a->raw_len, fdctxt, &a->opts);
+  close (fdctxt);
+  return r;
 }
 
 void 
 usage (const char *pname)
 {
   printf ("Simple File Decryption Utility\n");
-  printf ("Usage: %s SK-FILE CTEXT-FILE PTEXT-FILE\n", pname);
+  printf ("Usage: %s [--bufsize N] [-j N] [--mmap] [--offset X] [--length N]\n"
+	  "          [--nocache | --direct] [--stats] [--max-rate N] [--max-iops N]\n"
+	  "          [--rate-file F] [--nice N] [--ioprio C[:N]]\n"
+	  "          SK-FILE CTEXT-FILE PTEXT-FILE\n",
+	  pname);
+  printf ("       %s [--bufsize N] --verify SK-FILE CTEXT-FILE\n", pname);
+  printf ("       %s [options] [--suffix S] --batch MANIFEST SK-FILE\n", pname);
   printf ("       Exits if either SK-FILE or CTEXT-FILE don't exist, or\n");
   printf ("       if a symmetric key sk cannot be found in SK-FILE.\n");
   printf ("       Otherwise, tries to use sk to decrypt the content of\n");
@@ -199,6 +792,47 @@ usage (const char *pname)
   printf ("       in PTEXT-FILE; if a decryption problem is encountered\n"); 
   printf ("       after the processing started, PTEXT-FILE is truncated\n");
   printf ("       to zero-length and its previous content is lost.\n");
+  printf ("       CTEXT-FILE or PTEXT-FILE may be - for stdin or stdout;\n");
+  printf ("       then a failure can only be reported (exit status 1)\n");
+  printf ("       after some ptxt may have been written.\n");
+  printf ("       --bufsize N  read and write N bytes at a time\n");
+  printf ("                    (suffix K, M or G; default 1M)\n");
+  printf ("       -j N         decrypt on N threads\n");
+  printf ("       --mmap       cbc modes: map CTEXT-FILE and PTEXT-FILE\n");
+  printf ("                    rather than read and write them\n");
+  printf ("       --offset X   only decrypt from byte X of the ptxt ...\n");
+  printf ("       --length N   ... and N bytes of it (or to the end); reads\n");
+  printf ("                    just the segments needed (--mode seg only)\n");
+  printf ("       --batch M    decrypt every CTEXT-FILE PTEXT-FILE pair listed\n");
+  printf ("                    in file M, one per line; or, if M is a\n");
+  printf ("                    directory, each file F.pv in it to F\n");
+  printf ("                    Prints ok or FAILED for each; -j N then\n");
+  printf ("                    means N files at a time.\n");
+  printf ("       --suffix S   with --batch DIR, use S instead of .pv\n");
+  printf ("       --verify     only check that CTEXT-FILE is authentic (exit\n");
+  printf ("                    status 0) or not (1); decrypts and writes\n");
+  printf ("                    nothing.  With --batch, the PTEXT-FILEs are\n");
+  printf ("                    not touched.\n");
+  printf ("       --verify-first  check all of CTEXT-FILE before decrypting\n");
+  printf ("                    it, so that a tampered one never gets as far as\n");
+  printf ("                    PTEXT-FILE (which is not even created); reads\n");
+  printf ("                    CTEXT-FILE twice, so it can't be a pipe\n");
+  printf ("       --nocache    keep the files out of the page cache: drop\n");
+  printf ("                    each chunk once read or written, and reserve\n");
+  printf ("                    PTEXT-FILE's space up front\n");
+  printf ("       --direct     --nocache, and O_DIRECT where the file system\n");
+  printf ("                    takes it\n");
+  printf ("       --max-rate N read and write at most N bytes a second\n");
+  printf ("                    (suffix K, M or G), all threads together\n");
+  printf ("       --max-iops N make at most N read or write requests a second\n");
+  printf ("       --rate-file F  take max-rate N and max-iops N lines from F,\n");
+  printf ("                    and again whenever F changes or on SIGHUP\n");
+  printf ("       --nice N     run at CPU priority N (see nice(1))\n");
+  printf ("       --ioprio C   I/O priority class idle, be[:0-7] or rt[:0-7]\n");
+  printf ("                    (see ionice(1))\n");
+  printf ("       --stats      print where the time went, as a line of JSON\n");
+  printf ("                    on stderr (or set PV_STATS=1, or PV_STATS=FILE\n");
+  printf ("                    to append it to FILE)\n");
 
   exit (1);
 }
@@ -206,15 +840,65 @@ usage (const char *pname)
 int 
 main (int argc, char **argv)
 {
-  int fdsk, fdctxt;
+  int fdsk, fdctxt = -1;
   char *raw_sk = NULL;
   size_t raw_len = 0;
+  struct pv_opts opts;
+  const char *batch = NULL, *suffix = PV_BATCH_SUFFIX;
+  struct batch_arg ba;
+  struct pv_stamp t;
+  long failed = 0;
+  int argi, stats = 0;
 
-  if (argc != 4) {
+  pv_opts_init (&opts);
+  for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+    if (!strcmp (argv[argi], "--bufsize") && argi + 1 < argc) {
+      if (!(opts.bufsize = parse_bufsize (argv[++argi])))
+	usage (argv[0]);
+    }
+    else if (!strcmp (argv[argi], "--offset") && argi + 1 < argc) {
+      if ((opts.offset = parse_offset (argv[++argi])) == -1)
+	usage (argv[0]);
+      opts.range = 1;
+    }
+    else if (!strcmp (argv[argi], "--length") && argi + 1 < argc) {
+      if ((opts.length = parse_offset (argv[++argi])) == -1)
+	usage (argv[0]);
+      opts.range = 1;
+    }
+    else if (!strcmp (argv[argi], "--mmap"))
+      opts.use_mmap = 1;
+    else if (!strcmp (argv[argi], "--nocache"))
+      pv_iopolicy |= PV_IOP_NOCACHE;
+    else if (!strcmp (argv[argi], "--direct"))
+      pv_iopolicy |= PV_IOP_NOCACHE | PV_IOP_DIRECT;
+    else if (!strcmp (argv[argi], "--stats"))
+      stats = 1;
+    else if (!strcmp (argv[argi], "--verify"))
+      opts.verify = PV_VERIFY_ONLY;
+    else if (!strcmp (argv[argi], "--verify-first"))
+      opts.verify = PV_VERIFY_FIRST;
+    else if (!strcmp (argv[argi], "-j") && argi + 1 < argc) {
+      if ((opts.jobs = atoi (argv[++argi])) < 1)
+	usage (argv[0]);
+    }
+    else if (!strcmp (argv[argi], "--batch") && argi + 1 < argc)
+      batch = argv[++argi];
+    else if (!strcmp (argv[argi], "--suffix") && argi + 1 < argc)
+      suffix = argv[++argi];
+    else if (pv_qos_arg (argc, argv, &argi) != 1)
+      usage (argv[0]);
+  }
+  pv_stats_init (stats);
+  if (pv_qos_start (argv[0]) != 0)
+    exit (1);
+
+  if (argc - argi != (batch ? 1 : opts.verify == PV_VERIFY_ONLY ? 2 : 3)
+      || (opts.verify && opts.range)) {
     usage (argv[0]);
-  }   /* Check if argv[1] and argv[2] are existing files */
-  else if (((fdsk = open (argv[1], O_RDONLY)) == -1)
-	   || ((fdctxt = open (argv[2], O_RDONLY)) == -1)) {
+  }   /* Check if SK-FILE and CTEXT-FILE are existing files */
+  else if (((fdsk = open (argv[argi], O_RDONLY)) == -1)
+	   || (!batch && (fdctxt = pv_open_in (argv[argi+1])) == -1)) {
     if (errno == ENOENT) {
       usage (argv[0]);
     }
@@ -226,24 +910,54 @@ main (int argc, char **argv)
   else {
     setprogname (argv[0]);
 
-    /* Import symmetric key from argv[1] */
+    /* make sure the AES backend picked for this CPU gives the right answers */
+    pv_stats_begin (&t);
+    if (pv_kern_selftest () != 0 || pv_aes_selftest () != 0 || pv_hmac_selftest () != 0
+	|| pv_gcm_selftest () != 0)
+      exit (-1);
+    pv_stats_end (PV_PH_SELFTEST, &t);
+
+    /* Import symmetric key from SK-FILE */
+    pv_stats_begin (&t);
     if (!(raw_sk = import_sk_from_file (&raw_sk, &raw_len, fdsk))) {
-      printf ("%s: no symmetric key found in %s\n", argv[0], argv[1]);
+      fprintf (stderr, "%s: no symmetric key found in %s\n", argv[0], argv[argi]);
       close (fdsk);
       exit (2);
     }
     close (fdsk);
+    pv_stats_end (PV_PH_KEY, &t);
 
     /* printf("raw_len: %zu\n",raw_len); */
     /* Enough setting up---let's get to the crypto... */
-    decrypt_file (argv[3], raw_sk, raw_len, fdctxt);    
+    if (batch) {		/* all of the above once, for every file */
+      ba.raw_sk = raw_sk;
+      ba.raw_len = raw_len;
+      ba.opts = opts;
+      ba.opts.jobs = 1;		/* the threads take a file each instead */
+      failed = pv_batch_run (batch, suffix, 1, opts.jobs, batch_one, &ba);
+      if (failed > 0)
+	fprintf (stderr, "%s: %ld files failed\n", argv[0], failed);
+    }
+    else {
+      /* "-" for either file means a pipe, more often than not; make
+	 its buffer big enough for a chunk at a time */
+      pv_pipe_grow (fdctxt, opts.bufsize);
+      if (opts.verify == PV_VERIFY_ONLY)
+	failed = verify_file (fdctxt, raw_sk, raw_len, &opts) != 0;
+      else {
+	if (!strcmp (argv[argi+2], PV_STDIO))
+	  pv_pipe_grow (STDOUT_FILENO, opts.bufsize);
+	failed = decrypt_file (argv[argi+2], raw_sk, raw_len, fdctxt, &opts) != 0;
+      }
+    }
 
     /* scrub the buffer that's holding the key before exiting */
-    bzero(raw_sk, raw_len);
-    free(raw_sk);
+    pv_free(raw_sk, raw_len);
 
-    close (fdctxt);
+    if (fdctxt != -1)
+      close (fdctxt);
   }
 
-  return 0;
+  pv_stats_report ("pv_decrypt", failed ? 1 : 0);
+  return failed ? 1 : 0;
 }
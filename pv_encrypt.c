@@ -1,7 +1,563 @@
 #include "pv.h"
 
-void
-encrypt_file (const char *ctxt_fname, void *raw_sk, size_t raw_len, int fin)
+/* encrypt_seg -j N: every segment's place in the ctxt follows from the
+   ptxt's size, so N threads can each take the next segment, pread it,
+   encrypt and tag it under its own IV, and pwrite it where it goes.
+   Only the final tag waits for them all, over the tags in order. */
+struct seg_par {
+  int fin, fctxt;
+  off_t in0, out0;		/* where segment 0 is in each file */
+  size_t seglen;
+  u_int32_t nseg;		/* the last one short, perhaps empty */
+  size_t lastlen;		/* its ptxt bytes */
+  const struct pv_aes_ctx *aes;
+  const struct pv_seg *seg;
+  u_char *tags;			/* nseg of them, in order */
+  u_int32_t next;		/* the next segment to be taken */
+  int err;
+};
+
+struct seg_worker {
+  struct pv_task task;		/* must be first */
+  struct seg_par *p;
+};
+
+static void
+seg_worker_run (struct pv_task *task)
+{
+  struct seg_par *p = ((struct seg_worker *) task)->p;
+  const size_t reclen = BLOCK_LEN + p->seglen + PV_SEG_TAG_LEN;
+  char *rec = (char*)pv_alloc(reclen * sizeof(char));
+  char iv[BLOCK_LEN];
+  u_int32_t idx, numpad0;
+  struct pv_stamp t;
+  off_t in, out;
+  ssize_t numread;
+  size_t len;
+  int last;
+
+  if (!rec) {
+    fprintf(stderr, "encrypt_file: Cannot allocate memory\n");
+    __atomic_store_n(&p->err, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  while (!__atomic_load_n(&p->err, __ATOMIC_RELAXED)
+	 && (idx = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED))
+	 < p->nseg) {
+    last = idx == p->nseg - 1;
+    len = last ? p->lastlen : p->seglen;
+    in = p->in0 + (off_t) idx * p->seglen;
+    out = p->out0 + (off_t) idx * reclen;
+    pv_stats_begin(&t);
+    numread = pread_chunk(p->fin, rec + BLOCK_LEN, len, in);
+    pv_stats_end(PV_PH_READ, &t);
+    if (numread != (ssize_t) len) {
+      if (numread == -1)
+	perror("encrypt_file: error reading ptxt file");
+      else
+	fprintf(stderr, "encrypt_file: ptxt file changed size\n");
+      __atomic_store_n(&p->err, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    pv_cache_drop(p->fin, in, len, 0);
+    numpad0 = 0;
+    if (len % BLOCK_LEN) { 	/* final block; 0-pad */
+      numpad0 = BLOCK_LEN - len % BLOCK_LEN;
+      bzero(rec + BLOCK_LEN + len, numpad0);
+      len += numpad0;
+    }
+
+    pv_random(rec, BLOCK_LEN); /* a fresh IV per segment */
+    memcpy(iv, rec, BLOCK_LEN);
+    pv_stats_begin(&t);
+    pv_cbc_encrypt(p->aes, rec + BLOCK_LEN, rec + BLOCK_LEN, len, iv);
+    pv_stats_end(PV_PH_CIPHER, &t);
+    pv_stats_begin(&t);
+    pv_seg_mac(p->seg, idx, last, numpad0, rec, BLOCK_LEN + len,
+	       p->tags + (size_t) idx * PV_SEG_TAG_LEN);
+    memcpy(rec + BLOCK_LEN + len, p->tags + (size_t) idx * PV_SEG_TAG_LEN,
+	   PV_SEG_TAG_LEN);
+    pv_stats_end(PV_PH_MAC, &t);
+    PV_PROBE2(encrypt_chunk, numread, len);
+    pv_stats_begin(&t);
+    if (pwrite_chunk(p->fctxt, rec, BLOCK_LEN + len + PV_SEG_TAG_LEN, out)
+	!= 0) {
+      perror("encrypt_file: error writing ctxt");
+      __atomic_store_n(&p->err, 1, __ATOMIC_RELAXED);
+      pv_stats_end(PV_PH_WRITE, &t);
+      break;
+    }
+    pv_cache_drop(p->fctxt, out, BLOCK_LEN + len + PV_SEG_TAG_LEN, 1);
+    pv_stats_end(PV_PH_WRITE, &t);
+  }
+  pv_free(rec, reclen);
+}
+
+/* the segments and trailer of encrypt_seg on opts->jobs threads, the
+   header being out.  Returns 0, -1 (after complaining), or 1 if fin or
+   fctxt isn't a regular file, for encrypt_seg's loop to do instead. */
+static int
+encrypt_seg_threads (int fctxt, int fin, const struct pv_aes_ctx *aes,
+		     struct pv_seg *seg, const struct pv_opts *opts)
+{
+  const size_t reclen = BLOCK_LEN + opts->bufsize + PV_SEG_TAG_LEN;
+  char trailer[PV_SEG_TRAILER_LEN];
+  struct seg_worker *w;
+  struct pv_pool *pool;
+  struct seg_par p;
+  struct stat st;
+  u_int32_t i, numpad0;
+  off_t size, end;
+  int k;
+
+  bzero(&p, sizeof(p));
+  if (fstat(fin, &st) != 0 || !S_ISREG(st.st_mode)
+      || (p.in0 = lseek(fin, 0, SEEK_CUR)) == -1 || p.in0 > st.st_size)
+    return 1;
+  size = st.st_size - p.in0;
+  if (fstat(fctxt, &st) != 0 || !S_ISREG(st.st_mode)
+      || (p.out0 = lseek(fctxt, 0, SEEK_CUR)) == -1
+      || (u_int64_t) size / opts->bufsize >= 0xffffffffu)
+    return 1;
+  p.fin = fin;
+  p.fctxt = fctxt;
+  p.seglen = opts->bufsize;
+  p.nseg = size / p.seglen + 1;
+  p.lastlen = size % p.seglen;
+  p.aes = aes;
+  p.seg = seg;
+  numpad0 = p.lastlen % BLOCK_LEN ? BLOCK_LEN - p.lastlen % BLOCK_LEN : 0;
+  end = p.out0 + (off_t) (p.nseg - 1) * reclen
+    + BLOCK_LEN + p.lastlen + numpad0 + PV_SEG_TAG_LEN; /* the trailer's */
+  if (pv_prealloc(fctxt, end + PV_SEG_TRAILER_LEN) != 0) {
+    perror("encrypt_file: cannot reserve space for ctxt file");
+    return -1;
+  }
+
+  p.tags = (u_char*)malloc((size_t) p.nseg * PV_SEG_TAG_LEN);
+  w = (struct seg_worker*)malloc(opts->jobs * sizeof(struct seg_worker));
+  pool = pv_pool_new(opts->jobs);
+  if (!p.tags || !w || !pool) {
+    fprintf(stderr, "encrypt_file: Cannot allocate memory\n");
+    p.err = 1;
+  }
+  for (k = 0; !p.err && k < opts->jobs; k++) {
+    w[k].task.fn = seg_worker_run;
+    w[k].p = &p;
+    pv_pool_submit(pool, &w[k].task);
+  }
+  if (!p.err)
+    pv_pool_wait(pool);
+
+  if (!p.err) {
+    for (i = 0; i < p.nseg; i++)
+      pv_seg_add(seg, p.tags + (size_t) i * PV_SEG_TAG_LEN);
+    putint(trailer, numpad0);
+    pv_seg_final(seg, (u_char*)trailer + 4);
+    if (pwrite_chunk(fctxt, trailer, PV_SEG_TRAILER_LEN, end) != 0) {
+      perror("encrypt_file: error writing trailer");
+      p.err = 1;
+    }
+    /* the offsets where the serial loop would have left them */
+    lseek(fin, p.in0 + size, SEEK_SET);
+    lseek(fctxt, end + PV_SEG_TRAILER_LEN, SEEK_SET);
+  }
+  /* --nocache: what read-ahead brought back in behind the threads, the
+     pages two segments share, and the header's */
+  pv_cache_drop(fin, p.in0, size, 0);
+  pv_cache_drop(fctxt, p.out0 - p.out0 % PV_DIRECT_ALIGN,
+		end + PV_SEG_TRAILER_LEN - p.out0 + p.out0 % PV_DIRECT_ALIGN, 1);
+  pv_pool_free(pool);
+  free(w);
+  free(p.tags);
+  return p.err ? -1 : 0;
+}
+
+/* PV_MODE_SEG: header | nonce, then the plaintext in segments of
+   opts->bufsize bytes, each written as IV | CBC-AES | tag, then
+   padlen | final tag; with -j N, N segments at a time (above).
+   Returns 0 on success, -1 (after complaining) on failure. */
+static int
+encrypt_seg (int fctxt, const char *sk_aes, const char *sk_hmac, size_t sk_len,
+	     int fin, const struct pv_opts *opts)
+{
+  const size_t seglen = opts->bufsize;
+  struct pv_hdr hdr;
+  char head[PV_HDR_LEN + PV_SEG_NONCE_LEN];
+  char iv[BLOCK_LEN];
+  struct pv_aes_ctx aes_s;
+  struct pv_seg seg_s;
+  u_int32_t numpad0 = 0u;
+  struct pv_stamp t;
+  ssize_t numread;
+  size_t len;
+  int last;
+
+  bzero(&hdr, sizeof(hdr));
+  hdr.version = PV_VERSION;
+  hdr.mode = PV_MODE_SEG;
+  hdr.param = seglen;
+  pv_hdr_pack(head, &hdr);
+  pv_random(head + PV_HDR_LEN, PV_SEG_NONCE_LEN);
+  if (write_chunk(fctxt, head, sizeof(head)) != 0) {
+    perror("encrypt_file: error writing header");
+    return -1;
+  }
+  pv_aes_setkey(&aes_s, sk_aes, sk_len);
+  pv_seg_init(&seg_s, sk_hmac, sk_len, head);
+  if (opts->jobs > 1
+      && (numread = encrypt_seg_threads(fctxt, fin, &aes_s, &seg_s, opts))
+      != 1) {
+    pv_seg_clr(&seg_s);
+    pv_aes_clrkey(&aes_s);
+    return numread;
+  }
+
+  /* one segment, IV | Y | tag, goes out in one write; the trailer
+     fits in here afterwards */
+  char *rec = (char*)pv_alloc((BLOCK_LEN + seglen + PV_SEG_TAG_LEN) * sizeof(char));
+  struct pv_io *rin = pv_io_open(fin, 0, seglen);
+  struct pv_io *wout = pv_io_open(fctxt, 1, BLOCK_LEN + seglen + PV_SEG_TAG_LEN);
+  if (!rec || !rin || !wout) {
+    fprintf(stderr, "encrypt_file: Cannot allocate memory\n");
+    pv_io_close(rin); pv_io_close(wout);
+    pv_free(rec, 0);
+    pv_seg_clr(&seg_s);
+    pv_aes_clrkey(&aes_s);
+    return -1;
+  }
+
+  do {
+    if ((numread = pv_io_read(rin, rec + BLOCK_LEN, seglen)) == -1) {
+      perror("encrypt_file: error reading ptxt file");
+      break;
+    }
+    len = numread;
+    last = len < seglen;	/* short read_chunk means EOF */
+    if (len % BLOCK_LEN) { 	/* final block; 0-pad */
+      numpad0 = BLOCK_LEN - len % BLOCK_LEN;
+      bzero(rec + BLOCK_LEN + len, numpad0);
+      len += numpad0;
+    }
+
+    pv_random(rec, BLOCK_LEN); /* a fresh IV per segment */
+    memcpy(iv, rec, BLOCK_LEN);
+    pv_stats_begin(&t);
+    pv_cbc_encrypt(&aes_s, rec + BLOCK_LEN, rec + BLOCK_LEN, len, iv);
+    pv_stats_end(PV_PH_CIPHER, &t);
+    pv_stats_begin(&t);
+    pv_seg_tag(&seg_s, last, numpad0, rec, BLOCK_LEN + len,
+	       (u_char*)rec + BLOCK_LEN + len);
+    pv_stats_end(PV_PH_MAC, &t);
+    PV_PROBE2(encrypt_chunk, numread, len);
+    if (pv_io_write(wout, rec, BLOCK_LEN + len + PV_SEG_TAG_LEN) != 0) {
+      perror("encrypt_file: error writing ctxt");
+      numread = -1;
+      break;
+    }
+  } while (!last);
+
+  if (numread != -1) {
+    putint(rec, numpad0);
+    pv_seg_final(&seg_s, (u_char*)rec + 4);
+    if (pv_io_write(wout, rec, PV_SEG_TRAILER_LEN) != 0) {
+      perror("encrypt_file: error writing trailer");
+      numread = -1;
+    }
+  }
+  pv_io_close(rin);
+  if (pv_io_close(wout) != 0 && numread != -1) {
+    perror("encrypt_file: error writing ctxt");
+    numread = -1;
+  }
+
+  pv_seg_clr(&seg_s);
+  pv_aes_clrkey(&aes_s);
+  pv_free(rec, BLOCK_LEN + seglen);
+  return numread == -1 ? -1 : 0;
+}
+
+/* --mmap: encrypt all of fin (a regular file) straight from its pages
+   into those of fctxt, which is grown by the size of Y; the trailer is
+   then written after it as usual.  Goes in strides of bufsize so that
+   the HMAC reads each stride of Y while it is still in cache.  Sets
+   *numpad0.  Returns 0 on success, -1 (after complaining) on failure,
+   or 1 if the files can't be mapped and should be read and written. */
+static int
+encrypt_mapped (int fctxt, int fin, const struct pv_aes_ctx *aes,
+		struct pv_hmac_ctx *hmac, char *iv, size_t bufsize,
+		u_int32_t *numpad0)
+{
+  struct stat st_in, st_out;
+  char *in = NULL, *out = NULL, *y;
+  char last[BLOCK_LEN];
+  size_t ptlen, ylen, full, off, len;
+  struct pv_stamp t;
+  off_t pos;
+
+  if (fstat(fin, &st_in) != 0 || !S_ISREG(st_in.st_mode)
+      || fstat(fctxt, &st_out) != 0 || !S_ISREG(st_out.st_mode)
+      || (fcntl(fctxt, F_GETFL) & O_ACCMODE) != O_RDWR /* e.g. stdout */
+      || (off_t) (size_t) st_in.st_size != st_in.st_size
+      || (pos = lseek(fctxt, 0, SEEK_CUR)) == -1)
+    return 1;
+  ptlen = st_in.st_size;
+  *numpad0 = ptlen % BLOCK_LEN ? BLOCK_LEN - ptlen % BLOCK_LEN : 0;
+  ylen = ptlen + *numpad0;
+  full = ptlen - ptlen % BLOCK_LEN;
+  if (!ylen)
+    return 0;
+
+  if ((in = (char*)mmap(NULL, ptlen, PROT_READ, MAP_PRIVATE, fin, 0)) == MAP_FAILED)
+    return 1;
+  if (ftruncate(fctxt, pos + ylen) != 0) {
+    perror("encrypt_file: cannot extend ctxt file");
+    munmap(in, ptlen);
+    return -1;
+  }
+  out = (char*)mmap(NULL, pos + ylen, PROT_READ | PROT_WRITE, MAP_SHARED, fctxt, 0);
+  if (out == MAP_FAILED) {
+    perror("encrypt_file: cannot map ctxt file");
+    munmap(in, ptlen);
+    return -1;
+  }
+  madvise(in, ptlen, MADV_SEQUENTIAL);
+  madvise(out, pos + ylen, MADV_SEQUENTIAL);
+  y = out + pos;
+  pv_stats_add(PV_ST_BYTES_IN, ptlen); /* no read or write calls to count */
+  pv_stats_add(PV_ST_BYTES_OUT, ylen);
+
+  for (off = 0; off < ylen; off += len) {
+    len = ylen - off < bufsize ? ylen - off : bufsize;
+    pv_stats_begin(&t);
+    if (off + len > full) {	/* only the last stride; 0-pad */
+      pv_cbc_encrypt(aes, y + off, in + off, full - off, iv);
+      bzero(last, BLOCK_LEN);
+      memcpy(last, in + full, ptlen - full);
+      pv_cbc_encrypt(aes, y + full, last, BLOCK_LEN, iv);
+      pv_scrub(last, BLOCK_LEN);
+    }
+    else
+      pv_cbc_encrypt(aes, y + off, in + off, len, iv);
+    pv_stats_end(PV_PH_CIPHER, &t);
+    pv_stats_begin(&t);
+    pv_hmac_update(hmac, y + off, len);
+    pv_stats_end(PV_PH_MAC, &t);
+  }
+
+  munmap(in, ptlen);
+  munmap(out, pos + ylen);
+  if (lseek(fctxt, pos + ylen, SEEK_SET) == -1) {
+    perror("encrypt_file: cannot seek in ctxt file");
+    return -1;
+  }
+  return 0;
+}
+
+/* --pipeline: the CBC loop of encrypt_file split into four stages,
+ * each on its own thread, which pass PIPE_CHUNKS buffers around a cycle
+ * of rings:
+ *
+ *     reader -> cipher -> MAC -> writer -> (back to the) reader
+ *
+ * CBC encryption of one stream is still serial, but reading the next
+ * chunk and MACing and writing the previous ones no longer wait on it,
+ * so a file takes about as long as its slowest stage.  The cipher stage
+ * is the calling thread.  Every ring has room for all the chunks, so
+ * pushing never fails.
+ */
+#define PIPE_CHUNKS 4
+
+struct pipe_chunk {
+  char *buf;			/* bufsize bytes */
+  size_t len;
+  int last;			/* the final chunk; short, maybe empty */
+};
+
+struct enc_pipe {
+  int fin, fctxt;
+  size_t bufsize;
+  struct pv_ring *to_read, *to_cipher, *to_mac, *to_write;
+  struct pv_hmac_ctx *hmac;
+  int err;			/* a stage failed: stop reading, stop writing */
+};
+
+static void *
+pipe_reader (void *arg)
+{
+  struct enc_pipe *p = (struct enc_pipe *) arg;
+  struct pipe_chunk *c;
+  struct pv_stamp t;
+  ssize_t numread;
+  int last;
+
+  do {
+    c = (struct pipe_chunk *) pv_ring_pop_wait(p->to_read);
+    pv_stats_begin(&t);
+    if (__atomic_load_n(&p->err, __ATOMIC_RELAXED))
+      numread = 0;		/* wind the pipeline down */
+    else if ((numread = read_chunk(p->fin, c->buf, p->bufsize)) == -1) {
+      perror("encrypt_file: error reading ptxt file");
+      __atomic_store_n(&p->err, 1, __ATOMIC_RELAXED);
+      numread = 0;
+    }
+    pv_stats_end(PV_PH_READ, &t);
+    c->len = numread;
+    c->last = last = (size_t) numread < p->bufsize; /* short read_chunk means EOF */
+    pv_ring_push(p->to_cipher, c);
+  } while (!last);
+  return NULL;
+}
+
+static void *
+pipe_mac (void *arg)
+{
+  struct enc_pipe *p = (struct enc_pipe *) arg;
+  struct pipe_chunk *c;
+  struct pv_stamp t;
+  int last;
+
+  do {
+    c = (struct pipe_chunk *) pv_ring_pop_wait(p->to_mac);
+    pv_stats_begin(&t);
+    pv_hmac_update(p->hmac, c->buf, c->len);
+    pv_stats_end(PV_PH_MAC, &t);
+    last = c->last;
+    pv_ring_push(p->to_write, c);
+  } while (!last);
+  return NULL;
+}
+
+static void *
+pipe_writer (void *arg)
+{
+  struct enc_pipe *p = (struct enc_pipe *) arg;
+  struct pipe_chunk *c;
+  struct pv_stamp t;
+  int last;
+
+  do {
+    c = (struct pipe_chunk *) pv_ring_pop_wait(p->to_write);
+    pv_stats_begin(&t);
+    if (!__atomic_load_n(&p->err, __ATOMIC_RELAXED) && c->len
+	&& write_chunk(p->fctxt, c->buf, c->len) != 0) {
+      perror("encrypt_file: error writing ctxt");
+      __atomic_store_n(&p->err, 1, __ATOMIC_RELAXED);
+    }
+    pv_stats_end(PV_PH_WRITE, &t);
+    last = c->last;
+    pv_ring_push(p->to_read, c);
+  } while (!last);
+  return NULL;
+}
+
+/* hand r a chunk marking the end of the input, so that the stages
+   downstream of it finish */
+static void
+pipe_stop (struct enc_pipe *p, struct pv_ring *r)
+{
+  struct pipe_chunk *c = (struct pipe_chunk *) pv_ring_pop(p->to_read);
+
+  c->len = 0;
+  c->last = 1;
+  pv_ring_push(r, c);
+}
+
+static void
+pipe_free (struct enc_pipe *p, struct pipe_chunk *chunks)
+{
+  int i;
+
+  pv_ring_free(p->to_read); pv_ring_free(p->to_cipher);
+  pv_ring_free(p->to_mac); pv_ring_free(p->to_write);
+  for (i = 0; i < PIPE_CHUNKS; i++)
+    pv_free(chunks[i].buf, p->bufsize); /* may hold ptxt */
+}
+
+/* Encrypts and MACs all of fin (Y, in the picture in encrypt_file) and
+   writes it to fctxt, chaining on iv.  Sets *numpad0.  Returns 0 on
+   success, -1 (after complaining) on failure. */
+static int
+encrypt_pipelined (int fctxt, int fin, const struct pv_aes_ctx *aes,
+		   struct pv_hmac_ctx *hmac, char *iv, size_t bufsize,
+		   u_int32_t *numpad0)
+{
+  struct pipe_chunk chunks[PIPE_CHUNKS], *c;
+  struct enc_pipe p;
+  pthread_t reader, mac, writer;
+  struct pv_stamp t;
+  int i, last, have_reader = 1;
+
+  bzero(&p, sizeof(p));
+  bzero(chunks, sizeof(chunks));
+  p.fin = fin;
+  p.fctxt = fctxt;
+  p.bufsize = bufsize;
+  p.hmac = hmac;
+  p.to_read = pv_ring_new(PIPE_CHUNKS);
+  p.to_cipher = pv_ring_new(PIPE_CHUNKS);
+  p.to_mac = pv_ring_new(PIPE_CHUNKS);
+  p.to_write = pv_ring_new(PIPE_CHUNKS);
+  for (i = 0; i < PIPE_CHUNKS; i++)
+    chunks[i].buf = (char*)pv_alloc(bufsize * sizeof(char));
+  for (i = 0; i < PIPE_CHUNKS && chunks[i].buf; i++)
+    ;
+  if (i < PIPE_CHUNKS || !p.to_read || !p.to_cipher || !p.to_mac || !p.to_write) {
+    fprintf(stderr, "encrypt_file: Cannot allocate memory\n");
+    pipe_free(&p, chunks);
+    return -1;
+  }
+  for (i = 0; i < PIPE_CHUNKS; i++)
+    pv_ring_push(p.to_read, &chunks[i]);
+
+  /* start from the end of the pipeline, so a stage can be stopped
+     by feeding it a last chunk if a later one can't be started */
+  if (pthread_create(&writer, NULL, pipe_writer, &p) != 0) {
+    perror("encrypt_file: cannot start writer thread");
+    pipe_free(&p, chunks);
+    return -1;
+  }
+  if (pthread_create(&mac, NULL, pipe_mac, &p) != 0) {
+    perror("encrypt_file: cannot start MAC thread");
+    p.err = 1;
+    pipe_stop(&p, p.to_write);
+    pthread_join(writer, NULL);
+    pipe_free(&p, chunks);
+    return -1;
+  }
+  if (pthread_create(&reader, NULL, pipe_reader, &p) != 0) {
+    perror("encrypt_file: cannot start reader thread");
+    p.err = 1;
+    pipe_stop(&p, p.to_cipher);
+    have_reader = 0;
+  }
+
+  do {				/* the cipher stage */
+    c = (struct pipe_chunk *) pv_ring_pop_wait(p.to_cipher);
+    if (c->len % BLOCK_LEN) { 	/* final block; 0-pad */
+      *numpad0 = BLOCK_LEN - c->len % BLOCK_LEN;
+      bzero(c->buf + c->len, *numpad0);
+      c->len += *numpad0;
+    }
+    pv_stats_begin(&t);
+    pv_cbc_encrypt(aes, c->buf, c->buf, c->len, iv); /* chained on iv */
+    pv_stats_end(PV_PH_CIPHER, &t);
+    last = c->last;
+    pv_ring_push(p.to_mac, c);
+  } while (!last);
+
+  if (have_reader)
+    pthread_join(reader, NULL);
+  pthread_join(mac, NULL);
+  pthread_join(writer, NULL);
+  pipe_free(&p, chunks);
+  return p.err ? -1 : 0;
+}
+
+/* Returns 0, or -1 (after complaining, and removing ctxt_fname) */
+int
+encrypt_file (const char *ctxt_fname, void *raw_sk, size_t raw_len, int fin,
+	      const struct pv_opts *opts)
 {
   /*************************************************************************** 
    * Task: Read the content from file descriptor fin, encrypt it using raw_sk,
@@ -53,15 +609,14 @@ encrypt_file (const char *ctxt_fname, void *raw_sk, size_t raw_len, int fin)
 
   /* Create the ciphertext file---the content will be encrypted, 
    * so it can be world-readable! */
-  int fctxt = open(ctxt_fname, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+  /* (a shared writable mapping needs the file open for reading too) */
+  int fctxt = pv_open_out(ctxt_fname, (opts->use_mmap ? O_RDWR : O_WRONLY)
+		   | O_TRUNC | O_CREAT, 0644);
   if (fctxt == -1) {
     perror("encrypt_file: error opening ctxt file");
-    return;
+    return -1;
   }
 
-  /* initialize the pseudorandom generator (for the IV) */
-  ri();
-
   /* The buffer for the symmetric key actually holds two keys: */
   /* use the first key for the CBC-AES encryption ...*/
   assert(raw_len % 2 == 0);  /* really should be == 2*CCA_STRENGTH */
@@ -70,115 +625,456 @@ encrypt_file (const char *ctxt_fname, void *raw_sk, size_t raw_len, int fin)
   /* ... and the second part for the HMAC-SHA1 */
   const char *sk_hmac = (const char*)raw_sk+sk_len;
 
-  /* Now start processing the actual file content using symmetric encryption */
-  /* Remember that CBC-mode needs a random IV (Initialization Vector) */
-  char *cprev = (char*)malloc(BLOCK_LEN * sizeof(char));
-  if (!cprev) {
-    fprintf(stderr, "encrypt_file: Cannot allocate %d bytes\n",BLOCK_LEN);
-    close(fctxt); unlink(ctxt_fname);
-    return;
+  PV_PROBE2(encrypt_start, opts->mode, opts->bufsize);
+  if (opts->mode == PV_MODE_SEG) {
+    int r = encrypt_seg(fctxt, sk_aes, sk_hmac, sk_len, fin, opts);
+    if (r != 0)
+      pv_remove_out(ctxt_fname);
+    close(fctxt);
+    PV_PROBE1(encrypt_done, r);
+    return r;
   }
-  prng_getbytes(cprev, BLOCK_LEN); /* IV */
-
-  struct aes_ctx aes_s;		/* init AES */
-  aes_setkey(&aes_s, sk_aes, sk_len);
 
-  struct sha1_ctx hmac_s;	/* init HMAC */
-  hmac_sha1_init(sk_hmac, sk_len, &hmac_s);
-
-  /* output IV as first part of ctxt and pass to HMAC */
-  if (write_chunk(fctxt, cprev, BLOCK_LEN) != 0) {
-    fprintf(stderr,"encrypt_file: error writing to %s\n", ctxt_fname);
-    aes_clrkey(&aes_s);
-    close(fctxt); unlink(ctxt_fname);
-    free(cprev);
-    return;
+  /* The rest is libpv's (pv_lib.c): the context picks the IV (or nonce)
+   * and keeps the AES, HMAC or GCM state, and we shuttle chunks between
+   * the files and it.  bufout has room for a chunk of ctxt and for the
+   * header, the final block and the trailer around it.  With --compress
+   * each chunk goes through pv_lz_frames (into bufz) on its way. */
+  struct pv_encrypt_ctx ctx;
+  int r = pv_encrypt_init(&ctx, raw_sk, raw_len, opts->mode
+			  | (opts->compress ? PV_MODE_FLAGS(PV_FLAG_LZ) : 0));
+  if (r != PV_OK) {
+    fprintf(stderr, "encrypt_file: %s\n", pv_strerror(r));
+    close(fctxt); pv_remove_out(ctxt_fname);
+    return -1;
   }
-  /* printf("wrote %d\n",BLOCK_LEN); */
-  hmac_sha1_update(&hmac_s, cprev, BLOCK_LEN);
+  const size_t bufsize = opts->bufsize; /* multiple of BLOCK_LEN */
+  const size_t zcap = opts->compress ? PV_LZ_BOUND(bufsize) : 0;
+  const size_t outcap = PV_UPDATE_MAX(bufsize + zcap) < PV_FINAL_MAX
+    ? PV_FINAL_MAX : PV_UPDATE_MAX(bufsize + zcap);
+  char *bufin = (char*)pv_alloc(bufsize * sizeof(char));
+  char *bufout = (char*)pv_alloc(outcap * sizeof(char));
+  char *bufz = NULL;
+  struct pv_lz *lz = NULL;
+  if (opts->compress) {
+    bufz = (char*)pv_alloc(zcap * sizeof(char));
+    if ((lz = (struct pv_lz*)pv_alloc(sizeof(struct pv_lz))))
+      pv_lz_init(lz);
+  }
+  if (!bufin || !bufout || (opts->compress && (!bufz || !lz))) {
+    fprintf(stderr, "encrypt_file: Cannot allocate %lu bytes\n",
+	    (unsigned long) (bufsize + outcap + zcap));
+    pv_encrypt_clr(&ctx);
+    close(fctxt); pv_remove_out(ctxt_fname);
+    pv_free(bufin, 0); pv_free(bufout, 0); pv_free(bufz, 0);
+    pv_free(lz, sizeof(*lz));
+    return -1;
+  }
+  ssize_t numread = 1;
+  size_t len;
+  int done = 0;			/* Y was taken care of by --mmap or --pipeline */
 
-  char *bufin = (char*)malloc(BLOCK_LEN * sizeof(char)); /* buffer to hold chunks of plaintext */
-  if (!bufin) {
-    fprintf(stderr, "encrypt_file: Cannot allocate %d bytes\n",BLOCK_LEN);
-    aes_clrkey(&aes_s);
-    close(fctxt); unlink(ctxt_fname);
-    free(cprev);
-    return;
+  /* --nocache, --direct: the ctxt's size follows from the ptxt's,
+     unless it's to be compressed */
+  struct stat st;
+  off_t pos;
+  if (!opts->compress && fstat(fin, &st) == 0 && S_ISREG(st.st_mode)
+      && (pos = lseek(fin, 0, SEEK_CUR)) != -1 && pos <= st.st_size
+      && pv_prealloc(fctxt, pv_encrypt_length(opts->mode, st.st_size - pos))
+      != 0) {
+    perror("encrypt_file: cannot reserve space for ctxt file");
+    numread = -1;
+    done = 1;
   }
-  int numread = read(fin, bufin, BLOCK_LEN); /* first ptxt read */
-  u_int32_t numpad0 = 0u; 	/* number of 0-pad bits */
 
-  while (numread > 0) {
-    if (numread < BLOCK_LEN) { 	/* final block; 0-pad */
-      numpad0 = BLOCK_LEN - numread;
-      bzero(bufin+numread, numpad0);
-    }
-    
-    xor_buffers(bufin, bufin, cprev, BLOCK_LEN); /* bufin := bufin ^ cprev */
-    aes_encrypt(&aes_s, cprev, bufin); /* cprev := AES(bufin) */
+  if (!done && opts->mode != PV_MODE_GCM && !opts->compress
+      && (opts->use_mmap || opts->pipeline)) {
+    /* these work on the whole of Y at once with the context's AES and
+       HMAC, once the header (if any) and the IV are out */
+    u_int32_t numpad0 = 0u;
 
-    hmac_sha1_update(&hmac_s, cprev, BLOCK_LEN); /* update HMAC with next ctxt piece */
-    if (write_chunk(fctxt, cprev, BLOCK_LEN) != 0) {
+    pv_encrypt_update(&ctx, NULL, 0, bufout, outcap, &len);
+    if (write_chunk(fctxt, bufout, len) != 0) {
       fprintf(stderr,"encrypt_file: error writing to %s\n", ctxt_fname);
-      aes_clrkey(&aes_s);
-      close(fctxt); unlink(ctxt_fname);
-      free(cprev); free(bufin);
-      return;
+      numread = -1;
+    }
+    else if (opts->use_mmap)	/* 0, -1 or 1: can't map */
+      numread = encrypt_mapped(fctxt, fin, &ctx.aes, &ctx.mac, ctx.iv,
+			       bufsize, &numpad0);
+    if (numread == 1 && opts->pipeline) /* 0 or -1 */
+      numread = encrypt_pipelined(fctxt, fin, &ctx.aes, &ctx.mac, ctx.iv,
+				  bufsize, &numpad0);
+    if (numread != 1) {
+      done = 1;
+      if (numread == 0) {	/* finish HMAC and writeout, then numpad0 */
+	pv_hmac_padlen(&ctx.mac, ctx.mode, numpad0);
+	pv_hmac_final(&ctx.mac, (u_char*)bufout);
+	putint(bufout+ctx.mac.outlen, numpad0); /* cross-platform stability */
+	if (write_chunk(fctxt, bufout, ctx.mac.outlen + 4) != 0) {
+	  fprintf(stderr,"encrypt_file: error writing to %s\n", ctxt_fname);
+	  numread = -1;
+	}
+      }
     }
-    /* printf("wrote %d\n",BLOCK_LEN); */
-    
-    numread = read(fin, bufin, BLOCK_LEN);
-  }
-  /* numread == 0 is normal EOF */
-  if (numread == -1) {
-    fprintf(stderr,"encrypt_file: error reading ctxt file\n");
-    aes_clrkey(&aes_s);
-    close(fctxt); unlink(ctxt_fname);
-    free(cprev); free(bufin);
-    return;
   }
 
-  /* AES done; finish HMAC and writeout, then write numpad0 */
-  aes_clrkey(&aes_s);
-  free(cprev);
-  bufin = (char*)realloc(bufin, 20); /* ensure bufin has 20 bytes capacity */
-  if (!bufin) {
-    fprintf(stderr,"encrypt_file: failed to reallocate 20 bytes\n");
-    close(fctxt); unlink(ctxt_fname);
-    free(bufin);
-    return;
+  /* otherwise the file goes through pv_io.c, which keeps reads ahead
+     and writes behind in flight while we encrypt */
+  struct pv_io *rin = NULL, *wout = NULL;
+  if (!done && (!(rin = pv_io_open(fin, 0, bufsize))
+		|| !(wout = pv_io_open(fctxt, 1, outcap)))) {
+    fprintf(stderr, "encrypt_file: Cannot allocate memory\n");
+    numread = -1;
+    done = 1;
   }
-  hmac_sha1_final(sk_hmac, sk_len, &hmac_s, (u_char*)bufin);
-  if (write_chunk(fctxt, bufin, 20) != 0) {
-    fprintf(stderr,"encrypt_file: error writing HMAC 20 bytes to %s\n", ctxt_fname);
-    close(fctxt); unlink(ctxt_fname);
-    free(bufin);
-    return;
+  while (!done) {
+    if ((numread = pv_io_read(rin, bufin, bufsize)) == -1) {
+      fprintf(stderr,"encrypt_file: error reading ptxt file\n");
+      break;
+    }
+    const char *p = bufin;
+    size_t n = numread;
+    if (opts->compress) {
+      struct pv_stamp t;
+      pv_stats_begin(&t);
+      n = pv_lz_frames(lz, bufz, bufin, numread);
+      pv_stats_end(PV_PH_LZ, &t);
+      p = bufz;
+    }
+    if ((r = pv_encrypt_update(&ctx, p, n, bufout, outcap, &len))
+	!= PV_OK) {
+      fprintf(stderr, "encrypt_file: %s\n", pv_strerror(r));
+      numread = -1;
+      break;
+    }
+    PV_PROBE2(encrypt_chunk, numread, len);
+    if (pv_io_write(wout, bufout, len) != 0) {
+      fprintf(stderr,"encrypt_file: error writing to %s\n", ctxt_fname);
+      numread = -1;
+      break;
+    }
+    if ((size_t) numread < bufsize) { /* short read_chunk means EOF */
+      numread = 0;
+      break;
+    }
   }
-  /* printf("wrote %d\n",20); */
-  putint(bufin, numpad0); 	/* cross-platform stability */
-  /* printf("numpad0: %u\n",numpad0); */
-  if (write_chunk(fctxt, bufin, 4) != 0) {
-    fprintf(stderr,"encrypt_file: error writing last 4 bytes to %s\n", ctxt_fname);
-    close(fctxt); unlink(ctxt_fname);
-    free(bufin);
-    return;
+  if (!done && numread == 0) {	/* the final block and the trailer */
+    if ((r = pv_encrypt_final(&ctx, bufout, outcap, &len)) != PV_OK) {
+      fprintf(stderr, "encrypt_file: %s\n", pv_strerror(r));
+      numread = -1;
+    }
+    else if (pv_io_write(wout, bufout, len) != 0) {
+      fprintf(stderr,"encrypt_file: error writing to %s\n", ctxt_fname);
+      numread = -1;
+    }
   }
-  /* printf("wrote %d\n",4); */
-  
+  pv_io_close(rin);
+  if (pv_io_close(wout) != 0 && numread == 0) { /* finishes the writes */
+    fprintf(stderr,"encrypt_file: error writing to %s\n", ctxt_fname);
+    numread = -1;
+  }
+
+  pv_encrypt_clr(&ctx);
+  pv_free(bufin, bufsize);
+  pv_free(bufout, outcap);
+  pv_free(bufz, zcap);
+  pv_free(lz, sizeof(*lz));	/* its table says something of the ptxt */
   close(fctxt);
-  free(bufin);
+  PV_PROBE1(encrypt_done, numread == 0 ? 0 : -1);
+  if (numread != 0) {
+    pv_remove_out(ctxt_fname);
+    return -1;
+  }
+  return 0;
+}
+
+/* --batch: the key and options shared by every file */
+struct batch_arg {
+  void *raw_sk;
+  size_t raw_len;
+  const struct pv_opts *opts;
+};
+
+static int
+batch_one (const char *ptxt, const char *ctxt, void *arg)
+{
+  struct batch_arg *a = (struct batch_arg *) arg;
+  int fdptxt, r;
+
+  if ((fdptxt = open (ptxt, O_RDONLY)) == -1) {
+    fprintf (stderr, "%s: %s: %s\n", getprogname (), ptxt, strerror (errno));
+    return -1;
+  }
+  r = encrypt_file (ctxt, a->raw_sk, a->raw_len, fdptxt, a->opts);
+  close (fdptxt);
+  return r;
+}
+
+/* --batch in a cbc mode: CBC encryption of one file is a chain, each
+ * block waiting for the one before it, which leaves most of the AES
+ * unit idle.  So each thread keeps opts->lanes files open, reads a
+ * chunk of each, encrypts all of them together (pv_cbc_encrypt_lanes,
+ * a block of each per trip through the rounds) in place, then MACs and
+ * writes each.  As soon as a file ends, its lane takes the next one
+ * from the batch.  The ciphertexts are just what encrypt_file would
+ * have written, and every file still gets its own context (IV, HMAC,
+ * header) from libpv; only the CBC step is done here, as for --mmap
+ * and --pipeline.
+ */
+
+struct lane {
+  const char *in, *out;		/* NULL: the lane is free */
+  int fin, fout;
+  struct pv_encrypt_ctx ctx;
+  struct pv_io *rin, *wout;
+  char *buf;			/* a chunk, encrypted in place */
+  ssize_t n;			/* bytes in it */
+};
+
+/* finishes L (the ragged tail in L->buf[whole..n], the padding and the
+   MAC, if r is still 0), reports it, and frees the lane */
+static void
+lane_finish (struct pv_batch_worker *w, struct lane *L, const char *tail,
+	     size_t ntail, int r)
+{
+  char out[PV_FINAL_MAX];
+  size_t len;
+  int e;
+
+  if (r == 0
+      && ((e = pv_encrypt_update(&L->ctx, tail, ntail, out, sizeof(out), &len))
+	  != PV_OK
+	  || (e = pv_encrypt_final(&L->ctx, out, sizeof(out), &len)) != PV_OK)) {
+    fprintf(stderr, "encrypt_file: %s\n", pv_strerror(e));
+    r = -1;
+  }
+  if (r == 0 && pv_io_write(L->wout, out, len) != 0) {
+    fprintf(stderr,"encrypt_file: error writing to %s\n", L->out);
+    r = -1;
+  }
+  pv_io_close(L->rin);
+  if (pv_io_close(L->wout) != 0 && r == 0) { /* finishes the writes */
+    fprintf(stderr,"encrypt_file: error writing to %s\n", L->out);
+    r = -1;
+  }
+  pv_encrypt_clr(&L->ctx);
+  close(L->fin);
+  close(L->fout);
+  if (r != 0)
+    pv_remove_out(L->out);
+  PV_PROBE1(encrypt_done, r);
+  pv_batch_done(w, L->in, L->out, r);
+  L->in = L->out = NULL;
+  L->rin = L->wout = NULL;
+}
+
+/* starts encrypting in to out in L: the files opened, the context set
+   up and the header and IV on their way.  Returns 0, or -1 (after
+   complaining and reporting the file) if L is still free. */
+static int
+lane_start (struct pv_batch_worker *w, struct lane *L, const char *in,
+	    const char *out, const struct batch_arg *a)
+{
+  const struct pv_opts *opts = a->opts;
+  char head[PV_UPDATE_MAX(0)];
+  struct stat st;
+  size_t len;
+  int r;
+
+  L->in = in;
+  L->out = out;
+  if ((L->fin = open(in, O_RDONLY)) == -1) {
+    fprintf(stderr, "%s: %s: %s\n", getprogname(), in, strerror(errno));
+    pv_batch_done(w, in, out, -1);
+    L->in = L->out = NULL;
+    return -1;
+  }
+  if ((L->fout = pv_open_out(out, O_WRONLY | O_TRUNC | O_CREAT, 0644)) == -1) {
+    perror("encrypt_file: error opening ctxt file");
+    close(L->fin);
+    pv_batch_done(w, in, out, -1);
+    L->in = L->out = NULL;
+    return -1;
+  }
+  PV_PROBE2(encrypt_start, opts->mode, opts->bufsize);
+  if ((r = pv_encrypt_init(&L->ctx, a->raw_sk, a->raw_len, opts->mode))
+      != PV_OK) {
+    fprintf(stderr, "encrypt_file: %s\n", pv_strerror(r));
+    lane_finish(w, L, NULL, 0, -1);
+    return -1;
+  }
+  if (fstat(L->fin, &st) == 0 && S_ISREG(st.st_mode)
+      && pv_prealloc(L->fout, pv_encrypt_length(opts->mode, st.st_size))
+      != 0) {
+    perror("encrypt_file: cannot reserve space for ctxt file");
+    lane_finish(w, L, NULL, 0, -1);
+    return -1;
+  }
+  if (!(L->rin = pv_io_open(L->fin, 0, opts->bufsize))
+      || !(L->wout = pv_io_open(L->fout, 1, opts->bufsize))) {
+    fprintf(stderr, "encrypt_file: Cannot allocate memory\n");
+    lane_finish(w, L, NULL, 0, -1);
+    return -1;
+  }
+  pv_encrypt_update(&L->ctx, NULL, 0, head, sizeof(head), &len);
+  if (pv_io_write(L->wout, head, len) != 0) {
+    fprintf(stderr,"encrypt_file: error writing to %s\n", out);
+    lane_finish(w, L, NULL, 0, -1);
+    return -1;
+  }
+  return 0;
+}
+
+/* a batch worker's loop (see pv_batch.c) */
+static void
+encrypt_lanes (struct pv_batch_worker *w, void *arg)
+{
+  const struct batch_arg *a = (const struct batch_arg *) arg;
+  const size_t bufsize = a->opts->bufsize; /* multiple of BLOCK_LEN */
+  const int nlanes = a->opts->lanes;
+  struct lane *lanes;
+  struct pv_cbc_lane *job;	/* one per lane; len 0 if it's free */
+  struct pv_aes_ctx aes;	/* every lane's key is this one */
+  const char *in, *out;
+  struct pv_stamp t;
+  struct lane *L;
+  int i, m, queued = 1, ok = 1;
+
+  lanes = (struct lane*)pv_alloc(nlanes * sizeof(struct lane));
+  job = (struct pv_cbc_lane*)malloc(nlanes * sizeof(struct pv_cbc_lane));
+  if (!lanes || !job)
+    ok = 0;
+  else
+    bzero(lanes, nlanes * sizeof(struct lane));
+  for (i = 0; ok && i < nlanes; i++)
+    if (!(lanes[i].buf = (char*)pv_alloc(bufsize)))
+      ok = 0;
+  if (!ok) {
+    fprintf(stderr, "encrypt_file: Cannot allocate memory\n");
+    while (pv_batch_next(w, &in, &out) == 0)
+      pv_batch_done(w, in, out, -1);
+  }
+  pv_aes_setkey(&aes, a->raw_sk, a->raw_len / 2);
+
+  while (ok) {
+    /* a file in every free lane, while there are any left */
+    for (i = 0; queued && i < nlanes; i++)
+      while (!lanes[i].in && queued) {
+	if (pv_batch_next(w, &in, &out) != 0)
+	  queued = 0;
+	else
+	  lane_start(w, &lanes[i], in, out, a);
+      }
+
+    /* a chunk of each, encrypted all together */
+    for (m = i = 0; i < nlanes; i++) {
+      L = &lanes[i];
+      job[i].out = L->buf;
+      job[i].in = L->buf;
+      job[i].len = 0;
+      job[i].iv = L->ctx.iv;
+      if (!L->in)
+	continue;
+      if ((L->n = pv_io_read(L->rin, L->buf, bufsize)) == -1) {
+	fprintf(stderr,"encrypt_file: error reading ptxt file\n");
+	lane_finish(w, L, NULL, 0, -1);
+	continue;
+      }
+      job[i].len = L->n / BLOCK_LEN * BLOCK_LEN;
+      m++;
+    }
+    if (!m && !queued)
+      break;
+    if (!m)
+      continue;			/* (they all failed to read) */
+    pv_stats_begin(&t);
+    pv_cbc_encrypt_lanes(&aes, job, nlanes);
+    pv_stats_end(PV_PH_CIPHER, &t);
+
+    /* then the MAC and the write, and the end of any file that ended */
+    for (i = 0; i < nlanes; i++) {
+      L = &lanes[i];
+      if (!L->in)
+	continue;
+      pv_stats_begin(&t);
+      pv_hmac_update(&L->ctx.mac, L->buf, job[i].len);
+      pv_stats_end(PV_PH_MAC, &t);
+      PV_PROBE2(encrypt_chunk, L->n, job[i].len);
+      if (pv_io_write(L->wout, L->buf, job[i].len) != 0) {
+	fprintf(stderr,"encrypt_file: error writing to %s\n", L->out);
+	lane_finish(w, L, NULL, 0, -1);
+      }
+      else if ((size_t) L->n < bufsize) /* short read means EOF */
+	lane_finish(w, L, L->buf + job[i].len, L->n - job[i].len, 0);
+    }
+  }
+
+  pv_aes_clrkey(&aes);
+  for (i = 0; lanes && i < nlanes; i++)
+    pv_free(lanes[i].buf, bufsize);
+  pv_free(lanes, lanes ? nlanes * sizeof(struct lane) : 0);
+  free(job);
 }
 
 void 
 usage (const char *pname)
 {
   printf ("Personal Vault: Encryption \n");
-  printf ("Usage: %s SK-FILE PTEXT-FILE CTEXT-FILE\n", pname);
+  printf ("Usage: %s [--bufsize N] [--mode cbc|cbc-sha256|gcm|seg] [--pipeline] [--mmap]\n"
+	  "          [--compress] [-j N] [--nocache | --direct] [--stats]\n"
+	  "          [--max-rate N] [--max-iops N] [--rate-file F] [--nice N]\n"
+	  "          [--ioprio C[:N]]\n"
+	  "          SK-FILE PTEXT-FILE CTEXT-FILE\n", pname);
+  printf ("       %s [options] [-j N] [--lanes N] [--suffix S] --batch MANIFEST SK-FILE\n",
+	  pname);
   printf ("       Exits if either SK-FILE or PTEXT-FILE don't exist.\n");
   printf ("       Otherwise, encrpyts the content of PTEXT-FILE under\n");
   printf ("       sk, and place the resulting ciphertext in CTEXT-FILE.\n");
   printf ("       If CTEXT-FILE existed, any previous content is lost.\n");
+  printf ("       PTEXT-FILE or CTEXT-FILE may be - for stdin or stdout.\n");
+  printf ("       --bufsize N  read and write N bytes at a time\n");
+  printf ("                    (suffix K, M or G; default 1M)\n");
+  printf ("       --mode M     cbc: CBC-AES then HMAC-SHA1 (default)\n");
+  printf ("                    cbc-sha256: the same with HMAC-SHA256\n");
+  printf ("                    gcm: AES-GCM, one pass, no padding\n");
+  printf ("                    seg: segments of --bufsize bytes, each with\n");
+  printf ("                         its own HMAC-SHA256, so that pv_decrypt\n");
+  printf ("                         never writes unverified ptxt\n");
+  printf ("       --pipeline   cbc modes: read, encrypt, MAC and write\n");
+  printf ("                    on separate threads\n");
+  printf ("       --mmap       cbc modes: map PTEXT-FILE and CTEXT-FILE\n");
+  printf ("                    rather than read and write them\n");
+  printf ("       --batch M    encrypt every PTEXT-FILE CTEXT-FILE pair listed\n");
+  printf ("                    in file M, one per line; or, if M is a\n");
+  printf ("                    directory, each file F in it to F.pv\n");
+  printf ("                    Prints ok or FAILED for each.\n");
+  printf ("       -j N         with --batch, run N threads; with --mode seg,\n");
+  printf ("                    encrypt N segments at a time\n");
+  printf ("       --lanes N    with --batch in a cbc mode, keep N files\n");
+  printf ("                    going in each thread, their CBC chains\n");
+  printf ("                    interleaved (default 8; 1 for one at a time)\n");
+  printf ("       --suffix S   with --batch DIR, use S instead of .pv\n");
+  printf ("       --compress   LZ-compress the ptxt before encrypting it;\n");
+  printf ("                    pv_decrypt undoes it.  Makes the default\n");
+  printf ("                    mode cbc-sha256 (classic cbc has no header to\n");
+  printf ("                    record it in); not for seg.  Leaves out\n");
+  printf ("                    --mmap and --pipeline.\n");
+  printf ("       --nocache    keep the files out of the page cache: drop\n");
+  printf ("                    each chunk once read or written, and reserve\n");
+  printf ("                    CTEXT-FILE's space up front\n");
+  printf ("       --direct     --nocache, and O_DIRECT where the file system\n");
+  printf ("                    takes it\n");
+  printf ("       --max-rate N read and write at most N bytes a second\n");
+  printf ("                    (suffix K, M or G), all threads together\n");
+  printf ("       --max-iops N make at most N read or write requests a second\n");
+  printf ("       --rate-file F  take max-rate N and max-iops N lines from F,\n");
+  printf ("                    and again whenever F changes or on SIGHUP\n");
+  printf ("       --nice N     run at CPU priority N (see nice(1))\n");
+  printf ("       --ioprio C   I/O priority class idle, be[:0-7] or rt[:0-7]\n");
+  printf ("                    (see ionice(1))\n");
+  printf ("       --stats      print where the time went, as a line of JSON\n");
+  printf ("                    on stderr (or set PV_STATS=1, or PV_STATS=FILE\n");
+  printf ("                    to append it to FILE)\n");
 
   exit (1);
 }
@@ -186,18 +1082,71 @@ usage (const char *pname)
 int 
 main (int argc, char **argv)
 {
-  int fdsk, fdptxt;
+  int fdsk, fdptxt = -1;
   char *raw_sk;
   size_t raw_len;
+  struct pv_opts opts, bopts;
+  const char *batch = NULL, *suffix = PV_BATCH_SUFFIX;
+  struct batch_arg ba;
+  struct pv_stamp t;
+  long failed = 0;
+  int argi, stats = 0, mode_set = 0;
 
-  /* YOUR CODE HERE */
-
+  pv_opts_init (&opts);
+  for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+    if (!strcmp (argv[argi], "--bufsize") && argi + 1 < argc) {
+      if (!(opts.bufsize = parse_bufsize (argv[++argi])))
+	usage (argv[0]);
+    }
+    else if (!strcmp (argv[argi], "--pipeline"))
+      opts.pipeline = 1;
+    else if (!strcmp (argv[argi], "--mmap"))
+      opts.use_mmap = 1;
+    else if (!strcmp (argv[argi], "--nocache"))
+      pv_iopolicy |= PV_IOP_NOCACHE;
+    else if (!strcmp (argv[argi], "--direct"))
+      pv_iopolicy |= PV_IOP_NOCACHE | PV_IOP_DIRECT;
+    else if (!strcmp (argv[argi], "--stats"))
+      stats = 1;
+    else if (!strcmp (argv[argi], "--mode") && argi + 1 < argc) {
+      if ((opts.mode = parse_mode (argv[++argi])) == -1)
+	usage (argv[0]);
+      mode_set = 1;
+    }
+    else if (!strcmp (argv[argi], "--compress"))
+      opts.compress = 1;
+    else if (!strcmp (argv[argi], "--batch") && argi + 1 < argc)
+      batch = argv[++argi];
+    else if (!strcmp (argv[argi], "--suffix") && argi + 1 < argc)
+      suffix = argv[++argi];
+    else if (!strcmp (argv[argi], "-j") && argi + 1 < argc) {
+      if ((opts.jobs = atoi (argv[++argi])) < 1)
+	usage (argv[0]);
+    }
+    else if (!strcmp (argv[argi], "--lanes") && argi + 1 < argc) {
+      if ((opts.lanes = atoi (argv[++argi])) < 1)
+	usage (argv[0]);
+    }
+    else if (pv_qos_arg (argc, argv, &argi) != 1)
+      usage (argv[0]);
+  }
+  pv_stats_init (stats);
+  if (pv_qos_start (argv[0]) != 0)
+    exit (1);
+  /* the flag saying so goes in the header, which classic cbc hasn't
+     got; seg segments are addressed by ptxt offset */
+  if (opts.compress && !mode_set)
+    opts.mode = PV_MODE_CBC_SHA256;
+  if (opts.compress && (opts.mode == PV_MODE_CBC || opts.mode == PV_MODE_SEG)) {
+    fprintf (stderr, "%s: --compress needs --mode cbc-sha256 or gcm\n", argv[0]);
+    exit (1);
+  }
 
-  if (argc != 4) {
+  if (argc - argi != (batch ? 1 : 3)) {
     usage (argv[0]);
-  }   /* Check if argv[1] and argv[2] are existing files */
-  else if (((fdsk = open (argv[1], O_RDONLY)) == -1)
-	   || ((fdptxt = open (argv[2], O_RDONLY)) == -1)) { /* WRONLY? Prompt for overrite? */
+  }   /* Check if SK-FILE and PTEXT-FILE are existing files */
+  else if (((fdsk = open (argv[argi], O_RDONLY)) == -1)
+	   || (!batch && (fdptxt = pv_open_in (argv[argi+1])) == -1)) { /* WRONLY? Prompt for overrite? */
     if (errno == ENOENT) {
       usage (argv[0]);
     }
@@ -208,25 +1157,62 @@ main (int argc, char **argv)
   }
   else {
     setprogname (argv[0]);
+
+    /* make sure the AES backend picked for this CPU gives the right answers */
+    pv_stats_begin (&t);
+    if (pv_kern_selftest () != 0 || pv_aes_selftest () != 0
+	|| (opts.mode == PV_MODE_GCM ? pv_gcm_selftest () : pv_hmac_selftest ()) != 0)
+      exit (-1);
+    pv_stats_end (PV_PH_SELFTEST, &t);
     
-    /* Import symmetric key from argv[1] */
+    /* Import symmetric key from SK-FILE */
+    pv_stats_begin (&t);
     if (!(import_sk_from_file (&raw_sk, &raw_len, fdsk))) { /* SETS raw_sk, raw_len */
-      printf ("%s: no symmetric key found in %s\n", argv[0], argv[1]);
+      fprintf (stderr, "%s: no symmetric key found in %s\n", argv[0], argv[argi]);
       close (fdsk);
       exit (2);
     }
     close (fdsk);
+    pv_stats_end (PV_PH_KEY, &t);
+
+    /* initialize the pseudorandom generator (for the IVs) */
+    pv_stats_begin (&t);
+    ri ();
+    pv_stats_end (PV_PH_SEED, &t);
 
     /* Enough setting up---let's get to the crypto... */
     /* printf("raw_len: %zu\n",raw_len); */
-    encrypt_file (argv[3], raw_sk, raw_len, fdptxt);    
+    if (batch) {		/* all of the above once, for every file */
+      ba.raw_sk = raw_sk;
+      ba.raw_len = raw_len;
+      bopts = opts;
+      bopts.jobs = 1;		/* the threads take a file each instead */
+      ba.opts = &bopts;
+      if (opts.lanes > 1 && !opts.compress && !opts.use_mmap && !opts.pipeline
+	  && (opts.mode == PV_MODE_CBC || opts.mode == PV_MODE_CBC_SHA256))
+	failed = pv_batch_run_loop (batch, suffix, 0, opts.jobs, encrypt_lanes,
+				    &ba);
+      else
+	failed = pv_batch_run (batch, suffix, 0, opts.jobs, batch_one, &ba);
+      if (failed > 0)
+	fprintf (stderr, "%s: %ld files failed\n", argv[0], failed);
+    }
+    else {
+      /* "-" for either file means a pipe, more often than not; make
+	 its buffer big enough for a chunk at a time */
+      pv_pipe_grow (fdptxt, opts.bufsize);
+      if (!strcmp (argv[argi+2], PV_STDIO))
+	pv_pipe_grow (STDOUT_FILENO, opts.bufsize);
+      failed = encrypt_file (argv[argi+2], raw_sk, raw_len, fdptxt, &opts) != 0;
+    }
 
     /* scrub the buffer that's holding the key before exiting */
-    bzero(raw_sk, raw_len);
-    free(raw_sk);
+    pv_free(raw_sk, raw_len);
 
-    close (fdptxt);
+    if (fdptxt != -1)
+      close (fdptxt);
   }
 
-  return 0;
+  pv_stats_report ("pv_encrypt", failed ? 1 : 0);
+  return failed ? 1 : 0;
 }
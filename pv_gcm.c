@@ -0,0 +1,528 @@
+#include "pv.h"
+
+/* AES-GCM (NIST SP 800-38D) with 96-bit nonces, for the PV_MODE_GCM
+ * format.  Counter-mode encryption and GHASH are run over the same
+ * stretch of data while it is still in cache, so a chunk goes through
+ * the CPU once.  GHASH uses PCLMULQDQ carry-less multiplication when
+ * cpuid reports it (PV_GHASH=generic in the environment forces the
+ * portable code), and otherwise Shoup's 4-bit tables.
+ */
+
+/* bytes of CTR output fed to GHASH at a time; small enough to stay in L1 */
+#define GCM_STRIDE (16 * 1024)
+
+static u_int64_t
+load_be64 (const u_char *p)
+{
+  return ((u_int64_t) p[0] << 56) | ((u_int64_t) p[1] << 48)
+    | ((u_int64_t) p[2] << 40) | ((u_int64_t) p[3] << 32)
+    | ((u_int64_t) p[4] << 24) | ((u_int64_t) p[5] << 16)
+    | ((u_int64_t) p[6] << 8) | (u_int64_t) p[7];
+}
+
+static void
+store_be64 (u_char *p, u_int64_t v)
+{
+  int i;
+
+  for (i = 7; i >= 0; i--, v >>= 8)
+    p[i] = (u_char) v;
+}
+
+/*
+ * portable GHASH: 4-bit tables
+ */
+
+static const u_int16_t last4[16] = {
+  0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+  0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static void
+ghash_table_init (struct pv_gcm_ctx *g)
+{
+  u_int64_t vh, vl;
+  u_int32_t t;
+  int i, j;
+
+  vh = load_be64 (g->h);
+  vl = load_be64 (g->h + 8);
+  g->hl[8] = vl;
+  g->hh[8] = vh;
+  g->hl[0] = g->hh[0] = 0;
+  for (i = 4; i > 0; i >>= 1) {
+    t = (u_int32_t) (vl & 1) * 0xe1000000U;
+    vl = (vh << 63) | (vl >> 1);
+    vh = (vh >> 1) ^ ((u_int64_t) t << 32);
+    g->hl[i] = vl;
+    g->hh[i] = vh;
+  }
+  for (i = 2; i <= 8; i *= 2)
+    for (j = 1; j < i; j++) {
+      g->hh[i+j] = g->hh[i] ^ g->hh[j];
+      g->hl[i+j] = g->hl[i] ^ g->hl[j];
+    }
+}
+
+/* x := x * H */
+static void
+ghash_table_mult (const struct pv_gcm_ctx *g, u_char *x)
+{
+  u_int64_t zh, zl;
+  u_char lo, hi, rem;
+  int i;
+
+  lo = x[15] & 0xf;
+  zh = g->hh[lo];
+  zl = g->hl[lo];
+  for (i = 15; i >= 0; i--) {
+    lo = x[i] & 0xf;
+    hi = (x[i] >> 4) & 0xf;
+    if (i != 15) {
+      rem = (u_char) (zl & 0xf);
+      zl = (zh << 60) | (zl >> 4);
+      zh = (zh >> 4) ^ ((u_int64_t) last4[rem] << 48);
+      zh ^= g->hh[lo];
+      zl ^= g->hl[lo];
+    }
+    rem = (u_char) (zl & 0xf);
+    zl = (zh << 60) | (zl >> 4);
+    zh = (zh >> 4) ^ ((u_int64_t) last4[rem] << 48);
+    zh ^= g->hh[hi];
+    zl ^= g->hl[hi];
+  }
+  store_be64 (x, zh);
+  store_be64 (x + 8, zl);
+}
+
+static void
+ghash_generic (struct pv_gcm_ctx *g, const u_char *p, size_t nblocks)
+{
+  for (; nblocks--; p += BLOCK_LEN) {
+    xor_buffers (g->x, g->x, p, BLOCK_LEN);
+    ghash_table_mult (g, g->x);
+  }
+}
+
+/*
+ * PCLMULQDQ GHASH, after Intel's carry-less multiplication white paper
+ * (Gueron & Kounavis).  Blocks are byte-reversed on load so that the
+ * 128-bit lanes hold GCM's bit-reflected polynomials; four blocks are
+ * multiplied by H^4..H^1 and summed before a single reduction.
+ */
+
+#ifdef PV_HAVE_AESNI
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+
+#define CLMUL __attribute__ ((target ("pclmul,ssse3,sse2")))
+
+static int
+have_pclmul (void)
+{
+  unsigned int a, b, c, d;
+
+  if (!__get_cpuid (1, &a, &b, &c, &d))
+    return 0;
+  return (c & bit_PCLMUL) && (c & bit_SSSE3);
+}
+
+static CLMUL __m128i
+bswap128 (__m128i v)
+{
+  return _mm_shuffle_epi8 (v, _mm_set_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+					    10, 11, 12, 13, 14, 15));
+}
+
+/* 256-bit carry-less product a*b, accumulated into (*lo, *hi) */
+static CLMUL void
+clmul_acc (__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+  __m128i t0, t1, t2, t3;
+
+  t0 = _mm_clmulepi64_si128 (a, b, 0x00);
+  t1 = _mm_clmulepi64_si128 (a, b, 0x10);
+  t2 = _mm_clmulepi64_si128 (a, b, 0x01);
+  t3 = _mm_clmulepi64_si128 (a, b, 0x11);
+  t1 = _mm_xor_si128 (t1, t2);
+  *lo = _mm_xor_si128 (*lo, _mm_xor_si128 (t0, _mm_slli_si128 (t1, 8)));
+  *hi = _mm_xor_si128 (*hi, _mm_xor_si128 (t3, _mm_srli_si128 (t1, 8)));
+}
+
+/* shift the 256-bit product left by one (bit reflection), then reduce
+   modulo x^128 + x^7 + x^2 + x + 1 */
+static CLMUL __m128i
+clmul_reduce (__m128i lo, __m128i hi)
+{
+  __m128i t7, t8, t9, t2, t4, t5;
+
+  t7 = _mm_srli_epi32 (lo, 31);
+  t8 = _mm_srli_epi32 (hi, 31);
+  lo = _mm_slli_epi32 (lo, 1);
+  hi = _mm_slli_epi32 (hi, 1);
+  t9 = _mm_srli_si128 (t7, 12);
+  t8 = _mm_slli_si128 (t8, 4);
+  t7 = _mm_slli_si128 (t7, 4);
+  lo = _mm_or_si128 (lo, t7);
+  hi = _mm_or_si128 (hi, t8);
+  hi = _mm_or_si128 (hi, t9);
+
+  t7 = _mm_slli_epi32 (lo, 31);
+  t8 = _mm_slli_epi32 (lo, 30);
+  t9 = _mm_slli_epi32 (lo, 25);
+  t7 = _mm_xor_si128 (t7, t8);
+  t7 = _mm_xor_si128 (t7, t9);
+  t8 = _mm_srli_si128 (t7, 4);
+  t7 = _mm_slli_si128 (t7, 12);
+  lo = _mm_xor_si128 (lo, t7);
+  t2 = _mm_srli_epi32 (lo, 1);
+  t4 = _mm_srli_epi32 (lo, 2);
+  t5 = _mm_srli_epi32 (lo, 7);
+  t2 = _mm_xor_si128 (t2, t4);
+  t2 = _mm_xor_si128 (t2, t5);
+  t2 = _mm_xor_si128 (t2, t8);
+  lo = _mm_xor_si128 (lo, t2);
+  return _mm_xor_si128 (hi, lo);
+}
+
+static CLMUL __m128i
+clmul_mult (__m128i a, __m128i b)
+{
+  __m128i lo = _mm_setzero_si128 (), hi = _mm_setzero_si128 ();
+
+  clmul_acc (a, b, &lo, &hi);
+  return clmul_reduce (lo, hi);
+}
+
+#define HPOW(g, i) _mm_loadu_si128 ((const __m128i *) (g)->hpow[i])
+
+static CLMUL void
+ghash_clmul_init (struct pv_gcm_ctx *g)
+{
+  __m128i h, hn;
+  int i;
+
+  h = hn = bswap128 (_mm_loadu_si128 ((const __m128i *) g->h));
+  _mm_storeu_si128 ((__m128i *) g->hpow[0], h);
+  for (i = 1; i < 4; i++) {
+    hn = clmul_mult (hn, h);
+    _mm_storeu_si128 ((__m128i *) g->hpow[i], hn);	/* H^(i+1) */
+  }
+}
+
+static CLMUL void
+ghash_clmul (struct pv_gcm_ctx *g, const u_char *p, size_t nblocks)
+{
+  __m128i x, lo, hi, h1, h2, h3, h4;
+
+  x = bswap128 (_mm_loadu_si128 ((const __m128i *) g->x));
+  h1 = HPOW (g, 0);
+  h2 = HPOW (g, 1);
+  h3 = HPOW (g, 2);
+  h4 = HPOW (g, 3);
+  for (; nblocks >= 4; nblocks -= 4, p += 4 * BLOCK_LEN) {
+    lo = hi = _mm_setzero_si128 ();
+    clmul_acc (_mm_xor_si128 (x, bswap128 (_mm_loadu_si128 ((const __m128i *) p))),
+	       h4, &lo, &hi);
+    clmul_acc (bswap128 (_mm_loadu_si128 ((const __m128i *) p + 1)), h3, &lo, &hi);
+    clmul_acc (bswap128 (_mm_loadu_si128 ((const __m128i *) p + 2)), h2, &lo, &hi);
+    clmul_acc (bswap128 (_mm_loadu_si128 ((const __m128i *) p + 3)), h1, &lo, &hi);
+    x = clmul_reduce (lo, hi);
+  }
+  for (; nblocks--; p += BLOCK_LEN)
+    x = clmul_mult (_mm_xor_si128 (x, bswap128 (_mm_loadu_si128 ((const __m128i *) p))),
+		    h1);
+  _mm_storeu_si128 ((__m128i *) g->x, bswap128 (x));
+}
+#endif /* PV_HAVE_AESNI */
+
+/*
+ * GCM proper
+ */
+
+/* increment the big-endian 32-bit counter in the last word of ctr */
+static void
+inc32 (u_char *ctr)
+{
+  int i;
+
+  for (i = BLOCK_LEN - 1; i >= BLOCK_LEN - 4; i--)
+    if (++ctr[i])
+      break;
+}
+
+void
+pv_gcm_init (struct pv_gcm_ctx *g, const struct pv_aes_ctx *aes,
+	     const u_char *nonce)
+{
+  const char *force = getenv ("PV_GHASH");
+  u_char zero[BLOCK_LEN];
+
+  bzero (g, sizeof (*g));
+  g->aes = aes;
+  bzero (zero, sizeof (zero));
+  pv_aes_encrypt (aes, g->h, zero);	/* H := AES(0^128) */
+  memcpy (g->j0, nonce, PV_GCM_NONCE_LEN);
+  g->j0[BLOCK_LEN - 1] = 1;		/* J0 := nonce || 0^31 || 1 */
+  memcpy (g->ctr, g->j0, BLOCK_LEN);
+  inc32 (g->ctr);
+
+#ifdef PV_HAVE_AESNI
+  if (!(force && !strcmp (force, "generic")) && have_pclmul ()) {
+    ghash_clmul_init (g);
+    g->ghash = ghash_clmul;
+    return;
+  }
+#else
+  (void) force;
+#endif /* PV_HAVE_AESNI */
+  ghash_table_init (g);
+  g->ghash = ghash_generic;
+}
+
+/* authenticate len bytes of additional data; at most once, before any
+   pv_gcm_encrypt or pv_gcm_decrypt */
+void
+pv_gcm_aad (struct pv_gcm_ctx *g, const void *aad, size_t len)
+{
+  u_char last[BLOCK_LEN];
+  size_t full = len - len % BLOCK_LEN;
+
+  assert (g->alen == 0 && g->clen == 0);
+  g->ghash (g, (const u_char *) aad, full / BLOCK_LEN);
+  if (len > full) {
+    bzero (last, sizeof (last));
+    memcpy (last, (const u_char *) aad + full, len - full);
+    g->ghash (g, last, 1);
+  }
+  g->alen = len;
+}
+
+/* counter-mode part common to both directions: out := in ^ keystream;
+   ctxt is whichever of in/out is the ciphertext, and gets hashed */
+static int
+gcm_crypt (struct pv_gcm_ctx *g, char *out, const char *in, size_t len,
+	   int decrypting)
+{
+  u_char last[BLOCK_LEN];
+  size_t off, n, full = len - len % BLOCK_LEN;
+
+  assert (!g->partial);		/* only the final call may be ragged */
+  if (len > PV_GCM_MAX_LEN - g->clen)
+    return -1;			/* 32-bit block counter would wrap */
+
+  for (off = 0; off < full; off += n) {
+    n = (full - off < GCM_STRIDE) ? full - off : GCM_STRIDE;
+    if (decrypting)
+      g->ghash (g, (const u_char *) in + off, n / BLOCK_LEN);
+    pv_ctr32_encrypt (g->aes, out + off, in + off, n / BLOCK_LEN, g->ctr);
+    if (!decrypting)
+      g->ghash (g, (const u_char *) out + off, n / BLOCK_LEN);
+  }
+  if (len > full) {
+    bzero (last, sizeof (last));
+    memcpy (last, in + full, len - full);
+    if (decrypting)
+      g->ghash (g, last, 1);
+    pv_ctr32_encrypt (g->aes, (char *) last, (char *) last, 1, g->ctr);
+    memcpy (out + full, last, len - full);
+    if (!decrypting) {
+      bzero (last + (len - full), BLOCK_LEN - (len - full));
+      g->ghash (g, last, 1);
+    }
+    g->partial = 1;
+  }
+  g->clen += len;
+
+  return 0;
+}
+
+/* Encrypt len bytes; out may equal in.  Every call but the last must
+   pass a multiple of BLOCK_LEN.  Returns -1 once the message would
+   exceed PV_GCM_MAX_LEN. */
+int
+pv_gcm_encrypt (struct pv_gcm_ctx *g, char *out, const char *in, size_t len)
+{
+  return gcm_crypt (g, out, in, len, 0);
+}
+
+int
+pv_gcm_decrypt (struct pv_gcm_ctx *g, char *out, const char *in, size_t len)
+{
+  return gcm_crypt (g, out, in, len, 1);
+}
+
+/* Only GHASH len bytes of ciphertext, as pv_gcm_decrypt would, with
+   no keystream: enough to check the tag (pv_decrypt --verify).  The
+   same rules for len apply. */
+int
+pv_gcm_hash (struct pv_gcm_ctx *g, const char *in, size_t len)
+{
+  u_char last[BLOCK_LEN];
+  size_t full = len - len % BLOCK_LEN;
+
+  assert (!g->partial);
+  if (len > PV_GCM_MAX_LEN - g->clen)
+    return -1;
+  g->ghash (g, (const u_char *) in, full / BLOCK_LEN);
+  if (len > full) {
+    bzero (last, sizeof (last));
+    memcpy (last, in + full, len - full);
+    g->ghash (g, last, 1);
+    g->partial = 1;
+  }
+  g->clen += len;
+  return 0;
+}
+
+void
+pv_gcm_final (struct pv_gcm_ctx *g, u_char *tag)
+{
+  u_char lens[BLOCK_LEN];
+
+  store_be64 (lens, (u_int64_t) g->alen * 8);
+  store_be64 (lens + 8, (u_int64_t) g->clen * 8);
+  g->ghash (g, lens, 1);
+  pv_aes_encrypt (g->aes, tag, g->j0);
+  xor_buffers (tag, tag, g->x, PV_GCM_TAG_LEN);
+  pv_scrub (g, sizeof (*g));
+}
+
+/* known answers from the GCM spec (McGrew & Viega), test cases 2, 4
+   and 16, plus a check that the table and PCLMULQDQ GHASH agree.
+   Returns 0 on success, -1 otherwise. */
+int
+pv_gcm_selftest (void)
+{
+  static const u_char k4[32] = {
+    0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c,
+    0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08,
+    0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c,
+    0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08
+  };
+  static const u_char iv4[PV_GCM_NONCE_LEN] = {
+    0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad,
+    0xde, 0xca, 0xf8, 0x88
+  };
+  static const u_char pt4[60] = {
+    0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5,
+    0xa5, 0x59, 0x09, 0xc5, 0xaf, 0xf5, 0x26, 0x9a,
+    0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda,
+    0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72,
+    0x1c, 0x3c, 0x0c, 0x95, 0x95, 0x68, 0x09, 0x53,
+    0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+    0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57,
+    0xba, 0x63, 0x7b, 0x39
+  };
+  static const u_char aad4[20] = {
+    0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+    0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+    0xab, 0xad, 0xda, 0xd2
+  };
+  static const u_char ct4[60] = {
+    0x42, 0x83, 0x1e, 0xc2, 0x21, 0x77, 0x74, 0x24,
+    0x4b, 0x72, 0x21, 0xb7, 0x84, 0xd0, 0xd4, 0x9c,
+    0xe3, 0xaa, 0x21, 0x2f, 0x2c, 0x02, 0xa4, 0xe0,
+    0x35, 0xc1, 0x7e, 0x23, 0x29, 0xac, 0xa1, 0x2e,
+    0x21, 0xd5, 0x14, 0xb2, 0x54, 0x66, 0x93, 0x1c,
+    0x7d, 0x8f, 0x6a, 0x5a, 0xac, 0x84, 0xaa, 0x05,
+    0x1b, 0xa3, 0x0b, 0x39, 0x6a, 0x0a, 0xac, 0x97,
+    0x3d, 0x58, 0xe0, 0x91
+  };
+  static const u_char tag4[PV_GCM_TAG_LEN] = {
+    0x5b, 0xc9, 0x4f, 0xbc, 0x32, 0x21, 0xa5, 0xdb,
+    0x94, 0xfa, 0xe9, 0x5a, 0xe7, 0x12, 0x1a, 0x47
+  };
+  static const u_char ct16[60] = {
+    0x52, 0x2d, 0xc1, 0xf0, 0x99, 0x56, 0x7d, 0x07,
+    0xf4, 0x7f, 0x37, 0xa3, 0x2a, 0x84, 0x42, 0x7d,
+    0x64, 0x3a, 0x8c, 0xdc, 0xbf, 0xe5, 0xc0, 0xc9,
+    0x75, 0x98, 0xa2, 0xbd, 0x25, 0x55, 0xd1, 0xaa,
+    0x8c, 0xb0, 0x8e, 0x48, 0x59, 0x0d, 0xbb, 0x3d,
+    0xa7, 0xb0, 0x8b, 0x10, 0x56, 0x82, 0x88, 0x38,
+    0xc5, 0xf6, 0x1e, 0x63, 0x93, 0xba, 0x7a, 0x0a,
+    0xbc, 0xc9, 0xf6, 0x62
+  };
+  static const u_char tag16[PV_GCM_TAG_LEN] = {
+    0x76, 0xfc, 0x6e, 0xce, 0x0f, 0x4e, 0x17, 0x68,
+    0xcd, 0xdf, 0x88, 0x53, 0xbb, 0x2d, 0x55, 0x1b
+  };
+  static const u_char tag2[PV_GCM_TAG_LEN] = {
+    0xab, 0x6e, 0x47, 0xd4, 0x2c, 0xec, 0x13, 0xbd,
+    0xf5, 0x3a, 0x67, 0xb2, 0x12, 0x57, 0xbd, 0xdf
+  };
+  static const u_char ct2[BLOCK_LEN] = {
+    0x03, 0x88, 0xda, 0xce, 0x60, 0xb6, 0xa3, 0x92,
+    0xf3, 0x28, 0xc2, 0xb9, 0x71, 0xb2, 0xfe, 0x78
+  };
+  struct pv_aes_ctx aes;
+  struct pv_gcm_ctx g;
+  u_char zero[32], buf[64], tag[PV_GCM_TAG_LEN];
+  int ret = 0;
+
+  bzero (zero, sizeof (zero));
+
+  /* test case 2: AES-128, all-zero key, nonce and one-block message */
+  pv_aes_setkey (&aes, zero, 16);
+  pv_gcm_init (&g, &aes, zero);
+  pv_gcm_encrypt (&g, (char *) buf, (char *) zero, BLOCK_LEN);
+  pv_gcm_final (&g, tag);
+  if (memcmp (buf, ct2, BLOCK_LEN) || memcmp (tag, tag2, PV_GCM_TAG_LEN))
+    ret = -1;
+
+  /* test case 4: AES-128 with additional data and a ragged last block;
+     fed in two calls to exercise the streaming interface */
+  pv_aes_setkey (&aes, k4, 16);
+  pv_gcm_init (&g, &aes, iv4);
+  pv_gcm_aad (&g, aad4, sizeof (aad4));
+  pv_gcm_encrypt (&g, (char *) buf, (char *) pt4, 32);
+  pv_gcm_encrypt (&g, (char *) buf + 32, (char *) pt4 + 32, 28);
+  pv_gcm_final (&g, tag);
+  if (memcmp (buf, ct4, sizeof (ct4)) || memcmp (tag, tag4, PV_GCM_TAG_LEN))
+    ret = -1;
+  pv_gcm_init (&g, &aes, iv4);
+  pv_gcm_aad (&g, aad4, sizeof (aad4));
+  pv_gcm_decrypt (&g, (char *) buf, (char *) ct4, sizeof (ct4));
+  pv_gcm_final (&g, tag);
+  if (memcmp (buf, pt4, sizeof (pt4)) || memcmp (tag, tag4, PV_GCM_TAG_LEN))
+    ret = -1;
+
+  /* test case 16: the same with AES-256 */
+  pv_aes_setkey (&aes, k4, 32);
+  pv_gcm_init (&g, &aes, iv4);
+  pv_gcm_aad (&g, aad4, sizeof (aad4));
+  pv_gcm_encrypt (&g, (char *) buf, (char *) pt4, sizeof (pt4));
+  pv_gcm_final (&g, tag);
+  if (memcmp (buf, ct16, sizeof (ct16)) || memcmp (tag, tag16, PV_GCM_TAG_LEN))
+    ret = -1;
+
+#ifdef PV_HAVE_AESNI
+  /* both GHASH implementations over a few aggregated batches */
+  if (have_pclmul ()) {
+    struct pv_gcm_ctx g2;
+    u_char msg[7 * BLOCK_LEN];
+    size_t i;
+
+    for (i = 0; i < sizeof (msg); i++)
+      msg[i] = (u_char) (i * 13 + 1);
+    pv_gcm_init (&g, &aes, iv4);
+    memcpy (&g2, &g, sizeof (g));
+    ghash_table_init (&g2);
+    g2.ghash = ghash_generic;
+    g.ghash (&g, msg, sizeof (msg) / BLOCK_LEN);
+    g2.ghash (&g2, msg, sizeof (msg) / BLOCK_LEN);
+    if (memcmp (g.x, g2.x, BLOCK_LEN))
+      ret = -1;
+    pv_scrub (&g2, sizeof (g2));
+  }
+#endif /* PV_HAVE_AESNI */
+
+  pv_scrub (&g, sizeof (g));
+  pv_aes_clrkey (&aes);
+  if (ret)
+    fprintf (stderr, "%s: AES-GCM self-test failed\n", getprogname ());
+
+  return ret;
+}
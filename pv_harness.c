@@ -0,0 +1,194 @@
+#include "pv.h"
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* What make check (pv_check.c) and make bench (pv_bench.c) share:
+ * running the tools, generating inputs and comparing outputs, and
+ * parsing their option lists.  Inputs come from a fixed xorshift stream
+ * seeded by their size, so every run (and every machine) sees the same
+ * bytes.
+ */
+
+#define HARNESS_CHUNK (1 << 20)
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* runs bin/prog with argv, its stdout (and, if quiet, its stderr) to
+   /dev/null; r, if not NULL, gets its time, peak RSS and status.
+   Returns 0 if it exited 0, -1 otherwise. */
+int
+pv_run_tool (const char *bin, const char *prog, char **argv, int quiet,
+	     struct pv_run *r)
+{
+  char path[PATH_MAX];
+  struct rusage ru;
+  double t0;
+  pid_t pid;
+  int fd, status;
+
+  sprintf (path, "%.*s/%s", PATH_MAX - 32, bin, prog);
+  argv[0] = path;
+  t0 = now ();
+  if ((pid = fork ()) == -1) {
+    perror ("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    if ((fd = open ("/dev/null", O_WRONLY)) != -1) {
+      dup2 (fd, STDOUT_FILENO);
+      if (quiet)
+	dup2 (fd, STDERR_FILENO);
+    }
+    execv (path, argv);
+    perror (path);
+    _exit (127);
+  }
+  if (wait4 (pid, &status, 0, &ru) == -1) {
+    perror ("wait4");
+    return -1;
+  }
+  if (r) {
+    r->secs = now () - t0;
+    r->rss_kb = ru.ru_maxrss;
+    r->status = status;
+  }
+  return WIFEXITED (status) && WEXITSTATUS (status) == 0 ? 0 : -1;
+}
+
+static u_int64_t
+xorshift (u_int64_t *x)
+{
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+/* len bytes of log lines made up from x; the last one is cut short */
+static void
+make_text (char *buf, size_t len, u_int64_t *x)
+{
+  static const char *const verb[4] = { "GET", "GET", "POST", "PUT" };
+  static const int status[4] = { 200, 200, 404, 500 };
+  char line[160];
+  size_t i, n;
+  u_int64_t v;
+
+  for (i = 0; i < len; i += n) {
+    v = xorshift (x);
+    n = sprintf (line, "2026-01-%02u %02u:%02u:%02u.%06u host%02u app[%u]: "
+		 "%s /api/v1/items/%u status=%d bytes=%u\n",
+		 (u_int) (v % 28 + 1), (u_int) (v >> 5) % 24,
+		 (u_int) (v >> 10) % 60, (u_int) (v >> 16) % 60,
+		 (u_int) (v >> 22) % 1000000, (u_int) (v >> 42) % 16,
+		 1000 + (u_int) (v >> 46) % 100, verb[(v >> 53) % 4],
+		 (u_int) (v >> 20) % 100000, status[(v >> 55) % 4],
+		 (u_int) (v >> 30) % 50000);
+    if (n > len - i)
+      n = len - i;
+    memcpy (buf + i, line, n);
+  }
+}
+
+/* the input of a given size, random bytes or (text) log lines; the
+   same bytes every time */
+int
+pv_make_input (const char *path, off_t size, int text)
+{
+  u_int64_t x = 0x9e3779b97f4a7c15ULL ^ (u_int64_t) size;
+  char *buf;
+  size_t i, len;
+  int fd, ret = 0;
+
+  if (!(buf = (char *) malloc (HARNESS_CHUNK))) {
+    fprintf (stderr, "%s: out of memory\n", getprogname ());
+    return -1;
+  }
+  if ((fd = open (path, O_WRONLY | O_TRUNC | O_CREAT, 0600)) == -1) {
+    perror (path);
+    free (buf);
+    return -1;
+  }
+  while (!ret && size > 0) {
+    len = size < HARNESS_CHUNK ? (size_t) size : HARNESS_CHUNK;
+    if (text)
+      make_text (buf, len, &x);
+    else
+      for (i = 0; i < len; i += 8) {
+	xorshift (&x);
+	memcpy (buf + i, &x, len - i < 8 ? len - i : 8);
+      }
+    if (write_chunk (fd, buf, len) != 0) {
+      perror (path);
+      ret = -1;
+    }
+    size -= len;
+  }
+  close (fd);
+  free (buf);
+  return ret;
+}
+
+/* 0 if files a and b have the same contents */
+int
+pv_same_file (const char *a, const char *b)
+{
+  char *ba = (char *) malloc (HARNESS_CHUNK), *bb = (char *) malloc (HARNESS_CHUNK);
+  ssize_t na, nb;
+  int fa, fb, ret = -1;
+
+  fa = open (a, O_RDONLY);
+  fb = open (b, O_RDONLY);
+  if (ba && bb && fa != -1 && fb != -1) {
+    do {
+      na = read_chunk (fa, ba, HARNESS_CHUNK);
+      nb = read_chunk (fb, bb, HARNESS_CHUNK);
+    } while (na == nb && na > 0 && !memcmp (ba, bb, na));
+    ret = na == 0 && nb == 0 ? 0 : -1;
+  }
+  if (fa != -1)
+    close (fa);
+  if (fb != -1)
+    close (fb);
+  free (ba);
+  free (bb);
+  return ret;
+}
+
+/* "a,b,c" into at most PV_MAXLIST pieces, in place */
+int
+pv_split (char *s, char **v)
+{
+  int n = 0;
+  char *p;
+
+  for (p = strtok (s, ","); p && n < PV_MAXLIST; p = strtok (NULL, ","))
+    v[n++] = p;
+  return n;
+}
+
+/* a size such as 4096, 64M or 1M+7 */
+off_t
+pv_parse_sum (const char *s)
+{
+  char buf[64], *plus;
+  off_t a, c = 0;
+
+  if (strlen (s) >= sizeof (buf))
+    return -1;
+  strcpy (buf, s);
+  if ((plus = strchr (buf, '+'))) {
+    *plus = '\0';
+    if ((c = parse_offset (plus + 1)) == -1)
+      return -1;
+  }
+  return (a = parse_offset (buf)) == -1 ? -1 : a + c;
+}
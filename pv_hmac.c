@@ -0,0 +1,591 @@
+#include "pv.h"
+
+/* HMAC-SHA1 and HMAC-SHA256 (RFC 2104) for the CBC formats.  The key is
+ * folded into the compression state of K^ipad and K^opad once, in
+ * pv_hmac_init, so finishing a MAC costs two compressions of its own
+ * rather than four.  The SHA compression functions use the x86 SHA
+ * extensions when cpuid reports them (PV_SHA=generic in the environment
+ * forces the portable code).  HMAC-SHA1 output is identical to
+ * libdcrypt's hmac_sha1_*, which the self-test checks.
+ */
+
+#define SHA_BLOCK 64
+
+static const u_int32_t sha1_iv[5] = {
+  0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const u_int32_t sha256_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const u_int32_t k256[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * portable compression functions
+ */
+
+static void
+sha1_generic (u_int32_t *st, const u_char *p, size_t nblocks)
+{
+  u_int32_t w[80], a, b, c, d, e, t;
+  int i;
+
+  for (; nblocks--; p += SHA_BLOCK) {
+    for (i = 0; i < 16; i++)
+      w[i] = getint (p + 4 * i);
+    for (; i < 80; i++)
+      w[i] = ROTL (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = st[0]; b = st[1]; c = st[2]; d = st[3]; e = st[4];
+    for (i = 0; i < 80; i++) {
+      if (i < 20)
+	t = ((b & c) | (~b & d)) + 0x5a827999;
+      else if (i < 40)
+	t = (b ^ c ^ d) + 0x6ed9eba1;
+      else if (i < 60)
+	t = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+      else
+	t = (b ^ c ^ d) + 0xca62c1d6;
+      t += ROTL (a, 5) + e + w[i];
+      e = d; d = c; c = ROTL (b, 30); b = a; a = t;
+    }
+    st[0] += a; st[1] += b; st[2] += c; st[3] += d; st[4] += e;
+  }
+}
+
+static void
+sha256_generic (u_int32_t *st, const u_char *p, size_t nblocks)
+{
+  u_int32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  for (; nblocks--; p += SHA_BLOCK) {
+    for (i = 0; i < 16; i++)
+      w[i] = getint (p + 4 * i);
+    for (; i < 64; i++)
+      w[i] = w[i - 16] + w[i - 7]
+	+ (ROTR (w[i - 15], 7) ^ ROTR (w[i - 15], 18) ^ (w[i - 15] >> 3))
+	+ (ROTR (w[i - 2], 17) ^ ROTR (w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    a = st[0]; b = st[1]; c = st[2]; d = st[3];
+    e = st[4]; f = st[5]; g = st[6]; h = st[7];
+    for (i = 0; i < 64; i++) {
+      t1 = h + (ROTR (e, 6) ^ ROTR (e, 11) ^ ROTR (e, 25))
+	+ ((e & f) ^ (~e & g)) + k256[i] + w[i];
+      t2 = (ROTR (a, 2) ^ ROTR (a, 13) ^ ROTR (a, 22))
+	+ ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+    st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+  }
+}
+
+/*
+ * SHA extensions (sha1rnds4, sha256rnds2, ...), after Intel's "New
+ * Instructions Supporting the Secure Hash Algorithm on Intel
+ * Architecture Processors" (Gulley et al., 2013).
+ */
+
+#ifdef PV_HAVE_AESNI
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI __attribute__ ((target ("sha,sse4.1,ssse3,sse2")))
+
+static int
+have_shani (void)
+{
+  unsigned int a, b, c, d;
+
+  if (__get_cpuid_max (0, NULL) < 7 || !__get_cpuid (1, &a, &b, &c, &d))
+    return 0;
+  if (!(c & bit_SSE4_1) || !(c & bit_SSSE3))
+    return 0;
+  __cpuid_count (7, 0, a, b, c, d);
+  return (b & bit_SHA) != 0;
+}
+
+/* rounds 4i..4i+3, i >= 4: m0 holds W[4i..4i+3]; schedule three groups
+   ahead while the rounds run */
+#define SHA1_STEP(ea, eb, m0, m1, m2, m3, f)	\
+  do {						\
+    ea = _mm_sha1nexte_epu32 (ea, m0);		\
+    eb = abcd;					\
+    m1 = _mm_sha1msg2_epu32 (m1, m0);		\
+    abcd = _mm_sha1rnds4_epu32 (abcd, ea, f);	\
+    m3 = _mm_sha1msg1_epu32 (m3, m0);		\
+    m2 = _mm_xor_si128 (m2, m0);		\
+  } while (0)
+
+static SHANI void
+sha1_shani (u_int32_t *st, const u_char *p, size_t nblocks)
+{
+  const __m128i bswap = _mm_set_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+				      10, 11, 12, 13, 14, 15);
+  __m128i abcd, abcd_save, e0, e0_save, e1, m0, m1, m2, m3;
+
+  abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) st), 0x1b);
+  e0 = _mm_set_epi32 (st[4], 0, 0, 0);
+
+  for (; nblocks--; p += SHA_BLOCK) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    m0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) p), bswap);
+    e0 = _mm_add_epi32 (e0, m0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+
+    m1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) p + 1), bswap);
+    e1 = _mm_sha1nexte_epu32 (e1, m1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+    m0 = _mm_sha1msg1_epu32 (m0, m1);
+
+    m2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) p + 2), bswap);
+    e0 = _mm_sha1nexte_epu32 (e0, m2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+    m1 = _mm_sha1msg1_epu32 (m1, m2);
+    m0 = _mm_xor_si128 (m0, m2);
+
+    m3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) p + 3), bswap);
+    e1 = _mm_sha1nexte_epu32 (e1, m3);
+    e0 = abcd;
+    m0 = _mm_sha1msg2_epu32 (m0, m3);
+    abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+    m2 = _mm_sha1msg1_epu32 (m2, m3);
+    m1 = _mm_xor_si128 (m1, m3);
+
+    SHA1_STEP (e0, e1, m0, m1, m2, m3, 0);	/* 16..19 */
+    SHA1_STEP (e1, e0, m1, m2, m3, m0, 1);	/* 20..23 */
+    SHA1_STEP (e0, e1, m2, m3, m0, m1, 1);
+    SHA1_STEP (e1, e0, m3, m0, m1, m2, 1);
+    SHA1_STEP (e0, e1, m0, m1, m2, m3, 1);
+    SHA1_STEP (e1, e0, m1, m2, m3, m0, 1);
+    SHA1_STEP (e0, e1, m2, m3, m0, m1, 2);	/* 40..43 */
+    SHA1_STEP (e1, e0, m3, m0, m1, m2, 2);
+    SHA1_STEP (e0, e1, m0, m1, m2, m3, 2);
+    SHA1_STEP (e1, e0, m1, m2, m3, m0, 2);
+    SHA1_STEP (e0, e1, m2, m3, m0, m1, 2);
+    SHA1_STEP (e1, e0, m3, m0, m1, m2, 3);	/* 60..63 */
+    SHA1_STEP (e0, e1, m0, m1, m2, m3, 3);
+    SHA1_STEP (e1, e0, m1, m2, m3, m0, 3);
+    SHA1_STEP (e0, e1, m2, m3, m0, m1, 3);
+    SHA1_STEP (e1, e0, m3, m0, m1, m2, 3);	/* 76..79 */
+
+    e0 = _mm_sha1nexte_epu32 (e0, e0_save);
+    abcd = _mm_add_epi32 (abcd, abcd_save);
+  }
+
+  _mm_storeu_si128 ((__m128i *) st, _mm_shuffle_epi32 (abcd, 0x1b));
+  st[4] = (u_int32_t) _mm_extract_epi32 (e0, 3);
+}
+#undef SHA1_STEP
+
+/* rounds 4i..4i+3, i >= 3: m0 holds W[4i..4i+3]; finish the schedule
+   of m1 and start that of m3 */
+#define SHA256_STEP(i, m0, m1, m2, m3)					\
+  do {									\
+    msg = _mm_add_epi32 (m0, _mm_loadu_si128 ((const __m128i *) k256 + (i))); \
+    s1 = _mm_sha256rnds2_epu32 (s1, s0, msg);				\
+    m1 = _mm_add_epi32 (m1, _mm_alignr_epi8 (m0, m3, 4));		\
+    m1 = _mm_sha256msg2_epu32 (m1, m0);					\
+    s0 = _mm_sha256rnds2_epu32 (s0, s1, _mm_shuffle_epi32 (msg, 0x0e)); \
+    m3 = _mm_sha256msg1_epu32 (m3, m0);					\
+  } while (0)
+
+/* the first rounds, on W[0..15] straight from the block */
+#define SHA256_LOAD(i, m)						\
+  do {									\
+    m = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) p + (i)), bswap); \
+    msg = _mm_add_epi32 (m, _mm_loadu_si128 ((const __m128i *) k256 + (i))); \
+    s1 = _mm_sha256rnds2_epu32 (s1, s0, msg);				\
+    s0 = _mm_sha256rnds2_epu32 (s0, s1, _mm_shuffle_epi32 (msg, 0x0e)); \
+  } while (0)
+
+static SHANI void
+sha256_shani (u_int32_t *st, const u_char *p, size_t nblocks)
+{
+  const __m128i bswap = _mm_set_epi8 (12, 13, 14, 15, 8, 9, 10, 11,
+				      4, 5, 6, 7, 0, 1, 2, 3);
+  __m128i s0, s1, s0_save, s1_save, msg, t, m0, m1, m2, m3;
+
+  /* the instructions want the state as ABEF and CDGH */
+  t = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) st), 0xb1);
+  s1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) st + 1), 0x1b);
+  s0 = _mm_alignr_epi8 (t, s1, 8);
+  s1 = _mm_blend_epi16 (s1, t, 0xf0);
+
+  for (; nblocks--; p += SHA_BLOCK) {
+    s0_save = s0;
+    s1_save = s1;
+
+    SHA256_LOAD (0, m0);
+    SHA256_LOAD (1, m1);
+    m0 = _mm_sha256msg1_epu32 (m0, m1);
+    SHA256_LOAD (2, m2);
+    m1 = _mm_sha256msg1_epu32 (m1, m2);
+    m3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) p + 3), bswap);
+
+    SHA256_STEP (3, m3, m0, m1, m2);
+    SHA256_STEP (4, m0, m1, m2, m3);
+    SHA256_STEP (5, m1, m2, m3, m0);
+    SHA256_STEP (6, m2, m3, m0, m1);
+    SHA256_STEP (7, m3, m0, m1, m2);
+    SHA256_STEP (8, m0, m1, m2, m3);
+    SHA256_STEP (9, m1, m2, m3, m0);
+    SHA256_STEP (10, m2, m3, m0, m1);
+    SHA256_STEP (11, m3, m0, m1, m2);
+    SHA256_STEP (12, m0, m1, m2, m3);
+    SHA256_STEP (13, m1, m2, m3, m0);
+    SHA256_STEP (14, m2, m3, m0, m1);
+    SHA256_STEP (15, m3, m0, m1, m2);	/* 60..63 */
+
+    s0 = _mm_add_epi32 (s0, s0_save);
+    s1 = _mm_add_epi32 (s1, s1_save);
+  }
+
+  t = _mm_shuffle_epi32 (s0, 0x1b);
+  s1 = _mm_shuffle_epi32 (s1, 0xb1);
+  _mm_storeu_si128 ((__m128i *) st, _mm_blend_epi16 (t, s1, 0xf0));
+  _mm_storeu_si128 ((__m128i *) st + 1, _mm_alignr_epi8 (s1, t, 8));
+}
+#undef SHA256_STEP
+#undef SHA256_LOAD
+#endif /* PV_HAVE_AESNI */
+
+/*
+ * HMAC
+ */
+
+/* pad out the message in c->buf and write the digest of everything
+   hashed since c->st was set up to out (c->outlen bytes) */
+static void
+hash_final (struct pv_hmac_ctx *c, u_char *out)
+{
+  u_int64_t bits = c->len * 8;
+  u_int i;
+
+  c->buf[c->nbuf++] = 0x80;
+  if (c->nbuf > SHA_BLOCK - 8) {
+    bzero (c->buf + c->nbuf, SHA_BLOCK - c->nbuf);
+    c->compress (c->st, c->buf, 1);
+    c->nbuf = 0;
+  }
+  bzero (c->buf + c->nbuf, SHA_BLOCK - 8 - c->nbuf);
+  putint (c->buf + SHA_BLOCK - 8, (u_int32_t) (bits >> 32));
+  putint (c->buf + SHA_BLOCK - 4, (u_int32_t) bits);
+  c->compress (c->st, c->buf, 1);
+  for (i = 0; i < c->outlen / 4; i++)
+    putint (out + 4 * i, c->st[i]);
+}
+
+/* start c->st over from a state reached after hashing one block */
+static void
+hash_resume (struct pv_hmac_ctx *c, const u_int32_t *st)
+{
+  memcpy (c->st, st, sizeof (c->st));
+  c->len = SHA_BLOCK;
+  c->nbuf = 0;
+}
+
+static void
+hmac_setup (struct pv_hmac_ctx *c, int alg, const void *key, size_t keylen,
+	    int shani)
+{
+  const u_int32_t *iv = alg == PV_MAC_SHA256 ? sha256_iv : sha1_iv;
+  const size_t ivlen = alg == PV_MAC_SHA256 ? sizeof (sha256_iv) : sizeof (sha1_iv);
+  u_char k0[SHA_BLOCK];
+  u_int i;
+
+  bzero (c, sizeof (*c));
+  c->outlen = alg == PV_MAC_SHA256 ? PV_SHA256_LEN : HMAC_LEN;
+  c->name = "generic";
+  c->compress = alg == PV_MAC_SHA256 ? sha256_generic : sha1_generic;
+#ifdef PV_HAVE_AESNI
+  if (shani) {
+    c->name = "sha-ni";
+    c->compress = alg == PV_MAC_SHA256 ? sha256_shani : sha1_shani;
+  }
+#else
+  (void) shani;
+#endif /* PV_HAVE_AESNI */
+
+  /* K0 is the key, or its hash if longer than a block, 0-padded */
+  bzero (k0, sizeof (k0));
+  if (keylen > SHA_BLOCK) {
+    memcpy (c->st, iv, ivlen);
+    pv_hmac_update (c, key, keylen);
+    hash_final (c, k0);
+  }
+  else
+    memcpy (k0, key, keylen);
+
+  /* the midstates after one block of K0^ipad and of K0^opad */
+  for (i = 0; i < SHA_BLOCK; i++)
+    k0[i] ^= 0x36;
+  memcpy (c->ist, iv, ivlen);
+  c->compress (c->ist, k0, 1);
+  for (i = 0; i < SHA_BLOCK; i++)
+    k0[i] ^= 0x36 ^ 0x5c;
+  memcpy (c->ost, iv, ivlen);
+  c->compress (c->ost, k0, 1);
+  pv_scrub (k0, sizeof (k0));
+
+  hash_resume (c, c->ist);
+}
+
+/* alg is PV_MAC_SHA1 or PV_MAC_SHA256; c->outlen is then the length of
+   the MAC.  c can be reused for any number of messages under the same
+   key: pv_hmac_final leaves it ready for the next one. */
+void
+pv_hmac_init (struct pv_hmac_ctx *c, int alg, const void *key, size_t keylen)
+{
+  const char *force = getenv ("PV_SHA");
+  int shani = 0;
+
+#ifdef PV_HAVE_AESNI
+  shani = !(force && !strcmp (force, "generic")) && have_shani ();
+#else
+  (void) force;
+#endif /* PV_HAVE_AESNI */
+  hmac_setup (c, alg, key, keylen, shani);
+}
+
+void
+pv_hmac_update (struct pv_hmac_ctx *c, const void *data, size_t len)
+{
+  const u_char *p = (const u_char *) data;
+  size_t n;
+
+  c->len += len;
+  if (c->nbuf) {
+    n = SHA_BLOCK - c->nbuf < len ? SHA_BLOCK - c->nbuf : len;
+    memcpy (c->buf + c->nbuf, p, n);
+    c->nbuf += n;
+    p += n;
+    len -= n;
+    if (c->nbuf < SHA_BLOCK)
+      return;
+    c->compress (c->st, c->buf, 1);
+    c->nbuf = 0;
+  }
+  if (len >= SHA_BLOCK) {
+    c->compress (c->st, p, len / SHA_BLOCK);	/* straight from the caller */
+    p += len - len % SHA_BLOCK;
+    len %= SHA_BLOCK;
+  }
+  memcpy (c->buf, p, len);
+  c->nbuf = len;
+}
+
+/* out gets c->outlen bytes */
+void
+pv_hmac_final (struct pv_hmac_ctx *c, u_char *out)
+{
+  u_char inner[PV_SHA256_LEN];
+
+  hash_final (c, inner);		/* H (K^ipad || msg) */
+  hash_resume (c, c->ost);
+  pv_hmac_update (c, inner, c->outlen);
+  hash_final (c, out);			/* H (K^opad || inner) */
+  pv_scrub (inner, sizeof (inner));
+  hash_resume (c, c->ist);
+}
+
+/* padlen as the trailer has it, into the MAC of the formats that cover
+   it (PV_MODE_CBC_SHA256; the classic PV_MODE_CBC leaves it out), just
+   before pv_hmac_final */
+void
+pv_hmac_padlen (struct pv_hmac_ctx *c, int mode, u_int32_t numpad0)
+{
+  u_char b[4];
+
+  if (mode != PV_MODE_CBC_SHA256)
+    return;
+  putint (b, numpad0);
+  pv_hmac_update (c, b, 4);
+}
+
+void
+pv_hmac_clr (struct pv_hmac_ctx *c)
+{
+  pv_scrub (c, sizeof (*c));
+}
+
+/* the known answers of RFC 4231 cases 2 and 6 (HMAC-SHA256) and RFC
+   2202 case 2 (HMAC-SHA1), through the compression functions chosen by
+   shani; the SHA-1 one a second time, reusing the context after final.
+   Returns 0 on success, -1 otherwise. */
+static int
+hmac_kat (int shani)
+{
+  static const char key2[] = "Jefe";
+  static const char msg2[] = "what do ya want for nothing?";
+  static const u_char mac2[PV_SHA256_LEN] = {
+    0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e,
+    0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+    0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83,
+    0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43
+  };
+  static const u_char mac2_sha1[HMAC_LEN] = {
+    0xef, 0xfc, 0xdf, 0x6a, 0xe5, 0xeb, 0x2f, 0xa2, 0xd2, 0x74,
+    0x16, 0xd5, 0xf1, 0x84, 0xdf, 0x9c, 0x25, 0x9a, 0x7c, 0x79
+  };
+  /* a key longer than the block */
+  static const char msg6[] = "Test Using Larger Than Block-Size Key - Hash Key First";
+  static const u_char mac6[PV_SHA256_LEN] = {
+    0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f,
+    0x0d, 0x8a, 0x26, 0xaa, 0xcb, 0xf5, 0xb7, 0x7f,
+    0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28, 0xc5, 0x14,
+    0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54
+  };
+  u_char key6[131], mac[PV_SHA256_LEN];
+  struct pv_hmac_ctx c;
+  int ret = 0;
+
+  memset (key6, 0xaa, sizeof (key6));
+  hmac_setup (&c, PV_MAC_SHA256, key2, strlen (key2), shani);
+  pv_hmac_update (&c, msg2, strlen (msg2));
+  pv_hmac_final (&c, mac);
+  if (memcmp (mac, mac2, PV_SHA256_LEN))
+    ret = -1;
+  hmac_setup (&c, PV_MAC_SHA256, key6, sizeof (key6), shani);
+  pv_hmac_update (&c, msg6, strlen (msg6));
+  pv_hmac_final (&c, mac);
+  if (memcmp (mac, mac6, PV_SHA256_LEN))
+    ret = -1;
+  hmac_setup (&c, PV_MAC_SHA1, key2, strlen (key2), shani);
+  pv_hmac_update (&c, msg2, 10);
+  pv_hmac_update (&c, msg2 + 10, strlen (msg2) - 10);
+  pv_hmac_final (&c, mac);
+  if (memcmp (mac, mac2_sha1, HMAC_LEN))
+    ret = -1;
+  pv_hmac_update (&c, msg2, strlen (msg2));	/* reuse after final */
+  pv_hmac_final (&c, mac);
+  if (memcmp (mac, mac2_sha1, HMAC_LEN))
+    ret = -1;
+  pv_hmac_clr (&c);
+  return ret;
+}
+
+/* whether this CPU has a second set of compression functions */
+static int
+hmac_backends (void)
+{
+#ifdef PV_HAVE_AESNI
+  return have_shani () ? 2 : 1;
+#else
+  return 1;
+#endif /* PV_HAVE_AESNI */
+}
+
+/* the known answers, for every compression function this CPU has: all
+   the tools do at start-up (pv_hmac_check, run by make check, is the
+   thorough one).  Returns 0 on success, -1 otherwise. */
+int
+pv_hmac_selftest (void)
+{
+  int shani, n = hmac_backends (), ret = 0;
+
+  for (shani = 0; shani < n && !ret; shani++)
+    ret = hmac_kat (shani);
+  if (ret)
+    fprintf (stderr, "%s: HMAC self-test failed\n", getprogname ());
+  return ret;
+}
+
+/* make check: the known answers, then HMAC-SHA1 against libdcrypt over
+   lengths around the block and padding boundaries, fed in two uneven
+   pieces, with a short and a long key; all for every compression
+   function this CPU has, and then the SHA-256 ones against each other
+   on longer messages.  Returns 0 on success, -1 otherwise. */
+int
+pv_hmac_check (void)
+{
+  u_char key[80], msg[300], mac[PV_SHA256_LEN], ref[PV_SHA256_LEN];
+  struct pv_hmac_ctx c;
+  struct sha1_ctx sc;
+  int shani, n = hmac_backends (), ret = 0;
+  size_t len, keylen, i;
+
+  memset (key, 0xaa, sizeof (key));
+  for (i = 0; i < sizeof (msg); i++)
+    msg[i] = (u_char) (i * 31 + 5);
+
+  for (shani = 0; shani < n && !ret; shani++) {
+    if (hmac_kat (shani) != 0) {
+      fprintf (stderr, "%s: HMAC (%s) known answers are wrong\n",
+	       getprogname (), shani ? "SHA-NI" : "generic");
+      return -1;
+    }
+    for (keylen = 16; keylen <= 80 && !ret; keylen += 64)
+      for (len = 0; len <= sizeof (msg) && !ret; len += len < 140 ? 1 : 53) {
+	hmac_sha1_init ((const char *) key, keylen, &sc);
+	hmac_sha1_update (&sc, msg, len);
+	hmac_sha1_final ((const char *) key, keylen, &sc, ref);
+	hmac_setup (&c, PV_MAC_SHA1, key, keylen, shani);
+	pv_hmac_update (&c, msg, len / 3);
+	pv_hmac_update (&c, msg + len / 3, len - len / 3);
+	pv_hmac_final (&c, mac);
+	if (memcmp (mac, ref, HMAC_LEN))
+	  ret = -1;
+	pv_hmac_update (&c, msg, len);	/* reuse after final */
+	pv_hmac_final (&c, mac);
+	if (memcmp (mac, ref, HMAC_LEN))
+	  ret = -1;
+	if (ret)
+	  fprintf (stderr, "%s: HMAC-SHA1 (%s) differs from libdcrypt at "
+		   "length %lu, key length %lu\n", getprogname (),
+		   shani ? "SHA-NI" : "generic", (unsigned long) len,
+		   (unsigned long) keylen);
+      }
+  }
+
+  /* both SHA-256 compression functions agree on longer messages */
+  for (len = 0; n == 2 && len <= sizeof (msg) && !ret; len += 7) {
+    hmac_setup (&c, PV_MAC_SHA256, key, 32, 0);
+    pv_hmac_update (&c, msg, len);
+    pv_hmac_final (&c, ref);
+    hmac_setup (&c, PV_MAC_SHA256, key, 32, 1);
+    pv_hmac_update (&c, msg, len);
+    pv_hmac_final (&c, mac);
+    if (memcmp (mac, ref, PV_SHA256_LEN)) {
+      fprintf (stderr, "%s: HMAC-SHA256 with SHA-NI differs from the "
+	       "generic code at length %lu\n", getprogname (),
+	       (unsigned long) len);
+      ret = -1;
+    }
+  }
+
+  pv_hmac_clr (&c);
+  if (!ret)
+    printf ("hmac %s compression functions agree with libdcrypt and "
+	    "RFC 4231\n", n == 2 ? "generic and SHA-NI" : "generic");
+  return ret;
+}
@@ -0,0 +1,502 @@
+#include "pv.h"
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Sequential file I/O that keeps the device busy.  A pv_io owns
+ * PV_IO_DEPTH buffers of chunk bytes each.  A reader has all of them
+ * out reading the chunks ahead of the one being consumed; a writer
+ * fills one while the ones before it are being written.  Reads and
+ * writes go through an io_uring (set up with the raw system calls) and
+ * complete while the caller encrypts; when the kernel won't give us a
+ * ring, or PV_IO=sync is set, each request is a plain pread/pwrite made
+ * on the spot instead, which is the old synchronous behaviour.  Pipes
+ * and other files without offsets are simply read and written.
+ *
+ * Under --direct (pv_iopolicy) the file is switched to O_DIRECT, the
+ * buffers and requests are aligned to PV_DIRECT_ALIGN, and the odd
+ * request that can't be (the head of a writer that starts part way
+ * into a block, the short tail of a file) goes through the page cache
+ * with the flag off for the moment; if the file system won't take
+ * O_DIRECT at all, or refuses a request, we carry on without it.
+ * Under --nocache (or --direct) each chunk is dropped from the page
+ * cache once it has been consumed or written.
+ */
+
+#define PV_IO_DEPTH 4
+#define PV_IO_MIN_CHUNK (128 << 10)
+
+#define IO_STREAM 0		/* read_chunk/write_chunk */
+#define IO_SYNC 1		/* pread/pwrite, one at a time */
+#define IO_URING 2
+
+struct io_slot {
+  char *buf;			/* (a writer's, allocated when first needed) */
+  size_t used;			/* most of buf ever filled, for the scrub */
+  off_t off;			/* where in the file */
+  size_t len;			/* bytes asked for; 0 once a write is checked */
+  ssize_t res;			/* bytes done, or -errno */
+  int busy;			/* submitted and not yet reaped */
+};
+
+struct io_ring {
+  int fd;
+  void *sq, *cq;
+  size_t sqsz, cqsz, sqesz;
+  struct io_uring_sqe *sqes;
+  u_int *sq_tail, *sq_mask, *sq_array;
+  u_int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+struct pv_io {
+  int fd;
+  int writing;
+  int kind;			/* IO_* */
+  int err;			/* errno of the first failure, sticky */
+  size_t chunk;
+  struct io_slot slot[PV_IO_DEPTH];
+  int cur;			/* the slot being consumed or filled */
+  size_t pos;			/* bytes of it consumed or filled */
+  off_t next;			/* offset of the next request */
+  int eof;			/* reader: slot cur ends the file */
+  int direct;			/* O_DIRECT is on */
+  size_t lead;			/* writer: first slot is short by this */
+  off_t start;			/* --nocache: first block used */
+  off_t dropped;		/* writer: cache dropped up to here */
+  struct io_ring ring;
+};
+
+static void
+ring_free (struct io_ring *r)
+{
+  if (r->sqes != MAP_FAILED)
+    munmap (r->sqes, r->sqesz);
+  if (r->cq != MAP_FAILED)
+    munmap (r->cq, r->cqsz);
+  if (r->sq != MAP_FAILED)
+    munmap (r->sq, r->sqsz);
+  if (r->fd != -1)
+    close (r->fd);
+}
+
+/* Returns 0, or -1 if this kernel can't do it (too old, or io_uring
+   disabled or filtered), in which case r holds nothing. */
+static int
+ring_init (struct io_ring *r, u_int entries)
+{
+  struct io_uring_params p;
+
+  r->sq = r->cq = MAP_FAILED;
+  r->sqes = (struct io_uring_sqe *) MAP_FAILED;
+  bzero (&p, sizeof (p));
+  if ((r->fd = syscall (__NR_io_uring_setup, entries, &p)) == -1)
+    return -1;
+  if (!(p.features & IORING_FEAT_RW_CUR_POS)) { /* no IORING_OP_READ */
+    ring_free (r);
+    return -1;
+  }
+
+  r->sqsz = p.sq_off.array + p.sq_entries * sizeof (u_int);
+  r->cqsz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  r->sqesz = p.sq_entries * sizeof (struct io_uring_sqe);
+  r->sq = mmap (NULL, r->sqsz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq = mmap (NULL, r->cqsz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = (struct io_uring_sqe *)
+    mmap (NULL, r->sqesz, PROT_READ | PROT_WRITE,
+	  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sq == MAP_FAILED || r->cq == MAP_FAILED
+      || r->sqes == MAP_FAILED) {
+    ring_free (r);
+    return -1;
+  }
+
+  r->sq_tail = (u_int *) ((char *) r->sq + p.sq_off.tail);
+  r->sq_mask = (u_int *) ((char *) r->sq + p.sq_off.ring_mask);
+  r->sq_array = (u_int *) ((char *) r->sq + p.sq_off.array);
+  r->cq_head = (u_int *) ((char *) r->cq + p.cq_off.head);
+  r->cq_tail = (u_int *) ((char *) r->cq + p.cq_off.tail);
+  r->cq_mask = (u_int *) ((char *) r->cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) ((char *) r->cq + p.cq_off.cqes);
+  return 0;
+}
+
+static int
+ring_enter (struct io_ring *r, u_int submit, u_int wait)
+{
+  long n;
+
+  do {
+    n = syscall (__NR_io_uring_enter, r->fd, submit, wait,
+		 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    pv_stats_add (PV_ST_URING_ENTERS, 1);
+  } while (n == -1 && (errno == EINTR || errno == EAGAIN));
+  return n == -1 ? -1 : 0;
+}
+
+/* s done on the spot */
+static void
+io_sync (struct pv_io *io, struct io_slot *s)
+{
+  if (io->writing)
+    s->res = pwrite_chunk (io->fd, s->buf, s->len, s->off) == 0
+      ? (ssize_t) s->len : -errno;
+  else if ((s->res = pread_chunk (io->fd, s->buf, s->len, s->off)) == -1)
+    s->res = -errno;
+}
+
+/* start s->len bytes of I/O at s->off */
+static void
+io_submit (struct pv_io *io, struct io_slot *s)
+{
+  struct io_ring *r = &io->ring;
+  struct io_uring_sqe *e;
+  u_int tail, i;
+
+  if (io->direct && (s->off % PV_DIRECT_ALIGN || s->len % PV_DIRECT_ALIGN)) {
+    pv_direct (io->fd, 0);	/* not whole blocks: through the cache */
+    io_sync (io, s);
+    pv_direct (io->fd, 1);
+    return;
+  }
+  if (io->kind == IO_SYNC) {
+    io_sync (io, s);
+    return;
+  }
+
+  tail = *r->sq_tail;
+  i = tail & *r->sq_mask;
+  e = &r->sqes[i];
+  bzero (e, sizeof (*e));
+  e->opcode = io->writing ? IORING_OP_WRITE : IORING_OP_READ;
+  e->fd = io->fd;
+  e->off = s->off;
+  e->addr = (unsigned long) s->buf;
+  e->len = s->len;
+  e->user_data = s - io->slot;
+  r->sq_array[i] = i;
+  __atomic_store_n (r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  pv_stats_add (io->writing ? PV_ST_WRITES : PV_ST_READS, 1);
+  s->busy = 1;
+  if (ring_enter (r, 1, 0) == -1) {
+    /* the ring is no use; nothing more will be submitted to it */
+    io->err = errno;
+    s->busy = 0;
+    s->res = -errno;
+  }
+}
+
+/* waits until s is done; for a writer, also finishes a short write and
+   collects any error.  Returns 0, or -1 once anything has failed. */
+static int
+io_wait (struct pv_io *io, struct io_slot *s)
+{
+  struct io_ring *r = &io->ring;
+  struct io_uring_cqe *e;
+  u_int head;
+
+  while (s->busy) {
+    head = *r->cq_head;
+    if (head == __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE)) {
+      if (ring_enter (r, 0, 1) == -1) {
+	io->err = errno;
+	s->busy = 0;		/* lost; the caller fails from here on */
+	s->res = -errno;
+      }
+      continue;
+    }
+    e = &r->cqes[head & *r->cq_mask];
+    if (e->res > 0)
+      pv_stats_add (io->writing ? PV_ST_BYTES_OUT : PV_ST_BYTES_IN, e->res);
+    pv_qos_charge (e->res > 0 ? e->res : 0);
+    io->slot[e->user_data].res = e->res;
+    io->slot[e->user_data].busy = 0;
+    __atomic_store_n (r->cq_head, head + 1, __ATOMIC_RELEASE);
+  }
+
+  if (io->direct && s->len && s->res == -EINVAL) {
+    io->direct = 0;		/* O_DIRECT after all refused: do without */
+    pv_direct (io->fd, 0);
+    io_sync (io, s);
+  }
+  if (io->writing && s->len) {
+    if (s->res < 0) {
+      if (!io->err)
+	io->err = -s->res;
+    }
+    else if ((size_t) s->res < s->len
+	     && pwrite_chunk (io->fd, s->buf + s->res, s->len - s->res,
+			      s->off + s->res) != 0 && !io->err)
+      io->err = errno;
+    else if (pv_iopolicy) {
+      /* start this chunk on its way to the disk, and drop the ones
+	 before it, which have had the time to get there */
+      pv_cache_flush (io->fd, s->off, s->len);
+      if (s->off > io->dropped) {
+	pv_cache_drop (io->fd, io->dropped, s->off - io->dropped, 1);
+	io->dropped = s->off;
+      }
+    }
+    s->len = 0;
+  }
+  return io->err ? -1 : 0;
+}
+
+/* a pv_io for fd, which is read (or written) sequentially from its
+   current offset in requests of chunk bytes or more.  NULL if out of
+   memory. */
+struct pv_io *
+pv_io_open (int fd, int writing, size_t chunk)
+{
+  const char *e = getenv ("PV_IO");
+  struct pv_io *io;
+  struct stat st;
+  size_t rest;
+  int i;
+
+  if (!(io = (struct pv_io *) malloc (sizeof (*io))))
+    return NULL;
+  bzero (io, sizeof (*io));
+  io->fd = fd;
+  io->writing = writing;
+  io->chunk = chunk < PV_IO_MIN_CHUNK ? PV_IO_MIN_CHUNK : chunk;
+
+  if (fstat (fd, &st) == -1 || !(S_ISREG (st.st_mode) || S_ISBLK (st.st_mode))
+      || (io->next = lseek (fd, 0, SEEK_CUR)) == -1) {
+    io->kind = IO_STREAM;
+    return io;
+  }
+  io->start = io->dropped = io->next - io->next % PV_DIRECT_ALIGN;
+  pv_cache_start (fd);
+  if ((pv_iopolicy & PV_IOP_DIRECT) && pv_direct (fd, 1) == 0) {
+    io->direct = 1;
+    if (writing)		/* the first slot ends on a block */
+      io->lead = io->next % PV_DIRECT_ALIGN;
+    else {			/* read from the block start, skip to ours */
+      io->pos = io->next % PV_DIRECT_ALIGN;
+      io->next -= io->pos;
+    }
+  }
+  /* a small file is read in one short request, which tells us it's all
+     there is; lots of small files (--batch) shouldn't cost lots of
+     big buffers */
+  if (!writing && S_ISREG (st.st_mode)) {
+    rest = st.st_size > io->next ? st.st_size - io->next : 0;
+    if (rest < io->chunk)
+      io->chunk = (rest / 4096 + 1) * 4096;
+  }
+  if (io->direct)
+    io->chunk = (io->chunk + PV_DIRECT_ALIGN - 1) / PV_DIRECT_ALIGN
+      * PV_DIRECT_ALIGN;
+  for (i = 0; i < PV_IO_DEPTH && !writing; i++)
+    if (!(io->slot[i].buf = (char *) pv_alloc (io->chunk))) {
+      pv_io_close (io);		/* nothing is in flight yet */
+      return NULL;
+    }
+  if ((e && !strcmp (e, "sync")) || ring_init (&io->ring, PV_IO_DEPTH) == -1)
+    io->kind = IO_SYNC;
+  else
+    io->kind = IO_URING;
+
+  if (!writing)			/* start reading ahead right away */
+    for (i = 0; i < PV_IO_DEPTH && !io->err; i++) {
+      io->slot[i].off = io->next;
+      io->slot[i].len = io->chunk;
+      io->next += io->chunk;
+      io_submit (io, &io->slot[i]);
+    }
+  return io;
+}
+
+static ssize_t
+io_read (struct pv_io *io, char *buf, size_t len)
+{
+  struct io_slot *s;
+  size_t got = 0, n;
+  ssize_t more;
+
+  if (io->kind == IO_STREAM)
+    return read_chunk (io->fd, buf, len);
+
+  while (got < len) {
+    s = &io->slot[io->cur];
+    io_wait (io, s);
+    if (s->res < 0 || io->err) {
+      errno = io->err ? io->err : -s->res;
+      io->err = errno;
+      return -1;
+    }
+    if ((size_t) s->res < s->len && !io->eof) {
+      /* a short read is the end of the file, unless there's more now */
+      if (io->direct)
+	pv_direct (io->fd, 0);	/* from part way into a block */
+      more = pread_chunk (io->fd, s->buf + s->res, s->len - s->res,
+			  s->off + s->res);
+      if (io->direct)
+	pv_direct (io->fd, 1);
+      if (more == -1) {
+	io->err = errno;
+	return -1;
+      }
+      s->res += more;
+      io->eof = (size_t) s->res < s->len;
+      pv_stats_add (PV_ST_SHORT_READS, more > 0);
+    }
+    if ((size_t) s->res > s->used)
+      s->used = s->res;
+
+    n = (size_t) s->res > io->pos ? s->res - io->pos : 0;
+    if (n > len - got)
+      n = len - got;
+    memcpy (buf + got, s->buf + io->pos, n);
+    got += n;
+    io->pos += n;
+    if (io->pos >= (size_t) s->res) {
+      if (io->eof)
+	break;
+      pv_cache_drop (io->fd, s->off, s->res, 0);
+      s->off = io->next;	/* all used: send it after the next chunk */
+      io->next += io->chunk;
+      io_submit (io, s);
+      io->cur = (io->cur + 1) % PV_IO_DEPTH;
+      io->pos = 0;
+    }
+  }
+  return got;
+}
+
+static int
+io_write (struct pv_io *io, const char *buf, size_t len)
+{
+  struct io_slot *s;
+  size_t n;
+
+  if (io->kind == IO_STREAM)
+    return write_chunk (io->fd, buf, len);
+
+  while (len > 0) {
+    s = &io->slot[io->cur];
+    if (io_wait (io, s) != 0) {	/* its previous write */
+      errno = io->err;
+      return -1;
+    }
+    if (!s->buf && !(s->buf = (char *) pv_alloc (io->chunk)))
+      return -1;
+    n = io->chunk - io->lead - io->pos;
+    if (n > len)
+      n = len;
+    memcpy (s->buf + io->pos, buf, n);
+    buf += n;
+    len -= n;
+    if ((io->pos += n) > s->used)
+      s->used = io->pos;
+    if (io->pos == io->chunk - io->lead) {
+      s->off = io->next;
+      s->len = io->pos;
+      io->next += io->pos;
+      io_submit (io, s);
+      io->cur = (io->cur + 1) % PV_IO_DEPTH;
+      io->pos = 0;
+      io->lead = 0;
+    }
+  }
+  return io->err ? (errno = io->err, -1) : 0;
+}
+
+/* like read_chunk: len bytes, fewer only at the end of the file, or -1 */
+ssize_t
+pv_io_read (struct pv_io *io, char *buf, size_t len)
+{
+  struct pv_stamp t;
+  ssize_t r;
+
+  pv_stats_begin (&t);
+  r = io_read (io, buf, len);
+  pv_stats_end (PV_PH_READ, &t);
+  return r;
+}
+
+/* like write_chunk: 0, or -1 if this or an earlier write failed */
+int
+pv_io_write (struct pv_io *io, const char *buf, size_t len)
+{
+  struct pv_stamp t;
+  int r;
+
+  pv_stats_begin (&t);
+  r = io_write (io, buf, len);
+  pv_stats_end (PV_PH_WRITE, &t);
+  return r;
+}
+
+/* writes out what's left, waits for everything in flight, leaves the
+   file offset just past the last byte written (or consumed) and frees
+   io.  Returns 0, or -1 if any write failed. */
+int
+pv_io_close (struct pv_io *io)
+{
+  struct io_slot *s;
+  struct pv_stamp t;
+  int i, err;
+
+  if (!io)
+    return 0;
+  if (io->kind != IO_STREAM) {
+    pv_stats_begin (&t);	/* the last writes are waited for here */
+    s = &io->slot[io->cur];
+    if (io->writing && io->pos && io_wait (io, s) == 0) {
+      s->off = io->next;
+      s->len = io->pos;
+      io->next += io->pos;
+      io_submit (io, s);
+    }
+    for (i = 0; i < PV_IO_DEPTH; i++) {
+      io_wait (io, &io->slot[i]);
+      /* read ahead but never consumed (an early close): it still
+	 holds what was read, which the scrub must cover */
+      if (io->slot[i].res > 0 && (size_t) io->slot[i].res > io->slot[i].used)
+	io->slot[i].used = io->slot[i].res;
+    }
+    lseek (io->fd, io->writing ? io->next : s->off + (off_t) io->pos,
+	   SEEK_SET);
+    pv_cache_drop (io->fd, io->start, io->next - io->start, io->writing);
+    if (io->direct)
+      pv_direct (io->fd, 0);	/* the caller may write the odd byte */
+    pv_stats_end (io->writing ? PV_PH_WRITE : PV_PH_READ, &t);
+  }
+  if (io->kind == IO_URING)
+    ring_free (&io->ring);
+
+  for (i = 0; i < PV_IO_DEPTH; i++)
+    pv_free (io->slot[i].buf, io->slot[i].used); /* may hold plaintext */
+  err = io->err;
+  free (io);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/* the length of the ptxt in the ctxt file fd of format mode, from its
+   size and the padding length in its trailer (not authenticated yet,
+   so only good for sizing things), or -1 if that can't be told */
+off_t
+pv_ptxt_length (int fd, int mode)
+{
+  const off_t over = pv_encrypt_length (mode, 0);
+  u_int32_t numpad0 = 0;
+  struct stat st;
+  char pad[4];
+
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode) || st.st_size < over)
+    return -1;
+  if (mode != PV_MODE_GCM) {
+    if (pread_chunk (fd, pad, sizeof (pad), st.st_size - sizeof (pad))
+	!= sizeof (pad) || (numpad0 = getint (pad)) >= BLOCK_LEN
+	|| numpad0 > st.st_size - over)
+      return -1;
+  }
+  return st.st_size - over - numpad0;
+}
@@ -0,0 +1,370 @@
+#include "pv.h"
+
+/* Small data-parallel kernels used on every buffer: xor, constant-time
+ * comparison of MACs, and scrubbing.  xor and compare come in scalar,
+ * SSE2 and AVX2 flavours; the widest one the CPU supports is picked on
+ * first use.  PV_KERN=scalar|sse2|avx2 in the environment caps the
+ * choice, which is handy for benchmarking and for testing the fallbacks.
+ */
+
+typedef void (*xor_fn) (void *, const void *, const void *, size_t);
+typedef int (*differs_fn) (const void *, const void *, size_t);
+
+/*
+ * scalar reference versions
+ */
+
+static void
+xor_scalar (void *dst, const void *a, const void *b, size_t len)
+{
+  u_char *d = (u_char *) dst;
+  const u_char *x = (const u_char *) a, *y = (const u_char *) b;
+  u_int64_t u, v;
+
+  /* a word at a time; memcpy keeps this legal for any alignment */
+  for (; len >= 8; len -= 8, d += 8, x += 8, y += 8) {
+    memcpy (&u, x, 8);
+    memcpy (&v, y, 8);
+    u ^= v;
+    memcpy (d, &u, 8);
+  }
+  while (len--)
+    *d++ = *x++ ^ *y++;
+}
+
+static int
+differs_scalar (const void *a, const void *b, size_t len)
+{
+  const u_char *x = (const u_char *) a, *y = (const u_char *) b;
+  u_char diff = 0;
+
+  while (len--)
+    diff |= *x++ ^ *y++;
+  return diff != 0;
+}
+
+/*
+ * SSE2 and AVX2 versions.  Loads and stores are unaligned, so callers
+ * need not care; the xor of one vector is stored only after both
+ * inputs are loaded, so dst may be a or b (but not partially overlap).
+ */
+
+#ifdef PV_HAVE_AESNI
+#include <immintrin.h>
+
+#define SSE2 __attribute__ ((target ("sse2")))
+#define AVX2 __attribute__ ((target ("avx2")))
+
+static SSE2 void
+xor_sse2 (void *dst, const void *a, const void *b, size_t len)
+{
+  u_char *d = (u_char *) dst;
+  const u_char *x = (const u_char *) a, *y = (const u_char *) b;
+
+  for (; len >= 64; len -= 64, d += 64, x += 64, y += 64) {
+    __m128i x0 = _mm_loadu_si128 ((const __m128i *) x);
+    __m128i x1 = _mm_loadu_si128 ((const __m128i *) x + 1);
+    __m128i x2 = _mm_loadu_si128 ((const __m128i *) x + 2);
+    __m128i x3 = _mm_loadu_si128 ((const __m128i *) x + 3);
+    x0 = _mm_xor_si128 (x0, _mm_loadu_si128 ((const __m128i *) y));
+    x1 = _mm_xor_si128 (x1, _mm_loadu_si128 ((const __m128i *) y + 1));
+    x2 = _mm_xor_si128 (x2, _mm_loadu_si128 ((const __m128i *) y + 2));
+    x3 = _mm_xor_si128 (x3, _mm_loadu_si128 ((const __m128i *) y + 3));
+    _mm_storeu_si128 ((__m128i *) d, x0);
+    _mm_storeu_si128 ((__m128i *) d + 1, x1);
+    _mm_storeu_si128 ((__m128i *) d + 2, x2);
+    _mm_storeu_si128 ((__m128i *) d + 3, x3);
+  }
+  for (; len >= 16; len -= 16, d += 16, x += 16, y += 16)
+    _mm_storeu_si128 ((__m128i *) d,
+		      _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) x),
+				     _mm_loadu_si128 ((const __m128i *) y)));
+  xor_scalar (d, x, y, len);
+}
+
+static AVX2 void
+xor_avx2 (void *dst, const void *a, const void *b, size_t len)
+{
+  u_char *d = (u_char *) dst;
+  const u_char *x = (const u_char *) a, *y = (const u_char *) b;
+
+  for (; len >= 128; len -= 128, d += 128, x += 128, y += 128) {
+    __m256i x0 = _mm256_loadu_si256 ((const __m256i *) x);
+    __m256i x1 = _mm256_loadu_si256 ((const __m256i *) x + 1);
+    __m256i x2 = _mm256_loadu_si256 ((const __m256i *) x + 2);
+    __m256i x3 = _mm256_loadu_si256 ((const __m256i *) x + 3);
+    x0 = _mm256_xor_si256 (x0, _mm256_loadu_si256 ((const __m256i *) y));
+    x1 = _mm256_xor_si256 (x1, _mm256_loadu_si256 ((const __m256i *) y + 1));
+    x2 = _mm256_xor_si256 (x2, _mm256_loadu_si256 ((const __m256i *) y + 2));
+    x3 = _mm256_xor_si256 (x3, _mm256_loadu_si256 ((const __m256i *) y + 3));
+    _mm256_storeu_si256 ((__m256i *) d, x0);
+    _mm256_storeu_si256 ((__m256i *) d + 1, x1);
+    _mm256_storeu_si256 ((__m256i *) d + 2, x2);
+    _mm256_storeu_si256 ((__m256i *) d + 3, x3);
+  }
+  for (; len >= 32; len -= 32, d += 32, x += 32, y += 32)
+    _mm256_storeu_si256 ((__m256i *) d,
+			 _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i *) x),
+					   _mm256_loadu_si256 ((const __m256i *) y)));
+  _mm256_zeroupper ();
+  xor_sse2 (d, x, y, len);
+}
+
+/* OR together the xor of every vector; no data-dependent branches */
+static SSE2 int
+differs_sse2 (const void *a, const void *b, size_t len)
+{
+  const u_char *x = (const u_char *) a, *y = (const u_char *) b;
+  __m128i acc = _mm_setzero_si128 ();
+
+  for (; len >= 16; len -= 16, x += 16, y += 16)
+    acc = _mm_or_si128 (acc, _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) x),
+					    _mm_loadu_si128 ((const __m128i *) y)));
+  acc = _mm_cmpeq_epi8 (acc, _mm_setzero_si128 ());
+  return (_mm_movemask_epi8 (acc) != 0xffff) | differs_scalar (x, y, len);
+}
+
+static AVX2 int
+differs_avx2 (const void *a, const void *b, size_t len)
+{
+  const u_char *x = (const u_char *) a, *y = (const u_char *) b;
+  __m256i acc = _mm256_setzero_si256 ();
+  int d;
+
+  for (; len >= 32; len -= 32, x += 32, y += 32)
+    acc = _mm256_or_si256 (acc, _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i *) x),
+						  _mm256_loadu_si256 ((const __m256i *) y)));
+  d = !_mm256_testz_si256 (acc, acc);
+  _mm256_zeroupper ();
+  return d | differs_sse2 (x, y, len);
+}
+#endif /* PV_HAVE_AESNI */
+
+/*
+ * dispatch
+ */
+
+static void xor_resolve (void *, const void *, const void *, size_t);
+static int differs_resolve (const void *, const void *, size_t);
+
+/* Both start out as a resolver that installs the real kernel and calls
+   it.  Threads racing here all store the same value, so no lock. */
+static xor_fn xor_impl = xor_resolve;
+static differs_fn differs_impl = differs_resolve;
+
+/* the kernel level the CPU (and PV_KERN) allows: 0 scalar, 1 sse2, 2 avx2 */
+static int
+kern_level (void)
+{
+  const char *cap = getenv ("PV_KERN");
+  int level = 0;
+
+#ifdef PV_HAVE_AESNI
+  if (__builtin_cpu_supports ("avx2"))
+    level = 2;
+  else if (__builtin_cpu_supports ("sse2"))
+    level = 1;
+#endif /* PV_HAVE_AESNI */
+  if (cap && !strcmp (cap, "scalar"))
+    level = 0;
+  else if (cap && !strcmp (cap, "sse2") && level > 1)
+    level = 1;
+  return level;
+}
+
+static void
+kern_select (int level, xor_fn *x, differs_fn *d)
+{
+  *x = xor_scalar;
+  *d = differs_scalar;
+#ifdef PV_HAVE_AESNI
+  if (level >= 2) {
+    *x = xor_avx2;
+    *d = differs_avx2;
+  }
+  else if (level == 1) {
+    *x = xor_sse2;
+    *d = differs_sse2;
+  }
+#else
+  (void) level;
+#endif /* PV_HAVE_AESNI */
+}
+
+static void
+xor_resolve (void *dst, const void *a, const void *b, size_t len)
+{
+  kern_select (kern_level (), &xor_impl, &differs_impl);
+  xor_impl (dst, a, b, len);
+}
+
+static int
+differs_resolve (const void *a, const void *b, size_t len)
+{
+  kern_select (kern_level (), &xor_impl, &differs_impl);
+  return differs_impl (a, b, len);
+}
+
+/* dst := a ^ b over len bytes, any alignment; dst may be a or b
+   (assert a,b,dst have at least len bytes allocated) */
+void
+xor_buffers (void *dst, const void *a, const void *b, size_t len)
+{
+  xor_impl (dst, a, b, len);
+}
+
+/* compares two MACs in time that depends only on len: nonzero if
+   they differ anywhere */
+int
+pv_ct_differs (const void *a, const void *b, size_t len)
+{
+  return differs_impl (a, b, len);
+}
+
+/* zero a buffer holding secrets in a way the compiler may not drop as
+   a dead store, unlike bzero right before free() or return */
+void
+pv_scrub (void *p, size_t len)
+{
+  memset (p, 0, len);
+#ifdef __GNUC__
+  __asm__ __volatile__ ("" : : "r" (p) : "memory");
+#else
+  {
+    volatile u_char *v = (volatile u_char *) p;
+    while (len--)
+      *v++ = 0;
+  }
+#endif
+}
+
+/* one vector through the kernels this run will use, against the
+   scalar code: a cheap check at start-up that the dispatch is sane
+   (pv_kern_check, run by make check, is the thorough one).  Returns 0
+   on success, -1 otherwise. */
+int
+pv_kern_selftest (void)
+{
+  u_char a[68], b[68], ref[68], out[68];
+  size_t i;
+  int ret = 0;
+
+  for (i = 0; i < sizeof (a); i++) {
+    a[i] = (u_char) (i * 29 + 7);
+    b[i] = (u_char) (i * 101 + 3);
+  }
+  xor_scalar (ref, a + 1, b + 2, 65);
+  xor_buffers (out + 3, a + 1, b + 2, 65);
+  if (memcmp (ref, out + 3, 65) || pv_ct_differs (a + 1, a + 1, 65) != 0)
+    ret = -1;
+  out[3 + 64] ^= 0x80;
+  if (pv_ct_differs (ref, out + 3, 65) == 0)
+    ret = -1;
+
+  if (ret)
+    fprintf (stderr, "%s: xor/compare kernel self-test failed\n",
+	     getprogname ());
+  return ret;
+}
+
+/* rate of x (or of d, if x is NULL) in MB/s over a 64K buffer */
+static double
+kern_rate (xor_fn x, differs_fn d, u_char *a, u_char *b, size_t len)
+{
+  struct timespec t0, t1;
+  double secs;
+  int n = 0, sink = 0;
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  do {
+    if (x)
+      x (a, a, b, len);
+    else
+      sink |= d (a, b, len);
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  } while (++n < 64 || secs < 0.05);
+  a[0] ^= (u_char) sink;	/* keep the comparisons */
+  return n * (double) len / secs / 1e6;
+}
+
+/* make check: every kernel level this CPU has against the scalar code,
+   over all lengths up to a few vectors and every misalignment mod 4,
+   in place and not; then the rate of each level next to the scalar
+   one, printed to stdout.  Returns 0 on success, -1 otherwise. */
+int
+pv_kern_check (void)
+{
+#define KT_MAX 200
+#define KT_RATE (64 << 10)
+  static const char *const name[3] = { "scalar", "sse2", "avx2" };
+  u_char a[KT_MAX + 4], b[KT_MAX + 4], ref[KT_MAX + 4], out[KT_MAX + 4];
+  u_char *ra, *rb;
+  double scalar[2] = { 0, 0 }, r[2];
+  xor_fn x;
+  differs_fn d;
+  int level, top = kern_level (), ret = 0;
+  size_t len, off, i;
+
+  for (i = 0; i < sizeof (a); i++) {
+    a[i] = (u_char) (i * 29 + 7);
+    b[i] = (u_char) (i * 101 + 3);
+  }
+  for (level = 0; level <= top && !ret; level++) {
+    kern_select (level, &x, &d);
+    for (len = 0; len <= KT_MAX && !ret; len++)
+      for (off = 0; off < 4 && !ret; off++) {
+	xor_scalar (ref, a + off, b + (3 - off), len);
+	x (out + off, a + off, b + (3 - off), len);
+	if (memcmp (ref, out + off, len))
+	  ret = -1;
+	memcpy (out, a + off, len);		/* in place */
+	x (out, out, b + (3 - off), len);
+	if (memcmp (ref, out, len))
+	  ret = -1;
+	if (d (a + off, a + off, len) != 0)
+	  ret = -1;
+	for (i = 0; i < 3 && len; i++) {	/* first, middle or last byte */
+	  memcpy (out, a + off, len);
+	  out[i * (len - 1) / 2] ^= 0x80;
+	  if (d (a + off, out, len) == 0)
+	    ret = -1;
+	}
+      }
+    if (ret)
+      fprintf (stderr, "%s: %s xor/compare kernel differs from the scalar "
+	       "code at length %lu\n", getprogname (), name[level],
+	       (unsigned long) len - 1);
+  }
+  pv_scrub (out, sizeof (out));
+  for (i = 0; i < sizeof (out); i++)
+    if (out[i]) {
+      fprintf (stderr, "%s: pv_scrub left data behind\n", getprogname ());
+      ret = -1;
+      break;
+    }
+  if (ret)
+    return ret;
+
+  if (!(ra = (u_char *) calloc (2, KT_RATE + 1))) {
+    fprintf (stderr, "%s: out of memory\n", getprogname ());
+    return -1;
+  }
+  rb = ra + KT_RATE + 1;
+  for (level = 0; level <= top; level++) {
+    kern_select (level, &x, &d);
+    r[0] = kern_rate (x, NULL, ra + 1, rb, KT_RATE);	/* misaligned */
+    r[1] = kern_rate (NULL, d, ra + 1, rb, KT_RATE);
+    if (!level) {
+      scalar[0] = r[0];
+      scalar[1] = r[1];
+    }
+    printf ("kern %-6s  xor %8.0f MB/s (%4.1fx scalar)  compare %8.0f MB/s "
+	    "(%4.1fx scalar)\n", name[level], r[0], r[0] / scalar[0],
+	    r[1], r[1] / scalar[1]);
+  }
+  free (ra);
+#undef KT_RATE
+#undef KT_MAX
+  return 0;
+}
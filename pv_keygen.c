@@ -18,9 +18,9 @@ write_skfile (const char *skfname, void *raw_sk, size_t raw_sklen)
     perror (getprogname ());
 
     /* scrub the buffer that's holding the key before exiting */
-    bzero(s, strlen(s)); 	/* scrub armored sk */
+    pv_scrub(s, strlen(s)); 	/* scrub armored sk */
     free (s);
-    bzero(raw_sk, raw_sklen);	/* scrub original buffer */
+    pv_scrub(raw_sk, raw_sklen);	/* scrub original buffer */
 
     exit (-1);
   }
@@ -29,7 +29,7 @@ write_skfile (const char *skfname, void *raw_sk, size_t raw_sklen)
     if (status != -1) {
       status = write (fdsk, "\n", 1);
     }
-    bzero(s, strlen(s)); 	/* scrub armored sk */
+    pv_scrub(s, strlen(s)); 	/* scrub armored sk */
     free (s);
     close (fdsk);
     /* do not scrub the key buffer under normal circumstances
@@ -41,7 +41,7 @@ write_skfile (const char *skfname, void *raw_sk, size_t raw_sklen)
       perror (getprogname ());
       
       /* scrub the buffer that's holding the key before exiting */
-      bzero(raw_sk, raw_sklen);	/* scrub original buffer */
+      pv_scrub(raw_sk, raw_sklen);	/* scrub original buffer */
           
       exit (-1);
     }
@@ -63,7 +63,7 @@ int
 main (int argc, char **argv)
 {
   /* argv[1] is the file name */
-  char raw_sk[2*CCA_STRENGTH];
+  char *raw_sk;
 
   if (argc != 2) {
     usage (argv[0]);
@@ -73,6 +73,10 @@ main (int argc, char **argv)
 
     /* first, let's create a new symmetric key */
     ri ();
+    if (!(raw_sk = (char *) pv_alloc (2*CCA_STRENGTH))) { /* locked */
+      perror (argv[0]);
+      exit (-1);
+    }
 
     /* Note that since we'll need to do both AES-CBC-MAC and HMAC-SHA1,
        there are actuall *two* symmetric keys, which could, e.g., be 
@@ -85,7 +89,7 @@ main (int argc, char **argv)
 
     /* finally, let's scrub the buffer that held the random bits 
        by overwriting with a bunch of 0's */
-    bzero(raw_sk, 2*CCA_STRENGTH);
+    pv_free(raw_sk, 2*CCA_STRENGTH);
 
   }
 
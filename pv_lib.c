@@ -0,0 +1,612 @@
+#include "pv.h"
+
+/* libpv: the cbc, cbc-sha256 and gcm formats (see pv.h) as a streaming
+ * API over caller-owned memory, for programs that would rather not
+ * fork pv_encrypt and go through temporary files.
+ *
+ * A context is set up by *_init, fed any number of *_update calls with
+ * whatever lengths the caller has at hand, and finished by *_final,
+ * which also scrubs it.  Nothing here allocates, prints or exits:
+ * every call returns PV_OK or a PV_ERR_* code.  Output buffers are the
+ * caller's; PV_UPDATE_MAX (n) and PV_FINAL_MAX bound what one call can
+ * produce, and a call whose output wouldn't fit fails with
+ * PV_ERR_SPACE having consumed nothing, so it can be retried.  Input
+ * and output must not overlap, and contexts must not be copied (the
+ * GCM state points at the AES key inside its own context).
+ *
+ * Both directions work in whole blocks and keep any ragged tail in the
+ * context.  Decryption also holds back the ciphertext that might turn
+ * out to be the trailer (MAC or tag) together with the last block of Y,
+ * so the zero padding is stripped by pv_decrypt_final without seeking.
+ * Note that, as with pv_decrypt, plaintext from pv_decrypt_update is
+ * released before the MAC has been checked: it must not be trusted
+ * until pv_decrypt_final returns PV_OK.  The one-shot
+ * pv_decrypt_buffer scrubs its output when that fails.
+ *
+ * The random IVs and nonces come from libdcrypt's generator, which has
+ * to have been seeded first (ri ()).  PV_MODE_SEG needs a whole segment
+ * in hand before anything can be MACed, so it stays with pv_encrypt
+ * and pv_decrypt.
+ */
+
+#define ST_HEAD 0			/* encrypt: header not out yet;
+					   decrypt: header still coming */
+#define ST_BODY 1
+#define ST_DONE 2
+
+static int
+check_key (const void *key, size_t keylen)
+{
+  return key && (keylen == 32 || keylen == 48 || keylen == 64)
+    ? 0 : PV_ERR_ARG;		/* AES-128/192/256, HMAC key alongside */
+}
+
+const char *
+pv_strerror (int err)
+{
+  switch (err) {
+  case PV_OK: return "success";
+  case PV_ERR_ARG: return "bad argument or call out of order";
+  case PV_ERR_SPACE: return "output buffer too small";
+  case PV_ERR_FORMAT: return "not a ciphertext, or truncated or malformed";
+  case PV_ERR_AUTH: return "MAC mismatch (wrong key or tampered ciphertext)";
+  case PV_ERR_MODE: return "format not supported here";
+  case PV_ERR_LENGTH: return "too long for the mode";
+  }
+  return "unknown error";
+}
+
+/* Encryption */
+
+int
+pv_encrypt_init (struct pv_encrypt_ctx *c, const void *key, size_t keylen,
+		 int mode)
+{
+  const char *k = (const char *) key;
+  const size_t half = keylen / 2;
+  const int flags = mode >> 8;	/* PV_MODE_FLAGS */
+  struct pv_hdr h;
+
+  mode &= 0xff;
+  if (mode == PV_MODE_SEG)
+    return PV_ERR_MODE;
+  if (check_key (key, keylen) != 0 || (mode != PV_MODE_CBC
+					&& mode != PV_MODE_CBC_SHA256
+					&& mode != PV_MODE_GCM)
+      || flags & ~PV_FLAG_LZ || (flags && mode == PV_MODE_CBC))
+    return PV_ERR_ARG;		/* (the classic format has no header) */
+
+  bzero (c, sizeof (*c));
+  c->mode = mode;
+  pv_aes_setkey (&c->aes, k, half);
+  if (mode != PV_MODE_CBC) {
+    bzero (&h, sizeof (h));
+    h.version = PV_VERSION;
+    h.mode = mode;
+    h.flags = flags;
+    pv_hdr_pack (c->head, &h);
+    c->nhead = PV_HDR_LEN;
+  }
+
+  if (mode == PV_MODE_GCM) {
+    pv_random (c->head + c->nhead, PV_GCM_NONCE_LEN);
+    pv_gcm_init (&c->gcm, &c->aes, (u_char *) c->head + c->nhead);
+    pv_gcm_aad (&c->gcm, c->head, PV_HDR_LEN);
+    c->nhead += PV_GCM_NONCE_LEN;
+  }
+  else {
+    do
+      pv_random (c->iv, BLOCK_LEN);
+    while (!memcmp (c->iv, PV_MAGIC, PV_MAGIC_LEN)); /* not a header */
+    memcpy (c->head + c->nhead, c->iv, BLOCK_LEN);
+    c->nhead += BLOCK_LEN;
+    pv_hmac_init (&c->mac, mode == PV_MODE_CBC ? PV_MAC_SHA1 : PV_MAC_SHA256,
+		  k + half, half);
+    pv_hmac_update (&c->mac, c->head, c->nhead);
+  }
+  c->state = ST_HEAD;
+  return PV_OK;
+}
+
+/* out := E(in), len a multiple of BLOCK_LEN */
+static int
+enc_blocks (struct pv_encrypt_ctx *c, char *out, const char *in, size_t len)
+{
+  struct pv_stamp t;
+  int r = PV_OK;
+
+  pv_stats_begin (&t);
+  if (c->mode == PV_MODE_GCM) {
+    r = pv_gcm_encrypt (&c->gcm, out, in, len) ? PV_ERR_LENGTH : PV_OK;
+    pv_stats_end (PV_PH_CIPHER, &t);
+    return r;
+  }
+  pv_cbc_encrypt (&c->aes, out, in, len, c->iv);
+  pv_stats_end (PV_PH_CIPHER, &t);
+  pv_stats_begin (&t);
+  pv_hmac_update (&c->mac, out, len);
+  pv_stats_end (PV_PH_MAC, &t);
+  return r;
+}
+
+/* the header and IV (or nonce), then every whole block of ptxt so far */
+int
+pv_encrypt_update (struct pv_encrypt_ctx *c, const void *in, size_t inlen,
+		   void *out, size_t outcap, size_t *outlen)
+{
+  const char *p = (const char *) in;
+  char *o = (char *) out;
+  size_t head, n, k;
+  int r;
+
+  *outlen = 0;
+  if (c->state == ST_DONE)
+    return PV_ERR_ARG;
+  head = c->state == ST_HEAD ? c->nhead : 0;
+  n = (c->npart + inlen) / BLOCK_LEN * BLOCK_LEN; /* whole blocks */
+  if (outcap < head + n)
+    return PV_ERR_SPACE;
+
+  memcpy (o, c->head, head);
+  o += head;
+  c->state = ST_BODY;
+  if (c->npart && n) {		/* finish the held-back block first */
+    k = BLOCK_LEN - c->npart;
+    memcpy (c->part + c->npart, p, k);
+    p += k;
+    inlen -= k;
+    if ((r = enc_blocks (c, o, c->part, BLOCK_LEN)) != PV_OK)
+      return r;
+    o += BLOCK_LEN;
+    n -= BLOCK_LEN;
+    c->npart = 0;
+  }
+  if (n && (r = enc_blocks (c, o, p, n)) != PV_OK)
+    return r;
+  o += n;
+  memcpy (c->part + c->npart, p + n, inlen - n);
+  c->npart += inlen - n;
+  *outlen = o - (char *) out;
+  return PV_OK;
+}
+
+/* the (padded) last block and the trailer; scrubs c */
+int
+pv_encrypt_final (struct pv_encrypt_ctx *c, void *out, size_t outcap,
+		  size_t *outlen)
+{
+  char *o = (char *) out;
+  u_int32_t numpad0 = 0;
+  size_t need;
+  int r;
+
+  *outlen = 0;
+  if (c->state == ST_DONE)
+    return PV_ERR_ARG;
+  need = (c->state == ST_HEAD ? c->nhead : 0) + (c->mode == PV_MODE_GCM
+    ? c->npart + PV_GCM_TAG_LEN
+    : (c->npart ? BLOCK_LEN : 0) + c->mac.outlen + 4);
+  if (outcap < need)
+    return PV_ERR_SPACE;
+  if (c->state == ST_HEAD) {
+    memcpy (o, c->head, c->nhead);
+    o += c->nhead;
+  }
+
+  if (c->mode == PV_MODE_GCM) {
+    if (pv_gcm_encrypt (&c->gcm, o, c->part, c->npart) != 0) {
+      pv_encrypt_clr (c);
+      return PV_ERR_LENGTH;
+    }
+    o += c->npart;
+    pv_gcm_final (&c->gcm, (u_char *) o);
+    o += PV_GCM_TAG_LEN;
+  }
+  else {
+    if (c->npart) {		/* final block; 0-pad */
+      numpad0 = BLOCK_LEN - c->npart;
+      bzero (c->part + c->npart, numpad0);
+      if ((r = enc_blocks (c, o, c->part, BLOCK_LEN)) != PV_OK)
+	return r;
+      o += BLOCK_LEN;
+    }
+    pv_hmac_padlen (&c->mac, c->mode, numpad0);
+    pv_hmac_final (&c->mac, (u_char *) o);
+    o += c->mac.outlen;
+    putint (o, numpad0);
+    o += 4;
+  }
+
+  *outlen = o - (char *) out;
+  pv_encrypt_clr (c);
+  return PV_OK;
+}
+
+void
+pv_encrypt_clr (struct pv_encrypt_ctx *c)
+{
+  pv_aes_clrkey (&c->aes);
+  pv_scrub (c, sizeof (*c));
+  c->state = ST_DONE;
+}
+
+/* Decryption */
+
+int
+pv_decrypt_init (struct pv_decrypt_ctx *c, const void *key, size_t keylen)
+{
+  const size_t half = keylen / 2;
+
+  if (check_key (key, keylen) != 0)
+    return PV_ERR_ARG;
+  bzero (c, sizeof (*c));
+  c->mode = -1;
+  pv_aes_setkey (&c->aes, key, half);
+  memcpy (c->mackey, (const char *) key + half, half);
+  c->mackeylen = half;
+  c->headlen = PV_HDR_LEN;	/* for a start: a header or the IV? */
+  c->state = ST_HEAD;
+  return PV_OK;
+}
+
+/* the same, but the context only checks the MAC (or the gcm tag):
+   pv_decrypt_update and pv_decrypt_final take no output buffer (out
+   may be NULL) and release nothing, and pv_decrypt_final's result
+   says whether the ciphertext is authentic.  No AES key schedule is
+   set up for the cbc formats; gcm needs one for its hash key and tag
+   mask, but none of the keystream is generated. */
+int
+pv_verify_init (struct pv_decrypt_ctx *c, const void *key, size_t keylen)
+{
+  const size_t half = keylen / 2;
+
+  if (check_key (key, keylen) != 0)
+    return PV_ERR_ARG;
+  bzero (c, sizeof (*c));
+  c->mode = -1;
+  c->verify = 1;
+  memcpy (c->aeskey, key, half);
+  memcpy (c->mackey, (const char *) key + half, half);
+  c->mackeylen = half;
+  c->headlen = PV_HDR_LEN;
+  c->state = ST_HEAD;
+  return PV_OK;
+}
+
+/* let pv_decrypt_update spread CBC decryption over a caller's pool,
+   in up to njobs pieces (pv_cbc_decrypt_start) */
+void
+pv_decrypt_threads (struct pv_decrypt_ctx *c, struct pv_pool *pool,
+		    struct pv_cbc_job *jobs, int njobs)
+{
+  c->pool = pool;
+  c->jobs = jobs;
+  c->njobs = njobs;
+}
+
+/* the mode and flags of a ctxt whose first PV_HDR_LEN bytes are b,
+   and how long its header and IV (or nonce) are.  Returns PV_OK, or an
+   error (and sets nothing). */
+static int
+head_mode (const char *b, int *mode, int *flags, size_t *headlen)
+{
+  struct pv_hdr h;
+
+  if (pv_hdr_parse (&h, b) != 0) {
+    *mode = PV_MODE_CBC;	/* the classic format: that was the IV */
+    *flags = 0;
+    *headlen = PV_HDR_LEN;
+    return PV_OK;
+  }
+  if (h.version != PV_VERSION || h.flags & ~PV_FLAG_LZ)
+    return PV_ERR_FORMAT;
+  if (h.mode == PV_MODE_SEG)
+    return PV_ERR_MODE;
+  if (h.mode == PV_MODE_CBC_SHA256)
+    *headlen = PV_HDR_LEN + BLOCK_LEN;
+  else if (h.mode == PV_MODE_GCM)
+    *headlen = PV_HDR_LEN + PV_GCM_NONCE_LEN;
+  else
+    return PV_ERR_FORMAT;
+  *mode = h.mode;
+  *flags = h.flags;
+  return PV_OK;
+}
+
+/* how much ctxt decryption holds back in mode: the trailer (and for
+   the CBC formats the last block of Y with its padding); for gcm a
+   block more than needed, to match */
+static size_t
+dec_keep (int mode)
+{
+  if (mode == PV_MODE_GCM)
+    return BLOCK_LEN + PV_GCM_TAG_LEN;
+  return BLOCK_LEN + (mode == PV_MODE_CBC ? HMAC_LEN : PV_SHA256_LEN) + 4;
+}
+
+/* c->head is complete when it's PV_HDR_LEN bytes and not a header,
+   or a header with what follows it.  Returns PV_OK, or an error. */
+static int
+dec_head (struct pv_decrypt_ctx *c)
+{
+  int r;
+
+  if (c->mode == -1) {
+    if ((r = head_mode (c->head, &c->mode, &c->flags, &c->headlen)) != PV_OK)
+      return r;
+    if (c->nhead < c->headlen)
+      return PV_OK;		/* more to come */
+  }
+
+  if (c->mode == PV_MODE_GCM) {
+    if (c->verify)
+      pv_aes_setkey (&c->aes, c->aeskey, c->mackeylen);
+    pv_gcm_init (&c->gcm, &c->aes, (u_char *) c->head + PV_HDR_LEN);
+    pv_gcm_aad (&c->gcm, c->head, PV_HDR_LEN);
+  }
+  else {
+    memcpy (c->iv, c->head + c->headlen - BLOCK_LEN, BLOCK_LEN);
+    pv_hmac_init (&c->mac, c->mode == PV_MODE_CBC ? PV_MAC_SHA1 : PV_MAC_SHA256,
+		  c->mackey, c->mackeylen);
+    pv_hmac_update (&c->mac, c->head, c->headlen);
+  }
+  c->keep = dec_keep (c->mode);
+  pv_scrub (c->mackey, sizeof (c->mackey));
+  pv_scrub (c->aeskey, sizeof (c->aeskey));
+  c->state = ST_BODY;
+  return PV_OK;
+}
+
+/* out := D(in), len a multiple of BLOCK_LEN (or, verifying, just
+   authenticate in) */
+static int
+dec_blocks (struct pv_decrypt_ctx *c, char *out, const char *in, size_t len)
+{
+  struct pv_stamp t;
+  int r = PV_OK;
+
+  if (c->verify) {
+    pv_stats_begin (&t);
+    if (c->mode == PV_MODE_GCM)
+      r = pv_gcm_hash (&c->gcm, in, len) ? PV_ERR_LENGTH : PV_OK;
+    else
+      pv_hmac_update (&c->mac, in, len);
+    pv_stats_end (PV_PH_MAC, &t);
+    return r;
+  }
+  pv_stats_begin (&t);
+  if (c->mode == PV_MODE_GCM) {
+    r = pv_gcm_decrypt (&c->gcm, out, in, len) ? PV_ERR_LENGTH : PV_OK;
+    pv_stats_end (PV_PH_CIPHER, &t);
+    return r;
+  }
+  /* MAC the ctxt while the pool (if any) decrypts it; the wait for the
+     pool is what --stats shows as cipher time then */
+  pv_cbc_decrypt_start (c->pool, c->jobs, c->njobs, &c->aes, out, in, len,
+			c->iv);
+  pv_stats_end (PV_PH_CIPHER, &t);
+  pv_stats_begin (&t);
+  pv_hmac_update (&c->mac, in, len);
+  pv_stats_end (PV_PH_MAC, &t);
+  if (c->pool) {
+    pv_stats_begin (&t);
+    pv_pool_wait (c->pool);
+    pv_stats_end (PV_PH_CIPHER, &t);
+  }
+  return r;
+}
+
+/* the plaintext an update with inlen more bytes at p will release,
+   worked out without touching c (the header's bytes release none), so
+   that one that won't fit can fail before consuming anything */
+static size_t
+dec_out_len (const struct pv_decrypt_ctx *c, const char *p, size_t inlen)
+{
+  char b[PV_HDR_LEN];
+  size_t headlen = c->headlen, nla = c->nla, keep = c->keep, k;
+  int mode = c->mode, flags;
+
+  if (c->state == ST_HEAD) {
+    if (mode == -1) {
+      if (c->nhead + inlen < PV_HDR_LEN)
+	return 0;
+      memcpy (b, c->head, c->nhead);
+      memcpy (b + c->nhead, p, PV_HDR_LEN - c->nhead);
+      if (head_mode (b, &mode, &flags, &headlen) != PV_OK)
+	return 0;		/* the update will fail on it anyway */
+    }
+    k = headlen - c->nhead;
+    if (inlen <= k)
+      return 0;
+    inlen -= k;
+    keep = dec_keep (mode);
+    nla = 0;			/* nothing is held back until then */
+  }
+  if (nla + inlen < keep + BLOCK_LEN)
+    return 0;
+  return (nla + inlen - keep) / BLOCK_LEN * BLOCK_LEN;
+}
+
+/* every whole block of ctxt so far, except the last c->keep bytes */
+int
+pv_decrypt_update (struct pv_decrypt_ctx *c, const void *in, size_t inlen,
+		   void *out, size_t outcap, size_t *outlen)
+{
+  const char *p = (const char *) in;
+  char *o = c->verify ? NULL : (char *) out;
+  size_t n, k;
+  int r;
+
+  *outlen = 0;
+  if (c->state == ST_DONE)
+    return PV_ERR_ARG;
+  if (!c->verify && outcap < dec_out_len (c, p, inlen))
+    return PV_ERR_SPACE;	/* before the header is taken in */
+  while (c->state == ST_HEAD && inlen) {
+    k = c->headlen - c->nhead;
+    if (k > inlen)
+      k = inlen;
+    memcpy (c->head + c->nhead, p, k);
+    c->nhead += k;
+    p += k;
+    inlen -= k;
+    if (c->nhead == c->headlen && (r = dec_head (c)) != PV_OK)
+      return r;
+  }
+  if (c->state == ST_HEAD || c->nla + inlen < c->keep + BLOCK_LEN) {
+    memcpy (c->la + c->nla, p, inlen); /* not a whole block to spare */
+    c->nla += inlen;
+    return PV_OK;
+  }
+
+  n = (c->nla + inlen - c->keep) / BLOCK_LEN * BLOCK_LEN;
+  while (n && c->nla) {		/* the held-back bytes go first */
+    if (c->nla < BLOCK_LEN) {
+      k = BLOCK_LEN - c->nla;
+      memcpy (c->la + c->nla, p, k);
+      c->nla += k;
+      p += k;
+      inlen -= k;
+    }
+    if ((r = dec_blocks (c, o, c->la, BLOCK_LEN)) != PV_OK)
+      return r;
+    memmove (c->la, c->la + BLOCK_LEN, c->nla -= BLOCK_LEN);
+    if (o)
+      o += BLOCK_LEN;
+    n -= BLOCK_LEN;
+  }
+  if (n && (r = dec_blocks (c, o, p, n)) != PV_OK)
+    return r;
+  if (o)
+    o += n;
+  memcpy (c->la + c->nla, p + n, inlen - n);
+  c->nla += inlen - n;
+  *outlen = c->verify ? 0 : o - (char *) out;
+  return PV_OK;
+}
+
+/* checks the MAC or tag and releases the last, unpadded bytes of
+   ptxt; scrubs c either way */
+int
+pv_decrypt_final (struct pv_decrypt_ctx *c, void *out, size_t outcap,
+		  size_t *outlen)
+{
+  u_char mac[PV_MAC_MAX_LEN];
+  char last[2 * BLOCK_LEN];
+  u_int32_t numpad0 = 0;
+  size_t ctlen, maclen;
+  int r = PV_OK;
+
+  *outlen = 0;
+  if (c->state == ST_DONE)
+    return PV_ERR_ARG;
+  maclen = c->mode == PV_MODE_GCM ? PV_GCM_TAG_LEN : c->mac.outlen;
+  if (c->state == ST_HEAD || c->nla < c->keep - BLOCK_LEN) {
+    pv_decrypt_clr (c);
+    return PV_ERR_FORMAT;	/* too short even for an empty ptxt */
+  }
+  ctlen = c->nla - (c->keep - BLOCK_LEN);
+  if (c->mode != PV_MODE_GCM && ctlen % BLOCK_LEN) {
+    pv_decrypt_clr (c);
+    return PV_ERR_FORMAT;
+  }
+  if (outcap < ctlen && !c->verify)
+    return PV_ERR_SPACE;
+
+  if (c->mode == PV_MODE_GCM) {
+    if ((c->verify ? pv_gcm_hash (&c->gcm, c->la, ctlen)
+	 : pv_gcm_decrypt (&c->gcm, last, c->la, ctlen)) != 0)
+      r = PV_ERR_LENGTH;
+    pv_gcm_final (&c->gcm, mac);
+  }
+  else {
+    r = dec_blocks (c, last, c->la, ctlen);
+    numpad0 = getint (c->la + ctlen + maclen);	/* trusted after the MAC */
+    pv_hmac_padlen (&c->mac, c->mode, numpad0);
+    pv_hmac_final (&c->mac, mac);
+  }
+  if (r == PV_OK && pv_ct_differs (mac, c->la + ctlen, maclen))
+    r = PV_ERR_AUTH;
+  else if (r == PV_OK && (numpad0 >= BLOCK_LEN || numpad0 > ctlen))
+    r = PV_ERR_FORMAT;		/* authentic, yet not ours */
+  if (r == PV_OK && !c->verify) {
+    memcpy (out, last, ctlen - numpad0);
+    *outlen = ctlen - numpad0;
+  }
+
+  pv_scrub (last, sizeof (last));
+  pv_decrypt_clr (c);
+  return r;
+}
+
+void
+pv_decrypt_clr (struct pv_decrypt_ctx *c)
+{
+  pv_aes_clrkey (&c->aes);
+  pv_scrub (c, sizeof (*c));
+  c->state = ST_DONE;
+}
+
+/* One-shot, memory to memory */
+
+/* how long the ciphertext of inlen bytes will be */
+size_t
+pv_encrypt_length (int mode, size_t inlen)
+{
+  if (mode == PV_MODE_GCM)
+    return PV_HDR_LEN + PV_GCM_NONCE_LEN + inlen + PV_GCM_TAG_LEN;
+  return (mode == PV_MODE_CBC ? 0 : PV_HDR_LEN) + BLOCK_LEN
+    + (inlen + BLOCK_LEN - 1) / BLOCK_LEN * BLOCK_LEN
+    + (mode == PV_MODE_CBC ? HMAC_LEN : PV_SHA256_LEN) + 4;
+}
+
+int
+pv_encrypt_buffer (const void *key, size_t keylen, int mode,
+		   const void *in, size_t inlen, void *out, size_t outcap,
+		   size_t *outlen)
+{
+  struct pv_encrypt_ctx c;
+  size_t n, m;
+  int r;
+
+  *outlen = 0;
+  if ((r = pv_encrypt_init (&c, key, keylen, mode)) != PV_OK)
+    return r;
+  if (outcap < pv_encrypt_length (mode, inlen)) {
+    pv_encrypt_clr (&c);
+    return PV_ERR_SPACE;
+  }
+  if ((r = pv_encrypt_update (&c, in, inlen, out, outcap, &n)) != PV_OK
+      || (r = pv_encrypt_final (&c, (char *) out + n, outcap - n, &m))
+      != PV_OK) {
+    pv_encrypt_clr (&c);
+    return r;
+  }
+  *outlen = n + m;
+  return PV_OK;
+}
+
+/* out must have room for inlen bytes (the ptxt is always shorter).
+   On failure out is scrubbed: none of it is to be trusted. */
+int
+pv_decrypt_buffer (const void *key, size_t keylen, const void *in,
+		   size_t inlen, void *out, size_t outcap, size_t *outlen)
+{
+  struct pv_decrypt_ctx c;
+  size_t n = 0, m;
+  int r;
+
+  *outlen = 0;
+  if ((r = pv_decrypt_init (&c, key, keylen)) != PV_OK)
+    return r;
+  if ((r = pv_decrypt_update (&c, in, inlen, out, outcap, &n)) != PV_OK
+      || (c.flags && (r = PV_ERR_MODE)) /* --compress: no room to undo it */
+      || (r = pv_decrypt_final (&c, (char *) out + n, outcap - n, &m))
+      != PV_OK) {
+    pv_decrypt_clr (&c);
+    pv_scrub (out, n);
+    return r;
+  }
+  *outlen = n + m;
+  return PV_OK;
+}
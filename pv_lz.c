@@ -0,0 +1,351 @@
+#include "pv.h"
+
+/* --compress: a small LZ77 codec in the style of LZ4, fast enough to
+ * sit in front of the cipher (a single greedy pass with a hash table
+ * of 4-byte sequences) and simple enough to decode safely.
+ *
+ * The plaintext is cut into blocks of at most PV_LZ_BLOCK bytes, each
+ * compressed on its own (so matches reach back at most 64K), and each
+ * written out as a frame:
+ *
+ *     length (32 bits, big endian; top bit set if stored) | payload
+ *
+ * where the payload is the block itself if it wouldn't shrink, or else
+ * a run of sequences
+ *
+ *     token | [more literal length] | literals | offset (16 bits, little
+ *       endian) | [more match length]
+ *
+ * with the literal length in the high nibble of the token and the match
+ * length less PV_LZ_MINMATCH in the low one; a nibble of 15 continues
+ * in the bytes after it, each adding its value, until one below 255.
+ * The last sequence of a block has only literals.
+ *
+ * pv_decrypt of a cbc ciphertext releases plaintext before the MAC has
+ * been checked, so the decoder must take any bytes at all without
+ * reading or writing out of bounds.
+ */
+
+#define PV_LZ_MINMATCH 4
+#define PV_LZ_STORED 0x80000000u
+#define LZ_LASTLIT 5		/* a match ends this far before a block's end */
+#define LZ_SLACK 16		/* room past a decoded block for wide copies */
+
+static u_int32_t
+load32 (const u_char *p)
+{
+  u_int32_t v;
+
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static u_int64_t
+load64 (const u_char *p)
+{
+  u_int64_t v;
+
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static u_int
+lz_hash (u_int32_t v)
+{
+  return (v * 2654435761u) >> (32 - PV_LZ_HASH_LOG);
+}
+
+/* a length past its nibble: 255s, then the rest */
+static u_char *
+put_len (u_char *op, size_t n)
+{
+  for (; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = (u_char) n;
+  return op;
+}
+
+/* one sequence; returns NULL if it wouldn't fit before oend.  The
+   block being compressed ends at iend. */
+static u_char *
+put_seq (u_char *op, u_char *oend, const u_char *iend, const u_char *lit,
+	 size_t nlit, size_t off, size_t mlen)
+{
+  u_char *token = op;
+
+  if ((size_t) (oend - op) < 1 + nlit + nlit / 255 + 1 + 2 + mlen / 255 + 1)
+    return NULL;
+  op++;
+  *token = (u_char) ((nlit < 15 ? nlit : 15) << 4);
+  if (nlit >= 15)
+    op = put_len (op, nlit - 15);
+  if (nlit <= 16 && oend - op >= 16 && iend - lit >= 16)
+    memcpy (op, lit, 16);	/* the usual short run, in one go */
+  else
+    memcpy (op, lit, nlit);
+  op += nlit;
+  if (!mlen)
+    return op;			/* the last sequence */
+  *op++ = (u_char) off;
+  *op++ = (u_char) (off >> 8);
+  mlen -= PV_LZ_MINMATCH;
+  *token |= (u_char) (mlen < 15 ? mlen : 15);
+  if (mlen >= 15)
+    op = put_len (op, mlen - 15);
+  return op;
+}
+
+/* compresses in[0..len] (len <= PV_LZ_BLOCK) into out; returns the
+   compressed length, or 0 if it wouldn't come out shorter than len */
+static size_t
+lz_block (struct pv_lz *z, u_char *out, const u_char *in, size_t len)
+{
+  const u_char *ip = in, *anchor = in, *ref, *p, *q;
+  const u_char *const end = in + len;
+  const u_char *const limit = end - LZ_LASTLIT;
+  u_char *op = out, *const oend = out + len;
+  u_int32_t seq, cand;
+  u_int h;
+
+  if (len < PV_LZ_MINMATCH + LZ_LASTLIT + 1)
+    return 0;
+  /* the table holds positions in earlier blocks too; they are only
+     hints, each is checked against the bytes themselves */
+  while (ip + PV_LZ_MINMATCH <= limit) {
+    seq = load32 (ip);
+    h = lz_hash (seq);
+    cand = z->table[h];
+    z->table[h] = (u_int32_t) (ip - in);
+    if (cand >= (u_int32_t) (ip - in) || (ip - in) - cand > 0xffff
+	|| load32 (in + cand) != seq) {
+      ip += 1 + ((ip - anchor) >> 6); /* skip faster through noise */
+      continue;
+    }
+    ref = in + cand;
+    while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+    p = ip + PV_LZ_MINMATCH;
+    q = ref + PV_LZ_MINMATCH;
+    while (p + 8 <= limit && load64 (p) == load64 (q)) {
+      p += 8;
+      q += 8;
+    }
+#if defined (__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (p + 8 <= limit)		/* the first byte that differs */
+      p += __builtin_ctzll (load64 (p) ^ load64 (q)) >> 3;
+    else
+#endif
+      while (p < limit && *p == *q) {
+	p++;
+	q++;
+      }
+    if (!(op = put_seq (op, oend, end, anchor, ip - anchor, ip - ref, p - ip)))
+      return 0;
+    ip = anchor = p;
+    if (ip + PV_LZ_MINMATCH <= limit) /* a hint for the next match */
+      z->table[lz_hash (load32 (ip - 2))] = (u_int32_t) (ip - 2 - in);
+  }
+  if (!(op = put_seq (op, oend, end, anchor, end - anchor, 0, 0))
+      || op >= oend)
+    return 0;
+  return op - out;
+}
+
+void
+pv_lz_init (struct pv_lz *z)
+{
+  bzero (z, sizeof (*z));
+}
+
+/* in[0..len] as frames into out, which has room for PV_LZ_BOUND(len)
+   bytes; returns the number of bytes written */
+size_t
+pv_lz_frames (struct pv_lz *z, char *out, const char *in, size_t len)
+{
+  char *op = out;
+  size_t n, c;
+
+  for (; len; in += n, len -= n) {
+    n = len < PV_LZ_BLOCK ? len : PV_LZ_BLOCK;
+    c = lz_block (z, (u_char *) op + 4, (const u_char *) in, n);
+    if (c)
+      putint (op, c);
+    else {
+      memcpy (op + 4, in, n);
+      putint (op, n | PV_LZ_STORED);
+      c = n;
+    }
+    op += 4 + c;
+  }
+  return op - out;
+}
+
+/* the block in in[0..len] into out, which has room for PV_LZ_BLOCK
+   bytes and LZ_SLACK more that copies 16 (or 8) bytes at a time may
+   scribble on; returns its length, or -1 if in isn't a valid block */
+static ssize_t
+unlz_block (u_char *out, const u_char *in, size_t len)
+{
+  const u_char *ip = in, *const iend = in + len, *ref;
+  u_char *op = out, *const oend = out + PV_LZ_BLOCK, *end;
+  size_t nlit, mlen, off;
+  u_int b;
+
+  while (ip < iend) {
+    b = *ip++;
+    nlit = b >> 4;
+    mlen = (b & 15) + PV_LZ_MINMATCH;
+    if (nlit == 15)
+      do {
+	if (ip == iend)
+	  return -1;
+	nlit += b = *ip++;
+      } while (b == 255);
+    if (nlit > (size_t) (iend - ip) || nlit > (size_t) (oend - op))
+      return -1;
+    if (nlit <= 16 && iend - ip >= 16)
+      memcpy (op, ip, 16);	/* the usual short run, in one go */
+    else
+      memcpy (op, ip, nlit);
+    op += nlit;
+    ip += nlit;
+    if (ip == iend)
+      break;			/* the last sequence */
+
+    if (iend - ip < 2)
+      return -1;
+    off = ip[0] | (size_t) ip[1] << 8;
+    ip += 2;
+    if (mlen == 15 + PV_LZ_MINMATCH)
+      do {
+	if (ip == iend)
+	  return -1;
+	mlen += b = *ip++;
+      } while (b == 255);
+    if (!off || off > (size_t) (op - out) || mlen > (size_t) (oend - op))
+      return -1;
+    ref = op - off;
+    end = op + mlen;
+    if (off >= 16)		/* whole copies never overlap */
+      for (; op < end; op += 16, ref += 16)
+	memcpy (op, ref, 16);
+    else if (off >= 8)
+      for (; op < end; op += 8, ref += 8)
+	memcpy (op, ref, 8);
+    else
+      while (op < end)
+	*op++ = *ref++;
+    op = end;
+  }
+  return op - out;
+}
+
+int
+pv_unlz_init (struct pv_unlz *u)
+{
+  bzero (u, sizeof (*u));
+  u->frame = (char *) pv_alloc (4 + PV_LZ_BLOCK);
+  u->out = (char *) pv_alloc (PV_LZ_BLOCK + LZ_SLACK);
+  if (!u->frame || !u->out) {
+    pv_unlz_free (u);
+    return -1;
+  }
+  return 0;
+}
+
+/* one whole frame, its length already checked */
+static int
+unlz_frame (struct pv_unlz *u, const char *f, u_int32_t flen,
+	    int (*put) (void *, const char *, size_t), void *arg)
+{
+  ssize_t n;
+
+  if (flen & PV_LZ_STORED)
+    return put (arg, f + 4, flen & ~PV_LZ_STORED) ? -2 : 0;
+  if ((n = unlz_block ((u_char *) u->out, (const u_char *) f + 4, flen)) < 0)
+    return -1;
+  return put (arg, u->out, n) ? -2 : 0;
+}
+
+/* the length in a frame header, or 0 if it can't be one */
+static u_int32_t
+frame_len (const char *f)
+{
+  u_int32_t flen = getint (f), n = flen & ~PV_LZ_STORED;
+
+  return n && n <= PV_LZ_BLOCK ? flen : 0;
+}
+
+/* Decodes the frames in in[0..len], which may start or end part way
+   through one, and hands each block to put (arg, data, n), which
+   returns 0 or non-zero to stop.  Returns 0, -1 if the frames are
+   corrupt, or -2 if put failed. */
+int
+pv_unlz_update (struct pv_unlz *u, const char *in, size_t len,
+		int (*put) (void *, const char *, size_t), void *arg)
+{
+  u_int32_t flen;
+  size_t k;
+  int r;
+
+  while (len) {
+    if (u->nframe || len < 4) { /* part of a frame: gather it */
+      if (u->nframe < 4) {
+	k = 4 - u->nframe < len ? 4 - u->nframe : len;
+	memcpy (u->frame + u->nframe, in, k);
+	u->nframe += k;
+	in += k;
+	len -= k;
+	if (u->nframe < 4)
+	  return 0;
+	if (!(u->flen = frame_len (u->frame)))
+	  return -1;
+      }
+      k = 4 + (u->flen & ~PV_LZ_STORED) - u->nframe;
+      if (k > len)
+	k = len;
+      memcpy (u->frame + u->nframe, in, k);
+      u->nframe += k;
+      in += k;
+      len -= k;
+      if (u->nframe < 4 + (u->flen & ~PV_LZ_STORED))
+	return 0;
+      if ((r = unlz_frame (u, u->frame, u->flen, put, arg)) != 0)
+	return r;
+      u->nframe = 0;
+      continue;
+    }
+    if (!(flen = frame_len (in)))
+      return -1;
+    if (len < 4 + (flen & ~PV_LZ_STORED)) {
+      memcpy (u->frame, in, 4); /* the rest comes later */
+      u->nframe = 4;
+      u->flen = flen;
+      in += 4;
+      len -= 4;
+      continue;
+    }
+    if ((r = unlz_frame (u, in, flen, put, arg)) != 0)
+      return r;
+    in += 4 + (flen & ~PV_LZ_STORED);
+    len -= 4 + (flen & ~PV_LZ_STORED);
+  }
+  return 0;
+}
+
+/* 0 if the stream ended on a frame boundary, -1 if not */
+int
+pv_unlz_final (struct pv_unlz *u)
+{
+  return u->nframe ? -1 : 0;
+}
+
+void
+pv_unlz_free (struct pv_unlz *u)
+{
+  pv_free (u->out, PV_LZ_BLOCK + LZ_SLACK);
+  pv_free (u->frame, 4 + PV_LZ_BLOCK);
+  u->out = u->frame = NULL;
+}
@@ -65,7 +65,7 @@ ri (void)
     else {
       /* we found a random device; let's get some bytes from it */
       ssize_t seed_len = 32;
-      char *seed = (char *) malloc (seed_len * sizeof (char));
+      char *seed = (char *) pv_alloc (seed_len * sizeof (char));
       int cur_bytes_read, bytes_read = 0; 
 
       bytes_read = 0;
@@ -85,8 +85,7 @@ ri (void)
 	exit (-1);	
       }
       
-      bzero (seed, seed_len);
-      free (seed);
+      pv_free (seed, seed_len);
       seed = NULL;
     }
   }
@@ -102,10 +101,22 @@ ri (void)
     rid.pid = getpid ();
     rid.time = time (NULL);
     prng_seed (&rid, sizeof (rid));
-    bzero (&rid, sizeof (rid));
+    pv_scrub (&rid, sizeof (rid));
   }
 }
 
+/* prng_getbytes for threaded callers: libdcrypt's generator is one
+   global state, so --batch workers take turns at it */
+static pthread_mutex_t prng_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+pv_random (void *buf, size_t len)
+{
+  pthread_mutex_lock (&prng_lock);
+  prng_getbytes (buf, len);
+  pthread_mutex_unlock (&prng_lock);
+}
+
 char *
 import_from_file (int fd)
 {
@@ -114,15 +125,20 @@ import_from_file (int fd)
   size_t bufsize = 512; /* initial bufsize is enough for 1024-bit keys */
   size_t tot;           /* total bytes read so far */
   ssize_t cur;           /* no bytes read in the last read */
-  char *buf = (char *) malloc (bufsize * sizeof (char));
+  char *buf = (char *) pv_alloc (bufsize * sizeof (char));
+  char *more;
   
   tot = 0;
   do {
     cur = read (fd, buf + tot, bufsize - tot); 
     tot += cur;
     if (bufsize == tot) {/* saturated current size; double the buffer */
+      /* (not realloc, which would leave a copy of the key behind) */
+      more = (char *) pv_alloc (2 * bufsize);
+      memcpy (more, buf, tot);
+      pv_free (buf, bufsize);
+      buf = more;
       bufsize <<= 1;
-      buf = (char *) realloc (buf, bufsize);
     }
   } while (cur > 0);
   if (cur == -1) {
@@ -130,7 +146,7 @@ import_from_file (int fd)
 	    getprogname ());
     perror (getprogname ());
     
-    free (buf);
+    pv_free (buf, bufsize);
     close (fd);
     
     exit (-1); 
@@ -157,11 +173,10 @@ import_sk_from_file (char **raw_sk_p, size_t *raw_len_p, int fdsk)
   }
   else {
     *raw_len_p = (size_t) dearmored_len;
-    *raw_sk_p = (char *) malloc (dearmored_len * sizeof (char));
+    *raw_sk_p = (char *) pv_alloc (dearmored_len * sizeof (char));
     dearmor64 (*raw_sk_p, armored_key);
   }    
-  bzero(armored_key, strlen(armored_key)); /* SCRUB & FREE ARMORED KEY */
-  free(armored_key);
+  pv_free(armored_key, strlen(armored_key)); /* SCRUB & FREE ARMORED KEY */
   return (*raw_sk_p);
 }
 
@@ -175,6 +190,9 @@ write_chunk (int fd, const char *buf, u_int len)
     if ((cur_bytes_written = write (fd, buf + bytes_written,
 					len - bytes_written)) != -1) {
 	  bytes_written += cur_bytes_written;
+	  pv_stats_add (PV_ST_WRITES, 1);
+	  pv_stats_add (PV_ST_BYTES_OUT, cur_bytes_written);
+	  pv_qos_charge (cur_bytes_written);
     }
     else {
       return -1;
@@ -184,12 +202,391 @@ write_chunk (int fd, const char *buf, u_int len)
   return 0;
 }
 
-/* assert a,b,dst have at least len bytes allocated */
+/* the reading counterpart of write_chunk: keeps calling read() until
+   len bytes have arrived or EOF is hit, so that callers see short
+   counts only at the end of the input.  Returns bytes read, or -1. */
+ssize_t
+read_chunk (int fd, char *buf, size_t len)
+{
+  ssize_t cur_bytes_read;
+  size_t bytes_read = 0;
+  int was_short = 0;
+
+  while (bytes_read < len) {
+    cur_bytes_read = read (fd, buf + bytes_read, len - bytes_read);
+    pv_stats_add (PV_ST_READS, 1);
+    if (cur_bytes_read == 0)
+      break;			/* EOF */
+    else if (cur_bytes_read == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    pv_stats_add (PV_ST_SHORT_READS, was_short); /* not the end after all */
+    was_short = (size_t) cur_bytes_read < len - bytes_read;
+    bytes_read += cur_bytes_read;
+    pv_stats_add (PV_ST_BYTES_IN, cur_bytes_read);
+    pv_qos_charge (cur_bytes_read);
+  }
+
+  return bytes_read;
+}
+
+/* read_chunk at a given offset, leaving the file offset alone */
+ssize_t
+pread_chunk (int fd, char *buf, size_t len, off_t off)
+{
+  ssize_t cur_bytes_read;
+  size_t bytes_read = 0;
+
+  while (bytes_read < len) {
+    cur_bytes_read = pread (fd, buf + bytes_read, len - bytes_read,
+			    off + bytes_read);
+    pv_stats_add (PV_ST_READS, 1);
+    if (cur_bytes_read == 0)
+      break;			/* EOF */
+    else if (cur_bytes_read == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    bytes_read += cur_bytes_read;
+    pv_stats_add (PV_ST_BYTES_IN, cur_bytes_read);
+    pv_qos_charge (cur_bytes_read);
+  }
+
+  return bytes_read;
+}
+
+/* write_chunk at a given offset, leaving the file offset alone */
+int
+pwrite_chunk (int fd, const char *buf, size_t len, off_t off)
+{
+  ssize_t cur_bytes_written;
+  size_t bytes_written = 0;
+
+  while (bytes_written < len) {
+    cur_bytes_written = pwrite (fd, buf + bytes_written, len - bytes_written,
+				off + bytes_written);
+    if (cur_bytes_written == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    bytes_written += cur_bytes_written;
+    pv_stats_add (PV_ST_WRITES, 1);
+    pv_stats_add (PV_ST_BYTES_OUT, cur_bytes_written);
+    pv_qos_charge (cur_bytes_written);
+  }
+
+  return 0;
+}
+
+/* "-" names stdin or stdout (PV_STDIO).  The descriptor returned is a
+   dup, so that callers close it as they would any other. */
+int
+pv_open_in (const char *name)
+{
+  return strcmp (name, PV_STDIO) ? open (name, O_RDONLY) : dup (STDIN_FILENO);
+}
+
+int
+pv_open_out (const char *name, int flags, mode_t mode)
+{
+  return strcmp (name, PV_STDIO) ? open (name, flags, mode)
+    : dup (STDOUT_FILENO);
+}
+
+/* a failed output is removed; what already went down stdout can't be,
+   so the reader is told to throw it away */
 void
-xor_buffers(void *dst, const void *a, const void *b, size_t len)
+pv_remove_out (const char *name)
 {
-  while (len--)
-    *((char*)dst++) = *((char*)a++) ^ *((char*)b++);
+  if (strcmp (name, PV_STDIO))
+    unlink (name);
+  else
+    fprintf (stderr, "%s: failed: discard what was written to stdout\n",
+	     getprogname ());
 }
 
-    
+/* after a rename to name, makes the new directory entry durable by
+   fsyncing the directory that holds it.  Returns 0, or -1 (errno set). */
+int
+pv_sync_dir (const char *name)
+{
+  const char *slash = strrchr (name, '/');
+  char *dir;
+  int fd, r;
+
+  if (!slash)
+    dir = strdup (".");
+  else if (slash == name)
+    dir = strdup ("/");
+  else if ((dir = (char *) malloc (slash - name + 1))) {
+    memcpy (dir, name, slash - name);
+    dir[slash - name] = '\0';
+  }
+  if (!dir)
+    return -1;
+  fd = open (dir, O_RDONLY);
+  free (dir);
+  if (fd == -1)
+    return -1;
+  r = fsync (fd);
+  close (fd);
+  return r;
+}
+
+/* A pipe holds 64K by default, so a --bufsize chunk takes many
+   wakeups of both ends to get through.  If fd is a pipe or FIFO, ask
+   for a buffer of size bytes (up to PV_PIPE_MAX), settling for less
+   when that is over the limit (/proc/sys/fs/pipe-max-size, for
+   unprivileged users). */
+void
+pv_pipe_grow (int fd, size_t size)
+{
+#ifdef F_SETPIPE_SZ
+  struct stat st;
+  int cur;
+
+  if (fstat (fd, &st) != 0 || !S_ISFIFO (st.st_mode))
+    return;
+  if (size > PV_PIPE_MAX)
+    size = PV_PIPE_MAX;
+  if ((cur = fcntl (fd, F_GETPIPE_SZ)) == -1)
+    return;
+  for (; size > (size_t) cur; size /= 2)
+    if (fcntl (fd, F_SETPIPE_SZ, (int) size) != -1)
+      return;
+#else
+  (void) fd;
+  (void) size;
+#endif
+}
+
+/* --nocache and --direct: bulk jobs that stay out of the page cache.
+ * pv_iopolicy holds the PV_IOP_* asked for; pv_io.c calls these around
+ * its reads and writes, and each does nothing unless asked, or where
+ * the system or the file system can't (everything here is a hint, but
+ * for running out of space in pv_prealloc). */
+int pv_iopolicy;
+
+/* turns O_DIRECT on fd on or off.  Returns 0, or -1 if the file system
+   won't have it. */
+int
+pv_direct (int fd, int on)
+{
+#ifdef O_DIRECT
+  int fl = fcntl (fd, F_GETFL);
+
+  if (fl == -1)
+    return -1;
+  if (!(fl & O_DIRECT) == !on)
+    return 0;
+  return fcntl (fd, F_SETFL, on ? fl | O_DIRECT : fl & ~O_DIRECT);
+#else
+  (void) fd;
+  return on ? -1 : 0;
+#endif
+}
+
+/* fd is about to be read or written straight through */
+void
+pv_cache_start (int fd)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (pv_iopolicy)
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+  (void) fd;
+#endif
+}
+
+/* starts writing fd[off..off+len] back to the disk, without waiting */
+void
+pv_cache_flush (int fd, off_t off, off_t len)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+  if (pv_iopolicy && len > 0)
+    sync_file_range (fd, off, len, SYNC_FILE_RANGE_WRITE);
+#else
+  (void) fd;
+  (void) off;
+  (void) len;
+#endif
+}
+
+/* fd[off..off+len] won't be needed again: drops it from the page
+   cache.  Dirty pages can't be dropped, so a writer (writing) first
+   waits for them to reach the disk; pv_cache_flush'ing them a chunk
+   earlier keeps that wait short. */
+void
+pv_cache_drop (int fd, off_t off, off_t len, int writing)
+{
+  if (!pv_iopolicy || len <= 0)
+    return;
+#ifdef SYNC_FILE_RANGE_WRITE
+  if (writing)
+    sync_file_range (fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE
+		     | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+  (void) writing;
+#endif
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise (fd, off, len, POSIX_FADV_DONTNEED);
+#else
+  (void) fd;
+  (void) off;
+#endif
+}
+
+/* Reserves the size bytes an output is going to take up front (without
+   changing its length), so that it isn't fragmented by growing a
+   chunk at a time.  Returns 0, or -1 if the disk hasn't that much
+   room; a file system that can't reserve space is left to grow. */
+int
+pv_prealloc (int fd, off_t size)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (pv_iopolicy && size > 0 && fallocate (fd, FALLOC_FL_KEEP_SIZE, 0, size)
+      && errno == ENOSPC)
+    return -1;
+#else
+  (void) fd;
+  (void) size;
+#endif
+  return 0;
+}
+
+/* parse a byte count such as "0", "4096", "64K", "4M" or "1G".
+   Returns -1 on malformed input. */
+off_t
+parse_offset (const char *s)
+{
+  char *end;
+  unsigned long v;
+  int shift = 0;
+
+  errno = 0;
+  v = strtoul (s, &end, 10);
+  if (errno || end == s || *s == '-')
+    return -1;
+  switch (*end) {
+  case 'k': case 'K': shift = 10; end++; break;
+  case 'm': case 'M': shift = 20; end++; break;
+  case 'g': case 'G': shift = 30; end++; break;
+  }
+  if (*end || v > (~0UL >> (shift + 1)))
+    return -1;
+
+  return (off_t) (v << shift);
+}
+
+/* parse_offset, but 0 is malformed too.  Returns 0 on malformed input. */
+size_t
+parse_size (const char *s)
+{
+  off_t v = parse_offset (s);
+
+  return v > 0 ? (size_t) v : 0;
+}
+
+/* parse the argument of --bufsize: rounded down to a whole number of
+   blocks and capped at PV_MAX_BUFSIZE.  Returns 0 on malformed input. */
+size_t
+parse_bufsize (const char *s)
+{
+  size_t n = parse_size (s);
+
+  if (n > PV_MAX_BUFSIZE)
+    n = PV_MAX_BUFSIZE;
+  n -= n % BLOCK_LEN;
+  return n;
+}
+
+void
+pv_opts_init (struct pv_opts *o)
+{
+  bzero (o, sizeof (*o));
+  o->bufsize = PV_DEFAULT_BUFSIZE;
+  o->jobs = 1;
+  o->lanes = PV_CBC_LANES;
+  o->mode = PV_MODE_CBC;
+  o->length = -1;
+}
+
+/* the argument of --mode; returns PV_MODE_* or -1 */
+int
+parse_mode (const char *s)
+{
+  if (!strcmp (s, "cbc"))
+    return PV_MODE_CBC;
+  else if (!strcmp (s, "gcm"))
+    return PV_MODE_GCM;
+  else if (!strcmp (s, "cbc-sha256"))
+    return PV_MODE_CBC_SHA256;
+  else if (!strcmp (s, "seg"))
+    return PV_MODE_SEG;
+  return -1;
+}
+
+/* write the PV_HDR_LEN-byte header described in pv.h into buf */
+void
+pv_hdr_pack (char *buf, const struct pv_hdr *h)
+{
+  bzero (buf, PV_HDR_LEN);
+  memcpy (buf, PV_MAGIC, PV_MAGIC_LEN);
+  buf[6] = (char) h->version;
+  buf[7] = (char) h->mode;
+  buf[8] = (char) h->flags;
+  putint (buf + 12, h->param);
+}
+
+/* Decode the first PV_HDR_LEN bytes of a ciphertext.  Returns 0 and
+   fills in h if they are a header, or -1 if they are not (i.e. buf
+   holds the IV of a classic PV_MODE_CBC ciphertext). */
+int
+pv_hdr_parse (struct pv_hdr *h, const char *buf)
+{
+  if (memcmp (buf, PV_MAGIC, PV_MAGIC_LEN))
+    return -1;
+  bzero (h, sizeof (*h));
+  h->version = (u_char) buf[6];
+  h->mode = (u_char) buf[7];
+  h->flags = (u_char) buf[8];
+  h->param = getint (buf + 12);
+  return 0;
+}
+
+/* is h a header this build can decrypt?  Prints why not. */
+int
+pv_hdr_check (const struct pv_hdr *h)
+{
+  if (h->version != PV_VERSION) {
+    fprintf (stderr, "%s: unsupported ciphertext version %u\n",
+	     getprogname (), h->version);
+    return -1;
+  }
+  if (h->mode == PV_MODE_ARCHIVE) {
+    fprintf (stderr, "%s: an archive; use pv_archive -x\n", getprogname ());
+    return -1;
+  }
+  if (h->mode != PV_MODE_GCM && h->mode != PV_MODE_CBC_SHA256
+      && h->mode != PV_MODE_SEG) {
+    fprintf (stderr, "%s: unknown ciphertext mode %u\n",
+	     getprogname (), h->mode);
+    return -1;
+  }
+  if (h->mode == PV_MODE_SEG
+      && (!h->param || h->param % BLOCK_LEN || h->param > PV_MAX_BUFSIZE)) {
+    fprintf (stderr, "%s: bad segment size %lu\n",
+	     getprogname (), (unsigned long) h->param);
+    return -1;
+  }
+  if (h->flags & ~PV_FLAG_LZ || (h->flags && h->mode == PV_MODE_SEG)) {
+    fprintf (stderr, "%s: unknown ciphertext flags 0x%x\n",
+	     getprogname (), h->flags);
+    return -1;
+  }
+  return 0;
+}
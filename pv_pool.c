@@ -0,0 +1,128 @@
+#include "pv.h"
+
+/* A fixed-size pool of worker threads.  Work items are intrusive: the
+ * caller embeds a struct pv_task in its own per-job structure, so that
+ * submitting work never allocates.  pv_pool_wait blocks until every
+ * task submitted so far has run.
+ */
+
+struct pv_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;		/* signalled when a task is queued */
+  pthread_cond_t done;		/* signalled when pending drops to 0 */
+  struct pv_task *head, *tail;	/* FIFO of queued tasks */
+  u_int pending;		/* queued + running */
+  int quit;
+  int nthreads;
+  pthread_t *threads;
+};
+
+static void *
+pool_worker (void *arg)
+{
+  struct pv_pool *p = (struct pv_pool *) arg;
+  struct pv_task *t;
+
+  pthread_mutex_lock (&p->lock);
+  for (;;) {
+    while (!p->head && !p->quit)
+      pthread_cond_wait (&p->work, &p->lock);
+    if (!p->head)
+      break;			/* quitting and nothing left to do */
+    t = p->head;
+    if (!(p->head = t->next))
+      p->tail = NULL;
+    pthread_mutex_unlock (&p->lock);
+
+    t->fn (t);
+
+    pthread_mutex_lock (&p->lock);
+    if (--p->pending == 0)
+      pthread_cond_broadcast (&p->done);
+  }
+  pthread_mutex_unlock (&p->lock);
+
+  return NULL;
+}
+
+struct pv_pool *
+pv_pool_new (int nthreads)
+{
+  struct pv_pool *p;
+  int i;
+
+  assert (nthreads > 0);
+  if (!(p = (struct pv_pool *) malloc (sizeof (*p))))
+    return NULL;
+  bzero (p, sizeof (*p));
+  if (!(p->threads = (pthread_t *) malloc (nthreads * sizeof (pthread_t)))) {
+    free (p);
+    return NULL;
+  }
+  pthread_mutex_init (&p->lock, NULL);
+  pthread_cond_init (&p->work, NULL);
+  pthread_cond_init (&p->done, NULL);
+
+  for (i = 0; i < nthreads; i++)
+    if (pthread_create (&p->threads[i], NULL, pool_worker, p) != 0)
+      break;
+  p->nthreads = i;
+  if (i < nthreads) {
+    pv_pool_free (p);
+    return NULL;
+  }
+
+  return p;
+}
+
+/* waits for outstanding work, then joins the workers */
+void
+pv_pool_free (struct pv_pool *p)
+{
+  int i;
+
+  if (!p)
+    return;
+  pthread_mutex_lock (&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast (&p->work);
+  pthread_mutex_unlock (&p->lock);
+  for (i = 0; i < p->nthreads; i++)
+    pthread_join (p->threads[i], NULL);
+
+  pthread_mutex_destroy (&p->lock);
+  pthread_cond_destroy (&p->work);
+  pthread_cond_destroy (&p->done);
+  free (p->threads);
+  free (p);
+}
+
+void
+pv_pool_submit (struct pv_pool *p, struct pv_task *t)
+{
+  t->next = NULL;
+  pthread_mutex_lock (&p->lock);
+  if (p->tail)
+    p->tail->next = t;
+  else
+    p->head = t;
+  p->tail = t;
+  p->pending++;
+  pthread_cond_signal (&p->work);
+  pthread_mutex_unlock (&p->lock);
+}
+
+void
+pv_pool_wait (struct pv_pool *p)
+{
+  pthread_mutex_lock (&p->lock);
+  while (p->pending)
+    pthread_cond_wait (&p->done, &p->lock);
+  pthread_mutex_unlock (&p->lock);
+}
+
+int
+pv_pool_size (const struct pv_pool *p)
+{
+  return p->nthreads;
+}
@@ -0,0 +1,278 @@
+#include "pv.h"
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/* --max-rate, --max-iops, --rate-file, --nice, --ioprio: room for
+ * whatever else the machine is for.  Every read and write that the
+ * I/O wrappers (and the io_uring completions in pv_io.c) see is
+ * charged to a pair of token buckets, one in bytes and one in
+ * requests, that fill at the set rates and hold a tenth of a second's
+ * worth (at least one request).  A charge the bucket can't cover runs
+ * it into debt, and the thread sleeps until the debt is paid off; so
+ * however many threads there are, the process as a whole keeps to the
+ * rates, and the sleeps are counted as the "throttle" phase of --stats.
+ * --mmap I/O (page faults) isn't seen, and so isn't throttled.
+ *
+ * The rates can be changed while a job runs through the file named by
+ * --rate-file, with lines like
+ *
+ *     max-rate 20M
+ *     max-iops 500
+ *
+ * (0 for no limit; a missing line leaves that rate as it was).  It is
+ * read when the job starts, again whenever its mtime changes (looked
+ * at once a second), and at once on SIGHUP.
+ *
+ * --nice and --ioprio are set on the main thread before any other
+ * starts, and every thread (and io_uring worker) inherits them.
+ */
+
+#define QOS_BURST 0.1		/* seconds' worth a bucket holds */
+#define QOS_RECHECK 1.0		/* seconds between looks at the file */
+
+#ifndef IOPRIO_CLASS_SHIFT
+# define IOPRIO_CLASS_SHIFT 13
+#endif
+#define QOS_IOPRIO_WHO_PROCESS 1
+
+int pv_qos_on;
+
+static struct {
+  pthread_mutex_t lock;
+  double rate, iops;		/* per second; 0: no limit */
+  double bytes, ops;		/* in the buckets; below 0 is debt */
+  double last;			/* when they were last filled */
+  const char *file;
+  time_t mtime;
+  double checked;
+  int nice_set, nice;
+  int ioprio;			/* -1 if not set */
+} q = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, NULL, 0, 0, 0, 0, -1 };
+
+static volatile sig_atomic_t q_hup;
+
+static double
+qos_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+qos_hup (int sig)
+{
+  (void) sig;
+  q_hup = 1;
+}
+
+/* --ioprio idle, be[:N] or rt[:N]; -1 if malformed */
+static int
+parse_ioprio (const char *s)
+{
+  int class, level = 4;
+  const char *c = strchr (s, ':');
+  size_t n = c ? (size_t) (c - s) : strlen (s);
+
+  if (n == 4 && !strncmp (s, "idle", 4))
+    class = 3;
+  else if (n == 2 && !strncmp (s, "be", 2))
+    class = 2;
+  else if (n == 2 && !strncmp (s, "rt", 2))
+    class = 1;
+  else
+    return -1;
+  if (c) {
+    if (class == 3 || c[1] < '0' || c[1] > '7' || c[2])
+      return -1;
+    level = c[1] - '0';
+  }
+  return class << IOPRIO_CLASS_SHIFT | (class == 3 ? 0 : level);
+}
+
+/* Takes the option at argv[*argi] (and its argument) if it is one of
+   ours: returns 1 if so, 0 if it isn't ours, -1 if its argument is
+   malformed. */
+int
+pv_qos_arg (int argc, char **argv, int *argi)
+{
+  const char *o = argv[*argi], *v = *argi + 1 < argc ? argv[*argi + 1] : NULL;
+  char *end;
+  off_t n;
+  long l;
+
+  if (!v)
+    return 0;
+  if (!strcmp (o, "--max-rate") || !strcmp (o, "--max-iops")) {
+    if ((n = parse_offset (v)) == -1)
+      return -1;
+    if (!strcmp (o, "--max-rate"))
+      q.rate = n;
+    else
+      q.iops = n;
+  }
+  else if (!strcmp (o, "--rate-file"))
+    q.file = v;
+  else if (!strcmp (o, "--nice")) {
+    errno = 0;
+    l = strtol (v, &end, 10);
+    if (errno || end == v || *end || l < -20 || l > 19)
+      return -1;
+    q.nice_set = 1;
+    q.nice = (int) l;
+  }
+  else if (!strcmp (o, "--ioprio")) {
+    if ((q.ioprio = parse_ioprio (v)) == -1)
+      return -1;
+  }
+  else
+    return 0;
+  ++*argi;
+  return 1;
+}
+
+/* reads the rate file (the lock held, or before any thread starts);
+   -1 if it can't be read or has a line we don't know */
+static int
+qos_load (void)
+{
+  char line[128], key[32], val[64];
+  struct stat st;
+  FILE *f;
+  off_t n;
+  int r = 0;
+
+  if (!(f = fopen (q.file, "r")))
+    return -1;
+  if (fstat (fileno (f), &st) == 0)
+    q.mtime = st.st_mtime;
+  while (fgets (line, sizeof (line), f)) {
+    if (sscanf (line, "%31s %63s", key, val) != 2) {
+      if (sscanf (line, "%31s", key) == 1 && key[0] != '#')
+	r = -1;
+      continue;
+    }
+    if (key[0] == '#')
+      continue;
+    if ((n = parse_offset (val)) == -1)
+      r = -1;
+    else if (!strcmp (key, "max-rate"))
+      q.rate = n;
+    else if (!strcmp (key, "max-iops"))
+      q.iops = n;
+    else
+      r = -1;
+  }
+  fclose (f);
+  return r;
+}
+
+/* on SIGHUP, or once a second if the file changed (the lock held) */
+static void
+qos_recheck (double now)
+{
+  struct stat st;
+  int hup = q_hup;
+
+  if (!hup && now - q.checked < QOS_RECHECK)
+    return;
+  q.checked = now;
+  q_hup = 0;
+  if (!hup && (stat (q.file, &st) == -1 || st.st_mtime == q.mtime))
+    return;
+  if (qos_load () == -1)
+    fprintf (stderr, "%s: %s: can't read all of it; rates now %.0f bytes/s, "
+	     "%.0f iops\n", getprogname (), q.file, q.rate, q.iops);
+}
+
+/* Applies --nice and --ioprio and reads --rate-file, before any thread
+   is started.  Returns 0, or -1 (having said why). */
+int
+pv_qos_start (const char *pname)
+{
+  struct sigaction sa;
+
+  if (q.nice_set && setpriority (PRIO_PROCESS, 0, q.nice) == -1) {
+    fprintf (stderr, "%s: --nice %d: %s\n", pname, q.nice, strerror (errno));
+    return -1;
+  }
+  if (q.ioprio != -1
+      && syscall (SYS_ioprio_set, QOS_IOPRIO_WHO_PROCESS, 0, q.ioprio) == -1) {
+    fprintf (stderr, "%s: --ioprio: %s\n", pname, strerror (errno));
+    return -1;
+  }
+  if (q.file) {
+    errno = 0;
+    if (qos_load () == -1) {
+      fprintf (stderr, "%s: --rate-file %s: ", pname, q.file);
+      if (errno)
+	perror (NULL);
+      else
+	fprintf (stderr, "expected max-rate N or max-iops N on each line\n");
+      return -1;
+    }
+    bzero (&sa, sizeof (sa));
+    sa.sa_handler = qos_hup;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGHUP, &sa, NULL);
+  }
+  pv_qos_on = q.rate > 0 || q.iops > 0 || q.file;
+  q.last = q.checked = qos_now ();
+  q.bytes = q.rate * QOS_BURST;
+  q.ops = q.iops * QOS_BURST > 1 ? q.iops * QOS_BURST : 1;
+  return 0;
+}
+
+/* a bucket, filled for the time since the last charge and charged n */
+static double
+qos_take (double *tokens, double rate, double dt, double n)
+{
+  double cap = rate * QOS_BURST;
+
+  if (rate <= 0) {
+    *tokens = 0;
+    return 0;
+  }
+  if (cap < 1)
+    cap = 1;
+  *tokens += dt * rate;
+  if (*tokens > cap)
+    *tokens = cap;
+  *tokens -= n;
+  return *tokens < 0 ? -*tokens / rate : 0;
+}
+
+/* One request of n bytes was made; sleeps for as long as that puts us
+   over --max-rate or --max-iops. */
+void
+pv_qos_charge (size_t n)
+{
+  struct pv_stamp t;
+  struct timespec ts;
+  double now, wait, w;
+
+  if (!pv_qos_on)
+    return;
+  pthread_mutex_lock (&q.lock);
+  now = qos_now ();
+  if (q.file)
+    qos_recheck (now);
+  wait = qos_take (&q.bytes, q.rate, now - q.last, n);
+  w = qos_take (&q.ops, q.iops, now - q.last, 1);
+  q.last = now;
+  pthread_mutex_unlock (&q.lock);
+
+  if (w > wait)
+    wait = w;
+  if (wait <= 0)
+    return;
+  pv_stats_begin (&t);
+  ts.tv_sec = (time_t) wait;
+  ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+  while (nanosleep (&ts, &ts) == -1 && errno == EINTR)
+    ;
+  pv_stats_end (PV_PH_THROTTLE, &t);
+}
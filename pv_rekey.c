@@ -0,0 +1,393 @@
+#include "pv.h"
+
+/* pv_rekey: re-encrypts a ctxt under a new key in one pass, instead of
+ * pv_decrypt to a temporary file and pv_encrypt from it.  Each chunk
+ * goes through a pv_decrypt_ctx under the old key and straight into a
+ * pv_encrypt_ctx under the new one (pv_lib.c), so the ptxt only ever
+ * sits in a locked buffer (pv_arena.c), and every byte is read once and
+ * written once.  The old MAC or tag is checked as the stream ends and
+ * the new one computed along the way; if the old one doesn't match,
+ * OUT is removed.  A --compress ctxt keeps its LZ frames as they are
+ * (they are the ptxt, as far as the cipher is concerned).
+ *
+ * OUT may be IN itself: then the new ctxt goes to a temporary file next
+ * to it, which replaces IN only once it is complete and the old MAC has
+ * checked out.  --batch over a directory rekeys every F.pv in place.
+ */
+
+/* the keys and options shared by every file */
+struct rekey_arg {
+  void *old_sk, *new_sk;
+  size_t old_len, new_len;
+  int mode;			/* of OUT; -1: the same as IN's */
+  const struct pv_opts *opts;
+  int in_place;			/* --batch DIR: OUT is IN */
+};
+
+/* fin to fout, both at their starts.  Returns 0, or -1 after
+   complaining. */
+static int
+rekey_stream (int fout, int fin, const struct rekey_arg *a)
+{
+  const struct pv_opts *opts = a->opts;
+  const size_t bufsize = opts->bufsize; /* multiple of BLOCK_LEN */
+  const size_t ptcap = PV_UPDATE_MAX(bufsize) < PV_FINAL_MAX
+    ? PV_FINAL_MAX : PV_UPDATE_MAX(bufsize);
+  const size_t outcap = PV_UPDATE_MAX(ptcap) + PV_FINAL_MAX;
+  struct pv_decrypt_ctx dctx;
+  struct pv_encrypt_ctx ectx;
+  struct pv_io *in = NULL, *out = NULL;
+  struct pv_pool *pool = NULL;
+  struct pv_cbc_job *jobs = NULL;
+  char head[PV_HDR_LEN], *ct, *pt, *buf;
+  struct pv_hdr hdr;
+  ssize_t numread;
+  off_t ptlen;
+  size_t len, n;
+  int r, inmode, mode, ret = -1;
+
+  if ((numread = read_chunk(fin, head, PV_HDR_LEN)) < PV_HDR_LEN) {
+    if (numread == -1) perror(0);
+    fprintf(stderr,"rekey_file: ctxt file is too short or read error\n");
+    return -1;
+  }
+  if (pv_hdr_parse(&hdr, head) == 0
+      && (pv_hdr_check(&hdr) != 0 || hdr.mode == PV_MODE_SEG)) {
+    if (hdr.mode == PV_MODE_SEG)
+      fprintf(stderr,"rekey_file: --mode seg ctxts can't be rekeyed; "
+	      "use pv_decrypt | pv_encrypt\n");
+    return -1;
+  }
+  if ((r = pv_decrypt_init(&dctx, a->old_sk, a->old_len)) != PV_OK
+      || (r = pv_decrypt_update(&dctx, head, PV_HDR_LEN, NULL, 0, &len))
+      != PV_OK) {
+    fprintf(stderr, "rekey_file: %s\n", pv_strerror(r));
+    pv_decrypt_clr(&dctx);
+    return -1;
+  }
+  inmode = dctx.mode;
+  mode = a->mode == -1 ? inmode : a->mode;
+  if (dctx.flags && mode == PV_MODE_CBC) {
+    fprintf(stderr, "rekey_file: a --compress ctxt needs --mode cbc-sha256 or gcm\n");
+    pv_decrypt_clr(&dctx);
+    return -1;
+  }
+  if ((r = pv_encrypt_init(&ectx, a->new_sk, a->new_len,
+			   mode | PV_MODE_FLAGS(dctx.flags))) != PV_OK) {
+    fprintf(stderr, "rekey_file: %s\n", pv_strerror(r));
+    pv_decrypt_clr(&dctx);
+    return -1;
+  }
+
+  ct = (char*)pv_alloc(bufsize);
+  pt = (char*)pv_alloc(ptcap);	/* the only place the ptxt ever is */
+  buf = (char*)pv_alloc(outcap);
+  if (opts->jobs > 1) {
+    pool = pv_pool_new(opts->jobs);
+    jobs = (struct pv_cbc_job*)malloc(opts->jobs * sizeof(struct pv_cbc_job));
+  }
+  in = pv_io_open(fin, 0, bufsize);
+  out = pv_io_open(fout, 1, outcap);
+  if (!ct || !pt || !buf || !in || !out
+      || (opts->jobs > 1 && (!pool || !jobs))) {
+    fprintf(stderr, "rekey_file: Cannot allocate memory\n");
+    goto out;
+  }
+  if (pool)
+    pv_decrypt_threads(&dctx, pool, jobs, opts->jobs);
+  /* (-1 for a pipe, or a ctxt too mangled to say) */
+  if ((ptlen = pv_ptxt_length(fin, inmode)) >= 0
+      && pv_prealloc(fout, pv_encrypt_length(mode, ptlen)) != 0) {
+    perror("rekey_file: cannot reserve space for new ctxt file");
+    goto out;
+  }
+
+  r = PV_OK;
+  while ((numread = pv_io_read(in, ct, bufsize)) > 0) {
+    if ((r = pv_decrypt_update(&dctx, ct, numread, pt, ptcap, &len)) != PV_OK
+	|| (r = pv_encrypt_update(&ectx, pt, len, buf, outcap, &n)) != PV_OK)
+      break;
+    if (pv_io_write(out, buf, n) != 0) {
+      perror("rekey_file: error writing new ctxt");
+      goto out;
+    }
+    if ((size_t) numread < bufsize) /* short read_chunk means EOF */
+      break;
+  }
+  if (numread == -1) {
+    perror("rekey_file: error reading ctxt");
+    goto out;
+  }
+  if (r == PV_OK
+      && (r = pv_decrypt_final(&dctx, pt, ptcap, &len)) == PV_OK
+      && (r = pv_encrypt_update(&ectx, pt, len, buf, outcap, &n)) == PV_OK) {
+    if (pv_io_write(out, buf, n) != 0
+	|| (r = pv_encrypt_final(&ectx, buf, outcap, &n)) != PV_OK
+	|| pv_io_write(out, buf, n) != 0) {
+      if (r == PV_OK)
+	perror("rekey_file: error writing new ctxt");
+      else
+	fprintf(stderr, "rekey_file: %s\n", pv_strerror(r));
+      goto out;
+    }
+  }
+  if (r == PV_ERR_AUTH)
+    fprintf(stderr, "WARNING: %s MISMATCH. Check the old key and ciphertext integrity.\n",
+	    inmode == PV_MODE_GCM ? "GCM TAG" : "HMAC");
+  else if (r != PV_OK)
+    fprintf(stderr, "rekey_file: %s\n", pv_strerror(r));
+  else
+    ret = 0;
+
+ out:
+  pv_io_close(in);
+  if (pv_io_close(out) != 0 && ret == 0) { /* finishes the writes */
+    perror("rekey_file: error writing new ctxt");
+    ret = -1;
+  }
+  pv_decrypt_clr(&dctx);
+  pv_encrypt_clr(&ectx);
+  pv_pool_free(pool);
+  free(jobs);
+  pv_free(ct, bufsize);
+  pv_free(pt, ptcap);
+  pv_free(buf, outcap);
+  return ret;
+}
+
+/* Rekeys the file in to out (which may be the same file).  Returns 0,
+   or -1 (after complaining, and removing whatever was written).  The
+   same file is replaced only once the new ctxt is on disk, and the
+   rename is synced too; if only that last sync fails, the new ctxt
+   stays in place, but -1 is still returned. */
+static int
+rekey_file (const char *in_fname, const char *out_fname,
+	    const struct rekey_arg *a)
+{
+  struct stat st_in, st_out;
+  char *tmp = NULL;
+  int fin, fout, r;
+
+  if ((fin = pv_open_in(in_fname)) == -1) {
+    fprintf(stderr, "%s: %s: %s\n", getprogname(), in_fname, strerror(errno));
+    return -1;
+  }
+  if (a->in_place
+      || (strcmp(out_fname, PV_STDIO) && fstat(fin, &st_in) == 0
+	  && stat(out_fname, &st_out) == 0 && st_in.st_dev == st_out.st_dev
+	  && st_in.st_ino == st_out.st_ino)) {
+    /* the same file: write next to it, then rename over it */
+    if (fstat(fin, &st_in) != 0
+	|| !(tmp = (char*)malloc(strlen(out_fname) + sizeof(".rekeyXXXXXX")))) {
+      perror("rekey_file");
+      close(fin);
+      return -1;
+    }
+    sprintf(tmp, "%s.rekeyXXXXXX", out_fname);
+    if ((fout = mkstemp(tmp)) != -1)
+      fchmod(fout, st_in.st_mode & 07777);
+  }
+  else
+    fout = pv_open_out(out_fname, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+  if (fout == -1) {
+    perror("rekey_file: error opening new ctxt file");
+    close(fin);
+    free(tmp);
+    return -1;
+  }
+
+  r = rekey_stream(fout, fin, a);
+  close(fin);
+  if (tmp && r == 0 && fsync(fout) != 0) { /* before it replaces IN */
+    perror("rekey_file: error writing new ctxt");
+    r = -1;
+  }
+  if (close(fout) != 0 && r == 0) {
+    perror("rekey_file: error writing new ctxt");
+    r = -1;
+  }
+  if (tmp) {
+    if (r == 0 && rename(tmp, out_fname) != 0) {
+      perror("rekey_file: cannot replace the old ctxt");
+      r = -1;
+    }
+    else if (r == 0 && pv_sync_dir(out_fname) != 0) {
+      /* replaced, but the rename may not survive a crash */
+      fprintf(stderr, "rekey_file: %s: cannot sync its directory: %s\n",
+	      out_fname, strerror(errno));
+      free(tmp);
+      return -1;
+    }
+    if (r != 0)
+      unlink(tmp);
+    free(tmp);
+  }
+  else if (r != 0)
+    pv_remove_out(out_fname);
+  return r;
+}
+
+static int
+batch_one (const char *in, const char *out, void *arg)
+{
+  struct rekey_arg *a = (struct rekey_arg *) arg;
+
+  return rekey_file (in, a->in_place ? in : out, a);
+}
+
+void
+usage (const char *pname)
+{
+  printf ("Personal Vault: Key Rotation\n");
+  printf ("Usage: %s [--bufsize N] [-j N] [--mode cbc|cbc-sha256|gcm]\n"
+	  "          [--nocache | --direct] [--stats] [--max-rate N] [--max-iops N]\n"
+	  "          [--rate-file F] [--nice N] [--ioprio C[:N]]\n"
+	  "          OLD-SK NEW-SK IN OUT\n",
+	  pname);
+  printf ("       %s [options] [--suffix S] --batch MANIFEST OLD-SK NEW-SK\n",
+	  pname);
+  printf ("       Decrypts the ctxt IN with the key in OLD-SK and encrypts\n");
+  printf ("       it again with the key in NEW-SK into OUT, in one pass and\n");
+  printf ("       without writing the ptxt anywhere.  If IN turns out not to\n");
+  printf ("       be authentic, OUT is removed.  OUT may be IN (it is only\n");
+  printf ("       replaced once the new ctxt is complete), and either may be\n");
+  printf ("       - for stdin or stdout.  --mode seg ctxts are not supported.\n");
+  printf ("       --bufsize N  read and write N bytes at a time\n");
+  printf ("                    (suffix K, M or G; default 1M)\n");
+  printf ("       -j N         decrypt on N threads\n");
+  printf ("       --mode M     the format of OUT (default: that of IN)\n");
+  printf ("       --batch M    rekey every IN OUT pair listed in file M, one\n");
+  printf ("                    per line; or, if M is a directory, each file\n");
+  printf ("                    F.pv in it, in place.  Prints ok or FAILED\n");
+  printf ("                    for each; -j N then means N files at a time.\n");
+  printf ("       --suffix S   with --batch DIR, use S instead of .pv\n");
+  printf ("       --nocache    keep the files out of the page cache\n");
+  printf ("       --direct     --nocache, and O_DIRECT where the file system\n");
+  printf ("                    takes it\n");
+  printf ("       --max-rate N read and write at most N bytes a second\n");
+  printf ("                    (suffix K, M or G), all threads together\n");
+  printf ("       --max-iops N make at most N read or write requests a second\n");
+  printf ("       --rate-file F  take max-rate N and max-iops N lines from F,\n");
+  printf ("                    and again whenever F changes or on SIGHUP\n");
+  printf ("       --nice N     run at CPU priority N (see nice(1))\n");
+  printf ("       --ioprio C   I/O priority class idle, be[:0-7] or rt[:0-7]\n");
+  printf ("                    (see ionice(1))\n");
+  printf ("       --stats      print where the time went, as a line of JSON\n");
+  printf ("                    on stderr (or set PV_STATS=1, or PV_STATS=FILE\n");
+  printf ("                    to append it to FILE)\n");
+
+  exit (1);
+}
+
+/* the key in the file name, or exits */
+static char *
+import_key (const char *pname, const char *name, size_t *len)
+{
+  char *raw_sk;
+  int fdsk;
+
+  if ((fdsk = open (name, O_RDONLY)) == -1) {
+    if (errno == ENOENT)
+      usage (pname);
+    perror (pname);
+    exit (-1);
+  }
+  if (!(import_sk_from_file (&raw_sk, len, fdsk))) {
+    fprintf (stderr, "%s: no symmetric key found in %s\n", pname, name);
+    close (fdsk);
+    exit (2);
+  }
+  close (fdsk);
+  return raw_sk;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct pv_opts opts;
+  const char *batch = NULL, *suffix = PV_BATCH_SUFFIX;
+  struct rekey_arg a;
+  struct pv_opts bopts;
+  struct pv_stamp t;
+  struct stat st;
+  long failed = 0;
+  int argi, stats = 0;
+
+  pv_opts_init (&opts);
+  bzero (&a, sizeof (a));
+  a.mode = -1;
+  for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+    if (!strcmp (argv[argi], "--bufsize") && argi + 1 < argc) {
+      if (!(opts.bufsize = parse_bufsize (argv[++argi])))
+	usage (argv[0]);
+    }
+    else if (!strcmp (argv[argi], "--mode") && argi + 1 < argc) {
+      if ((a.mode = parse_mode (argv[++argi])) == -1 || a.mode == PV_MODE_SEG)
+	usage (argv[0]);
+    }
+    else if (!strcmp (argv[argi], "--nocache"))
+      pv_iopolicy |= PV_IOP_NOCACHE;
+    else if (!strcmp (argv[argi], "--direct"))
+      pv_iopolicy |= PV_IOP_NOCACHE | PV_IOP_DIRECT;
+    else if (!strcmp (argv[argi], "--stats"))
+      stats = 1;
+    else if (!strcmp (argv[argi], "-j") && argi + 1 < argc) {
+      if ((opts.jobs = atoi (argv[++argi])) < 1)
+	usage (argv[0]);
+    }
+    else if (!strcmp (argv[argi], "--batch") && argi + 1 < argc)
+      batch = argv[++argi];
+    else if (!strcmp (argv[argi], "--suffix") && argi + 1 < argc)
+      suffix = argv[++argi];
+    else if (pv_qos_arg (argc, argv, &argi) != 1)
+      usage (argv[0]);
+  }
+  pv_stats_init (stats);
+  if (pv_qos_start (argv[0]) != 0)
+    exit (1);
+  if (argc - argi != (batch ? 2 : 4))
+    usage (argv[0]);
+  setprogname (argv[0]);
+
+  /* make sure the AES backend picked for this CPU gives the right answers */
+  pv_stats_begin (&t);
+  if (pv_kern_selftest () != 0 || pv_aes_selftest () != 0 || pv_hmac_selftest () != 0
+      || pv_gcm_selftest () != 0)
+    exit (-1);
+  pv_stats_end (PV_PH_SELFTEST, &t);
+
+  pv_stats_begin (&t);
+  a.old_sk = import_key (argv[0], argv[argi], &a.old_len);
+  a.new_sk = import_key (argv[0], argv[argi+1], &a.new_len);
+  pv_stats_end (PV_PH_KEY, &t);
+
+  /* initialize the pseudorandom generator (for the new IVs) */
+  pv_stats_begin (&t);
+  ri ();
+  pv_stats_end (PV_PH_SEED, &t);
+
+  if (batch) {			/* all of the above once, for every file */
+    bopts = opts;
+    bopts.jobs = 1;		/* the threads take a file each instead */
+    a.opts = &bopts;
+    a.in_place = stat (batch, &st) == 0 && S_ISDIR (st.st_mode);
+    failed = pv_batch_run (batch, suffix, 1, opts.jobs, batch_one, &a);
+    if (failed > 0)
+      fprintf (stderr, "%s: %ld files failed\n", argv[0], failed);
+  }
+  else {
+    a.opts = &opts;
+    if (!strcmp (argv[argi+2], PV_STDIO))
+      pv_pipe_grow (STDIN_FILENO, opts.bufsize);
+    if (!strcmp (argv[argi+3], PV_STDIO))
+      pv_pipe_grow (STDOUT_FILENO, opts.bufsize);
+    failed = rekey_file (argv[argi+2], argv[argi+3], &a) != 0;
+  }
+
+  /* scrub the buffers that are holding the keys before exiting */
+  pv_free (a.old_sk, a.old_len);
+  pv_free (a.new_sk, a.new_len);
+
+  pv_stats_report ("pv_rekey", failed ? 1 : 0);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+#include "pv.h"
+
+/* A bounded single-producer/single-consumer queue of pointers.  The
+ * producer only ever writes head and the consumer only ever writes
+ * tail, so neither side takes a lock: an acquire load of the other
+ * side's index, then a release store of its own, is all the ordering
+ * needed.  The two indices live on separate cache lines so that the
+ * producer and consumer threads don't bounce one line between them.
+ */
+
+#define CACHE_LINE 64
+
+struct pv_ring {
+  u_int mask;			/* size - 1; size is a power of 2 */
+  void **slot;
+  char pad0[CACHE_LINE];
+  u_int head;			/* next slot to fill (producer) */
+  char pad1[CACHE_LINE];
+  u_int tail;			/* next slot to empty (consumer) */
+  char pad2[CACHE_LINE];
+};
+
+/* room for at least size entries */
+struct pv_ring *
+pv_ring_new (u_int size)
+{
+  struct pv_ring *r;
+  u_int n = 1;
+
+  while (n < size)
+    n <<= 1;
+  if (!(r = (struct pv_ring *) malloc (sizeof (*r))))
+    return NULL;
+  bzero (r, sizeof (*r));
+  if (!(r->slot = (void **) malloc (n * sizeof (void *)))) {
+    free (r);
+    return NULL;
+  }
+  r->mask = n - 1;
+  return r;
+}
+
+void
+pv_ring_free (struct pv_ring *r)
+{
+  if (!r)
+    return;
+  free (r->slot);
+  free (r);
+}
+
+/* producer side.  Returns 0, or -1 if the ring is full. */
+int
+pv_ring_push (struct pv_ring *r, void *p)
+{
+  u_int head = r->head;
+
+  if (head - __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE) > r->mask)
+    return -1;
+  r->slot[head & r->mask] = p;
+  __atomic_store_n (&r->head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* consumer side.  Returns NULL if the ring is empty. */
+void *
+pv_ring_pop (struct pv_ring *r)
+{
+  u_int tail = r->tail;
+  void *p;
+
+  if (__atomic_load_n (&r->head, __ATOMIC_ACQUIRE) == tail)
+    return NULL;
+  p = r->slot[tail & r->mask];
+  __atomic_store_n (&r->tail, tail + 1, __ATOMIC_RELEASE);
+  return p;
+}
+
+/* consumer side: waits for an entry.  Spins briefly (the producer is
+   usually about to deliver), then yields the CPU, then naps, so that
+   a stage stuck behind a slow one doesn't burn a core. */
+void *
+pv_ring_pop_wait (struct pv_ring *r)
+{
+  struct timespec nap;
+  u_int tries = 0;
+  void *p;
+
+  nap.tv_sec = 0;
+  nap.tv_nsec = 20000;
+  while (!(p = pv_ring_pop (r))) {
+    if (tries < 64) {
+#if defined (__x86_64__) || defined (__i386__)
+      __asm__ __volatile__ ("pause");
+#endif
+    }
+    else if (tries < 256)
+      sched_yield ();
+    else
+      nanosleep (&nap, NULL);
+    tries++;
+  }
+  return p;
+}
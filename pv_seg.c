@@ -0,0 +1,102 @@
+#include "pv.h"
+
+/* The MACs of the PV_MODE_SEG format (see pv.h).  Every MAC starts with
+ * the file's header and nonce, so that state is computed once, in
+ * pv_seg_init, and copied for each segment.  Each tag is then
+ * followed by a 16-byte block naming what is being MACed:
+ *
+ *     index | kind | padlen | 0	(32 bits each, big endian)
+ *
+ * with kind PV_SEG_MIDDLE or PV_SEG_LAST for a segment, which binds
+ * its position and whether the file ends there, and PV_SEG_FINAL for
+ * the final tag over all the segment tags.
+ */
+
+#define PV_SEG_MIDDLE 0
+#define PV_SEG_LAST 1
+#define PV_SEG_FINAL 2
+
+static void
+seg_block (struct pv_hmac_ctx *c, u_int32_t idx, u_int32_t kind,
+	   u_int32_t numpad0)
+{
+  char b[16];
+
+  putint (b, idx);
+  putint (b + 4, kind);
+  putint (b + 8, numpad0);
+  putint (b + 12, 0);
+  pv_hmac_update (c, b, sizeof (b));
+}
+
+/* head is the PV_HDR_LEN-byte header followed by the nonce */
+void
+pv_seg_init (struct pv_seg *s, const char *sk_hmac, size_t sk_len,
+	     const char *head)
+{
+  bzero (s, sizeof (*s));
+  pv_hmac_init (&s->prefix, PV_MAC_SHA256, sk_hmac, sk_len);
+  pv_hmac_update (&s->prefix, head, PV_HDR_LEN + PV_SEG_NONCE_LEN);
+  memcpy (&s->all, &s->prefix, sizeof (s->all));
+  seg_block (&s->all, 0, PV_SEG_FINAL, 0);
+}
+
+/* c := the MAC of segment idx before any of its IV || Y, which goes
+   in with pv_hmac_update as it comes (a segment too big to hold at
+   once); pv_hmac_final then gives its tag */
+void
+pv_seg_start (const struct pv_seg *s, struct pv_hmac_ctx *c, u_int32_t idx,
+	      int last, u_int32_t numpad0)
+{
+  memcpy (c, &s->prefix, sizeof (*c));
+  seg_block (c, idx, last ? PV_SEG_LAST : PV_SEG_MIDDLE, numpad0);
+}
+
+/* tag := the MAC of segment idx, whose IV || Y is rec[0..len];
+   numpad0 is 0 unless last.  Leaves s alone, so segments can be
+   tagged on several threads at once (then pv_seg_add each in order). */
+void
+pv_seg_mac (const struct pv_seg *s, u_int32_t idx, int last,
+	    u_int32_t numpad0, const char *rec, size_t len, u_char *tag)
+{
+  struct pv_hmac_ctx c;
+
+  pv_seg_start (s, &c, idx, last, numpad0);
+  pv_hmac_update (&c, rec, len);
+  pv_hmac_final (&c, tag);
+  pv_hmac_clr (&c);
+}
+
+/* the next segment's tag, into the final one */
+void
+pv_seg_add (struct pv_seg *s, const u_char *tag)
+{
+  s->nseg++;
+  pv_hmac_update (&s->all, tag, PV_SEG_TAG_LEN);
+}
+
+/* both of the above, for the next segment */
+void
+pv_seg_tag (struct pv_seg *s, int last, u_int32_t numpad0, const char *rec,
+	    size_t len, u_char *tag)
+{
+  pv_seg_mac (s, s->nseg, last, numpad0, rec, len, tag);
+  pv_seg_add (s, tag);
+}
+
+/* tag := the final tag, over every segment tag so far */
+void
+pv_seg_final (struct pv_seg *s, u_char *tag)
+{
+  char n[4];
+
+  putint (n, s->nseg);
+  pv_hmac_update (&s->all, n, sizeof (n));
+  pv_hmac_final (&s->all, tag);
+}
+
+void
+pv_seg_clr (struct pv_seg *s)
+{
+  pv_scrub (s, sizeof (*s));
+}
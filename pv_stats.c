@@ -0,0 +1,119 @@
+#include "pv.h"
+#include <sys/resource.h>
+
+/* --stats (or PV_STATS in the environment): where the time went.
+ * Each phase accumulates the wall-clock and CPU time (of the thread
+ * doing it) spent between a pv_stats_begin and its pv_stats_end, and
+ * the I/O wrappers count system calls and bytes.  With stats off
+ * every hook is one test of pv_stats_on, so they can stay in the hot
+ * loops.  Threads may report concurrently (--batch, -j, --pipeline);
+ * the phase sums take a lock, the counters are atomic.
+ *
+ * The summary is a single line of JSON on stderr (stdout may be the
+ * data), or appended to the file PV_STATS names when that isn't "1".
+ */
+
+int pv_stats_on;
+
+static const char *const phase_name[PV_NPHASES] = {
+  "key_import", "seed", "selftest", "cipher", "mac", "read", "write",
+  "lz", "throttle"
+};
+static const char *const count_name[PV_NCOUNTS] = {
+  "bytes_in", "bytes_out", "reads", "writes", "short_reads", "uring_enters"
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct pv_stamp start;
+  double wall[PV_NPHASES], cpu[PV_NPHASES];
+  u_int64_t count[PV_NCOUNTS];
+  const char *dest;
+} st = { PTHREAD_MUTEX_INITIALIZER, { 0, 0 }, { 0 }, { 0 }, { 0 }, NULL };
+
+/* on if asked for on the command line (on) or by PV_STATS */
+void
+pv_stats_init (int on)
+{
+  const char *env = getenv ("PV_STATS");
+
+  if (env && *env && strcmp (env, "0")) {
+    on = 1;
+    if (strcmp (env, "1"))
+      st.dest = env;
+  }
+  pv_stats_on = on;
+  if (on)
+    pv_stats_begin (&st.start);
+}
+
+void
+pv_stats_begin (struct pv_stamp *s)
+{
+  struct timespec ts;
+
+  if (!pv_stats_on)
+    return;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  s->wall = ts.tv_sec + ts.tv_nsec / 1e9;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  s->cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+pv_stats_end (int phase, const struct pv_stamp *s)
+{
+  struct pv_stamp e;
+
+  if (!pv_stats_on)
+    return;
+  pv_stats_begin (&e);
+  pthread_mutex_lock (&st.lock);
+  st.wall[phase] += e.wall - s->wall;
+  st.cpu[phase] += e.cpu - s->cpu;
+  pthread_mutex_unlock (&st.lock);
+}
+
+void
+pv_stats_add (int counter, u_int64_t n)
+{
+  if (pv_stats_on)
+    __atomic_fetch_add (&st.count[counter], n, __ATOMIC_RELAXED);
+}
+
+/* the summary, for a run of tool that ended with status (0 is success) */
+void
+pv_stats_report (const char *tool, int status)
+{
+  struct pv_stamp end;
+  struct rusage ru;
+  FILE *f = stderr;
+  double cpu;
+  int i;
+
+  if (!pv_stats_on)
+    return;
+  pv_stats_begin (&end);
+  getrusage (RUSAGE_SELF, &ru);	/* every thread's CPU time */
+  cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+    + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  if (st.dest && !(f = fopen (st.dest, "a"))) {
+    perror (st.dest);
+    return;
+  }
+
+  fprintf (f, "{\"tool\":\"%s\",\"status\":%d,\"wall_s\":%.6f,\"cpu_s\":%.6f,"
+	   "\"max_rss_kb\":%ld", tool, status, end.wall - st.start.wall, cpu,
+	   ru.ru_maxrss);
+  for (i = 0; i < PV_NCOUNTS; i++)
+    fprintf (f, ",\"%s\":%lu", count_name[i], (unsigned long) st.count[i]);
+  fprintf (f, ",\"gb_per_s\":%.3f,\"phases\":{",
+	   end.wall > st.start.wall
+	   ? st.count[PV_ST_BYTES_IN] / (end.wall - st.start.wall) / 1e9 : 0);
+  for (i = 0; i < PV_NPHASES; i++)
+    fprintf (f, "%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f}", i ? "," : "",
+	     phase_name[i], st.wall[i], st.cpu[i]);
+  fprintf (f, "}}\n");
+  if (f != stderr)
+    fclose (f);
+}